@@ -0,0 +1,520 @@
+/*
+ * End-to-end embedding throughput benchmark. Loads sqlite-lembed into an
+ * in-process SQLite, generates a reproducible corpus, and runs lembed(),
+ * lembed_batch() and lembed_chunks() over it.
+ *
+ *   make bench-embed BENCH_ARGS="--threads 1,2,4 --batch 512,2048"
+ *
+ *   bench_embed model.gguf [--corpus short,medium,long] [--rows 256]
+ *     [--threads 1,2,4] [--batch 512,2048]
+ *     [--workload lembed,lembed_batch,lembed_chunks] [--seed 42]
+ *
+ * Every combination of corpus, thread count, batch size and workload prints
+ * one JSON object per line to stdout, with rows/sec, tokens/sec, p50/p99
+ * latency, peak RSS, and the time spent tokenizing, decoding, normalizing,
+ * returning results and in SQLite itself, from lembed_stats.
+ *
+ * --threads is the number of connections embedding at the same time, each on
+ * its own thread with its own llama_context. --batch sets n_ctx, n_batch and
+ * n_ubatch of those contexts.
+ */
+#include "sqlite-lembed.c"
+
+#include <stdio.h>
+
+#ifdef _WIN32
+#include <psapi.h>
+#else
+#include <sys/resource.h>
+#endif
+
+#define BENCH_MAX_VALUES 16
+
+static const char *BENCH_WORDS[] = {
+    "the",      "of",        "and",       "to",        "in",
+    "is",       "was",       "for",       "that",      "with",
+    "on",       "as",        "by",        "at",        "from",
+    "his",      "her",       "their",     "an",        "which",
+    "city",     "river",     "government", "company",  "market",
+    "report",   "season",    "league",    "election",  "council",
+    "research", "university", "hospital", "station",   "village",
+    "century",  "building",  "program",   "network",   "engine",
+    "weather",  "museum",    "festival",  "railway",   "court",
+    "announced", "described", "developed", "increased", "published",
+    "received", "released",  "remained",  "reported",  "returned",
+    "after",    "before",    "during",    "between",   "against",
+    "embedding", "database", "sqlite",    "vector",
+};
+#define BENCH_N_WORDS ((int)(sizeof(BENCH_WORDS) / sizeof(BENCH_WORDS[0])))
+
+typedef struct {
+  const char *name;
+  int min_words;
+  int max_words;
+} bench_corpus;
+
+static const bench_corpus BENCH_CORPORA[] = {
+    {"short", 4, 12},
+    {"medium", 40, 80},
+    {"long", 300, 400},
+};
+
+typedef enum {
+  BENCH_LEMBED,
+  BENCH_LEMBED_BATCH,
+  BENCH_LEMBED_CHUNKS,
+} bench_workload;
+
+static const char *BENCH_WORKLOADS[] = {"lembed", "lembed_batch",
+                                        "lembed_chunks"};
+
+typedef struct {
+  const char *model_path;
+  int rows;
+  uint64_t seed;
+  const char *corpora[BENCH_MAX_VALUES];
+  int n_corpora;
+  int threads[BENCH_MAX_VALUES];
+  int n_threads;
+  int batches[BENCH_MAX_VALUES];
+  int n_batches;
+  const char *workloads[BENCH_MAX_VALUES];
+  int n_workloads;
+} bench_options;
+
+static uint32_t bench_rand(uint64_t *state) {
+  *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (uint32_t)(*state >> 33);
+}
+
+/** Deterministic texts of min_words..max_words words each. */
+static char **bench_corpus_generate(const bench_corpus *corpus, int rows,
+                                    uint64_t seed) {
+  char **texts = calloc(rows, sizeof(char *));
+  uint64_t state = seed;
+  for (int i = 0; i < rows; i++) {
+    int n_words = corpus->min_words +
+                  bench_rand(&state) % (corpus->max_words - corpus->min_words + 1);
+    size_t capacity = (size_t)n_words * 12 + 2;
+    char *text = malloc(capacity);
+    size_t length = 0;
+    for (int w = 0; w < n_words; w++) {
+      const char *word = BENCH_WORDS[bench_rand(&state) % BENCH_N_WORDS];
+      length += snprintf(text + length, capacity - length, "%s%s",
+                         w ? " " : "", word);
+    }
+    if (length + 1 < capacity) {
+      text[length++] = '.';
+      text[length] = '\0';
+    }
+    texts[i] = text;
+  }
+  return texts;
+}
+
+static int64_t bench_peak_rss_kb(void) {
+#ifdef _WIN32
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!K32GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                               sizeof(counters))) {
+    return -1;
+  }
+  return (int64_t)(counters.PeakWorkingSetSize / 1024);
+#else
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) {
+    return -1;
+  }
+#ifdef __APPLE__
+  return (int64_t)usage.ru_maxrss / 1024;
+#else
+  return (int64_t)usage.ru_maxrss;
+#endif
+#endif
+}
+
+static sqlite3 *bench_open(const char *model_path, int batch) {
+  sqlite3 *db;
+  if (sqlite3_open(":memory:", &db) != SQLITE_OK) {
+    return NULL;
+  }
+  char *zErr = NULL;
+  if (sqlite3_lembed_init(db, &zErr, NULL) != SQLITE_OK) {
+    fprintf(stderr, "could not load sqlite-lembed: %s\n", zErr ? zErr : "");
+    sqlite3_free(zErr);
+    sqlite3_close(db);
+    return NULL;
+  }
+  sqlite3_stmt *stmt;
+  int rc = sqlite3_prepare_v2(
+      db,
+      "insert into temp.lembed_models(name, model, context_options) "
+      "select 'bench', lembed_model_from_file(?1), lembed_context_options("
+      "'n_ctx', ?2, 'n_batch', ?2, 'n_ubatch', ?2, 'long_inputs', 'mean')",
+      -1, &stmt, NULL);
+  if (rc == SQLITE_OK) {
+    sqlite3_bind_text(stmt, 1, model_path, -1, SQLITE_STATIC);
+    sqlite3_bind_int(stmt, 2, batch);
+    rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+    sqlite3_finalize(stmt);
+  }
+  if (rc != SQLITE_OK) {
+    fprintf(stderr, "could not register %s: %s\n", model_path,
+            sqlite3_errmsg(db));
+    sqlite3_close(db);
+    return NULL;
+  }
+  return db;
+}
+
+/** Number of tokens in each text, which tokens/sec is computed from. */
+static int64_t bench_count_tokens(sqlite3 *db, char **texts, int rows) {
+  sqlite3_stmt *stmt;
+  int64_t total = 0;
+  if (sqlite3_prepare_v2(
+          db, "select json_array_length(lembed_tokenize_json('bench', ?))",
+          -1, &stmt, NULL) != SQLITE_OK) {
+    return -1;
+  }
+  for (int i = 0; i < rows; i++) {
+    sqlite3_bind_text(stmt, 1, texts[i], -1, SQLITE_STATIC);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      total += sqlite3_column_int64(stmt, 0);
+    }
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+  return total;
+}
+
+/** Microseconds spent in each stage on db since its stats were reset. */
+static void bench_stage_us(sqlite3 *db, int64_t *stage_us) {
+  sqlite3_stmt *stmt;
+  if (sqlite3_prepare_v2(db,
+                         "select stage, total_ns from lembed_stats "
+                         "where model = 'bench'",
+                         -1, &stmt, NULL) != SQLITE_OK) {
+    return;
+  }
+  while (sqlite3_step(stmt) == SQLITE_ROW) {
+    const char *stage = (const char *)sqlite3_column_text(stmt, 0);
+    for (int s = 0; s < LEMBED_STAGE_COUNT; s++) {
+      if (strcmp(stage, LEMBED_STAGE_NAMES[s]) == 0) {
+        stage_us[s] += sqlite3_column_int64(stmt, 1) / 1000;
+      }
+    }
+  }
+  sqlite3_finalize(stmt);
+}
+
+typedef struct {
+  sqlite3 *db;
+  bench_workload workload;
+  char **texts;
+  int n_texts;
+  // Latency of every row (lembed), batch row (lembed_batch) or document
+  // (lembed_chunks), in microseconds
+  int64_t *latencies;
+  int n_latencies;
+  int64_t busy_us;
+  int rc;
+} bench_thread;
+
+static void bench_thread_run(void *p) {
+  bench_thread *t = (bench_thread *)p;
+  sqlite3_stmt *stmt = NULL;
+  int64_t begin = ggml_time_us();
+  const char *sql = NULL;
+  switch (t->workload) {
+  case BENCH_LEMBED:
+    sql = "select lembed('bench', ?)";
+    break;
+  case BENCH_LEMBED_BATCH:
+    sql = "select embedding from lembed_batch('bench', ?)";
+    break;
+  case BENCH_LEMBED_CHUNKS:
+    sql = "select count(*) from lembed_chunks('bench', ?)";
+    break;
+  }
+  t->rc = sqlite3_prepare_v2(t->db, sql, -1, &stmt, NULL);
+  if (t->rc != SQLITE_OK) {
+    return;
+  }
+
+  if (t->workload == BENCH_LEMBED_BATCH) {
+    // The whole slice as one JSON array, so rows are packed into batches
+    size_t length = 2;
+    for (int i = 0; i < t->n_texts; i++) {
+      length += strlen(t->texts[i]) + 3;
+    }
+    char *json = malloc(length + 1);
+    size_t n = 0;
+    json[n++] = '[';
+    for (int i = 0; i < t->n_texts; i++) {
+      n += sprintf(json + n, "%s\"%s\"", i ? "," : "", t->texts[i]);
+    }
+    json[n++] = ']';
+    json[n] = '\0';
+    sqlite3_bind_text(stmt, 1, json, (int)n, free);
+
+    int64_t last = ggml_time_us();
+    while ((t->rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      int64_t now = ggml_time_us();
+      t->latencies[t->n_latencies++] = now - last;
+      last = now;
+    }
+  } else {
+    for (int i = 0; i < t->n_texts; i++) {
+      int64_t start = ggml_time_us();
+      sqlite3_bind_text(stmt, 1, t->texts[i], -1, SQLITE_STATIC);
+      while ((t->rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+      }
+      sqlite3_reset(stmt);
+      if (t->rc != SQLITE_DONE) {
+        break;
+      }
+      t->latencies[t->n_latencies++] = ggml_time_us() - start;
+    }
+  }
+  if (t->rc == SQLITE_DONE) {
+    t->rc = SQLITE_OK;
+  } else {
+    fprintf(stderr, "%s failed: %s\n", BENCH_WORKLOADS[t->workload],
+            sqlite3_errmsg(t->db));
+  }
+  sqlite3_finalize(stmt);
+  t->busy_us = ggml_time_us() - begin;
+}
+
+static int bench_compare_int64(const void *a, const void *b) {
+  int64_t x = *(const int64_t *)a;
+  int64_t y = *(const int64_t *)b;
+  return (x > y) - (x < y);
+}
+
+static double bench_percentile_ms(const int64_t *sorted, int n, double p) {
+  if (n == 0) {
+    return 0;
+  }
+  int i = (int)(p * (n - 1) + 0.5);
+  return sorted[i] / 1000.0;
+}
+
+static int bench_run(const bench_options *options, const bench_corpus *corpus,
+                     bench_workload workload, int n_threads, int batch) {
+  char **texts = bench_corpus_generate(corpus, options->rows, options->seed);
+  bench_thread *threads = calloc(n_threads, sizeof(bench_thread));
+  lembed_thread *handles = calloc(n_threads, sizeof(lembed_thread));
+  int64_t *latencies = malloc(sizeof(int64_t) * options->rows);
+  int rc = SQLITE_OK;
+  int64_t tokens = -1;
+
+  // Connections are opened (and the model loaded) before the clock starts
+  for (int i = 0; i < n_threads; i++) {
+    int from = (int)((int64_t)options->rows * i / n_threads);
+    int to = (int)((int64_t)options->rows * (i + 1) / n_threads);
+    threads[i].workload = workload;
+    threads[i].texts = texts + from;
+    threads[i].n_texts = to - from;
+    threads[i].latencies = latencies + from;
+    threads[i].db = bench_open(options->model_path, batch);
+    if (!threads[i].db) {
+      rc = SQLITE_ERROR;
+    }
+  }
+  if (rc == SQLITE_OK) {
+    tokens = bench_count_tokens(threads[0].db, texts, options->rows);
+  }
+
+  for (int i = 0; rc == SQLITE_OK && i < n_threads; i++) {
+    rc = sqlite3_exec(threads[i].db, "select lembed_stats_reset()", NULL, NULL,
+                      NULL);
+  }
+  int64_t start = ggml_time_us();
+  int n_started = 0;
+  for (; rc == SQLITE_OK && n_started < n_threads; n_started++) {
+    rc = lembed_thread_create(&handles[n_started], bench_thread_run,
+                              &threads[n_started]);
+  }
+  for (int i = 0; i < n_started; i++) {
+    lembed_thread_join(handles[i]);
+  }
+  int64_t elapsed_us = ggml_time_us() - start;
+
+  int64_t busy_us = 0;
+  int64_t stage_us[LEMBED_STAGE_COUNT] = {0};
+  int n_latencies = 0;
+  for (int i = 0; i < n_started; i++) {
+    if (threads[i].rc != SQLITE_OK) {
+      rc = threads[i].rc;
+    }
+    busy_us += threads[i].busy_us;
+    bench_stage_us(threads[i].db, stage_us);
+    memmove(latencies + n_latencies, threads[i].latencies,
+            sizeof(int64_t) * threads[i].n_latencies);
+    n_latencies += threads[i].n_latencies;
+  }
+
+  if (rc == SQLITE_OK) {
+    qsort(latencies, n_latencies, sizeof(int64_t), bench_compare_int64);
+    int64_t tokenize_us = stage_us[LEMBED_STAGE_TOKENIZE];
+    int64_t decode_us = stage_us[LEMBED_STAGE_DECODE];
+    int64_t normalize_us = stage_us[LEMBED_STAGE_NORMALIZE];
+    int64_t result_us = stage_us[LEMBED_STAGE_RESULT];
+    // Everything that isn't one of the stages: statement overhead, binding
+    // values, JSON parsing, and waiting on locks
+    int64_t sqlite_us =
+        busy_us - tokenize_us - decode_us - normalize_us - result_us;
+    if (sqlite_us < 0) {
+      sqlite_us = 0;
+    }
+    double seconds = elapsed_us / 1e6;
+    printf("{\"workload\":\"%s\",\"corpus\":\"%s\",\"rows\":%d,"
+           "\"threads\":%d,\"batch\":%d,\"tokens\":%lld,\"seconds\":%.6f,"
+           "\"rows_per_sec\":%.2f,\"tokens_per_sec\":%.2f,\"p50_ms\":%.3f,"
+           "\"p99_ms\":%.3f,\"peak_rss_kb\":%lld,\"tokenize_ms\":%.3f,"
+           "\"decode_ms\":%.3f,\"normalize_ms\":%.3f,\"result_ms\":%.3f,"
+           "\"sqlite_ms\":%.3f}\n",
+           BENCH_WORKLOADS[workload], corpus->name, options->rows, n_threads,
+           batch, (long long)tokens, seconds, options->rows / seconds,
+           tokens / seconds, bench_percentile_ms(latencies, n_latencies, 0.5),
+           bench_percentile_ms(latencies, n_latencies, 0.99),
+           (long long)bench_peak_rss_kb(), tokenize_us / 1000.0,
+           decode_us / 1000.0, normalize_us / 1000.0, result_us / 1000.0,
+           sqlite_us / 1000.0);
+    fflush(stdout);
+  }
+
+  for (int i = 0; i < n_threads; i++) {
+    if (threads[i].db) {
+      sqlite3_close(threads[i].db);
+    }
+  }
+  for (int i = 0; i < options->rows; i++) {
+    free(texts[i]);
+  }
+  free(texts);
+  free(threads);
+  free(handles);
+  free(latencies);
+  return rc;
+}
+
+/** Split a comma separated list in place. */
+static int bench_split(char *list, const char **values) {
+  int n = 0;
+  for (char *value = strtok(list, ","); value && n < BENCH_MAX_VALUES;
+       value = strtok(NULL, ",")) {
+    values[n++] = value;
+  }
+  return n;
+}
+
+static int bench_split_ints(char *list, int *values) {
+  const char *strings[BENCH_MAX_VALUES];
+  int n = bench_split(list, strings);
+  for (int i = 0; i < n; i++) {
+    values[i] = atoi(strings[i]);
+    if (values[i] <= 0) {
+      return -1;
+    }
+  }
+  return n;
+}
+
+static void bench_usage(const char *program) {
+  fprintf(stderr,
+          "usage: %s model.gguf [--corpus short,medium,long] [--rows N]\n"
+          "  [--threads 1,2,...] [--batch 512,...]\n"
+          "  [--workload lembed,lembed_batch,lembed_chunks] [--seed N]\n",
+          program);
+}
+
+int main(int argc, char **argv) {
+  bench_options options;
+  memset(&options, 0, sizeof(options));
+  options.rows = 256;
+  options.seed = 42;
+  char default_corpora[] = "short,medium,long";
+  char default_workloads[] = "lembed,lembed_batch,lembed_chunks";
+  options.n_corpora = bench_split(default_corpora, options.corpora);
+  options.n_workloads = bench_split(default_workloads, options.workloads);
+  options.threads[0] = 1;
+  options.n_threads = 1;
+  options.batches[0] = 512;
+  options.n_batches = 1;
+
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    char *value = i + 1 < argc ? argv[i + 1] : NULL;
+    if (arg[0] != '-') {
+      options.model_path = arg;
+      continue;
+    }
+    if (!value) {
+      bench_usage(argv[0]);
+      return 1;
+    }
+    i++;
+    if (strcmp(arg, "--corpus") == 0) {
+      options.n_corpora = bench_split(value, options.corpora);
+    } else if (strcmp(arg, "--workload") == 0) {
+      options.n_workloads = bench_split(value, options.workloads);
+    } else if (strcmp(arg, "--threads") == 0) {
+      options.n_threads = bench_split_ints(value, options.threads);
+    } else if (strcmp(arg, "--batch") == 0) {
+      options.n_batches = bench_split_ints(value, options.batches);
+    } else if (strcmp(arg, "--rows") == 0) {
+      options.rows = atoi(value);
+    } else if (strcmp(arg, "--seed") == 0) {
+      options.seed = strtoull(value, NULL, 10);
+    } else {
+      bench_usage(argv[0]);
+      return 1;
+    }
+  }
+  if (!options.model_path || options.rows <= 0 || options.n_threads <= 0 ||
+      options.n_batches <= 0) {
+    bench_usage(argv[0]);
+    return 1;
+  }
+
+  int failed = 0;
+  for (int c = 0; c < options.n_corpora; c++) {
+    const bench_corpus *corpus = NULL;
+    for (size_t k = 0; k < sizeof(BENCH_CORPORA) / sizeof(BENCH_CORPORA[0]);
+         k++) {
+      if (strcmp(BENCH_CORPORA[k].name, options.corpora[c]) == 0) {
+        corpus = &BENCH_CORPORA[k];
+      }
+    }
+    if (!corpus) {
+      fprintf(stderr, "unknown corpus '%s'\n", options.corpora[c]);
+      return 1;
+    }
+    for (int w = 0; w < options.n_workloads; w++) {
+      int workload = -1;
+      for (int k = 0; k < (int)(sizeof(BENCH_WORKLOADS) /
+                                sizeof(BENCH_WORKLOADS[0]));
+           k++) {
+        if (strcmp(BENCH_WORKLOADS[k], options.workloads[w]) == 0) {
+          workload = k;
+        }
+      }
+      if (workload < 0) {
+        fprintf(stderr, "unknown workload '%s'\n", options.workloads[w]);
+        return 1;
+      }
+      for (int t = 0; t < options.n_threads; t++) {
+        for (int b = 0; b < options.n_batches; b++) {
+          if (bench_run(&options, corpus, (bench_workload)workload,
+                        options.threads[t], options.batches[b]) !=
+              SQLITE_OK) {
+            failed = 1;
+          }
+        }
+      }
+    }
+  }
+  return failed;
+}
@@ -0,0 +1,196 @@
+/*
+ * Micro-benchmark of sqlite-lembed's per-vector kernels (normalize, int8 and
+ * bit quantization, dot product, L2 distance), comparing every SIMD implementation
+ * available on this machine against the scalar one.
+ *
+ *   make bench-kernels
+ *
+ * Each kernel is also checked against the scalar output, so this doubles as a
+ * quick sanity check when touching the kernels.
+ */
+#include "sqlite-lembed.c"
+
+#include <stdio.h>
+
+#define BENCH_VECTORS 256
+
+static double now_ns(void) { return (double)ggml_time_us() * 1000.0; }
+
+static float rand_float(uint64_t *state) {
+  *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return ((float)(*state >> 40) / (float)(1 << 24)) * 2.0f - 1.0f;
+}
+
+static volatile float sink;
+
+static double bench_dot(const lembed_kernels *k, const float *vecs, int n,
+                        int iterations) {
+  double start = now_ns();
+  float acc = 0;
+  for (int it = 0; it < iterations; it++) {
+    for (int v = 0; v + 1 < BENCH_VECTORS; v++) {
+      acc += k->dot(vecs + (size_t)v * n, vecs + (size_t)(v + 1) * n, n);
+    }
+  }
+  sink = acc;
+  return (now_ns() - start) / ((double)iterations * (BENCH_VECTORS - 1));
+}
+
+static double bench_l2(const lembed_kernels *k, const float *vecs, int n,
+                       int iterations) {
+  double start = now_ns();
+  float acc = 0;
+  for (int it = 0; it < iterations; it++) {
+    for (int v = 0; v + 1 < BENCH_VECTORS; v++) {
+      acc +=
+          k->l2_squared(vecs + (size_t)v * n, vecs + (size_t)(v + 1) * n, n);
+    }
+  }
+  sink = acc;
+  return (now_ns() - start) / ((double)iterations * (BENCH_VECTORS - 1));
+}
+
+static double bench_normalize(const lembed_kernels *k, const float *vecs,
+                              float *out, int n, int iterations) {
+  double start = now_ns();
+  for (int it = 0; it < iterations; it++) {
+    for (int v = 0; v < BENCH_VECTORS; v++) {
+      k->normalize(vecs + (size_t)v * n, out + (size_t)v * n, n);
+    }
+  }
+  sink = out[0];
+  return (now_ns() - start) / ((double)iterations * BENCH_VECTORS);
+}
+
+static double bench_int8(const lembed_kernels *k, const float *vecs,
+                         int8_t *out, int n, int iterations) {
+  double start = now_ns();
+  for (int it = 0; it < iterations; it++) {
+    for (int v = 0; v < BENCH_VECTORS; v++) {
+      k->quantize_int8(vecs + (size_t)v * n, out + (size_t)v * n, n);
+    }
+  }
+  sink = out[0];
+  return (now_ns() - start) / ((double)iterations * BENCH_VECTORS);
+}
+
+static double bench_bit(const lembed_kernels *k, const float *vecs,
+                        uint8_t *out, int n, int iterations) {
+  double start = now_ns();
+  for (int it = 0; it < iterations; it++) {
+    for (int v = 0; v < BENCH_VECTORS; v++) {
+      k->quantize_bit(vecs + (size_t)v * n, out + (size_t)v * ((n + 7) / 8),
+                      n);
+    }
+  }
+  sink = out[0];
+  return (now_ns() - start) / ((double)iterations * BENCH_VECTORS);
+}
+
+/** Returns the number of mismatches between k and the scalar kernels. */
+static int check(const lembed_kernels *k, const float *vecs, int n) {
+  int errors = 0;
+  float *a = malloc(sizeof(float) * n);
+  float *b = malloc(sizeof(float) * n);
+  int8_t *qa = malloc(n);
+  int8_t *qb = malloc(n);
+  uint8_t *ba = malloc((n + 7) / 8);
+  uint8_t *bb = malloc((n + 7) / 8);
+
+  float da = lembed_kernels_scalar.dot(vecs, vecs + n, n);
+  float db = k->dot(vecs, vecs + n, n);
+  if (fabsf(da - db) > 1e-3f * (fabsf(da) + 1.0f)) {
+    errors++;
+  }
+  float la = lembed_kernels_scalar.l2_squared(vecs, vecs + n, n);
+  float lb = k->l2_squared(vecs, vecs + n, n);
+  if (fabsf(la - lb) > 1e-3f * (fabsf(la) + 1.0f)) {
+    errors++;
+  }
+  lembed_kernels_scalar.normalize(vecs, a, n);
+  k->normalize(vecs, b, n);
+  for (int i = 0; i < n; i++) {
+    if (fabsf(a[i] - b[i]) > 1e-5f) {
+      errors++;
+    }
+  }
+  lembed_kernels_scalar.quantize_int8(a, qa, n);
+  k->quantize_int8(a, qb, n);
+  for (int i = 0; i < n; i++) {
+    if (abs(qa[i] - qb[i]) > 1) {
+      errors++;
+    }
+  }
+  lembed_kernels_scalar.quantize_bit(a, ba, n);
+  k->quantize_bit(a, bb, n);
+  if (memcmp(ba, bb, (n + 7) / 8) != 0) {
+    errors++;
+  }
+
+  free(a);
+  free(b);
+  free(qa);
+  free(qb);
+  free(ba);
+  free(bb);
+  return errors;
+}
+
+int main(int argc, char **argv) {
+  static const int dimensions[] = {384, 768, 1024, 4096};
+  const lembed_kernels *candidates[4];
+  int n_candidates = 0;
+  candidates[n_candidates++] = &lembed_kernels_scalar;
+#ifdef LEMBED_KERNELS_X86
+  if (ggml_cpu_has_avx2() && ggml_cpu_has_fma()) {
+    candidates[n_candidates++] = &lembed_kernels_avx2;
+  }
+  if (ggml_cpu_has_avx512()) {
+    candidates[n_candidates++] = &lembed_kernels_avx512;
+  }
+#endif
+#ifdef LEMBED_KERNELS_NEON
+  if (ggml_cpu_has_neon()) {
+    candidates[n_candidates++] = &lembed_kernels_neon;
+  }
+#endif
+  lembed_kernels_init();
+  printf("selected kernels: %s\n\n", kernels.name);
+  printf("%-8s %6s %12s %12s %12s %12s %12s\n", "kernels", "dims", "dot ns",
+         "l2 ns", "normalize ns", "int8 ns", "bit ns");
+
+  int failed = 0;
+  for (size_t d = 0; d < sizeof(dimensions) / sizeof(dimensions[0]); d++) {
+    int n = dimensions[d];
+    int iterations = (int)(4000000 / ((size_t)n * BENCH_VECTORS)) + 1;
+    float *vecs = malloc(sizeof(float) * n * BENCH_VECTORS);
+    float *out = malloc(sizeof(float) * n * BENCH_VECTORS);
+    int8_t *q8 = malloc((size_t)n * BENCH_VECTORS);
+    uint8_t *q1 = malloc((size_t)((n + 7) / 8) * BENCH_VECTORS);
+    uint64_t state = 42;
+    for (int i = 0; i < n * BENCH_VECTORS; i++) {
+      vecs[i] = rand_float(&state);
+    }
+
+    for (int c = 0; c < n_candidates; c++) {
+      const lembed_kernels *k = candidates[c];
+      int errors = check(k, vecs, n);
+      if (errors) {
+        fprintf(stderr, "%s kernels differ from scalar at %d dimensions (%d)\n",
+                k->name, n, errors);
+        failed = 1;
+      }
+      printf("%-8s %6d %12.1f %12.1f %12.1f %12.1f %12.1f\n", k->name, n,
+             bench_dot(k, vecs, n, iterations),
+             bench_l2(k, vecs, n, iterations),
+             bench_normalize(k, vecs, out, n, iterations),
+             bench_int8(k, out, q8, n, iterations),
+             bench_bit(k, out, q1, n, iterations));
+    }
+    free(vecs);
+    free(out);
+    free(q8);
+    free(q1);
+  }
+  return failed;
+}
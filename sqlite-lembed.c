@@ -1,9 +1,16 @@
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+// For pthread_setaffinity_np() and cpu_set_t
+#define _GNU_SOURCE
+#endif
+
 #include "sqlite-lembed.h"
 #include "llama.h"
 #include <assert.h>
+#include <ctype.h>
 #include <math.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <time.h>
 
 #include "sqlite3ext.h"
@@ -13,599 +20,9523 @@ SQLITE_EXTENSION_INIT1
 #define UNUSED_PARAMETER(X) (void)(X)
 #endif
 
-void dummy_log(enum ggml_log_level level, const char *text, void *user_data) {}
+#pragma region threads
 
-static void normalize(float *vec, float *out, int n) {
-  float norm = 0;
-  for (int i = 0; i < n; i++) {
-    norm += vec[i] * vec[i];
+#ifdef _WIN32
+#include <windows.h>
+typedef SRWLOCK lembed_mutex;
+typedef CONDITION_VARIABLE lembed_cond;
+#define LEMBED_MUTEX_INITIALIZER SRWLOCK_INIT
+#define LEMBED_COND_INITIALIZER CONDITION_VARIABLE_INIT
+static void lembed_mutex_init(lembed_mutex *m) { InitializeSRWLock(m); }
+static void lembed_mutex_destroy(lembed_mutex *m) { UNUSED_PARAMETER(m); }
+static void lembed_mutex_lock(lembed_mutex *m) { AcquireSRWLockExclusive(m); }
+static void lembed_mutex_unlock(lembed_mutex *m) { ReleaseSRWLockExclusive(m); }
+static void lembed_cond_init(lembed_cond *c) { InitializeConditionVariable(c); }
+static void lembed_cond_destroy(lembed_cond *c) { UNUSED_PARAMETER(c); }
+static void lembed_cond_wait(lembed_cond *c, lembed_mutex *m) {
+  SleepConditionVariableSRW(c, m, INFINITE, 0);
+}
+/** Wait on c until it's signaled, or for at most timeout_ns. */
+static void lembed_cond_timedwait(lembed_cond *c, lembed_mutex *m,
+                                  int64_t timeout_ns) {
+  SleepConditionVariableSRW(c, m, (DWORD)((timeout_ns + 999999) / 1000000),
+                            0);
+}
+static void lembed_cond_signal(lembed_cond *c) { WakeConditionVariable(c); }
+static void lembed_cond_broadcast(lembed_cond *c) {
+  WakeAllConditionVariable(c);
+}
+typedef HANDLE lembed_thread;
+typedef struct {
+  void (*fn)(void *);
+  void *arg;
+} lembed_thread_start;
+static DWORD WINAPI lembed_thread_main(LPVOID p) {
+  lembed_thread_start start = *(lembed_thread_start *)p;
+  sqlite3_free(p);
+  start.fn(start.arg);
+  return 0;
+}
+static int lembed_thread_create(lembed_thread *t, void (*fn)(void *),
+                                void *arg) {
+  lembed_thread_start *start = sqlite3_malloc(sizeof(*start));
+  if (!start) {
+    return SQLITE_NOMEM;
   }
-  norm = sqrt(norm);
-  for (int i = 0; i < n; i++) {
-    out[i] = vec[i] / norm;
+  start->fn = fn;
+  start->arg = arg;
+  *t = CreateThread(NULL, 0, lembed_thread_main, start, 0, NULL);
+  if (!*t) {
+    sqlite3_free(start);
+    return SQLITE_ERROR;
   }
+  return SQLITE_OK;
 }
-
-#define LEMBED_TOKEN_SUBTYPE 116 // ascii 't'
-
-int tokenize(struct llama_model *model, const char *input, size_t input_length,
-             int *token_count, llama_token **tokens) {
-  int input_token_count_estimate =
-      llama_tokenize(model, input, input_length, NULL, 0, true, true);
-  if (input_token_count_estimate >= 0) {
-    return SQLITE_ERROR;
+static void lembed_thread_join(lembed_thread t) {
+  WaitForSingleObject(t, INFINITE);
+  CloseHandle(t);
+}
+static int64_t lembed_atomic_add(int64_t *p, int64_t v) {
+  return InterlockedExchangeAdd64((volatile LONG64 *)p, v) + v;
+}
+static int64_t lembed_atomic_load(int64_t *p) {
+  return InterlockedCompareExchange64((volatile LONG64 *)p, 0, 0);
+}
+static void lembed_atomic_store(int64_t *p, int64_t v) {
+  InterlockedExchange64((volatile LONG64 *)p, v);
+}
+static int lembed_log2(uint64_t v) {
+  unsigned long i;
+  _BitScanReverse64(&i, v);
+  return (int)i;
+}
+/** Monotonic clock, in nanoseconds. */
+static int64_t lembed_time_ns(void) {
+  static LARGE_INTEGER frequency;
+  LARGE_INTEGER now;
+  if (!frequency.QuadPart) {
+    QueryPerformanceFrequency(&frequency);
   }
-  *tokens =
-      sqlite3_malloc(sizeof(llama_token) * abs(input_token_count_estimate));
-  if (!(*tokens)) {
+  QueryPerformanceCounter(&now);
+  int64_t seconds = now.QuadPart / frequency.QuadPart;
+  int64_t ticks = now.QuadPart % frequency.QuadPart;
+  return seconds * 1000000000 + ticks * 1000000000 / frequency.QuadPart;
+}
+#else
+#include <pthread.h>
+typedef pthread_mutex_t lembed_mutex;
+typedef pthread_cond_t lembed_cond;
+#define LEMBED_MUTEX_INITIALIZER PTHREAD_MUTEX_INITIALIZER
+#define LEMBED_COND_INITIALIZER PTHREAD_COND_INITIALIZER
+static void lembed_mutex_init(lembed_mutex *m) { pthread_mutex_init(m, NULL); }
+static void lembed_mutex_destroy(lembed_mutex *m) { pthread_mutex_destroy(m); }
+static void lembed_mutex_lock(lembed_mutex *m) { pthread_mutex_lock(m); }
+static void lembed_mutex_unlock(lembed_mutex *m) { pthread_mutex_unlock(m); }
+static void lembed_cond_init(lembed_cond *c) { pthread_cond_init(c, NULL); }
+static void lembed_cond_destroy(lembed_cond *c) { pthread_cond_destroy(c); }
+static void lembed_cond_wait(lembed_cond *c, lembed_mutex *m) {
+  pthread_cond_wait(c, m);
+}
+/** Wait on c until it's signaled, or for at most timeout_ns. */
+static void lembed_cond_timedwait(lembed_cond *c, lembed_mutex *m,
+                                  int64_t timeout_ns) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  int64_t ns = deadline.tv_nsec + timeout_ns;
+  deadline.tv_sec += ns / 1000000000;
+  deadline.tv_nsec = ns % 1000000000;
+  pthread_cond_timedwait(c, m, &deadline);
+}
+static void lembed_cond_signal(lembed_cond *c) { pthread_cond_signal(c); }
+static void lembed_cond_broadcast(lembed_cond *c) {
+  pthread_cond_broadcast(c);
+}
+typedef pthread_t lembed_thread;
+typedef struct {
+  void (*fn)(void *);
+  void *arg;
+} lembed_thread_start;
+static void *lembed_thread_main(void *p) {
+  lembed_thread_start start = *(lembed_thread_start *)p;
+  sqlite3_free(p);
+  start.fn(start.arg);
+  return NULL;
+}
+static int lembed_thread_create(lembed_thread *t, void (*fn)(void *),
+                                void *arg) {
+  lembed_thread_start *start = sqlite3_malloc(sizeof(*start));
+  if (!start) {
     return SQLITE_NOMEM;
   }
-  int input_token_count =
-      llama_tokenize(model, input, input_length, *tokens,
-                     abs(input_token_count_estimate), true, true);
-  if (input_token_count != abs(input_token_count_estimate)) {
-    sqlite3_free(*tokens);
+  start->fn = fn;
+  start->arg = arg;
+  if (pthread_create(t, NULL, lembed_thread_main, start) != 0) {
+    sqlite3_free(start);
     return SQLITE_ERROR;
   }
-
-  *token_count = input_token_count;
   return SQLITE_OK;
 }
+static void lembed_thread_join(lembed_thread t) { pthread_join(t, NULL); }
+static int64_t lembed_atomic_add(int64_t *p, int64_t v) {
+  return __atomic_add_fetch(p, v, __ATOMIC_RELAXED);
+}
+static int64_t lembed_atomic_load(int64_t *p) {
+  return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+static void lembed_atomic_store(int64_t *p, int64_t v) {
+  __atomic_store_n(p, v, __ATOMIC_RELAXED);
+}
+static int lembed_log2(uint64_t v) { return 63 - __builtin_clzll(v); }
+/** Monotonic clock, in nanoseconds. */
+static int64_t lembed_time_ns(void) {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return (int64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+#endif
 
-int embed_single(struct llama_model *model, struct llama_context *context,
-                 const char *input, size_t input_length,
-                 /** Output float embedding */
-                 float **out_embedding,
-                 /** Output embedding length (n dimensions) */
-                 int *out_dimensions) {
-  int n_batch = 512;
-  int n_ctx_train = llama_n_ctx_train(model);
-  int n_ctx = llama_n_ctx(context);
+#pragma endregion
 
-  llama_token *tokens;
-  int token_count;
-  int rc = tokenize(model, input, input_length, &token_count, &tokens);
-  if(rc != SQLITE_OK) {
-    // TODO error message
-    return rc;
+#pragma region resident memory
+
+/** Resident set size of this process in bytes, or -1 where it's unknown. */
+#if defined(_WIN32)
+#include <psapi.h>
+static int64_t lembed_resident_bytes(void) {
+  PROCESS_MEMORY_COUNTERS counters;
+  if (!K32GetProcessMemoryInfo(GetCurrentProcess(), &counters,
+                               sizeof(counters))) {
+    return -1;
+  }
+  return counters.WorkingSetSize;
+}
+#elif defined(__APPLE__)
+#include <mach/mach.h>
+static int64_t lembed_resident_bytes(void) {
+  mach_task_basic_info_data_t info;
+  mach_msg_type_number_t count = MACH_TASK_BASIC_INFO_COUNT;
+  if (task_info(mach_task_self(), MACH_TASK_BASIC_INFO, (task_info_t)&info,
+                &count) != KERN_SUCCESS) {
+    return -1;
+  }
+  return info.resident_size;
+}
+#elif defined(__linux__)
+#include <stdio.h>
+#include <unistd.h>
+static int64_t lembed_resident_bytes(void) {
+  FILE *f = fopen("/proc/self/statm", "r");
+  if (!f) {
+    return -1;
   }
+  long long size;
+  long long resident;
+  int n = fscanf(f, "%lld %lld", &size, &resident);
+  fclose(f);
+  return n == 2 ? resident * sysconf(_SC_PAGESIZE) : -1;
+}
+#else
+static int64_t lembed_resident_bytes(void) { return -1; }
+#endif
 
-  struct llama_batch batch = llama_batch_init(n_batch, 0, 1);
+#pragma endregion
 
-  int seq_id = 0;
-  // llama_batch_add(batch, tokens, 0, )
-  for (int i = 0; i < token_count; i++) {
-    batch.token[batch.n_tokens] = tokens[i];
-    batch.pos[batch.n_tokens] = i;
+#pragma region cpu affinity
 
-    batch.n_seq_id[batch.n_tokens] = 1;
-    batch.seq_id[batch.n_tokens][0] = seq_id;
+// CPUs a model's contexts decode on, from the cpu_mask context option
+#define LEMBED_MAX_CPUS 1024
+typedef struct lembed_cpu_mask {
+  uint64_t bits[LEMBED_MAX_CPUS / 64];
+} lembed_cpu_mask;
 
-    batch.logits[batch.n_tokens] = i == (token_count - 1);
-    batch.n_tokens++;
+/**
+ * Parse a list of CPUs and CPU ranges like "0-3,8,10-11" into mask. Returns
+ * SQLITE_ERROR for anything else, or for CPUs past LEMBED_MAX_CPUS.
+ */
+static int cpu_mask_parse(const char *z, lembed_cpu_mask *mask) {
+  memset(mask, 0, sizeof(*mask));
+  if (!z || !*z) {
+    return SQLITE_ERROR;
   }
-
-  int dimensions = llama_n_embd(model);
-  float *output_embedding = sqlite3_malloc(sizeof(float) * dimensions);
-  if(!output_embedding) {
-    llama_batch_free(batch);
-    return SQLITE_NOMEM;
+  while (*z) {
+    char *end;
+    long first = strtol(z, &end, 10);
+    if (end == z || first < 0) {
+      return SQLITE_ERROR;
+    }
+    long last = first;
+    z = end;
+    if (*z == '-') {
+      z++;
+      last = strtol(z, &end, 10);
+      if (end == z || last < first) {
+        return SQLITE_ERROR;
+      }
+      z = end;
+    }
+    if (last >= LEMBED_MAX_CPUS) {
+      return SQLITE_ERROR;
+    }
+    for (long cpu = first; cpu <= last; cpu++) {
+      mask->bits[cpu / 64] |= (uint64_t)1 << (cpu % 64);
+    }
+    if (*z == ',') {
+      z++;
+      if (!*z) {
+        return SQLITE_ERROR;
+      }
+    } else if (*z) {
+      return SQLITE_ERROR;
+    }
   }
+  return SQLITE_OK;
+}
 
-  llama_kv_cache_clear(context); // KV not needed for embeddings?
-  rc = llama_decode(context, batch);
-  if(rc != 0) {
-    sqlite3_free(output_embedding);
-    llama_batch_free(batch);
-    return SQLITE_ERROR;
+/*
+ * llama.cpp is built without OpenMP (LLAMA_OPENMP=OFF), so ggml starts its
+ * compute threads from the thread that calls llama_decode(), and they inherit
+ * its affinity. Pinning the calling thread around a decode pins them all.
+ */
+#if defined(_WIN32)
+typedef DWORD_PTR lembed_cpu_affinity;
+#define LEMBED_HAS_CPU_AFFINITY 1
+static int cpu_mask_supported(const lembed_cpu_mask *mask) {
+  for (int i = 1; i < LEMBED_MAX_CPUS / 64; i++) {
+    if (mask->bits[i]) {
+      return 0;
+    }
   }
-
-  float * source_embedding;
-  if(llama_pooling_type(context) == LLAMA_POOLING_TYPE_NONE) {
-    source_embedding = llama_get_embeddings(context);
+  return sizeof(DWORD_PTR) == 8 || mask->bits[0] >> 32 == 0;
+}
+static void cpu_affinity_enter(const lembed_cpu_mask *mask,
+                               lembed_cpu_affinity *saved) {
+  *saved = SetThreadAffinityMask(GetCurrentThread(), (DWORD_PTR)mask->bits[0]);
+}
+static void cpu_affinity_leave(lembed_cpu_affinity *saved) {
+  if (*saved) {
+    SetThreadAffinityMask(GetCurrentThread(), *saved);
   }
-  else {
-    source_embedding = llama_get_embeddings_seq(context, batch.seq_id[0][0]);
+}
+#elif defined(__linux__)
+#include <sched.h>
+typedef struct {
+  cpu_set_t set;
+  int ok;
+} lembed_cpu_affinity;
+#define LEMBED_HAS_CPU_AFFINITY 1
+static int cpu_mask_supported(const lembed_cpu_mask *mask) {
+  for (int cpu = CPU_SETSIZE; cpu < LEMBED_MAX_CPUS; cpu++) {
+    if (mask->bits[cpu / 64] & ((uint64_t)1 << (cpu % 64))) {
+      return 0;
+    }
   }
-  if(!source_embedding) {
-    sqlite3_free(output_embedding);
-    llama_batch_free(batch);
-    return SQLITE_ERROR;
+  return 1;
+}
+static void cpu_affinity_enter(const lembed_cpu_mask *mask,
+                               lembed_cpu_affinity *saved) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu = 0; cpu < CPU_SETSIZE && cpu < LEMBED_MAX_CPUS; cpu++) {
+    if (mask->bits[cpu / 64] & ((uint64_t)1 << (cpu % 64))) {
+      CPU_SET(cpu, &set);
+    }
+  }
+  pthread_t self = pthread_self();
+  saved->ok = pthread_getaffinity_np(self, sizeof(saved->set), &saved->set) ==
+                  0 &&
+              pthread_setaffinity_np(self, sizeof(set), &set) == 0;
+}
+static void cpu_affinity_leave(lembed_cpu_affinity *saved) {
+  if (saved->ok) {
+    pthread_setaffinity_np(pthread_self(), sizeof(saved->set), &saved->set);
   }
+}
+#else
+// macOS only has affinity hints (thread_policy_set), which aren't masks
+typedef int lembed_cpu_affinity;
+#define LEMBED_HAS_CPU_AFFINITY 0
+static int cpu_mask_supported(const lembed_cpu_mask *mask) {
+  UNUSED_PARAMETER(mask);
+  return 0;
+}
+static void cpu_affinity_enter(const lembed_cpu_mask *mask,
+                               lembed_cpu_affinity *saved) {
+  UNUSED_PARAMETER(mask);
+  UNUSED_PARAMETER(saved);
+}
+static void cpu_affinity_leave(lembed_cpu_affinity *saved) {
+  UNUSED_PARAMETER(saved);
+}
+#endif
 
-  normalize(source_embedding, output_embedding, dimensions);
-  llama_batch_free(batch);
+#pragma endregion
 
-  *out_dimensions = dimensions;
-  *out_embedding = output_embedding;
-  return SQLITE_OK;
+#pragma region thread budget
+
+/*
+ * Process-wide cap on the llama.cpp compute threads of every model, set with
+ * lembed_thread_budget(). Each decode takes its threads from the budget and
+ * gives them back afterwards, so models that run side by side split the
+ * cores instead of oversubscribing them. 0 means no cap.
+ */
+static struct {
+  lembed_mutex lock;
+  lembed_cond available;
+  int budget;
+  int in_use;
+} lembed_threads = {LEMBED_MUTEX_INITIALIZER, LEMBED_COND_INITIALIZER, 0, 0};
+
+/**
+ * Take up to want threads from the budget, waiting until at least one is
+ * free. Returns how many were taken, for lembed_threads_release().
+ */
+static int lembed_threads_acquire(int want) {
+  lembed_mutex_lock(&lembed_threads.lock);
+  int n = want;
+  if (lembed_threads.budget > 0) {
+    while (lembed_threads.in_use >= lembed_threads.budget) {
+      lembed_cond_wait(&lembed_threads.available, &lembed_threads.lock);
+    }
+    int free_threads = lembed_threads.budget - lembed_threads.in_use;
+    if (n > free_threads) {
+      n = free_threads;
+    }
+  }
+  lembed_threads.in_use += n;
+  lembed_mutex_unlock(&lembed_threads.lock);
+  return n;
 }
 
-typedef struct ApiModel ApiModel;
-struct ApiModel {
-  char *name;
-  struct llama_model *model;
-  struct llama_context *context;
-};
+static void lembed_threads_release(int n) {
+  lembed_mutex_lock(&lembed_threads.lock);
+  lembed_threads.in_use -= n;
+  lembed_cond_broadcast(&lembed_threads.available);
+  lembed_mutex_unlock(&lembed_threads.lock);
+}
 
-#define MAX_MODELS 16
-struct Api {
-  int default_index;
-  ApiModel models[MAX_MODELS];
+/**
+ * lembed_thread_budget([n]): the process-wide thread budget, after setting it
+ * to n if given. 0 means no budget.
+ */
+static void lembed_thread_budget(sqlite3_context *context, int argc,
+                                 sqlite3_value **argv) {
+  if (argc == 1) {
+    sqlite3_int64 n = sqlite3_value_int64(argv[0]);
+    if (sqlite3_value_type(argv[0]) != SQLITE_INTEGER || n < 0 ||
+        n > INT32_MAX) {
+      char *zErr = sqlite3_mprintf(
+          "thread budget must be 0 (no budget) or a number of threads, got %s",
+          sqlite3_value_text(argv[0]));
+      sqlite3_result_error(context, zErr, -1);
+      sqlite3_free(zErr);
+      return;
+    }
+    lembed_mutex_lock(&lembed_threads.lock);
+    lembed_threads.budget = (int)n;
+    lembed_cond_broadcast(&lembed_threads.available);
+    lembed_mutex_unlock(&lembed_threads.lock);
+  }
+  lembed_mutex_lock(&lembed_threads.lock);
+  int budget = lembed_threads.budget;
+  lembed_mutex_unlock(&lembed_threads.lock);
+  sqlite3_result_int(context, budget);
+}
+
+#pragma endregion
+
+void dummy_log(enum ggml_log_level level, const char *text, void *user_data) {}
+
+#pragma region stats
+
+/*
+ * Per-model counters and latency histograms of every stage of embedding,
+ * exposed by the lembed_stats table. Everything is updated with relaxed
+ * atomics, so threads embedding on the same model don't contend on a lock.
+ */
+enum lembed_stage {
+  // A whole lembed() call, tokens are the tokens of its input
+  LEMBED_STAGE_EMBED,
+  LEMBED_STAGE_TOKENIZE,
+  LEMBED_STAGE_DECODE,
+  // Reading pooled embeddings out of the context, and normalizing them
+  LEMBED_STAGE_NORMALIZE,
+  // Quantizing and copying embeddings into SQLite results
+  LEMBED_STAGE_RESULT,
+  // lembed() calls answered from the embedding cache
+  LEMBED_STAGE_CACHE_HIT,
+  // Waiting for a context of the connection's pool to be free, only when all
+  // were busy, which takes lembed_enqueue() workers
+  LEMBED_STAGE_CONTEXT_WAIT,
+  // lembed() calls coalesced with other callers, from joining a batch until
+  // its embeddings are decoded, with the coalesce_ms context option
+  LEMBED_STAGE_COALESCE,
+  // Loading the model and creating its contexts in lembed_models
+  LEMBED_STAGE_LOAD,
+  LEMBED_STAGE_COUNT,
 };
 
-void api_free(void *p) {
-  struct Api *a = (struct Api *)p;
-  llama_backend_free();
-  sqlite3_free(a);
-}
+static const char *LEMBED_STAGE_NAMES[LEMBED_STAGE_COUNT] = {
+    "embed",     "tokenize",     "decode",   "normalize", "result",
+    "cache_hit", "context_wait", "coalesce", "load"};
 
-typedef struct lembed_model_options lembed_model_options;
-struct lembed_model_options {
-  int32_t n_gpu_layers;
+/*
+ * Latencies are bucketed by their power of two, and each power of two is
+ * split in LEMBED_STATS_SUB_BUCKETS, so percentiles are within ~25%.
+ */
+#define LEMBED_STATS_SUB_BITS 2
+#define LEMBED_STATS_SUB_BUCKETS (1 << LEMBED_STATS_SUB_BITS)
+#define LEMBED_STATS_BUCKETS (64 * LEMBED_STATS_SUB_BUCKETS)
 
-  int8_t defined[1];
+typedef struct lembed_stage_stats lembed_stage_stats;
+struct lembed_stage_stats {
+  int64_t calls;
+  int64_t tokens;
+  int64_t errors;
+  int64_t total_ns;
+  int64_t histogram[LEMBED_STATS_BUCKETS];
 };
-static char *POINTER_NAME_MODEL = "lembed_model";
-static char *POINTER_NAME_MODEL_OPTIONS = "lembed_model_options";
 
-static void lembed_model_size(sqlite3_context *context, int argc,
-                              sqlite3_value **argv) {
-  struct llama_model *model =
-      sqlite3_value_pointer(argv[0], POINTER_NAME_MODEL);
-  if (!model)
+typedef struct lembed_stats lembed_stats;
+struct lembed_stats {
+  lembed_stage_stats stages[LEMBED_STAGE_COUNT];
+};
+
+static int lembed_stats_bucket(int64_t ns) {
+  if (ns < LEMBED_STATS_SUB_BUCKETS) {
+    return ns < 0 ? 0 : (int)ns;
+  }
+  int e = lembed_log2((uint64_t)ns);
+  int sub = (int)(ns >> (e - LEMBED_STATS_SUB_BITS)) &
+            (LEMBED_STATS_SUB_BUCKETS - 1);
+  return (e - LEMBED_STATS_SUB_BITS + 1) * LEMBED_STATS_SUB_BUCKETS + sub;
+}
+
+/** The largest latency that falls in bucket. */
+static int64_t lembed_stats_bucket_max(int bucket) {
+  if (bucket < LEMBED_STATS_SUB_BUCKETS) {
+    return bucket;
+  }
+  int e = bucket / LEMBED_STATS_SUB_BUCKETS + LEMBED_STATS_SUB_BITS - 1;
+  int sub = bucket % LEMBED_STATS_SUB_BUCKETS;
+  int64_t width = (int64_t)1 << (e - LEMBED_STATS_SUB_BITS);
+  return (LEMBED_STATS_SUB_BUCKETS + sub) * width + width - 1;
+}
+
+/** Record one call of stage that started at start_ns. stats may be NULL. */
+static void lembed_stats_record(lembed_stats *stats, enum lembed_stage stage,
+                                int64_t start_ns, int64_t tokens, int error) {
+  if (!stats) {
     return;
-  sqlite3_result_int64(context, llama_model_size(model));
+  }
+  int64_t ns = lembed_time_ns() - start_ns;
+  lembed_stage_stats *s = &stats->stages[stage];
+  lembed_atomic_add(&s->calls, 1);
+  lembed_atomic_add(&s->total_ns, ns);
+  lembed_atomic_add(&s->histogram[lembed_stats_bucket(ns)], 1);
+  if (tokens) {
+    lembed_atomic_add(&s->tokens, tokens);
+  }
+  if (error) {
+    lembed_atomic_add(&s->errors, 1);
+  }
 }
 
-static void lembed_model_options_(sqlite3_context *context, int argc,
-                                  sqlite3_value **argv) {
-  assert(argc >= 0);
-  assert(argc % 2 == 0);
-  lembed_model_options *o = sqlite3_malloc(sizeof(lembed_model_options));
-  assert(o);
-  memset(o, 0, sizeof(*o));
+/** Estimated latency that a fraction p of the calls of s took at most. */
+static int64_t lembed_stats_percentile(lembed_stage_stats *s, double p) {
+  int64_t calls = 0;
+  for (int i = 0; i < LEMBED_STATS_BUCKETS; i++) {
+    calls += lembed_atomic_load(&s->histogram[i]);
+  }
+  if (calls == 0) {
+    return 0;
+  }
+  int64_t rank = (int64_t)ceil(p * calls);
+  int64_t seen = 0;
+  for (int i = 0; i < LEMBED_STATS_BUCKETS; i++) {
+    seen += lembed_atomic_load(&s->histogram[i]);
+    if (seen >= rank) {
+      return lembed_stats_bucket_max(i);
+    }
+  }
+  return lembed_stats_bucket_max(LEMBED_STATS_BUCKETS - 1);
+}
 
-  for (int i = 0; i < argc; i += 2) {
-    sqlite3_value *key = argv[i];
-    sqlite3_value *value = argv[i + 1];
-    assert(sqlite3_value_type(key) == SQLITE_TEXT);
-    const char *k = (const char *)sqlite3_value_text(key);
-    if (sqlite3_stricmp(k, "n_gpu_layers") == 0) {
-      o->n_gpu_layers = sqlite3_value_int(value);
-      o->defined[0] = 1;
-    } else {
-      abort();
+static void lembed_stats_reset(lembed_stats *stats) {
+  for (int i = 0; i < LEMBED_STAGE_COUNT; i++) {
+    lembed_stage_stats *s = &stats->stages[i];
+    lembed_atomic_store(&s->calls, 0);
+    lembed_atomic_store(&s->tokens, 0);
+    lembed_atomic_store(&s->errors, 0);
+    lembed_atomic_store(&s->total_ns, 0);
+    for (int j = 0; j < LEMBED_STATS_BUCKETS; j++) {
+      lembed_atomic_store(&s->histogram[j], 0);
     }
   }
-  sqlite3_result_pointer(context, o, POINTER_NAME_MODEL_OPTIONS, sqlite3_free);
 }
 
-typedef struct lembed_context_options lembed_context_options;
-struct lembed_context_options {
-  uint32_t seed;
-  uint32_t n_ctx;
-  enum llama_rope_scaling_type rope_scaling_type;
-  float rope_freq_scale;
+#pragma endregion
 
-  int8_t defined[4];
-};
-static char *POINTER_NAME_CONTEXT_OPTIONS = "lembed_context_options";
+#pragma region kernels
 
-static void lembed_context_options_(sqlite3_context *context, int argc,
-                                    sqlite3_value **argv) {
-  assert(argc >= 0);
-  assert(argc % 2 == 0);
-  lembed_context_options *o = sqlite3_malloc(sizeof(lembed_context_options));
-  assert(o);
-  memset(o, 0, sizeof(*o));
+/*
+ * Per-vector kernels that run on every embedding: L2 normalization,
+ * quantization, and distances. Each has a portable scalar version, and
+ * AVX2, AVX-512, and NEON versions where the compiler supports them. The
+ * implementation is picked once in lembed_kernels_init(), based on the same
+ * ggml_cpu_has_*() probes llama.cpp uses.
+ */
 
-  for (int i = 0; i < argc; i += 2) {
-    sqlite3_value *key = argv[i];
-    sqlite3_value *value = argv[i + 1];
-    assert(sqlite3_value_type(key) == SQLITE_TEXT);
-    const char *k = (const char *)sqlite3_value_text(key);
-    if (sqlite3_stricmp("seed", k) == 0) {
-      sqlite3_int64 v = sqlite3_value_int64(value);
-      assert(v > 0);
-      o->seed = v;
-      o->defined[0] = 1;
-    } else if (sqlite3_stricmp("n_ctx", k) == 0) {
-      sqlite3_int64 v = sqlite3_value_int64(value);
-      assert(v > 0);
-      o->n_ctx = v;
-      o->defined[1] = 1;
-    } else if (sqlite3_stricmp("rope_scaling_type", k) == 0) {
-      const char *v = (const char *)sqlite3_value_text(value);
-      if (sqlite3_stricmp(v, "none")) {
-        o->rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_NONE;
-      } else if (sqlite3_stricmp(v, "linear")) {
-        o->rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_LINEAR;
-      } else if (sqlite3_stricmp(v, "yarn")) {
-        o->rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_YARN;
-      } else {
-        abort();
-      }
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) ||           \
+    defined(_M_IX86)
+#include <immintrin.h>
+#define LEMBED_KERNELS_X86
+#if defined(__GNUC__) || defined(__clang__)
+#define LEMBED_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define LEMBED_TARGET_AVX512 __attribute__((target("avx512f")))
+#else
+#define LEMBED_TARGET_AVX2
+#define LEMBED_TARGET_AVX512
+#endif
+#endif
 
-      o->defined[2] = 1;
-    } else if (sqlite3_stricmp(k, "rope_freq_scale") == 0) {
-      o->rope_freq_scale = sqlite3_value_double(value);
-      o->defined[3] = 1;
-    } else {
-      abort();
-    }
+#if defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#define LEMBED_KERNELS_NEON
+#endif
+
+typedef struct lembed_kernels lembed_kernels;
+struct lembed_kernels {
+  const char *name;
+  float (*dot)(const float *a, const float *b, int n);
+  float (*l2_squared)(const float *a, const float *b, int n);
+  void (*normalize)(const float *vec, float *out, int n);
+  void (*quantize_int8)(const float *vec, int8_t *out, int n);
+  void (*quantize_bit)(const float *vec, uint8_t *out, int n);
+};
+
+// Step of the "unit" int8 quantization: [-1.0, 1.0] in 255 even steps.
+#define LEMBED_INT8_UNIT_SCALE 127.5f
+
+static float dot_scalar(const float *a, const float *b, int n) {
+  float sum = 0;
+  for (int i = 0; i < n; i++) {
+    sum += a[i] * b[i];
   }
-  sqlite3_result_pointer(context, o, POINTER_NAME_CONTEXT_OPTIONS,
-                         sqlite3_free);
+  return sum;
 }
-static char *POINTER_NAME_MODEL_PATH = "lembed_model_path";
 
-static void lembed_model_from_file(sqlite3_context *context, int argc,
-                                   sqlite3_value **argv) {
-  sqlite3_result_pointer(context,
-                         sqlite3_mprintf("%.*s", sqlite3_value_bytes(argv[0]),
-                                         sqlite3_value_text(argv[0])),
-                         POINTER_NAME_MODEL_PATH, sqlite3_free);
+static float l2_squared_scalar(const float *a, const float *b, int n) {
+  float sum = 0;
+  for (int i = 0; i < n; i++) {
+    float d = a[i] - b[i];
+    sum += d * d;
+  }
+  return sum;
 }
 
-
-static void _static_text_func(sqlite3_context *context, int argc,
-                              sqlite3_value **argv) {
-  UNUSED_PARAMETER(argc);
-  UNUSED_PARAMETER(argv);
-  sqlite3_result_text(context, sqlite3_user_data(context), -1, SQLITE_STATIC);
+static void normalize_scalar(const float *vec, float *out, int n) {
+  float norm = sqrtf(dot_scalar(vec, vec, n));
+  float inv = norm > 0 ? 1.0f / norm : 0.0f;
+  for (int i = 0; i < n; i++) {
+    out[i] = vec[i] * inv;
+  }
 }
 
-int api_model_from_name(struct Api *api, const char *name, int name_length,
-                        struct llama_model **model,
-                        struct llama_context **context) {
-  for (int i = 0; i < MAX_MODELS; i++) {
-    if (!api->models[i].name)
-      continue;
-    if (strncmp(api->models[i].name, name, name_length) == 0) {
-      *model = api->models[i].model;
-      if (context)
-        *context = api->models[i].context;
-      return SQLITE_OK;
-    }
+/**
+ * Scalar quantize a unit-normalized vector into n int8 values, with the same
+ * "unit" scale as sqlite-vec's vec_quantize_int8(), so a value dequantizes as
+ * (q + 128) / 127.5 - 1.0.
+ */
+static void quantize_int8_scalar(const float *vec, int8_t *out, int n) {
+  for (int i = 0; i < n; i++) {
+    out[i] = (int8_t)((vec[i] + 1.0f) * LEMBED_INT8_UNIT_SCALE - 128.0f);
   }
-  return SQLITE_ERROR;
 }
-static void lembed(sqlite3_context *context, int argc, sqlite3_value **argv) {
-  struct llama_model *model;
-  struct llama_context *ctx;
-  int rc;
-  const char * input;
-  sqlite3_int64 input_len;
-  if(argc == 1) {
-    input = (const char *)sqlite3_value_text(argv[0]);
-    input_len = sqlite3_value_bytes(argv[0]);
-    rc = api_model_from_name((struct Api *)sqlite3_user_data(context), "default", strlen("default"), &model, &ctx);
-    if(rc != SQLITE_OK) {
-      sqlite3_result_error(context, "No default model has been registered yet with lembed_models", -1);
-      return;
-    }
-  }else {
-    input = (const char *)sqlite3_value_text(argv[1]);
-    input_len = sqlite3_value_bytes(argv[1]);
-    rc = api_model_from_name((struct Api *)sqlite3_user_data(context),
-                               (const char *)sqlite3_value_text(argv[0]),
-                               sqlite3_value_bytes(argv[0]), &model, &ctx);
 
-    if(rc != SQLITE_OK) {
-      char * zSql = sqlite3_mprintf("Unknown model name '%s'. Was it registered with lembed_models?", sqlite3_value_text(argv[0]));
-      sqlite3_result_error(context, zSql, -1);
-      sqlite3_free(zSql);
-      return;
+/**
+ * Binary quantize a vector into (n + 7) / 8 bytes, where bit i (least
+ * significant bit first) is set when vec[i] is positive. Same bit layout as
+ * sqlite-vec's vec_quantize_binary().
+ */
+static void quantize_bit_scalar(const float *vec, uint8_t *out, int n) {
+  memset(out, 0, (n + 7) / 8);
+  for (int i = 0; i < n; i++) {
+    if (vec[i] > 0) {
+      out[i / 8] |= 1 << (i % 8);
     }
   }
+}
 
-  int dimensions;
-  float *embedding;
-  rc = embed_single(model, ctx, input, input_len, &embedding, &dimensions);
-  if(rc != SQLITE_OK) {
-    sqlite3_result_error(context, "Error generating embedding", -1);
+static const lembed_kernels lembed_kernels_scalar = {
+    "scalar",         dot_scalar,          l2_squared_scalar,
+    normalize_scalar, quantize_int8_scalar, quantize_bit_scalar};
+
+#ifdef LEMBED_KERNELS_X86
+LEMBED_TARGET_AVX2 static float dot_avx2(const float *a, const float *b,
+                                         int n) {
+  __m256 acc0 = _mm256_setzero_ps();
+  __m256 acc1 = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i),
+                           acc0);
+    acc1 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i + 8),
+                           _mm256_loadu_ps(b + i + 8), acc1);
+  }
+  for (; i + 8 <= n; i += 8) {
+    acc0 = _mm256_fmadd_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i),
+                           acc0);
+  }
+  __m256 acc = _mm256_add_ps(acc0, acc1);
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc),
+                          _mm256_extractf128_ps(acc, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x1));
+  float result = _mm_cvtss_f32(sum);
+  for (; i < n; i++) {
+    result += a[i] * b[i];
+  }
+  return result;
+}
+
+LEMBED_TARGET_AVX2 static float l2_squared_avx2(const float *a,
+                                                const float *b, int n) {
+  __m256 acc = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 d = _mm256_sub_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i));
+    acc = _mm256_fmadd_ps(d, d, acc);
+  }
+  __m128 sum = _mm_add_ps(_mm256_castps256_ps128(acc),
+                          _mm256_extractf128_ps(acc, 1));
+  sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+  sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 0x1));
+  float result = _mm_cvtss_f32(sum);
+  for (; i < n; i++) {
+    float d = a[i] - b[i];
+    result += d * d;
+  }
+  return result;
+}
+
+LEMBED_TARGET_AVX2 static void normalize_avx2(const float *vec, float *out,
+                                              int n) {
+  float norm = sqrtf(dot_avx2(vec, vec, n));
+  float inv = norm > 0 ? 1.0f / norm : 0.0f;
+  __m256 scale = _mm256_set1_ps(inv);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_loadu_ps(vec + i), scale));
+  }
+  for (; i < n; i++) {
+    out[i] = vec[i] * inv;
+  }
+}
+
+LEMBED_TARGET_AVX2 static void quantize_int8_avx2(const float *vec,
+                                                  int8_t *out, int n) {
+  const __m256 one = _mm256_set1_ps(1.0f);
+  const __m256 scale = _mm256_set1_ps(LEMBED_INT8_UNIT_SCALE);
+  const __m256 offset = _mm256_set1_ps(128.0f);
+  // undo the per-128-bit-lane interleaving of the two pack instructions
+  const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  int i = 0;
+  for (; i + 32 <= n; i += 32) {
+    __m256i q[4];
+    for (int j = 0; j < 4; j++) {
+      __m256 x = _mm256_loadu_ps(vec + i + j * 8);
+      x = _mm256_sub_ps(_mm256_mul_ps(_mm256_add_ps(x, one), scale), offset);
+      q[j] = _mm256_cvttps_epi32(x);
+    }
+    __m256i lo = _mm256_packs_epi32(q[0], q[1]);
+    __m256i hi = _mm256_packs_epi32(q[2], q[3]);
+    __m256i packed = _mm256_packs_epi16(lo, hi);
+    packed = _mm256_permutevar8x32_epi32(packed, order);
+    _mm256_storeu_si256((__m256i *)(out + i), packed);
+  }
+  quantize_int8_scalar(vec + i, out + i, n - i);
+}
+
+LEMBED_TARGET_AVX2 static void quantize_bit_avx2(const float *vec,
+                                                 uint8_t *out, int n) {
+  const __m256 zero = _mm256_setzero_ps();
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    __m256 gt = _mm256_cmp_ps(_mm256_loadu_ps(vec + i), zero, _CMP_GT_OQ);
+    out[i / 8] = (uint8_t)_mm256_movemask_ps(gt);
+  }
+  if (i < n) {
+    quantize_bit_scalar(vec + i, out + i / 8, n - i);
+  }
+}
+
+static const lembed_kernels lembed_kernels_avx2 = {
+    "avx2",         dot_avx2,          l2_squared_avx2,
+    normalize_avx2, quantize_int8_avx2, quantize_bit_avx2};
+
+LEMBED_TARGET_AVX512 static float dot_avx512(const float *a, const float *b,
+                                             int n) {
+  __m512 acc = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    acc = _mm512_fmadd_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i), acc);
+  }
+  float result = _mm512_reduce_add_ps(acc);
+  for (; i < n; i++) {
+    result += a[i] * b[i];
+  }
+  return result;
+}
+
+LEMBED_TARGET_AVX512 static float l2_squared_avx512(const float *a,
+                                                    const float *b, int n) {
+  __m512 acc = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 d = _mm512_sub_ps(_mm512_loadu_ps(a + i), _mm512_loadu_ps(b + i));
+    acc = _mm512_fmadd_ps(d, d, acc);
+  }
+  float result = _mm512_reduce_add_ps(acc);
+  for (; i < n; i++) {
+    float d = a[i] - b[i];
+    result += d * d;
+  }
+  return result;
+}
+
+LEMBED_TARGET_AVX512 static void normalize_avx512(const float *vec,
+                                                  float *out, int n) {
+  float norm = sqrtf(dot_avx512(vec, vec, n));
+  float inv = norm > 0 ? 1.0f / norm : 0.0f;
+  __m512 scale = _mm512_set1_ps(inv);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    _mm512_storeu_ps(out + i, _mm512_mul_ps(_mm512_loadu_ps(vec + i), scale));
+  }
+  for (; i < n; i++) {
+    out[i] = vec[i] * inv;
+  }
+}
+
+LEMBED_TARGET_AVX512 static void quantize_int8_avx512(const float *vec,
+                                                      int8_t *out, int n) {
+  const __m512 one = _mm512_set1_ps(1.0f);
+  const __m512 scale = _mm512_set1_ps(LEMBED_INT8_UNIT_SCALE);
+  const __m512 offset = _mm512_set1_ps(128.0f);
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __m512 x = _mm512_loadu_ps(vec + i);
+    x = _mm512_sub_ps(_mm512_mul_ps(_mm512_add_ps(x, one), scale), offset);
+    __m128i q = _mm512_cvtsepi32_epi8(_mm512_cvttps_epi32(x));
+    _mm_storeu_si128((__m128i *)(out + i), q);
+  }
+  quantize_int8_scalar(vec + i, out + i, n - i);
+}
+
+LEMBED_TARGET_AVX512 static void quantize_bit_avx512(const float *vec,
+                                                     uint8_t *out, int n) {
+  const __m512 zero = _mm512_setzero_ps();
+  int i = 0;
+  for (; i + 16 <= n; i += 16) {
+    __mmask16 gt =
+        _mm512_cmp_ps_mask(_mm512_loadu_ps(vec + i), zero, _CMP_GT_OQ);
+    out[i / 8] = (uint8_t)(gt & 0xff);
+    out[i / 8 + 1] = (uint8_t)(gt >> 8);
+  }
+  if (i < n) {
+    quantize_bit_scalar(vec + i, out + i / 8, n - i);
+  }
+}
+
+static const lembed_kernels lembed_kernels_avx512 = {
+    "avx512",         dot_avx512,          l2_squared_avx512,
+    normalize_avx512, quantize_int8_avx512, quantize_bit_avx512};
+#endif
+
+#ifdef LEMBED_KERNELS_NEON
+static float dot_neon(const float *a, const float *b, int n) {
+  float32x4_t acc0 = vdupq_n_f32(0);
+  float32x4_t acc1 = vdupq_n_f32(0);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    acc0 = vfmaq_f32(acc0, vld1q_f32(a + i), vld1q_f32(b + i));
+    acc1 = vfmaq_f32(acc1, vld1q_f32(a + i + 4), vld1q_f32(b + i + 4));
+  }
+  float result = vaddvq_f32(vaddq_f32(acc0, acc1));
+  for (; i < n; i++) {
+    result += a[i] * b[i];
+  }
+  return result;
+}
+
+static float l2_squared_neon(const float *a, const float *b, int n) {
+  float32x4_t acc = vdupq_n_f32(0);
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    float32x4_t d = vsubq_f32(vld1q_f32(a + i), vld1q_f32(b + i));
+    acc = vfmaq_f32(acc, d, d);
+  }
+  float result = vaddvq_f32(acc);
+  for (; i < n; i++) {
+    float d = a[i] - b[i];
+    result += d * d;
+  }
+  return result;
+}
+
+static void normalize_neon(const float *vec, float *out, int n) {
+  float norm = sqrtf(dot_neon(vec, vec, n));
+  float inv = norm > 0 ? 1.0f / norm : 0.0f;
+  int i = 0;
+  for (; i + 4 <= n; i += 4) {
+    vst1q_f32(out + i, vmulq_n_f32(vld1q_f32(vec + i), inv));
+  }
+  for (; i < n; i++) {
+    out[i] = vec[i] * inv;
+  }
+}
+
+static void quantize_int8_neon(const float *vec, int8_t *out, int n) {
+  const float32x4_t one = vdupq_n_f32(1.0f);
+  const float32x4_t offset = vdupq_n_f32(128.0f);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    float32x4_t x0 = vsubq_f32(
+        vmulq_n_f32(vaddq_f32(vld1q_f32(vec + i), one), LEMBED_INT8_UNIT_SCALE),
+        offset);
+    float32x4_t x1 = vsubq_f32(vmulq_n_f32(vaddq_f32(vld1q_f32(vec + i + 4), one),
+                                           LEMBED_INT8_UNIT_SCALE),
+                               offset);
+    int16x8_t q16 = vcombine_s16(vqmovn_s32(vcvtq_s32_f32(x0)),
+                                 vqmovn_s32(vcvtq_s32_f32(x1)));
+    vst1_s8(out + i, vqmovn_s16(q16));
+  }
+  quantize_int8_scalar(vec + i, out + i, n - i);
+}
+
+static void quantize_bit_neon(const float *vec, uint8_t *out, int n) {
+  static const uint32_t lo_bits[4] = {1, 2, 4, 8};
+  static const uint32_t hi_bits[4] = {16, 32, 64, 128};
+  const uint32x4_t lo = vld1q_u32(lo_bits);
+  const uint32x4_t hi = vld1q_u32(hi_bits);
+  const float32x4_t zero = vdupq_n_f32(0);
+  int i = 0;
+  for (; i + 8 <= n; i += 8) {
+    uint32x4_t gt0 = vandq_u32(vcgtq_f32(vld1q_f32(vec + i), zero), lo);
+    uint32x4_t gt1 = vandq_u32(vcgtq_f32(vld1q_f32(vec + i + 4), zero), hi);
+    out[i / 8] = (uint8_t)vaddvq_u32(vorrq_u32(gt0, gt1));
+  }
+  if (i < n) {
+    quantize_bit_scalar(vec + i, out + i / 8, n - i);
+  }
+}
+
+static const lembed_kernels lembed_kernels_neon = {
+    "neon",         dot_neon,          l2_squared_neon,
+    normalize_neon, quantize_int8_neon, quantize_bit_neon};
+#endif
+
+static lembed_kernels kernels = {
+    "scalar",         dot_scalar,          l2_squared_scalar,
+    normalize_scalar, quantize_int8_scalar, quantize_bit_scalar};
+
+static void lembed_kernels_init(void) {
+#ifdef LEMBED_KERNELS_X86
+  if (ggml_cpu_has_avx512()) {
+    kernels = lembed_kernels_avx512;
+    return;
+  }
+  if (ggml_cpu_has_avx2() && ggml_cpu_has_fma()) {
+    kernels = lembed_kernels_avx2;
+    return;
+  }
+#endif
+#ifdef LEMBED_KERNELS_NEON
+  if (ggml_cpu_has_neon()) {
+    kernels = lembed_kernels_neon;
     return;
   }
-  sqlite3_result_blob(context, embedding, sizeof(float) * dimensions, sqlite3_free);
-  sqlite3_result_subtype(context, 223); // TODO define
+#endif
+  kernels = lembed_kernels_scalar;
+}
+
+#pragma endregion
+
+// Same subtypes as sqlite-vec's float32, bit, and int8 vectors
+#define LEMBED_FLOAT32_SUBTYPE 223
+#define LEMBED_BIT_SUBTYPE 224
+#define LEMBED_INT8_SUBTYPE 225
+#define JSON_SUBTYPE 74 // ascii 'J', same as SQLite's JSON functions
+
+/**
+ * Max number of tokens and sequences that fit in a single llama_decode() call
+ * on context. Non-causal (BERT-like) models must fit the entire batch in one
+ * ubatch, and every token needs its own KV cell.
+ */
+static void batch_capacity(struct llama_context *context, int *n_tokens_max,
+                           int *n_seq_max) {
+  int n = llama_n_ctx(context);
+  if ((int)llama_n_batch(context) < n) {
+    n = llama_n_batch(context);
+  }
+  if ((int)llama_n_ubatch(context) < n) {
+    n = llama_n_ubatch(context);
+  }
+  *n_tokens_max = n;
+  *n_seq_max = llama_n_seq_max(context);
+}
+
+/**
+ * Tokenize input into *tokens, which has room for *capacity tokens. When that
+ * isn't enough, *tokens is grown to fit and input is tokenized again, so
+ * callers that keep their buffer around only pay for a single pass.
+ */
+static int tokenize_into(struct llama_model *model, const char *input,
+                         size_t input_length, llama_token **tokens,
+                         int *capacity, int *token_count,
+                         lembed_stats *stats) {
+  int64_t start = lembed_time_ns();
+  int n = llama_tokenize(model, input, input_length, *tokens, *capacity, true,
+                         true);
+  if (n < 0) {
+    llama_token *grown = sqlite3_realloc64(*tokens, sizeof(llama_token) * -n);
+    if (!grown) {
+      lembed_stats_record(stats, LEMBED_STAGE_TOKENIZE, start, 0, 1);
+      return SQLITE_NOMEM;
+    }
+    *tokens = grown;
+    *capacity = -n;
+    n = llama_tokenize(model, input, input_length, *tokens, *capacity, true,
+                       true);
+    if (n < 0) {
+      lembed_stats_record(stats, LEMBED_STAGE_TOKENIZE, start, 0, 1);
+      return SQLITE_ERROR;
+    }
+  }
+  *token_count = n;
+  lembed_stats_record(stats, LEMBED_STAGE_TOKENIZE, start, n, 0);
+  return SQLITE_OK;
+}
+
+/**
+ * Instruction prefix that asymmetric models (like e5, bge or nomic) expect in
+ * front of queries or documents, from the query_prefix and document_prefix
+ * context options. It's tokenized once when the model is registered, and its
+ * tokens are spliced into every input with prefix_insert().
+ */
+typedef struct lembed_prefix lembed_prefix;
+struct lembed_prefix {
+  llama_token *tokens;
+  int n_tokens;
+  // Where the tokens go: right after the model's special prefix tokens
+  int at;
+  // Hash of the prefix text, mixed into embedding cache keys
+  uint64_t hash[2];
+};
+
+static void prefix_clear(lembed_prefix *prefix) {
+  sqlite3_free(prefix->tokens);
+  memset(prefix, 0, sizeof(*prefix));
+}
+
+/**
+ * Insert the tokens of prefix into the token_count tokens of *tokens, growing
+ * it past *capacity if needed. prefix may be NULL.
+ */
+static int prefix_insert(const lembed_prefix *prefix, llama_token **tokens,
+                         int *capacity, int *token_count) {
+  if (!prefix || prefix->n_tokens == 0) {
+    return SQLITE_OK;
+  }
+  int n = *token_count + prefix->n_tokens;
+  if (n > *capacity) {
+    llama_token *grown = sqlite3_realloc64(*tokens, sizeof(llama_token) * n);
+    if (!grown) {
+      return SQLITE_NOMEM;
+    }
+    *tokens = grown;
+    *capacity = n;
+  }
+  int at = prefix->at < *token_count ? prefix->at : *token_count;
+  memmove(*tokens + at + prefix->n_tokens, *tokens + at,
+          sizeof(llama_token) * (*token_count - at));
+  memcpy(*tokens + at, prefix->tokens, sizeof(llama_token) * prefix->n_tokens);
+  *token_count = n;
+  return SQLITE_OK;
+}
+
+/**
+ * Tokenize input into a new *tokens array, with the tokens of prefix (which
+ * may be NULL) inserted.
+ */
+int tokenize(struct llama_model *model, const char *input, size_t input_length,
+             const lembed_prefix *prefix, int *token_count,
+             llama_token **tokens, lembed_stats *stats) {
+  // Every token but the special ones covers at least one byte of input, so
+  // this is almost always enough for a single pass.
+  int capacity = input_length + 16;
+  *tokens = sqlite3_malloc64(sizeof(llama_token) * capacity);
+  if (!(*tokens)) {
+    return SQLITE_NOMEM;
+  }
+  int rc = tokenize_into(model, input, input_length, tokens, &capacity,
+                         token_count, stats);
+  if (rc == SQLITE_OK) {
+    rc = prefix_insert(prefix, tokens, &capacity, token_count);
+  }
+  if (rc != SQLITE_OK) {
+    sqlite3_free(*tokens);
+    *tokens = NULL;
+  }
+  return rc;
+}
+
+#define LEMBED_MAX_SPECIAL_TOKENS 8
+
+/**
+ * Special tokens llama_tokenize() adds before and after every input, like
+ * BERT's [CLS] and [SEP].
+ */
+typedef struct lembed_special_tokens lembed_special_tokens;
+struct lembed_special_tokens {
+  llama_token prefix[LEMBED_MAX_SPECIAL_TOKENS];
+  int n_prefix;
+  llama_token suffix[LEMBED_MAX_SPECIAL_TOKENS];
+  int n_suffix;
+};
+
+/** Find the special tokens of model, by tokenizing a probe with and without. */
+static int special_tokens(struct llama_model *model,
+                          lembed_special_tokens *out) {
+  llama_token with[2 * LEMBED_MAX_SPECIAL_TOKENS + 4];
+  llama_token without[4];
+  int n_with = llama_tokenize(model, "a", 1, with,
+                              sizeof(with) / sizeof(with[0]), true, false);
+  int n_without = llama_tokenize(model, "a", 1, without,
+                                 sizeof(without) / sizeof(without[0]), false,
+                                 false);
+  if (n_with < 0 || n_without <= 0 || n_without > n_with) {
+    return SQLITE_ERROR;
+  }
+  for (int i = 0; i + n_without <= n_with; i++) {
+    if (memcmp(with + i, without, sizeof(llama_token) * n_without) != 0) {
+      continue;
+    }
+    int n_after = n_with - i - n_without;
+    if (i > LEMBED_MAX_SPECIAL_TOKENS || n_after > LEMBED_MAX_SPECIAL_TOKENS) {
+      return SQLITE_ERROR;
+    }
+    memcpy(out->prefix, with, sizeof(llama_token) * i);
+    memcpy(out->suffix, with + i + n_without, sizeof(llama_token) * n_after);
+    out->n_prefix = i;
+    out->n_suffix = n_after;
+    return SQLITE_OK;
+  }
+  return SQLITE_ERROR;
+}
+
+/**
+ * What to do with inputs that have more tokens than fit in a single batch,
+ * set with the long_inputs context option.
+ */
+enum lembed_long_inputs {
+  // Fail with SQLITE_TOOBIG
+  LEMBED_LONG_INPUTS_ERROR,
+  // Only embed the first tokens that fit
+  LEMBED_LONG_INPUTS_TRUNCATE,
+  // Embed consecutive windows of tokens that fit, and average them
+  LEMBED_LONG_INPUTS_MEAN,
+};
+
+/**
+ * A llama_context, along with scratch buffers that are reused by every
+ * embedding made with it. They're grown on demand and never shrink, so once
+ * warmed up, embedding doesn't allocate.
+ */
+typedef struct ApiContext ApiContext;
+struct ApiContext {
+  struct llama_context *context;
+  ApiContext *next_free;
+
+  // batch_capacity() of context
+  int n_tokens_max;
+  int n_seq_max;
+  enum lembed_long_inputs long_inputs;
+  lembed_special_tokens special;
+  // Floats per embedding: llama_n_embd(), or the output_dims context option
+  int dimensions;
+  // llama_pooling_type() of context. With LLAMA_POOLING_TYPE_NONE, token
+  // embeddings are mean pooled into pooled, llama_n_embd() floats. With
+  // LLAMA_POOLING_TYPE_RANK, every sequence is a (query, document) pair of a
+  // reranker, and its "embedding" is a single relevance score.
+  enum llama_pooling_type pooling;
+  float *pooled;
+  // Stats of the model the context belongs to
+  lembed_stats *stats;
+  // Compute threads wanted per decode, from the context parameters, and the
+  // CPUs to decode on (the model's cpu_mask context option), or NULL
+  int n_threads;
+  int n_threads_batch;
+  const lembed_cpu_mask *cpu_mask;
+
+  // n_tokens_max tokens
+  struct llama_batch batch;
+  llama_token *tokens;
+  int tokens_capacity;
+  // For each sequence in batch, the input it belongs to and the batch index
+  // of its last token. n_seq_max each.
+  int *seq_inputs;
+  int *seq_last;
+  // dimensions floats
+  float *output;
+};
+
+static int api_context_init(ApiContext *c, struct llama_model *model,
+                            struct llama_context_params cparams,
+                            enum lembed_long_inputs long_inputs,
+                            int dimensions, lembed_stats *stats) {
+  memset(c, 0, sizeof(*c));
+  c->context = llama_new_context_with_model(model, cparams);
+  if (!c->context) {
+    return SQLITE_ERROR;
+  }
+  batch_capacity(c->context, &c->n_tokens_max, &c->n_seq_max);
+  c->pooling = llama_pooling_type(c->context);
+  if (c->pooling == LLAMA_POOLING_TYPE_RANK) {
+    dimensions = 1;
+  }
+  c->long_inputs = long_inputs;
+  c->dimensions = dimensions;
+  c->stats = stats;
+  c->n_threads = cparams.n_threads;
+  c->n_threads_batch = cparams.n_threads_batch;
+  if (special_tokens(model, &c->special) != SQLITE_OK) {
+    memset(&c->special, 0, sizeof(c->special));
+  }
+  c->batch = llama_batch_init(c->n_tokens_max, 0, 1);
+  c->tokens_capacity = c->n_tokens_max;
+  c->tokens = sqlite3_malloc(sizeof(llama_token) * c->tokens_capacity);
+  c->seq_inputs = sqlite3_malloc(sizeof(int) * c->n_seq_max);
+  c->seq_last = sqlite3_malloc(sizeof(int) * c->n_seq_max);
+  c->output = sqlite3_malloc(sizeof(float) * dimensions);
+  if (!c->tokens || !c->seq_inputs || !c->seq_last || !c->output) {
+    return SQLITE_NOMEM;
+  }
+  if (c->pooling == LLAMA_POOLING_TYPE_NONE) {
+    c->pooled = sqlite3_malloc(sizeof(float) * llama_n_embd(model));
+    if (!c->pooled) {
+      return SQLITE_NOMEM;
+    }
+  }
+  return SQLITE_OK;
+}
+
+static void api_context_free(ApiContext *c) {
+  if (c->context) {
+    llama_free(c->context);
+  }
+  if (c->batch.token) {
+    llama_batch_free(c->batch);
+  }
+  sqlite3_free(c->tokens);
+  sqlite3_free(c->seq_inputs);
+  sqlite3_free(c->seq_last);
+  sqlite3_free(c->output);
+  sqlite3_free(c->pooled);
+  memset(c, 0, sizeof(*c));
+}
+
+/** Append n tokens to batch as part of sequence seq_id, starting at pos. */
+static void batch_add(struct llama_batch *batch, const llama_token *tokens,
+                      int n, int pos, int seq_id) {
+  for (int i = 0; i < n; i++) {
+    batch->token[batch->n_tokens] = tokens[i];
+    batch->pos[batch->n_tokens] = pos + i;
+    batch->n_seq_id[batch->n_tokens] = 1;
+    batch->seq_id[batch->n_tokens][0] = seq_id;
+    batch->logits[batch->n_tokens] = 0;
+    batch->n_tokens++;
+  }
+}
+
+/**
+ * Decode c->batch, where sequence i ends at batch index c->seq_last[i]. Only
+ * the last token of each sequence is output, which is all pooling needs,
+ * unless the context doesn't pool and every token embedding is averaged.
+ */
+static int decode_batch(ApiContext *c, int n_seq) {
+  if (c->pooling == LLAMA_POOLING_TYPE_NONE) {
+    memset(c->batch.logits, 1, c->batch.n_tokens);
+  }
+  for (int i = 0; i < n_seq; i++) {
+    c->batch.logits[c->seq_last[i]] = 1;
+  }
+  llama_kv_cache_clear(c->context); // KV not needed for embeddings?
+  int64_t start = lembed_time_ns();
+  // llama.cpp uses n_threads for single tokens, n_threads_batch otherwise
+  int n_threads = lembed_threads_acquire(
+      c->batch.n_tokens > 1 ? c->n_threads_batch : c->n_threads);
+  llama_set_n_threads(c->context, n_threads, n_threads);
+  lembed_cpu_affinity saved;
+  if (c->cpu_mask) {
+    cpu_affinity_enter(c->cpu_mask, &saved);
+  }
+  int rc = llama_decode(c->context, c->batch);
+  if (c->cpu_mask) {
+    cpu_affinity_leave(&saved);
+  }
+  lembed_threads_release(n_threads);
+  lembed_stats_record(c->stats, LEMBED_STAGE_DECODE, start, c->batch.n_tokens,
+                      rc != 0);
+  return rc == 0 ? SQLITE_OK : SQLITE_ERROR;
+}
+
+/**
+ * Pooled embedding of sequence i of the last decode_batch(). Sequences are
+ * added to the batch one after the other, so sequence i starts right after
+ * sequence i - 1 ends.
+ */
+static float *sequence_embedding(ApiContext *c, int i) {
+  if (c->pooling != LLAMA_POOLING_TYPE_NONE) {
+    return llama_get_embeddings_seq(c->context, i);
+  }
+  int n_embd = llama_n_embd(llama_get_model(c->context));
+  int first = i > 0 ? c->seq_last[i - 1] + 1 : 0;
+  int last = c->seq_last[i];
+  memset(c->pooled, 0, sizeof(float) * n_embd);
+  for (int t = first; t <= last; t++) {
+    float *embedding = llama_get_embeddings_ith(c->context, t);
+    if (!embedding) {
+      return NULL;
+    }
+    for (int j = 0; j < n_embd; j++) {
+      c->pooled[j] += embedding[j];
+    }
+  }
+  // No need to divide by the number of tokens, it's normalized anyway
+  return c->pooled;
+}
+
+/**
+ * Embed an input with more than c->n_tokens_max tokens, following
+ * c->long_inputs. Long inputs are cut into windows of content tokens, and
+ * every window is wrapped in the model's special tokens and the n_instruction
+ * tokens of its instruction prefix, so no re-tokenizing is needed.
+ */
+static int embed_long(struct llama_model *model, ApiContext *c,
+                      const llama_token *tokens, int token_count,
+                      int n_instruction, float *out) {
+  const lembed_special_tokens *special = &c->special;
+  int n_special = special->n_prefix + special->n_suffix + n_instruction;
+  int window = c->n_tokens_max - n_special;
+  if (c->long_inputs == LEMBED_LONG_INPUTS_ERROR || window < 1) {
+    return SQLITE_TOOBIG;
+  }
+  const llama_token *instruction = tokens + special->n_prefix;
+  const llama_token *content = instruction + n_instruction;
+  int content_count = token_count - n_special;
+  int dimensions = c->dimensions;
+  if (c->long_inputs == LEMBED_LONG_INPUTS_TRUNCATE) {
+    content_count = window;
+  }
+
+  // Mean of the normalized embeddings of every window, weighted by their
+  // number of tokens. With truncate, the first window is the only one.
+  memset(out, 0, sizeof(float) * dimensions);
+  for (int start = 0; start < content_count; start += window) {
+    int n = content_count - start < window ? content_count - start : window;
+    c->batch.n_tokens = 0;
+    batch_add(&c->batch, special->prefix, special->n_prefix, 0, 0);
+    batch_add(&c->batch, instruction, n_instruction, special->n_prefix, 0);
+    batch_add(&c->batch, content + start, n,
+              special->n_prefix + n_instruction, 0);
+    batch_add(&c->batch, special->suffix, special->n_suffix,
+              special->n_prefix + n_instruction + n, 0);
+    c->seq_last[0] = c->batch.n_tokens - 1;
+    int rc = decode_batch(c, 1);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    int64_t normalize_start = lembed_time_ns();
+    float *embedding = sequence_embedding(c, 0);
+    if (!embedding) {
+      return SQLITE_ERROR;
+    }
+    float norm = sqrtf(kernels.dot(embedding, embedding, dimensions));
+    float scale = norm > 0 ? (float)n / norm : 0;
+    for (int i = 0; i < dimensions; i++) {
+      out[i] += scale * embedding[i];
+    }
+    lembed_stats_record(c->stats, LEMBED_STAGE_NORMALIZE, normalize_start, 0,
+                        0);
+  }
+  kernels.normalize(out, out, dimensions);
+  return SQLITE_OK;
+}
+
+/**
+ * Embed n_inputs tokenized inputs on context c, and write their normalized
+ * embeddings to out, n_inputs * c->dimensions floats. Embeddings are cut to
+ * their first c->dimensions dimensions before they're normalized, which is
+ * how Matryoshka models are meant to be truncated. Consecutive inputs
+ * are packed into as few llama_decode() calls as fit in the batch, and inputs
+ * that don't fit in a batch at all go through embed_long(). Inputs with a
+ * negative token count are skipped, and their embedding left as is. Every
+ * input starts with the same n_instruction tokens of a lembed_prefix, or 0.
+ * Rerankers write the raw score of each input instead, unnormalized.
+ */
+static int embed_many(struct llama_model *model, ApiContext *c,
+                      llama_token **tokens, const int *token_counts,
+                      int n_inputs, int n_instruction, float *out) {
+  int dimensions = c->dimensions;
+  int i = 0;
+  while (i < n_inputs) {
+    if (token_counts[i] < 0) {
+      i++;
+      continue;
+    }
+    if (token_counts[i] > c->n_tokens_max) {
+      int rc = embed_long(model, c, tokens[i], token_counts[i], n_instruction,
+                          out + (i * dimensions));
+      if (rc != SQLITE_OK) {
+        return rc;
+      }
+      i++;
+      continue;
+    }
+
+    int n_seq = 0;
+    c->batch.n_tokens = 0;
+    while (i < n_inputs && n_seq < c->n_seq_max) {
+      if (token_counts[i] < 0) {
+        i++;
+        continue;
+      }
+      if (c->batch.n_tokens + token_counts[i] > c->n_tokens_max) {
+        break;
+      }
+      batch_add(&c->batch, tokens[i], token_counts[i], 0, n_seq);
+      c->seq_inputs[n_seq] = i;
+      c->seq_last[n_seq] = c->batch.n_tokens - 1;
+      n_seq++;
+      i++;
+    }
+    int rc = decode_batch(c, n_seq);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    int64_t normalize_start = lembed_time_ns();
+    for (int s = 0; s < n_seq; s++) {
+      float *embedding = sequence_embedding(c, s);
+      if (!embedding) {
+        return SQLITE_ERROR;
+      }
+      if (c->pooling == LLAMA_POOLING_TYPE_RANK) {
+        out[c->seq_inputs[s]] = embedding[0];
+      } else {
+        kernels.normalize(embedding, out + (c->seq_inputs[s] * dimensions),
+                          dimensions);
+      }
+    }
+    lembed_stats_record(c->stats, LEMBED_STAGE_NORMALIZE, normalize_start, 0,
+                        0);
+  }
+  return SQLITE_OK;
+}
+
+/**
+ * Embed input on context c, with the tokens of prefix (which may be NULL)
+ * inserted, and write its normalized embedding to out, which has room for
+ * c->dimensions floats. out may be c->output. The number of tokens of input
+ * is written to *token_count.
+ */
+int embed_single(struct llama_model *model, ApiContext *c,
+                 const lembed_prefix *prefix, const char *input,
+                 size_t input_length, float *out, int *token_count) {
+  *token_count = 0;
+  int rc = tokenize_into(model, input, input_length, &c->tokens,
+                         &c->tokens_capacity, token_count, c->stats);
+  if (rc == SQLITE_OK) {
+    rc = prefix_insert(prefix, &c->tokens, &c->tokens_capacity, token_count);
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  return embed_many(model, c, &c->tokens, token_count, 1,
+                    prefix ? prefix->n_tokens : 0, out);
+}
+
+#pragma region shared models
+
+/*
+ * Process-wide registry of loaded models, shared by every connection that
+ * loads sqlite-lembed. Models are keyed by their canonical path and the
+ * llama_model_params they were loaded with, so registering the same GGUF file
+ * on another connection reuses the already loaded weights and only creates
+ * new contexts.
+ *
+ * Models that are no longer referenced stay loaded, so short-lived
+ * connections don't reload them. Only the LEMBED_SHARED_MODELS_MAX_IDLE most
+ * recently released of those are kept.
+ *
+ * Models are loaded outside of shared_models_lock, which can take seconds, so
+ * connections using other models don't wait on it. Until then, the model's
+ * entry is a placeholder with loading set, and connections that want the
+ * same model wait for shared_models_loaded.
+ */
+#define LEMBED_SHARED_MODELS_MAX_IDLE 4
+
+typedef struct lembed_shared_model lembed_shared_model;
+struct lembed_shared_model {
+  char *path;
+  struct llama_model_params params;
+  struct llama_model *model;
+  int refcount;
+  // Whether model is still being loaded, by the connection that added it
+  int loading;
+  lembed_shared_model *next;
+};
+
+static lembed_mutex shared_models_lock = LEMBED_MUTEX_INITIALIZER;
+// Broadcast when a model is done loading, or failed to load
+static lembed_cond shared_models_loaded = LEMBED_COND_INITIALIZER;
+// Most recently used first
+static lembed_shared_model *shared_models = NULL;
+
+static char *canonical_path(const char *path) {
+#ifdef _WIN32
+  char *resolved = _fullpath(NULL, path, 0);
+#else
+  char *resolved = realpath(path, NULL);
+#endif
+  char *result = sqlite3_mprintf("%s", resolved ? resolved : path);
+  free(resolved);
+  return result;
+}
+
+static int model_params_equal(const struct llama_model_params *a,
+                              const struct llama_model_params *b) {
+  return a->n_gpu_layers == b->n_gpu_layers && a->use_mmap == b->use_mmap &&
+         a->use_mlock == b->use_mlock && a->vocab_only == b->vocab_only;
+}
+
+static void shared_models_evict_idle(void) {
+  int idle = 0;
+  lembed_shared_model **pp = &shared_models;
+  while (*pp) {
+    lembed_shared_model *m = *pp;
+    if (m->refcount == 0 && ++idle > LEMBED_SHARED_MODELS_MAX_IDLE) {
+      *pp = m->next;
+      llama_free_model(m->model);
+      sqlite3_free(m->path);
+      sqlite3_free(m);
+      continue;
+    }
+    pp = &m->next;
+  }
+}
+
+/**
+ * Returns the model at path loaded with params, loading it if no connection
+ * has yet. Every successful call must be paired with shared_model_release().
+ */
+static struct llama_model *shared_model_acquire(const char *path,
+                                                struct llama_model_params params) {
+  char *key = canonical_path(path);
+  if (!key) {
+    return NULL;
+  }
+  struct llama_model *model = NULL;
+  lembed_mutex_lock(&shared_models_lock);
+  lembed_shared_model **pp;
+  while (1) {
+    pp = &shared_models;
+    for (; *pp; pp = &(*pp)->next) {
+      if (strcmp((*pp)->path, key) == 0 &&
+          model_params_equal(&(*pp)->params, &params)) {
+        break;
+      }
+    }
+    if (!*pp || !(*pp)->loading) {
+      break;
+    }
+    // Loaded by another connection. Look again once it's done, since the
+    // placeholder is removed if loading fails.
+    lembed_cond_wait(&shared_models_loaded, &shared_models_lock);
+  }
+  if (*pp) {
+    lembed_shared_model *m = *pp;
+    *pp = m->next;
+    m->next = shared_models;
+    shared_models = m;
+    m->refcount++;
+    model = m->model;
+    sqlite3_free(key);
+    lembed_mutex_unlock(&shared_models_lock);
+    return model;
+  }
+
+  lembed_shared_model *m = sqlite3_malloc(sizeof(*m));
+  if (!m) {
+    lembed_mutex_unlock(&shared_models_lock);
+    sqlite3_free(key);
+    return NULL;
+  }
+  m->path = key;
+  m->params = params;
+  m->model = NULL;
+  m->refcount = 1;
+  m->loading = 1;
+  m->next = shared_models;
+  shared_models = m;
+  lembed_mutex_unlock(&shared_models_lock);
+
+  model = llama_load_model_from_file(path, params);
+
+  lembed_mutex_lock(&shared_models_lock);
+  if (model) {
+    m->model = model;
+    m->loading = 0;
+  } else {
+    pp = &shared_models;
+    while (*pp != m) {
+      pp = &(*pp)->next;
+    }
+    *pp = m->next;
+    sqlite3_free(m->path);
+    sqlite3_free(m);
+  }
+  lembed_cond_broadcast(&shared_models_loaded);
+  lembed_mutex_unlock(&shared_models_lock);
+  return model;
+}
+
+/**
+ * Drop a reference to model. Unless keep_idle is set, the model is freed
+ * right away once no connection uses it, instead of being kept for the next
+ * connection that loads it.
+ */
+static void shared_model_release(struct llama_model *model, int keep_idle) {
+  lembed_mutex_lock(&shared_models_lock);
+  for (lembed_shared_model **pp = &shared_models; *pp; pp = &(*pp)->next) {
+    lembed_shared_model *m = *pp;
+    if (m->model == model) {
+      assert(m->refcount > 0);
+      if (--m->refcount == 0 && !keep_idle) {
+        *pp = m->next;
+        llama_free_model(m->model);
+        sqlite3_free(m->path);
+        sqlite3_free(m);
+      }
+      break;
+    }
+  }
+  shared_models_evict_idle();
+  lembed_mutex_unlock(&shared_models_lock);
+}
+
+#pragma endregion
+
+#pragma region embedding cache
+
+/**
+ * 128-bit MurmurHash3 (x64 variant) of the input text, used as the embedding
+ * cache key.
+ */
+static uint64_t murmur3_rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t murmur3_fmix64(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return k;
+}
+
+static void murmur3_128(const void *key, size_t len, uint64_t out[2]) {
+  const unsigned char *data = (const unsigned char *)key;
+  const uint64_t c1 = 0x87c37b91114253d5ULL;
+  const uint64_t c2 = 0x4cf5ad432745937fULL;
+  uint64_t h1 = 0;
+  uint64_t h2 = 0;
+  size_t nblocks = len / 16;
+
+  for (size_t i = 0; i < nblocks; i++) {
+    uint64_t k1;
+    uint64_t k2;
+    memcpy(&k1, data + i * 16, sizeof(k1));
+    memcpy(&k2, data + i * 16 + 8, sizeof(k2));
+
+    k1 *= c1;
+    k1 = murmur3_rotl64(k1, 31);
+    k1 *= c2;
+    h1 ^= k1;
+    h1 = murmur3_rotl64(h1, 27);
+    h1 += h2;
+    h1 = h1 * 5 + 0x52dce729;
+
+    k2 *= c2;
+    k2 = murmur3_rotl64(k2, 33);
+    k2 *= c1;
+    h2 ^= k2;
+    h2 = murmur3_rotl64(h2, 31);
+    h2 += h1;
+    h2 = h2 * 5 + 0x38495ab5;
+  }
+
+  const unsigned char *tail = data + nblocks * 16;
+  uint64_t k1 = 0;
+  uint64_t k2 = 0;
+  switch (len & 15) {
+  case 15: k2 ^= ((uint64_t)tail[14]) << 48; /* fallthrough */
+  case 14: k2 ^= ((uint64_t)tail[13]) << 40; /* fallthrough */
+  case 13: k2 ^= ((uint64_t)tail[12]) << 32; /* fallthrough */
+  case 12: k2 ^= ((uint64_t)tail[11]) << 24; /* fallthrough */
+  case 11: k2 ^= ((uint64_t)tail[10]) << 16; /* fallthrough */
+  case 10: k2 ^= ((uint64_t)tail[9]) << 8; /* fallthrough */
+  case 9:
+    k2 ^= ((uint64_t)tail[8]);
+    k2 *= c2;
+    k2 = murmur3_rotl64(k2, 33);
+    k2 *= c1;
+    h2 ^= k2;
+    /* fallthrough */
+  case 8: k1 ^= ((uint64_t)tail[7]) << 56; /* fallthrough */
+  case 7: k1 ^= ((uint64_t)tail[6]) << 48; /* fallthrough */
+  case 6: k1 ^= ((uint64_t)tail[5]) << 40; /* fallthrough */
+  case 5: k1 ^= ((uint64_t)tail[4]) << 32; /* fallthrough */
+  case 4: k1 ^= ((uint64_t)tail[3]) << 24; /* fallthrough */
+  case 3: k1 ^= ((uint64_t)tail[2]) << 16; /* fallthrough */
+  case 2: k1 ^= ((uint64_t)tail[1]) << 8; /* fallthrough */
+  case 1:
+    k1 ^= ((uint64_t)tail[0]);
+    k1 *= c1;
+    k1 = murmur3_rotl64(k1, 31);
+    k1 *= c2;
+    h1 ^= k1;
+  }
+
+  h1 ^= (uint64_t)len;
+  h2 ^= (uint64_t)len;
+  h1 += h2;
+  h2 += h1;
+  h1 = murmur3_fmix64(h1);
+  h2 = murmur3_fmix64(h2);
+  h1 += h2;
+  h2 += h1;
+  out[0] = h1;
+  out[1] = h2;
+}
+
+/*
+ * In-memory LRU cache of embedding blobs, keyed by the 128-bit hash of the
+ * input text. Entries are evicted least-recently-used first once the total
+ * size of the cache goes over its byte budget.
+ */
+typedef struct lembed_cache_entry lembed_cache_entry;
+struct lembed_cache_entry {
+  uint64_t hash[2];
+  lembed_cache_entry *bucket_next;
+  lembed_cache_entry *lru_prev;
+  lembed_cache_entry *lru_next;
+  int n;
+  unsigned char data[];
+};
+
+typedef struct lembed_cache lembed_cache;
+struct lembed_cache {
+  lembed_mutex lock;
+  sqlite3_int64 budget;
+  sqlite3_int64 bytes;
+  int n_entries;
+  int n_buckets;
+  lembed_cache_entry **buckets;
+  // most recently used
+  lembed_cache_entry *lru_head;
+  // least recently used, evicted first
+  lembed_cache_entry *lru_tail;
+
+  sqlite3_int64 hits;
+  sqlite3_int64 table_hits;
+  sqlite3_int64 misses;
+};
+
+static lembed_cache *lembed_cache_new(sqlite3_int64 budget) {
+  lembed_cache *c = sqlite3_malloc(sizeof(*c));
+  if (!c) {
+    return NULL;
+  }
+  memset(c, 0, sizeof(*c));
+  c->budget = budget;
+  c->n_buckets = 64;
+  c->buckets = sqlite3_malloc(sizeof(lembed_cache_entry *) * c->n_buckets);
+  if (!c->buckets) {
+    sqlite3_free(c);
+    return NULL;
+  }
+  memset(c->buckets, 0, sizeof(lembed_cache_entry *) * c->n_buckets);
+  lembed_mutex_init(&c->lock);
+  return c;
+}
+
+static void lembed_cache_free(lembed_cache *c) {
+  if (!c) {
+    return;
+  }
+  lembed_cache_entry *e = c->lru_head;
+  while (e) {
+    lembed_cache_entry *next = e->lru_next;
+    sqlite3_free(e);
+    e = next;
+  }
+  sqlite3_free(c->buckets);
+  lembed_mutex_destroy(&c->lock);
+  sqlite3_free(c);
+}
+
+static void lembed_cache_lru_unlink(lembed_cache *c, lembed_cache_entry *e) {
+  if (e->lru_prev) {
+    e->lru_prev->lru_next = e->lru_next;
+  } else {
+    c->lru_head = e->lru_next;
+  }
+  if (e->lru_next) {
+    e->lru_next->lru_prev = e->lru_prev;
+  } else {
+    c->lru_tail = e->lru_prev;
+  }
+  e->lru_prev = e->lru_next = NULL;
+}
+
+static void lembed_cache_lru_push(lembed_cache *c, lembed_cache_entry *e) {
+  e->lru_prev = NULL;
+  e->lru_next = c->lru_head;
+  if (c->lru_head) {
+    c->lru_head->lru_prev = e;
+  }
+  c->lru_head = e;
+  if (!c->lru_tail) {
+    c->lru_tail = e;
+  }
+}
+
+static lembed_cache_entry **lembed_cache_slot(lembed_cache *c,
+                                              const uint64_t hash[2]) {
+  lembed_cache_entry **pp = &c->buckets[hash[0] & (c->n_buckets - 1)];
+  while (*pp && ((*pp)->hash[0] != hash[0] || (*pp)->hash[1] != hash[1])) {
+    pp = &(*pp)->bucket_next;
+  }
+  return pp;
+}
+
+static void lembed_cache_remove(lembed_cache *c, lembed_cache_entry *e) {
+  lembed_cache_entry **pp = lembed_cache_slot(c, e->hash);
+  *pp = e->bucket_next;
+  lembed_cache_lru_unlink(c, e);
+  c->bytes -= sizeof(*e) + e->n;
+  c->n_entries--;
+  sqlite3_free(e);
+}
+
+static void lembed_cache_grow(lembed_cache *c) {
+  int n_buckets = c->n_buckets * 2;
+  lembed_cache_entry **buckets =
+      sqlite3_malloc(sizeof(lembed_cache_entry *) * n_buckets);
+  if (!buckets) {
+    // keep the old, more crowded, buckets
+    return;
+  }
+  memset(buckets, 0, sizeof(lembed_cache_entry *) * n_buckets);
+  for (int i = 0; i < c->n_buckets; i++) {
+    lembed_cache_entry *e = c->buckets[i];
+    while (e) {
+      lembed_cache_entry *next = e->bucket_next;
+      lembed_cache_entry **slot = &buckets[e->hash[0] & (n_buckets - 1)];
+      e->bucket_next = *slot;
+      *slot = e;
+      e = next;
+    }
+  }
+  sqlite3_free(c->buckets);
+  c->buckets = buckets;
+  c->n_buckets = n_buckets;
+}
+
+/**
+ * Look up hash in the cache. On a hit, returns a sqlite3_malloc'ed copy of the
+ * cached blob in out/out_n, to be freed by the caller.
+ */
+static int lembed_cache_get(lembed_cache *c, const uint64_t hash[2],
+                            void **out, int *out_n) {
+  int found = 0;
+  lembed_mutex_lock(&c->lock);
+  lembed_cache_entry *e = *lembed_cache_slot(c, hash);
+  if (e) {
+    *out = sqlite3_malloc(e->n);
+    if (*out) {
+      memcpy(*out, e->data, e->n);
+      *out_n = e->n;
+      lembed_cache_lru_unlink(c, e);
+      lembed_cache_lru_push(c, e);
+      c->hits++;
+      found = 1;
+    }
+  }
+  lembed_mutex_unlock(&c->lock);
+  return found;
+}
+
+static void lembed_cache_put(lembed_cache *c, const uint64_t hash[2],
+                             const void *data, int n) {
+  sqlite3_int64 size = sizeof(lembed_cache_entry) + n;
+  if (size > c->budget) {
+    return;
+  }
+  lembed_cache_entry *e = sqlite3_malloc(size);
+  if (!e) {
+    return;
+  }
+  memset(e, 0, sizeof(*e));
+  e->hash[0] = hash[0];
+  e->hash[1] = hash[1];
+  e->n = n;
+  memcpy(e->data, data, n);
+
+  lembed_mutex_lock(&c->lock);
+  lembed_cache_entry *existing = *lembed_cache_slot(c, hash);
+  if (existing) {
+    lembed_cache_remove(c, existing);
+  }
+  while (c->lru_tail && c->bytes + size > c->budget) {
+    lembed_cache_remove(c, c->lru_tail);
+  }
+  if (c->n_entries >= c->n_buckets) {
+    lembed_cache_grow(c);
+  }
+  lembed_cache_entry **slot = &c->buckets[hash[0] & (c->n_buckets - 1)];
+  e->bucket_next = *slot;
+  *slot = e;
+  lembed_cache_lru_push(c, e);
+  c->bytes += size;
+  c->n_entries++;
+  lembed_mutex_unlock(&c->lock);
+}
+
+static void lembed_cache_count(lembed_cache *c, sqlite3_int64 *counter) {
+  lembed_mutex_lock(&c->lock);
+  (*counter)++;
+  lembed_mutex_unlock(&c->lock);
+}
+
+/*
+ * Optional persistent embedding cache, stored in a regular table on the
+ * connection the model was registered on.
+ */
+static void cache_hash_key(const uint64_t hash[2], unsigned char key[16]) {
+  for (int i = 0; i < 8; i++) {
+    key[i] = (unsigned char)(hash[0] >> (56 - 8 * i));
+    key[8 + i] = (unsigned char)(hash[1] >> (56 - 8 * i));
+  }
+}
+
+/** Quoted identifier for a "table" or "schema.table" name. */
+static char *cache_table_identifier(const char *name) {
+  const char *dot = strchr(name, '.');
+  if (!dot) {
+    return sqlite3_mprintf("\"%w\"", name);
+  }
+  char *schema = sqlite3_mprintf("%.*s", (int)(dot - name), name);
+  if (!schema) {
+    return NULL;
+  }
+  char *result = sqlite3_mprintf("\"%w\".\"%w\"", schema, dot + 1);
+  sqlite3_free(schema);
+  return result;
+}
+
+static int cache_table_create(sqlite3 *db, const char *table) {
+  char *zSql = sqlite3_mprintf(
+      "CREATE TABLE IF NOT EXISTS %s(model TEXT NOT NULL, hash BLOB NOT NULL, "
+      "embedding BLOB NOT NULL, PRIMARY KEY(model, hash)) WITHOUT ROWID",
+      table);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  int rc = sqlite3_exec(db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  return rc;
+}
+
+/**
+ * Prepare zFormat, formatted with table, into *stmt unless it already was.
+ * Statements are kept until the connection closes, see
+ * lembed_modelsDisconnect().
+ */
+static int cache_table_prepare(sqlite3 *db, sqlite3_stmt **stmt,
+                               const char *zFormat, const char *table) {
+  if (*stmt) {
+    return SQLITE_OK;
+  }
+  char *zSql = sqlite3_mprintf(zFormat, table);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  int rc = sqlite3_prepare_v3(db, zSql, -1, SQLITE_PREPARE_PERSISTENT, stmt,
+                              NULL);
+  sqlite3_free(zSql);
+  return rc;
+}
+
+static int cache_table_get(sqlite3 *db, sqlite3_stmt **pStmt,
+                           const char *table, const char *model,
+                           const uint64_t hash[2], void **out, int *out_n) {
+  unsigned char key[16];
+  cache_hash_key(hash, key);
+  if (cache_table_prepare(
+          db, pStmt, "SELECT embedding FROM %s WHERE model = ? AND hash = ?",
+          table) != SQLITE_OK) {
+    return 0;
+  }
+  sqlite3_stmt *stmt = *pStmt;
+  sqlite3_bind_text(stmt, 1, model, -1, SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 2, key, sizeof(key), SQLITE_STATIC);
+  int found = 0;
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    int n = sqlite3_column_bytes(stmt, 0);
+    *out = sqlite3_malloc(n);
+    if (*out) {
+      memcpy(*out, sqlite3_column_blob(stmt, 0), n);
+      *out_n = n;
+      found = 1;
+    }
+  }
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+  return found;
+}
+
+static void cache_table_put(sqlite3 *db, sqlite3_stmt **pStmt,
+                            const char *table, const char *model,
+                            const uint64_t hash[2], const void *data, int n) {
+  unsigned char key[16];
+  cache_hash_key(hash, key);
+  if (cache_table_prepare(db, pStmt,
+                          "INSERT OR REPLACE INTO %s(model, hash, embedding) "
+                          "VALUES (?, ?, ?)",
+                          table) != SQLITE_OK) {
+    return;
+  }
+  sqlite3_stmt *stmt = *pStmt;
+  sqlite3_bind_text(stmt, 1, model, -1, SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 2, key, sizeof(key), SQLITE_STATIC);
+  sqlite3_bind_blob(stmt, 3, data, n, SQLITE_STATIC);
+  sqlite3_step(stmt);
+  sqlite3_reset(stmt);
+  sqlite3_clear_bindings(stmt);
+}
+
+/**
+ * Seed mixed into every cache key of a model, from what its embeddings depend
+ * on besides the input: the weights file at path (its size and modification
+ * time, for files replaced in place), and the context options that change
+ * embeddings. Cached embeddings of a name registered again with other weights
+ * or options are then misses, instead of stale hits.
+ */
+static int cache_model_seed(const char *path,
+                            const struct llama_context_params *cparams,
+                            int pooling, int dimensions, int long_inputs,
+                            int n_tokens_max, uint64_t seed[2]) {
+  char *canonical = canonical_path(path);
+  if (!canonical) {
+    return SQLITE_NOMEM;
+  }
+  struct stat st;
+  sqlite3_int64 size = -1;
+  sqlite3_int64 mtime = -1;
+  if (stat(canonical, &st) == 0) {
+    size = st.st_size;
+    mtime = st.st_mtime;
+  }
+  char *identity = sqlite3_mprintf(
+      "%s|%lld|%lld|%d|%d|%d|%d|%d|%.17g", canonical, size, mtime, pooling,
+      dimensions, long_inputs, n_tokens_max, (int)cparams->rope_scaling_type,
+      (double)cparams->rope_freq_scale);
+  sqlite3_free(canonical);
+  if (!identity) {
+    return SQLITE_NOMEM;
+  }
+  murmur3_128(identity, strlen(identity), seed);
+  sqlite3_free(identity);
+  return SQLITE_OK;
+}
+
+#pragma endregion
+
+/**
+ * Tokenize the instruction prefix text (which may be NULL or empty, for no
+ * prefix) of model, without special tokens.
+ */
+static int prefix_init(lembed_prefix *prefix, struct llama_model *model,
+                       const char *text) {
+  memset(prefix, 0, sizeof(*prefix));
+  if (!text || !text[0]) {
+    return SQLITE_OK;
+  }
+  int length = strlen(text);
+  int n = llama_tokenize(model, text, length, NULL, 0, false, true);
+  if (n < 0) {
+    n = -n;
+  }
+  if (n == 0) {
+    return SQLITE_OK;
+  }
+  prefix->tokens = sqlite3_malloc(sizeof(llama_token) * n);
+  if (!prefix->tokens) {
+    return SQLITE_NOMEM;
+  }
+  prefix->n_tokens =
+      llama_tokenize(model, text, length, prefix->tokens, n, false, true);
+  if (prefix->n_tokens != n) {
+    prefix_clear(prefix);
+    return SQLITE_ERROR;
+  }
+  lembed_special_tokens special;
+  if (special_tokens(model, &special) == SQLITE_OK) {
+    prefix->at = special.n_prefix;
+  }
+  murmur3_128(text, length, prefix->hash);
+  return SQLITE_OK;
+}
+
+typedef struct lembed_queue lembed_queue;
+typedef struct lembed_coalescer lembed_coalescer;
+
+typedef struct ApiModel ApiModel;
+struct ApiModel {
+  char *name;
+  struct llama_model *model;
+  // References from the registry and from open cursors. Unregistered models
+  // are freed once the last cursor using them is closed.
+  int refcount;
+  // Next model in the same bucket of the registry's name hash table
+  ApiModel *next_by_name;
+  // What the model was registered with, so an UPDATE on lembed_models can
+  // keep whatever it doesn't set
+  char *model_path;
+  struct lembed_model_options *model_options;
+  struct lembed_context_options *context_options;
+
+  // Pool of n_contexts contexts, so n_contexts embeddings on the same model
+  // can be decoded at the same time. Callers check out a context with
+  // api_model_context_acquire(), which blocks until one is free. The pool
+  // belongs to one connection, which runs a statement at a time, so it's the
+  // queue's workers that use several contexts at once.
+  int n_contexts;
+  ApiContext *contexts;
+  ApiContext *free_contexts;
+  lembed_mutex lock;
+  lembed_cond context_available;
+  // CPUs the contexts decode on, if the cpu_mask context option is set
+  lembed_cpu_mask cpu_mask;
+
+  // batch_capacity() of the contexts in the pool
+  int n_tokens_max;
+  int n_seq_max;
+
+  // What to do with inputs longer than n_tokens_max, from the long_inputs
+  // context option
+  enum lembed_long_inputs long_inputs;
+  // Floats per embedding of the contexts in the pool
+  int dimensions;
+  // Whether the contexts pool with LLAMA_POOLING_TYPE_RANK, so the model
+  // scores pairs with lembed_rerank() instead of embedding
+  int reranker;
+
+  // Instruction prefixes of lembed_query() inputs, and of every other input,
+  // from the query_prefix and document_prefix context options
+  lembed_prefix query_prefix;
+  lembed_prefix document_prefix;
+
+  // Embedding cache used by lembed(), NULL unless one of the cache_size or
+  // cache_table context options was given. cache_table is the quoted name of
+  // the table embeddings are persisted in, if any.
+  lembed_cache *cache;
+  char *cache_table;
+  // Mixed into the cache keys of the model, see cache_model_seed()
+  uint64_t cache_seed[2];
+  // Statements on cache_table, prepared on first use and finalized by
+  // api_model_free() or when the connection closes
+  sqlite3_stmt *cache_get;
+  sqlite3_stmt *cache_put;
+
+  // Dispatcher that lembed() calls on this and other connections are
+  // coalesced in, NULL unless the coalesce_ms context option was given
+  lembed_coalescer *coalescer;
+
+  // Background queue of lembed_enqueue(), created on first use. If the
+  // queue_table context option was given, finished embeddings are written to
+  // queue_table (quoted) in the database file at queue_db_path.
+  lembed_queue *queue;
+  char *queue_db_path;
+  char *queue_table;
+  // How many finished jobs the queue keeps for lembed_results, from the
+  // queue_results_max context option
+  int queue_results_max;
+
+  // How long registering the model took, and how much the resident memory
+  // of the process grew meanwhile (-1 if unknown), for lembed_models. Models
+  // that were already loaded by another connection only load new contexts.
+  int64_t load_ns;
+  int64_t resident_bytes;
+
+  // Counters and latencies exposed by lembed_stats
+  lembed_stats stats;
+
+  // Set once the model is deleted or replaced, so its weights are freed with
+  // it instead of kept for other connections
+  int evict;
+  // Next deleted or replaced model in the registry's retired list
+  ApiModel *next_retired;
+};
+
+static ApiContext *api_model_context_acquire(ApiModel *m) {
+  lembed_mutex_lock(&m->lock);
+  if (!m->free_contexts) {
+    int64_t start = lembed_time_ns();
+    while (!m->free_contexts) {
+      lembed_cond_wait(&m->context_available, &m->lock);
+    }
+    lembed_stats_record(&m->stats, LEMBED_STAGE_CONTEXT_WAIT, start, 0, 0);
+  }
+  ApiContext *c = m->free_contexts;
+  m->free_contexts = c->next_free;
+  lembed_mutex_unlock(&m->lock);
+  return c;
+}
+
+static void api_model_context_release(ApiModel *m, ApiContext *c) {
+  lembed_mutex_lock(&m->lock);
+  c->next_free = m->free_contexts;
+  m->free_contexts = c;
+  lembed_cond_signal(&m->context_available);
+  lembed_mutex_unlock(&m->lock);
+}
+
+#pragma region request coalescing
+
+/*
+ * Process-wide dispatchers that merge lembed() calls made at the same time,
+ * on any connection, into shared llama_decode() calls, for models registered
+ * with the coalesce_ms context option. Models loaded from the same weights,
+ * with the same context options that change embeddings, share a dispatcher.
+ *
+ * There's no scheduler thread. The first caller that finds no batch being
+ * collected collects one: it waits up to coalesce_ms for other callers to
+ * join, or until coalesce_max have, then decodes them all at once on a
+ * context of its own model, and wakes each caller with its embedding. Callers
+ * that arrive meanwhile are collected into the next batch.
+ */
+typedef struct lembed_coalesce_request lembed_coalesce_request;
+struct lembed_coalesce_request {
+  llama_token *tokens;
+  int token_count;
+  // Room for dimensions floats, written by whoever decodes the request
+  float *out;
+  int rc;
+  int done;
+  lembed_coalesce_request *next;
+};
+
+struct lembed_coalescer {
+  struct llama_model *model;
+  struct llama_context_params params;
+  int dimensions;
+  int64_t window_ns;
+  int max_sequences;
+  // Models using the dispatcher
+  int refcount;
+  lembed_coalescer *next;
+
+  lembed_mutex lock;
+  // Broadcast when max_sequences requests are pending, and when a batch is
+  // decoded
+  lembed_cond changed;
+  // Requests waiting to be collected, oldest first
+  lembed_coalesce_request *pending;
+  lembed_coalesce_request **pending_tail;
+  int n_pending;
+  // Whether a caller is collecting pending requests into a batch
+  int collecting;
+};
+
+static lembed_mutex coalescers_lock = LEMBED_MUTEX_INITIALIZER;
+static lembed_coalescer *coalescers = NULL;
+
+/** Whether contexts created with a and b embed the same inputs the same. */
+static int coalesce_params_equal(const struct llama_context_params *a,
+                                 const struct llama_context_params *b) {
+  return a->n_ctx == b->n_ctx && a->n_batch == b->n_batch &&
+         a->n_ubatch == b->n_ubatch && a->n_seq_max == b->n_seq_max &&
+         a->pooling_type == b->pooling_type &&
+         a->rope_scaling_type == b->rope_scaling_type &&
+         a->rope_freq_scale == b->rope_freq_scale;
+}
+
+/**
+ * The dispatcher of model with contexts created from params, creating it if
+ * no model uses it yet, or NULL if out of memory. Every successful call must
+ * be paired with coalescer_release().
+ */
+static lembed_coalescer *
+coalescer_acquire(struct llama_model *model,
+                  struct llama_context_params params, int dimensions,
+                  int64_t window_ns, int max_sequences) {
+  lembed_mutex_lock(&coalescers_lock);
+  lembed_coalescer *co = coalescers;
+  for (; co; co = co->next) {
+    if (co->model == model && coalesce_params_equal(&co->params, &params) &&
+        co->dimensions == dimensions && co->window_ns == window_ns &&
+        co->max_sequences == max_sequences) {
+      break;
+    }
+  }
+  if (co) {
+    co->refcount++;
+  } else {
+    co = sqlite3_malloc(sizeof(*co));
+    if (co) {
+      memset(co, 0, sizeof(*co));
+      co->model = model;
+      co->params = params;
+      co->dimensions = dimensions;
+      co->window_ns = window_ns;
+      co->max_sequences = max_sequences;
+      co->refcount = 1;
+      co->pending_tail = &co->pending;
+      lembed_mutex_init(&co->lock);
+      lembed_cond_init(&co->changed);
+      co->next = coalescers;
+      coalescers = co;
+    }
+  }
+  lembed_mutex_unlock(&coalescers_lock);
+  return co;
+}
+
+static void coalescer_release(lembed_coalescer *co) {
+  if (!co) {
+    return;
+  }
+  lembed_mutex_lock(&coalescers_lock);
+  if (--co->refcount == 0) {
+    lembed_coalescer **pp = &coalescers;
+    while (*pp != co) {
+      pp = &(*pp)->next;
+    }
+    *pp = co->next;
+    // Callers hold a reference until their request is done
+    assert(!co->pending && !co->collecting);
+    lembed_cond_destroy(&co->changed);
+    lembed_mutex_destroy(&co->lock);
+    sqlite3_free(co);
+  }
+  lembed_mutex_unlock(&coalescers_lock);
+}
+
+/**
+ * Embed the n requests of batch, chained through next, on a context of m.
+ * Every request gets the same rc.
+ */
+static int coalescer_decode(ApiModel *m, lembed_coalesce_request *batch,
+                            int n) {
+  llama_token **tokens = sqlite3_malloc(sizeof(llama_token *) * n);
+  int *token_counts = sqlite3_malloc(sizeof(int) * n);
+  float *out = sqlite3_malloc64(sizeof(float) * n * m->dimensions);
+  int rc = SQLITE_NOMEM;
+  if (tokens && token_counts && out) {
+    int i = 0;
+    for (lembed_coalesce_request *r = batch; r; r = r->next, i++) {
+      tokens[i] = r->tokens;
+      token_counts[i] = r->token_count;
+    }
+    ApiContext *ctx = api_model_context_acquire(m);
+    rc = embed_many(m->model, ctx, tokens, token_counts, n, 0, out);
+    api_model_context_release(m, ctx);
+  }
+  if (rc == SQLITE_OK) {
+    int i = 0;
+    for (lembed_coalesce_request *r = batch; r; r = r->next, i++) {
+      memcpy(r->out, out + (i * m->dimensions), sizeof(float) * m->dimensions);
+    }
+  }
+  sqlite3_free(tokens);
+  sqlite3_free(token_counts);
+  sqlite3_free(out);
+  return rc;
+}
+
+/**
+ * Embed token_count tokens, at most m->n_tokens_max, in the next batch of
+ * m's dispatcher, and write their normalized embedding to out. Blocks until
+ * the batch is decoded, either by this caller or by another one.
+ */
+static int coalescer_embed(ApiModel *m, llama_token *tokens, int token_count,
+                           float *out) {
+  lembed_coalescer *co = m->coalescer;
+  lembed_coalesce_request request = {tokens, token_count, out, SQLITE_OK, 0,
+                                     NULL};
+  int64_t start = lembed_time_ns();
+  lembed_mutex_lock(&co->lock);
+  *co->pending_tail = &request;
+  co->pending_tail = &request.next;
+  if (++co->n_pending >= co->max_sequences) {
+    lembed_cond_broadcast(&co->changed);
+  }
+  while (!request.done) {
+    if (co->collecting) {
+      lembed_cond_wait(&co->changed, &co->lock);
+      continue;
+    }
+
+    co->collecting = 1;
+    int64_t deadline = start + co->window_ns;
+    for (;;) {
+      int64_t now = lembed_time_ns();
+      if (co->n_pending >= co->max_sequences || now >= deadline) {
+        break;
+      }
+      lembed_cond_timedwait(&co->changed, &co->lock, deadline - now);
+    }
+    lembed_coalesce_request *batch = co->pending;
+    lembed_coalesce_request **tail = &co->pending;
+    int n = 0;
+    while (*tail && n < co->max_sequences) {
+      tail = &(*tail)->next;
+      n++;
+    }
+    co->pending = *tail;
+    *tail = NULL;
+    if (!co->pending) {
+      co->pending_tail = &co->pending;
+    }
+    co->n_pending -= n;
+    co->collecting = 0;
+    if (co->pending) {
+      // Let a caller left out of this batch collect the next one
+      lembed_cond_broadcast(&co->changed);
+    }
+    lembed_mutex_unlock(&co->lock);
+
+    int rc = coalescer_decode(m, batch, n);
+
+    lembed_mutex_lock(&co->lock);
+    while (batch) {
+      // Requests live on their caller's stack, which may return once done
+      lembed_coalesce_request *next = batch->next;
+      batch->rc = rc;
+      batch->done = 1;
+      batch = next;
+    }
+    lembed_cond_broadcast(&co->changed);
+  }
+  lembed_mutex_unlock(&co->lock);
+  lembed_stats_record(&m->stats, LEMBED_STAGE_COALESCE, start, token_count,
+                      request.rc != SQLITE_OK);
+  return request.rc;
+}
+
+/**
+ * Same as embed_single(), but through m's dispatcher, so the decode is shared
+ * with other callers. Inputs longer than a batch can't be shared, and are
+ * embedded on their own.
+ */
+static int embed_coalesced(ApiModel *m, const lembed_prefix *prefix,
+                           const char *input, size_t input_length, float *out,
+                           int *token_count) {
+  *token_count = 0;
+  int capacity = m->n_tokens_max;
+  llama_token *tokens = sqlite3_malloc(sizeof(llama_token) * capacity);
+  if (!tokens) {
+    return SQLITE_NOMEM;
+  }
+  int rc = tokenize_into(m->model, input, input_length, &tokens, &capacity,
+                         token_count, &m->stats);
+  if (rc == SQLITE_OK) {
+    rc = prefix_insert(prefix, &tokens, &capacity, token_count);
+  }
+  if (rc == SQLITE_OK && *token_count > m->n_tokens_max) {
+    ApiContext *ctx = api_model_context_acquire(m);
+    rc = embed_many(m->model, ctx, &tokens, token_count, 1,
+                    prefix ? prefix->n_tokens : 0, out);
+    api_model_context_release(m, ctx);
+  } else if (rc == SQLITE_OK) {
+    rc = coalescer_embed(m, tokens, *token_count, out);
+  }
+  sqlite3_free(tokens);
+  return rc;
+}
+
+#pragma endregion
+
+#pragma region embedding queue
+
+/*
+ * Background embedding queue of a model, for lembed_enqueue(). Jobs are
+ * embedded by one worker thread per context of the model, each taking up to
+ * n_seq_max jobs at a time and embedding them with embed_many(). Finished jobs
+ * are written to the model's queue_table on a separate connection, if it has
+ * one, and otherwise kept for the lembed_results table until they're deleted
+ * from it. Jobs that fail are always kept for lembed_results, with an error.
+ *
+ * At most queue_results_max results are kept. Without a queue_table,
+ * lembed_enqueue() refuses new jobs once the results and the jobs that will
+ * become results reach that, so no embedding is lost. With one, only failed
+ * jobs are kept, and the oldest are dropped to make room for new ones.
+ */
+// How long workers wait on a locked queue_table before failing their jobs
+#define LEMBED_QUEUE_BUSY_TIMEOUT_MS 5000
+// Default of the queue_results_max context option
+#define LEMBED_QUEUE_RESULTS_MAX 10000
+
+typedef struct lembed_job lembed_job;
+struct lembed_job {
+  sqlite3_int64 id;
+  sqlite3_value *key;
+  char *text;
+  int text_length;
+  // Once the job is done: the embedding, model->dimensions floats, or an error
+  float *embedding;
+  char *error;
+  // Once the job is a result: references from the queue's results and from
+  // lembed_results cursors, under the queue's lock
+  int refcount;
+  lembed_job *next;
+};
+
+static void lembed_job_free(lembed_job *job) {
+  sqlite3_value_free(job->key);
+  sqlite3_free(job->text);
+  sqlite3_free(job->embedding);
+  sqlite3_free(job->error);
+  sqlite3_free(job);
+}
+
+/** A worker thread of a queue, and its scratch buffers for n_seq_max jobs. */
+typedef struct lembed_queue_worker lembed_queue_worker;
+struct lembed_queue_worker {
+  lembed_queue *queue;
+  lembed_thread thread;
+  lembed_job **jobs;
+  llama_token **tokens;
+  int *token_counts;
+  float *embeddings;
+};
+
+struct lembed_queue {
+  ApiModel *model;
+  // Path of the database file queue_table is in, and its quoted name there.
+  // NULL if the model has no queue_table.
+  char *db_path;
+  char *table;
+
+  lembed_mutex lock;
+  // Signaled when jobs are added, or workers should stop
+  lembed_cond work_available;
+  // Signaled when workers finish jobs
+  lembed_cond progress;
+  // Waiting jobs, oldest first
+  lembed_job *head;
+  lembed_job **tail;
+  // Finished jobs for lembed_results, oldest first
+  lembed_job *results;
+  lembed_job **results_tail;
+  sqlite3_int64 n_results;
+  // Failed jobs dropped from results to stay under queue_results_max
+  sqlite3_int64 dropped;
+  sqlite3_int64 queued;
+  sqlite3_int64 running;
+  sqlite3_int64 completed;
+  sqlite3_int64 failed;
+  // Workers exit once this is set and there are no jobs left
+  int stop;
+  // Workers that were started and haven't exited yet
+  int n_running_workers;
+  int n_workers;
+  lembed_queue_worker *workers;
+};
+
+/** Drop a reference to a result, with the queue's lock held. */
+static void lembed_result_unref(lembed_job *job) {
+  if (--job->refcount == 0) {
+    lembed_job_free(job);
+  }
+}
+
+/** Remove the result *pp from the results of q, with its lock held. */
+static void lembed_queue_remove_result(lembed_queue *q, lembed_job **pp) {
+  lembed_job *job = *pp;
+  *pp = job->next;
+  if (q->results_tail == &job->next) {
+    q->results_tail = pp;
+  }
+  q->n_results--;
+  lembed_result_unref(job);
+}
+
+/** Tokenize and embed the first n jobs of w, and set their embedding or error. */
+static void lembed_queue_embed(lembed_queue_worker *w, int n) {
+  ApiModel *m = w->queue->model;
+  lembed_job **jobs = w->jobs;
+  llama_token **tokens = w->tokens;
+  int *token_counts = w->token_counts;
+  float *embeddings = w->embeddings;
+  for (int i = 0; i < n; i++) {
+    tokens[i] = NULL;
+    token_counts[i] = -1;
+    int rc = tokenize(m->model, jobs[i]->text, jobs[i]->text_length,
+                      &m->document_prefix, &token_counts[i], &tokens[i],
+                      &m->stats);
+    if (rc != SQLITE_OK) {
+      jobs[i]->error = sqlite3_mprintf("Error tokenizing input");
+      token_counts[i] = -1;
+    } else if (token_counts[i] > m->n_tokens_max &&
+               m->long_inputs == LEMBED_LONG_INPUTS_ERROR) {
+      jobs[i]->error = sqlite3_mprintf(
+          "Input has %d tokens, more than the batch size of %d. Use the "
+          "long_inputs context option to truncate or split long inputs.",
+          token_counts[i], m->n_tokens_max);
+      token_counts[i] = -1;
+    }
+  }
+
+  ApiContext *ctx = api_model_context_acquire(m);
+  int rc = embed_many(m->model, ctx, tokens, token_counts, n,
+                      m->document_prefix.n_tokens, embeddings);
+  api_model_context_release(m, ctx);
+
+  for (int i = 0; i < n; i++) {
+    sqlite3_free(tokens[i]);
+    if (token_counts[i] < 0) {
+      continue;
+    }
+    if (rc != SQLITE_OK) {
+      jobs[i]->error = sqlite3_mprintf("Error generating embedding");
+      continue;
+    }
+    jobs[i]->embedding = sqlite3_malloc(sizeof(float) * m->dimensions);
+    if (!jobs[i]->embedding) {
+      jobs[i]->error = sqlite3_mprintf("Out of memory");
+      continue;
+    }
+    memcpy(jobs[i]->embedding, embeddings + (i * m->dimensions),
+           sizeof(float) * m->dimensions);
+  }
+}
+
+/**
+ * Write the embeddings of n jobs to q->table, in a single transaction on *db,
+ * which is opened on first use. Jobs that can't be written get an error.
+ */
+static void lembed_queue_write(lembed_queue *q, sqlite3 **db,
+                               lembed_job **jobs, int n) {
+  int rc = SQLITE_OK;
+  if (!*db) {
+    rc = sqlite3_open_v2(q->db_path, db, SQLITE_OPEN_READWRITE, NULL);
+    if (rc == SQLITE_OK) {
+      sqlite3_busy_timeout(*db, LEMBED_QUEUE_BUSY_TIMEOUT_MS);
+    }
+  }
+  sqlite3_stmt *stmt = NULL;
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(*db, "BEGIN IMMEDIATE", NULL, NULL, NULL);
+  }
+  if (rc == SQLITE_OK) {
+    char *zSql = sqlite3_mprintf(
+        "INSERT OR REPLACE INTO %s(key, embedding) VALUES (?, ?)", q->table);
+    rc = zSql ? sqlite3_prepare_v2(*db, zSql, -1, &stmt, NULL) : SQLITE_NOMEM;
+    sqlite3_free(zSql);
+  }
+  for (int i = 0; rc == SQLITE_OK && i < n; i++) {
+    if (jobs[i]->error) {
+      continue;
+    }
+    sqlite3_bind_value(stmt, 1, jobs[i]->key);
+    sqlite3_bind_blob(stmt, 2, jobs[i]->embedding,
+                      sizeof(float) * q->model->dimensions, SQLITE_STATIC);
+    rc = sqlite3_step(stmt) == SQLITE_DONE ? SQLITE_OK : SQLITE_ERROR;
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+  if (rc == SQLITE_OK) {
+    rc = sqlite3_exec(*db, "COMMIT", NULL, NULL, NULL);
+  }
+  if (rc == SQLITE_OK) {
+    return;
+  }
+  const char *zErr = *db ? sqlite3_errmsg(*db) : "out of memory";
+  for (int i = 0; i < n; i++) {
+    if (!jobs[i]->error) {
+      jobs[i]->error = sqlite3_mprintf("Could not write to %s: %s", q->table,
+                                       zErr);
+    }
+  }
+  if (*db && !sqlite3_get_autocommit(*db)) {
+    sqlite3_exec(*db, "ROLLBACK", NULL, NULL, NULL);
+  }
+}
+
+static void lembed_queue_work(void *p) {
+  lembed_queue_worker *w = p;
+  lembed_queue *q = w->queue;
+  sqlite3 *db = NULL;
+  int n_max = q->model->n_seq_max;
+
+  lembed_mutex_lock(&q->lock);
+  while (1) {
+    while (!q->head && !q->stop) {
+      lembed_cond_wait(&q->work_available, &q->lock);
+    }
+    if (!q->head) {
+      break;
+    }
+    int n = 0;
+    while (q->head && n < n_max) {
+      w->jobs[n++] = q->head;
+      q->head = q->head->next;
+    }
+    if (!q->head) {
+      q->tail = &q->head;
+    }
+    q->queued -= n;
+    q->running += n;
+    lembed_mutex_unlock(&q->lock);
+
+    lembed_queue_embed(w, n);
+    if (q->table) {
+      lembed_queue_write(q, &db, w->jobs, n);
+    }
+
+    lembed_mutex_lock(&q->lock);
+    for (int i = 0; i < n; i++) {
+      lembed_job *job = w->jobs[i];
+      job->next = NULL;
+      if (job->error) {
+        q->failed++;
+      } else {
+        q->completed++;
+      }
+      if (q->table && !job->error) {
+        lembed_job_free(job);
+        continue;
+      }
+      // Only the result is needed from now on
+      sqlite3_free(job->text);
+      job->text = NULL;
+      job->refcount = 1;
+      *q->results_tail = job;
+      q->results_tail = &job->next;
+      q->n_results++;
+      if (q->n_results > q->model->queue_results_max) {
+        lembed_queue_remove_result(q, &q->results);
+        q->dropped++;
+      }
+    }
+    q->running -= n;
+    lembed_cond_broadcast(&q->progress);
+  }
+  q->n_running_workers--;
+  lembed_mutex_unlock(&q->lock);
+  sqlite3_close(db);
+}
+
+/**
+ * Tell the workers of q to exit once every queued job is done, without
+ * waiting for them.
+ */
+static void lembed_queue_stop(lembed_queue *q) {
+  lembed_mutex_lock(&q->lock);
+  q->stop = 1;
+  lembed_cond_broadcast(&q->work_available);
+  lembed_mutex_unlock(&q->lock);
+}
+
+/** Whether every worker of q has exited after lembed_queue_stop(). */
+static int lembed_queue_stopped(lembed_queue *q) {
+  lembed_mutex_lock(&q->lock);
+  int stopped = q->stop && q->n_running_workers == 0;
+  lembed_mutex_unlock(&q->lock);
+  return stopped;
+}
+
+/**
+ * Stop the workers of q once every queued job is done, and free it. Jobs
+ * that are still queued when a connection closes are embedded first.
+ */
+static void lembed_queue_free(lembed_queue *q) {
+  if (!q) {
+    return;
+  }
+  lembed_queue_stop(q);
+  for (int i = 0; i < q->n_workers; i++) {
+    lembed_queue_worker *w = &q->workers[i];
+    if (w->queue) {
+      lembed_thread_join(w->thread);
+    }
+    sqlite3_free(w->jobs);
+    sqlite3_free(w->tokens);
+    sqlite3_free(w->token_counts);
+    sqlite3_free(w->embeddings);
+  }
+  // Only possible if no worker could be started
+  while (q->head) {
+    lembed_job *job = q->head;
+    q->head = job->next;
+    lembed_job_free(job);
+  }
+  while (q->results) {
+    lembed_job *job = q->results;
+    q->results = job->next;
+    lembed_job_free(job);
+  }
+  lembed_cond_destroy(&q->work_available);
+  lembed_cond_destroy(&q->progress);
+  lembed_mutex_destroy(&q->lock);
+  sqlite3_free(q->workers);
+  sqlite3_free(q->db_path);
+  sqlite3_free(q->table);
+  sqlite3_free(q);
+}
+
+/**
+ * Create the queue_table called name ("table" or "schema.table") on db if it
+ * doesn't exist yet, and find the database file it's in. Workers write to it
+ * on their own connections, where it's *table in the main schema.
+ */
+static int queue_table_init(sqlite3 *db, const char *name, char **db_path,
+                            char **table, char **pzErr) {
+  const char *dot = strchr(name, '.');
+  char *schema = dot ? sqlite3_mprintf("%.*s", (int)(dot - name), name)
+                     : sqlite3_mprintf("main");
+  if (!schema) {
+    return SQLITE_NOMEM;
+  }
+  const char *filename = sqlite3_db_filename(db, schema);
+  sqlite3_free(schema);
+  if (!filename || !filename[0]) {
+    *pzErr = sqlite3_mprintf(
+        "queue_table %s must be in a database file, not in memory", name);
+    return SQLITE_ERROR;
+  }
+  char *identifier = cache_table_identifier(name);
+  char *zSql = identifier
+                   ? sqlite3_mprintf("CREATE TABLE IF NOT EXISTS %s(key "
+                                     "PRIMARY KEY, embedding BLOB NOT NULL)",
+                                     identifier)
+                   : NULL;
+  sqlite3_free(identifier);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  int rc = sqlite3_exec(db, zSql, NULL, NULL, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    *pzErr = sqlite3_mprintf("Could not create queue table %s: %s", name,
+                             sqlite3_errmsg(db));
+    return rc;
+  }
+  *db_path = sqlite3_mprintf("%s", filename);
+  *table = sqlite3_mprintf("\"%w\"", dot ? dot + 1 : name);
+  if (!*db_path || !*table) {
+    sqlite3_free(*db_path);
+    sqlite3_free(*table);
+    return SQLITE_NOMEM;
+  }
+  return SQLITE_OK;
+}
+
+/**
+ * Create the queue of model m, and start one worker per context. Results are
+ * written to table in the database file at db_path, if they're not NULL.
+ */
+static lembed_queue *lembed_queue_new(ApiModel *m, const char *db_path,
+                                      const char *table) {
+  lembed_queue *q = sqlite3_malloc(sizeof(*q));
+  if (!q) {
+    return NULL;
+  }
+  memset(q, 0, sizeof(*q));
+  q->model = m;
+  q->tail = &q->head;
+  q->results_tail = &q->results;
+  lembed_mutex_init(&q->lock);
+  lembed_cond_init(&q->work_available);
+  lembed_cond_init(&q->progress);
+  if (db_path) {
+    q->db_path = sqlite3_mprintf("%s", db_path);
+    q->table = sqlite3_mprintf("%s", table);
+    if (!q->db_path || !q->table) {
+      lembed_queue_free(q);
+      return NULL;
+    }
+  }
+
+  q->workers = sqlite3_malloc(sizeof(lembed_queue_worker) * m->n_contexts);
+  if (!q->workers) {
+    lembed_queue_free(q);
+    return NULL;
+  }
+  memset(q->workers, 0, sizeof(lembed_queue_worker) * m->n_contexts);
+  q->n_workers = m->n_contexts;
+  int started = 0;
+  for (int i = 0; i < q->n_workers; i++) {
+    lembed_queue_worker *w = &q->workers[i];
+    w->jobs = sqlite3_malloc(sizeof(lembed_job *) * m->n_seq_max);
+    w->tokens = sqlite3_malloc(sizeof(llama_token *) * m->n_seq_max);
+    w->token_counts = sqlite3_malloc(sizeof(int) * m->n_seq_max);
+    w->embeddings =
+        sqlite3_malloc(sizeof(float) * m->n_seq_max * m->dimensions);
+    if (!w->jobs || !w->tokens || !w->token_counts || !w->embeddings) {
+      continue;
+    }
+    w->queue = q;
+    lembed_mutex_lock(&q->lock);
+    q->n_running_workers++;
+    lembed_mutex_unlock(&q->lock);
+    if (lembed_thread_create(&w->thread, lembed_queue_work, w) != SQLITE_OK) {
+      lembed_mutex_lock(&q->lock);
+      q->n_running_workers--;
+      lembed_mutex_unlock(&q->lock);
+      w->queue = NULL;
+      continue;
+    }
+    started++;
+  }
+  if (!started) {
+    lembed_queue_free(q);
+    return NULL;
+  }
+  return q;
+}
+
+#pragma endregion
+
+typedef struct lembed_model_options lembed_model_options;
+struct lembed_model_options {
+  int32_t n_gpu_layers;
+  int8_t use_mmap;
+  int8_t use_mlock;
+  int8_t vocab_only;
+  enum ggml_numa_strategy numa;
+
+  int8_t defined[5];
+};
+static char *POINTER_NAME_MODEL = "lembed_model";
+static char *POINTER_NAME_MODEL_OPTIONS = "lembed_model_options";
+
+static void lembed_model_size(sqlite3_context *context, int argc,
+                              sqlite3_value **argv) {
+  struct llama_model *model =
+      sqlite3_value_pointer(argv[0], POINTER_NAME_MODEL);
+  if (!model)
+    return;
+  sqlite3_result_int64(context, llama_model_size(model));
+}
+
+static void lembed_model_options_(sqlite3_context *context, int argc,
+                                  sqlite3_value **argv) {
+  if (argc % 2 != 0) {
+    sqlite3_result_error(
+        context, "lembed_model_options() takes pairs of keys and values", -1);
+    return;
+  }
+  lembed_model_options *o = sqlite3_malloc(sizeof(lembed_model_options));
+  assert(o);
+  memset(o, 0, sizeof(*o));
+
+  for (int i = 0; i < argc; i += 2) {
+    sqlite3_value *key = argv[i];
+    sqlite3_value *value = argv[i + 1];
+    assert(sqlite3_value_type(key) == SQLITE_TEXT);
+    const char *k = (const char *)sqlite3_value_text(key);
+    if (sqlite3_stricmp(k, "n_gpu_layers") == 0) {
+      o->n_gpu_layers = sqlite3_value_int(value);
+      o->defined[0] = 1;
+    } else if (sqlite3_stricmp(k, "use_mmap") == 0) {
+      o->use_mmap = sqlite3_value_int(value) != 0;
+      o->defined[1] = 1;
+    } else if (sqlite3_stricmp(k, "use_mlock") == 0) {
+      o->use_mlock = sqlite3_value_int(value) != 0;
+      o->defined[2] = 1;
+    } else if (sqlite3_stricmp(k, "vocab_only") == 0) {
+      o->vocab_only = sqlite3_value_int(value) != 0;
+      o->defined[3] = 1;
+    } else if (sqlite3_stricmp(k, "numa") == 0) {
+      const char *v = (const char *)sqlite3_value_text(value);
+      if (v && sqlite3_stricmp(v, "distribute") == 0) {
+        o->numa = GGML_NUMA_STRATEGY_DISTRIBUTE;
+      } else if (v && sqlite3_stricmp(v, "isolate") == 0) {
+        o->numa = GGML_NUMA_STRATEGY_ISOLATE;
+      } else if (v && sqlite3_stricmp(v, "numactl") == 0) {
+        o->numa = GGML_NUMA_STRATEGY_NUMACTL;
+      } else if (v && sqlite3_stricmp(v, "mirror") == 0) {
+        o->numa = GGML_NUMA_STRATEGY_MIRROR;
+      } else {
+        char *zErr = sqlite3_mprintf(
+            "Unknown numa value '%s', expected 'distribute', 'isolate', "
+            "'numactl' or 'mirror'",
+            v);
+        sqlite3_result_error(context, zErr, -1);
+        sqlite3_free(zErr);
+        sqlite3_free(o);
+        return;
+      }
+      o->defined[4] = 1;
+    } else {
+      char *zErr = sqlite3_mprintf("Unknown model option '%s'", k);
+      sqlite3_result_error(context, zErr, -1);
+      sqlite3_free(zErr);
+      sqlite3_free(o);
+      return;
+    }
+  }
+  sqlite3_result_pointer(context, o, POINTER_NAME_MODEL_OPTIONS, sqlite3_free);
+}
+
+/*
+ * llama.cpp's NUMA policy is process-wide and can only be set once, by the
+ * first model loaded with the numa model option.
+ */
+static lembed_mutex lembed_numa_lock = LEMBED_MUTEX_INITIALIZER;
+static int lembed_numa_strategy = GGML_NUMA_STRATEGY_DISABLED;
+
+static int numa_init(enum ggml_numa_strategy strategy) {
+  int rc = SQLITE_OK;
+  lembed_mutex_lock(&lembed_numa_lock);
+  if (lembed_numa_strategy == GGML_NUMA_STRATEGY_DISABLED) {
+    llama_numa_init(strategy);
+    lembed_numa_strategy = strategy;
+  } else if (lembed_numa_strategy != (int)strategy) {
+    rc = SQLITE_ERROR;
+  }
+  lembed_mutex_unlock(&lembed_numa_lock);
+  return rc;
+}
+
+typedef struct lembed_context_options lembed_context_options;
+struct lembed_context_options {
+  uint32_t seed;
+  uint32_t n_ctx;
+  enum llama_rope_scaling_type rope_scaling_type;
+  float rope_freq_scale;
+  uint32_t n_batch;
+  uint32_t n_ubatch;
+  uint32_t n_seq_max;
+  int32_t n_parallel;
+  sqlite3_int64 cache_size;
+  char *cache_table;
+  enum lembed_long_inputs long_inputs;
+  int32_t output_dims;
+  enum llama_pooling_type pooling_type;
+  char *query_prefix;
+  char *document_prefix;
+  char *queue_table;
+  uint32_t n_threads;
+  uint32_t n_threads_batch;
+  lembed_cpu_mask cpu_mask;
+  double coalesce_ms;
+  int32_t coalesce_max;
+  int32_t queue_results_max;
+
+  int8_t defined[22];
+};
+static char *POINTER_NAME_CONTEXT_OPTIONS = "lembed_context_options";
+
+static void lembed_context_options_free(void *p) {
+  lembed_context_options *o = (lembed_context_options *)p;
+  sqlite3_free(o->cache_table);
+  sqlite3_free(o->query_prefix);
+  sqlite3_free(o->document_prefix);
+  sqlite3_free(o->queue_table);
+  sqlite3_free(o);
+}
+
+static char *options_strdup(const char *z, int *nomem) {
+  if (!z) {
+    return NULL;
+  }
+  char *copy = sqlite3_mprintf("%s", z);
+  if (!copy) {
+    *nomem = 1;
+  }
+  return copy;
+}
+
+/** Copy of o, to be freed with lembed_context_options_free(), or NULL. */
+static lembed_context_options *
+lembed_context_options_dup(const lembed_context_options *o) {
+  lembed_context_options *copy = sqlite3_malloc(sizeof(*copy));
+  if (!copy) {
+    return NULL;
+  }
+  int nomem = 0;
+  *copy = *o;
+  copy->cache_table = options_strdup(o->cache_table, &nomem);
+  copy->query_prefix = options_strdup(o->query_prefix, &nomem);
+  copy->document_prefix = options_strdup(o->document_prefix, &nomem);
+  copy->queue_table = options_strdup(o->queue_table, &nomem);
+  if (nomem) {
+    lembed_context_options_free(copy);
+    return NULL;
+  }
+  return copy;
+}
+
+/**
+ * Read value into *out as an integer option named key, that must be between
+ * minimum and maximum. Otherwise report an error on context.
+ */
+static int context_option_int(sqlite3_context *context, const char *key,
+                              sqlite3_value *value, sqlite3_int64 minimum,
+                              sqlite3_int64 maximum, sqlite3_int64 *out) {
+  sqlite3_int64 v = sqlite3_value_int64(value);
+  if (v >= minimum && v <= maximum) {
+    *out = v;
+    return SQLITE_OK;
+  }
+  char *zErr = minimum > 0
+                   ? sqlite3_mprintf("%s must be greater than 0", key)
+                   : sqlite3_mprintf("%s must not be negative", key);
+  sqlite3_result_error(context, zErr ? zErr : "out of memory", -1);
+  sqlite3_free(zErr);
+  return SQLITE_ERROR;
+}
+
+static void lembed_context_options_(sqlite3_context *context, int argc,
+                                    sqlite3_value **argv) {
+  if (argc % 2 != 0) {
+    sqlite3_result_error(
+        context, "lembed_context_options() takes pairs of keys and values",
+        -1);
+    return;
+  }
+  lembed_context_options *o = sqlite3_malloc(sizeof(lembed_context_options));
+  assert(o);
+  memset(o, 0, sizeof(*o));
+
+  for (int i = 0; i < argc; i += 2) {
+    sqlite3_value *key = argv[i];
+    sqlite3_value *value = argv[i + 1];
+    assert(sqlite3_value_type(key) == SQLITE_TEXT);
+    const char *k = (const char *)sqlite3_value_text(key);
+    if (sqlite3_stricmp("seed", k) == 0) {
+      sqlite3_int64 v;
+      if (context_option_int(context, "seed", value, 1, UINT32_MAX, &v) !=
+          SQLITE_OK) {
+        lembed_context_options_free(o);
+        return;
+      }
+      o->seed = v;
+      o->defined[0] = 1;
+    } else if (sqlite3_stricmp("n_ctx", k) == 0) {
+      sqlite3_int64 v;
+      if (context_option_int(context, "n_ctx", value, 1, INT32_MAX, &v) !=
+          SQLITE_OK) {
+        lembed_context_options_free(o);
+        return;
+      }
+      o->n_ctx = v;
+      o->defined[1] = 1;
+    } else if (sqlite3_stricmp("rope_scaling_type", k) == 0) {
+      const char *v = (const char *)sqlite3_value_text(value);
+      if (v && sqlite3_stricmp(v, "none") == 0) {
+        o->rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_NONE;
+      } else if (v && sqlite3_stricmp(v, "linear") == 0) {
+        o->rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_LINEAR;
+      } else if (v && sqlite3_stricmp(v, "yarn") == 0) {
+        o->rope_scaling_type = LLAMA_ROPE_SCALING_TYPE_YARN;
+      } else {
+        char *zErr = sqlite3_mprintf(
+            "Unknown rope_scaling_type '%s', expected 'none', 'linear' or "
+            "'yarn'",
+            v);
+        sqlite3_result_error(context, zErr, -1);
+        sqlite3_free(zErr);
+        lembed_context_options_free(o);
+        return;
+      }
+      o->defined[2] = 1;
+    } else if (sqlite3_stricmp(k, "rope_freq_scale") == 0) {
+      o->rope_freq_scale = sqlite3_value_double(value);
+      o->defined[3] = 1;
+    } else if (sqlite3_stricmp(k, "n_batch") == 0) {
+      sqlite3_int64 v;
+      if (context_option_int(context, "n_batch", value, 1, INT32_MAX, &v) !=
+          SQLITE_OK) {
+        lembed_context_options_free(o);
+        return;
+      }
+      o->n_batch = v;
+      o->defined[4] = 1;
+    } else if (sqlite3_stricmp(k, "n_ubatch") == 0) {
+      sqlite3_int64 v;
+      if (context_option_int(context, "n_ubatch", value, 1, INT32_MAX, &v) !=
+          SQLITE_OK) {
+        lembed_context_options_free(o);
+        return;
+      }
+      o->n_ubatch = v;
+      o->defined[5] = 1;
+    } else if (sqlite3_stricmp(k, "n_seq_max") == 0) {
+      sqlite3_int64 v;
+      if (context_option_int(context, "n_seq_max", value, 1, INT32_MAX, &v) !=
+          SQLITE_OK) {
+        lembed_context_options_free(o);
+        return;
+      }
+      o->n_seq_max = v;
+      o->defined[6] = 1;
+    } else if (sqlite3_stricmp(k, "n_parallel") == 0) {
+      sqlite3_int64 v;
+      if (context_option_int(context, "n_parallel", value, 1, INT32_MAX, &v) !=
+          SQLITE_OK) {
+        lembed_context_options_free(o);
+        return;
+      }
+      o->n_parallel = v;
+      o->defined[7] = 1;
+    } else if (sqlite3_stricmp(k, "cache_size") == 0) {
+      sqlite3_int64 v;
+      if (context_option_int(context, "cache_size", value, 0, INT64_MAX, &v) !=
+          SQLITE_OK) {
+        lembed_context_options_free(o);
+        return;
+      }
+      o->cache_size = v;
+      o->defined[8] = 1;
+    } else if (sqlite3_stricmp(k, "cache_table") == 0) {
+      sqlite3_free(o->cache_table);
+      o->cache_table = sqlite3_mprintf("%s", sqlite3_value_text(value));
+      assert(o->cache_table);
+      o->defined[9] = 1;
+    } else if (sqlite3_stricmp(k, "long_inputs") == 0) {
+      const char *v = (const char *)sqlite3_value_text(value);
+      if (v && sqlite3_stricmp(v, "error") == 0) {
+        o->long_inputs = LEMBED_LONG_INPUTS_ERROR;
+      } else if (v && sqlite3_stricmp(v, "truncate") == 0) {
+        o->long_inputs = LEMBED_LONG_INPUTS_TRUNCATE;
+      } else if (v && sqlite3_stricmp(v, "mean") == 0) {
+        o->long_inputs = LEMBED_LONG_INPUTS_MEAN;
+      } else {
+        char *zErr = sqlite3_mprintf(
+            "Unknown long_inputs value '%s', expected 'error', 'truncate' or "
+            "'mean'",
+            v ? v : "");
+        sqlite3_result_error(context, zErr, -1);
+        sqlite3_free(zErr);
+        lembed_context_options_free(o);
+        return;
+      }
+      o->defined[10] = 1;
+    } else if (sqlite3_stricmp(k, "output_dims") == 0) {
+      sqlite3_int64 v = sqlite3_value_int64(value);
+      if (v <= 0 || v > INT32_MAX) {
+        sqlite3_result_error(context, "output_dims must be greater than 0", -1);
+        lembed_context_options_free(o);
+        return;
+      }
+      o->output_dims = v;
+      o->defined[11] = 1;
+    } else if (sqlite3_stricmp(k, "pooling") == 0) {
+      const char *v = (const char *)sqlite3_value_text(value);
+      if (v && sqlite3_stricmp(v, "mean") == 0) {
+        o->pooling_type = LLAMA_POOLING_TYPE_MEAN;
+      } else if (v && sqlite3_stricmp(v, "cls") == 0) {
+        o->pooling_type = LLAMA_POOLING_TYPE_CLS;
+      } else if (v && sqlite3_stricmp(v, "last") == 0) {
+        o->pooling_type = LLAMA_POOLING_TYPE_LAST;
+      } else if (v && sqlite3_stricmp(v, "none") == 0) {
+        o->pooling_type = LLAMA_POOLING_TYPE_NONE;
+      } else if (v && sqlite3_stricmp(v, "rank") == 0) {
+        o->pooling_type = LLAMA_POOLING_TYPE_RANK;
+      } else {
+        char *zErr = sqlite3_mprintf(
+            "Unknown pooling value '%s', expected 'mean', 'cls', 'last', "
+            "'rank' or 'none'",
+            v ? v : "");
+        sqlite3_result_error(context, zErr, -1);
+        sqlite3_free(zErr);
+        lembed_context_options_free(o);
+        return;
+      }
+      o->defined[12] = 1;
+    } else if (sqlite3_stricmp(k, "query_prefix") == 0) {
+      sqlite3_free(o->query_prefix);
+      o->query_prefix = sqlite3_mprintf("%s", sqlite3_value_text(value));
+      assert(o->query_prefix);
+      o->defined[13] = 1;
+    } else if (sqlite3_stricmp(k, "document_prefix") == 0) {
+      sqlite3_free(o->document_prefix);
+      o->document_prefix = sqlite3_mprintf("%s", sqlite3_value_text(value));
+      assert(o->document_prefix);
+      o->defined[14] = 1;
+    } else if (sqlite3_stricmp(k, "queue_table") == 0) {
+      sqlite3_free(o->queue_table);
+      o->queue_table = sqlite3_mprintf("%s", sqlite3_value_text(value));
+      assert(o->queue_table);
+      o->defined[15] = 1;
+    } else if (sqlite3_stricmp(k, "n_threads") == 0) {
+      sqlite3_int64 v;
+      if (context_option_int(context, "n_threads", value, 1, INT32_MAX, &v) !=
+          SQLITE_OK) {
+        lembed_context_options_free(o);
+        return;
+      }
+      o->n_threads = v;
+      o->defined[16] = 1;
+    } else if (sqlite3_stricmp(k, "n_threads_batch") == 0) {
+      sqlite3_int64 v;
+      if (context_option_int(context, "n_threads_batch", value, 1,
+                             INT32_MAX, &v) != SQLITE_OK) {
+        lembed_context_options_free(o);
+        return;
+      }
+      o->n_threads_batch = v;
+      o->defined[17] = 1;
+    } else if (sqlite3_stricmp(k, "cpu_mask") == 0) {
+      const char *v = (const char *)sqlite3_value_text(value);
+      char *zErr = NULL;
+      if (cpu_mask_parse(v, &o->cpu_mask) != SQLITE_OK) {
+        zErr = sqlite3_mprintf(
+            "Invalid cpu_mask '%s', expected CPUs like '0-3,8'", v);
+      } else if (!LEMBED_HAS_CPU_AFFINITY ||
+                 !cpu_mask_supported(&o->cpu_mask)) {
+        zErr = sqlite3_mprintf("cpu_mask '%s' is not supported on this "
+                               "platform",
+                               v);
+      }
+      if (zErr) {
+        sqlite3_result_error(context, zErr, -1);
+        sqlite3_free(zErr);
+        lembed_context_options_free(o);
+        return;
+      }
+      o->defined[18] = 1;
+    } else if (sqlite3_stricmp(k, "coalesce_ms") == 0) {
+      double v = sqlite3_value_double(value);
+      if (!(v >= 0 && v <= 1000)) {
+        sqlite3_result_error(context,
+                             "coalesce_ms must be between 0 and 1000", -1);
+        lembed_context_options_free(o);
+        return;
+      }
+      o->coalesce_ms = v;
+      o->defined[19] = 1;
+    } else if (sqlite3_stricmp(k, "coalesce_max") == 0) {
+      sqlite3_int64 v = sqlite3_value_int64(value);
+      if (v <= 0 || v > INT32_MAX) {
+        sqlite3_result_error(context, "coalesce_max must be greater than 0",
+                             -1);
+        lembed_context_options_free(o);
+        return;
+      }
+      o->coalesce_max = v;
+      o->defined[20] = 1;
+    } else if (sqlite3_stricmp(k, "queue_results_max") == 0) {
+      sqlite3_int64 v;
+      if (context_option_int(context, "queue_results_max", value, 1,
+                             INT32_MAX, &v) != SQLITE_OK) {
+        lembed_context_options_free(o);
+        return;
+      }
+      o->queue_results_max = v;
+      o->defined[21] = 1;
+    } else {
+      char *zErr = sqlite3_mprintf("Unknown context option '%s'", k);
+      sqlite3_result_error(context, zErr, -1);
+      sqlite3_free(zErr);
+      lembed_context_options_free(o);
+      return;
+    }
+  }
+  sqlite3_result_pointer(context, o, POINTER_NAME_CONTEXT_OPTIONS,
+                         lembed_context_options_free);
+}
+static char *POINTER_NAME_MODEL_PATH = "lembed_model_path";
+
+static void lembed_model_from_file(sqlite3_context *context, int argc,
+                                   sqlite3_value **argv) {
+  sqlite3_result_pointer(context,
+                         sqlite3_mprintf("%.*s", sqlite3_value_bytes(argv[0]),
+                                         sqlite3_value_text(argv[0])),
+                         POINTER_NAME_MODEL_PATH, sqlite3_free);
+}
+
+
+static void _static_text_func(sqlite3_context *context, int argc,
+                              sqlite3_value **argv) {
+  UNUSED_PARAMETER(argc);
+  UNUSED_PARAMETER(argv);
+  sqlite3_result_text(context, sqlite3_user_data(context), -1, SQLITE_STATIC);
+}
+
+#pragma region model registry
+
+/*
+ * Models registered on a connection with lembed_models. The rowid of a model
+ * is its index in models, and api_model_from_name() finds models by name in a
+ * hash table, chained through ApiModel.next_by_name.
+ */
+struct Api {
+  int default_index;
+  // Id of the next lembed_enqueue() job, on any model
+  sqlite3_int64 next_job_id;
+  // n_models slots, NULL where a model was deleted
+  ApiModel **models;
+  int n_models;
+  int models_capacity;
+  // n_buckets is a power of 2, and at least n_registered
+  ApiModel **buckets;
+  int n_buckets;
+  int n_registered;
+  // Models that were unregistered while their queue still had jobs, see
+  // api_model_retire()
+  ApiModel *retired;
+};
+
+static ApiModel *api_model_retain(ApiModel *m) {
+  m->refcount++;
+  return m;
+}
+
+static void api_model_free(ApiModel *m) {
+  // Waits for queued jobs, which need the contexts
+  lembed_queue_free(m->queue);
+  sqlite3_free(m->queue_db_path);
+  sqlite3_free(m->queue_table);
+  for (int j = 0; j < m->n_contexts; j++) {
+    api_context_free(&m->contexts[j]);
+  }
+  sqlite3_free(m->contexts);
+  shared_model_release(m->model, !m->evict);
+  lembed_cache_free(m->cache);
+  sqlite3_finalize(m->cache_get);
+  sqlite3_finalize(m->cache_put);
+  sqlite3_free(m->cache_table);
+  coalescer_release(m->coalescer);
+  prefix_clear(&m->query_prefix);
+  prefix_clear(&m->document_prefix);
+  lembed_cond_destroy(&m->context_available);
+  lembed_mutex_destroy(&m->lock);
+  sqlite3_free(m->model_path);
+  sqlite3_free(m->model_options);
+  if (m->context_options) {
+    lembed_context_options_free(m->context_options);
+  }
+  sqlite3_free(m->name);
+  sqlite3_free(m);
+}
+
+static void api_model_release(ApiModel *m) {
+  if (m && --m->refcount == 0) {
+    api_model_free(m);
+  }
+}
+
+/** FNV-1a hash of a model name. */
+static uint64_t api_name_hash(const char *name, int length) {
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (int i = 0; i < length; i++) {
+    h ^= (unsigned char)name[i];
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+static ApiModel **api_name_bucket(struct Api *api, const char *name,
+                                  int length) {
+  return &api->buckets[api_name_hash(name, length) & (api->n_buckets - 1)];
+}
+
+/** Make room in the name hash table for n_registered models. */
+static int api_names_reserve(struct Api *api, int n_registered) {
+  if (n_registered <= api->n_buckets) {
+    return SQLITE_OK;
+  }
+  int n_buckets = api->n_buckets ? api->n_buckets * 2 : 16;
+  while (n_buckets < n_registered) {
+    n_buckets *= 2;
+  }
+  ApiModel **buckets = sqlite3_malloc64(sizeof(ApiModel *) * n_buckets);
+  if (!buckets) {
+    return SQLITE_NOMEM;
+  }
+  memset(buckets, 0, sizeof(ApiModel *) * n_buckets);
+  sqlite3_free(api->buckets);
+  api->buckets = buckets;
+  api->n_buckets = n_buckets;
+  for (int i = 0; i < api->n_models; i++) {
+    ApiModel *m = api->models[i];
+    if (m) {
+      ApiModel **bucket = api_name_bucket(api, m->name, strlen(m->name));
+      m->next_by_name = *bucket;
+      *bucket = m;
+    }
+  }
+  return SQLITE_OK;
+}
+
+static void api_names_remove(struct Api *api, ApiModel *m) {
+  for (ApiModel **pp = api_name_bucket(api, m->name, strlen(m->name)); *pp;
+       pp = &(*pp)->next_by_name) {
+    if (*pp == m) {
+      *pp = m->next_by_name;
+      m->next_by_name = NULL;
+      return;
+    }
+  }
+}
+
+static void api_names_insert(struct Api *api, ApiModel *m) {
+  ApiModel **bucket = api_name_bucket(api, m->name, strlen(m->name));
+  m->next_by_name = *bucket;
+  *bucket = m;
+}
+
+/**
+ * Register m, taking over the caller's reference to it. Its rowid is the
+ * first free slot of api->models.
+ */
+static int api_model_register(struct Api *api, ApiModel *m,
+                              sqlite3_int64 *rowid) {
+  int rc = api_names_reserve(api, api->n_registered + 1);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  int idx = 0;
+  while (idx < api->n_models && api->models[idx]) {
+    idx++;
+  }
+  if (idx == api->models_capacity) {
+    int capacity = api->models_capacity ? api->models_capacity * 2 : 16;
+    ApiModel **models =
+        sqlite3_realloc64(api->models, sizeof(ApiModel *) * capacity);
+    if (!models) {
+      return SQLITE_NOMEM;
+    }
+    api->models = models;
+    api->models_capacity = capacity;
+  }
+  if (idx == api->n_models) {
+    api->n_models++;
+  }
+  api->models[idx] = m;
+  api_names_insert(api, m);
+  api->n_registered++;
+  *rowid = idx;
+  return SQLITE_OK;
+}
+
+/** The registered model with the given rowid, or NULL. */
+static ApiModel *api_model_at(struct Api *api, sqlite3_int64 rowid) {
+  if (rowid < 0 || rowid >= api->n_models) {
+    return NULL;
+  }
+  return api->models[rowid];
+}
+
+/**
+ * Drop the registry's reference to m, which was just unregistered. Jobs still
+ * queued on it are embedded in the background, without waiting for them, so
+ * until its queue is done m is kept in api->retired, and freed by
+ * api_models_reap().
+ */
+static void api_model_retire(struct Api *api, ApiModel *m) {
+  if (!m->queue) {
+    api_model_release(m);
+    return;
+  }
+  lembed_queue_stop(m->queue);
+  m->next_retired = api->retired;
+  api->retired = m;
+}
+
+/**
+ * Drop the registry's reference to retired models whose queue is done, or to
+ * every retired model if wait is set, once their queues are.
+ */
+static void api_models_reap(struct Api *api, int wait) {
+  ApiModel **pp = &api->retired;
+  while (*pp) {
+    ApiModel *m = *pp;
+    if (wait || lembed_queue_stopped(m->queue)) {
+      *pp = m->next_retired;
+      // Joins the queue's workers, which have exited or are about to
+      api_model_release(m);
+      continue;
+    }
+    pp = &m->next_retired;
+  }
+}
+
+/**
+ * Remove the model with the given rowid from the registry, and retire it.
+ * Open cursors keep using it until they're closed.
+ */
+static void api_model_unregister(struct Api *api, sqlite3_int64 rowid) {
+  ApiModel *m = api_model_at(api, rowid);
+  if (!m) {
+    return;
+  }
+  api_names_remove(api, m);
+  api->models[rowid] = NULL;
+  api->n_registered--;
+  api_model_retire(api, m);
+}
+
+/**
+ * Atomically put m in place of the model with the given rowid, taking over
+ * the caller's reference to m. The old model is retired, and its weights are
+ * freed with it unless m or another connection still uses them.
+ */
+static void api_model_replace(struct Api *api, sqlite3_int64 rowid,
+                              ApiModel *m) {
+  ApiModel *old = api->models[rowid];
+  api_names_remove(api, old);
+  api->models[rowid] = m;
+  api_names_insert(api, m);
+  old->evict = 1;
+  api_model_retire(api, old);
+}
+
+void api_free(void *p) {
+  struct Api *a = (struct Api *)p;
+  for (int i = 0; i < a->n_models; i++) {
+    api_model_unregister(a, i);
+  }
+  // Jobs still queued when a connection closes are finished before it closes
+  api_models_reap(a, 1);
+  sqlite3_free(a->models);
+  sqlite3_free(a->buckets);
+  llama_backend_free();
+  sqlite3_free(a);
+}
+
+int api_model_from_name(struct Api *api, const char *name, int name_length,
+                        struct llama_model **model, ApiModel **entry) {
+  if (!name || api->n_buckets == 0) {
+    return SQLITE_ERROR;
+  }
+  for (ApiModel *m = *api_name_bucket(api, name, name_length); m;
+       m = m->next_by_name) {
+    if (strncmp(m->name, name, name_length) == 0 &&
+        m->name[name_length] == 0) {
+      *model = m->model;
+      if (entry)
+        *entry = m;
+      return SQLITE_OK;
+    }
+  }
+  return SQLITE_ERROR;
+}
+
+#pragma endregion
+
+/**
+ * Models loaded with the vocab_only model option have no contexts to embed
+ * with, and rerankers score pairs instead. Returns the error message for that
+ * (to be freed with sqlite3_free()), or NULL if the model can embed.
+ */
+static char *api_model_embed_error(ApiModel *entry) {
+  if (entry->n_contexts == 0) {
+    return sqlite3_mprintf(
+        "Model '%s' was loaded with vocab_only, so it can only tokenize",
+        entry->name);
+  }
+  if (entry->reranker) {
+    return sqlite3_mprintf(
+        "Model '%s' is a reranker, so it can only score with lembed_rerank()",
+        entry->name);
+  }
+  return NULL;
+}
+
+enum lembed_output_format {
+  LEMBED_OUTPUT_FLOAT32,
+  LEMBED_OUTPUT_INT8,
+  LEMBED_OUTPUT_BIT,
+};
+
+/**
+ * Result a normalized float embedding in the given output format. xDel is
+ * called on embedding once it's no longer needed, like sqlite3_result_blob():
+ * float32 embeddings are handed to SQLite as is, other formats are quantized
+ * into a new BLOB.
+ */
+static void lembed_result_embedding(sqlite3_context *context, float *embedding,
+                                    int dimensions,
+                                    enum lembed_output_format format,
+                                    void (*xDel)(void *)) {
+  if (format == LEMBED_OUTPUT_FLOAT32) {
+    sqlite3_result_blob(context, embedding, sizeof(float) * dimensions, xDel);
+    sqlite3_result_subtype(context, LEMBED_FLOAT32_SUBTYPE);
+    return;
+  }
+  if (xDel == SQLITE_TRANSIENT || xDel == SQLITE_STATIC) {
+    xDel = NULL;
+  }
+  switch (format) {
+  case LEMBED_OUTPUT_FLOAT32:
+    break;
+  case LEMBED_OUTPUT_INT8: {
+    int8_t *out = sqlite3_malloc(dimensions);
+    if (!out) {
+      sqlite3_result_error_nomem(context);
+      break;
+    }
+    kernels.quantize_int8(embedding, out, dimensions);
+    sqlite3_result_blob(context, out, dimensions, sqlite3_free);
+    sqlite3_result_subtype(context, LEMBED_INT8_SUBTYPE);
+    break;
+  }
+  case LEMBED_OUTPUT_BIT: {
+    uint8_t *out = sqlite3_malloc((dimensions + 7) / 8);
+    if (!out) {
+      sqlite3_result_error_nomem(context);
+      break;
+    }
+    kernels.quantize_bit(embedding, out, dimensions);
+    sqlite3_result_blob(context, out, (dimensions + 7) / 8, sqlite3_free);
+    sqlite3_result_subtype(context, LEMBED_BIT_SUBTYPE);
+    break;
+  }
+  }
+  if (xDel) {
+    xDel(embedding);
+  }
+}
+
+/**
+ * Cut a normalized embedding of dimensions floats down to its first dims, and
+ * normalize those again.
+ */
+static void embedding_truncate(float *embedding, int dimensions, int dims) {
+  if (dims < dimensions) {
+    kernels.normalize(embedding, embedding, dims);
+  }
+}
+
+static void lembed_generic(sqlite3_context *context, int argc,
+                           sqlite3_value **argv,
+                           enum lembed_output_format format, int query) {
+  struct llama_model *model;
+  ApiModel *entry;
+  int rc;
+  const char * input;
+  sqlite3_int64 input_len;
+  if(argc == 1) {
+    input = (const char *)sqlite3_value_text(argv[0]);
+    input_len = sqlite3_value_bytes(argv[0]);
+    rc = api_model_from_name((struct Api *)sqlite3_user_data(context), "default", strlen("default"), &model, &entry);
+    if(rc != SQLITE_OK) {
+      sqlite3_result_error(context, "No default model has been registered yet with lembed_models", -1);
+      return;
+    }
+  }else {
+    input = (const char *)sqlite3_value_text(argv[1]);
+    input_len = sqlite3_value_bytes(argv[1]);
+    rc = api_model_from_name((struct Api *)sqlite3_user_data(context),
+                               (const char *)sqlite3_value_text(argv[0]),
+                               sqlite3_value_bytes(argv[0]), &model, &entry);
+
+    if(rc != SQLITE_OK) {
+      char * zSql = sqlite3_mprintf("Unknown model name '%s'. Was it registered with lembed_models?", sqlite3_value_text(argv[0]));
+      sqlite3_result_error(context, zSql, -1);
+      sqlite3_free(zSql);
+      return;
+    }
+  }
+  char *zEmbedError = api_model_embed_error(entry);
+  if (zEmbedError) {
+    sqlite3_result_error(context, zEmbedError, -1);
+    sqlite3_free(zEmbedError);
+    return;
+  }
+
+  // The optional dims argument cuts embeddings down to their first dims
+  // dimensions, after they're cached at the model's full output size.
+  int dimensions = entry->dimensions;
+  int dims = dimensions;
+  if (argc == 3) {
+    sqlite3_int64 v = sqlite3_value_int64(argv[2]);
+    if (v < 1 || v > dimensions) {
+      char *zErr = sqlite3_mprintf("dims must be between 1 and %d, got %lld",
+                                   dimensions, v);
+      sqlite3_result_error(context, zErr, -1);
+      sqlite3_free(zErr);
+      return;
+    }
+    dims = v;
+  }
+
+  const lembed_prefix *prefix =
+      query ? &entry->query_prefix : &entry->document_prefix;
+  int64_t start = lembed_time_ns();
+  uint64_t hash[2];
+  if (entry->cache) {
+    void *cached;
+    int cached_n;
+    murmur3_128(input, input_len, hash);
+    hash[0] ^= prefix->hash[0] ^ entry->cache_seed[0];
+    hash[1] ^= prefix->hash[1] ^ entry->cache_seed[1];
+    if (lembed_cache_get(entry->cache, hash, &cached, &cached_n)) {
+      embedding_truncate(cached, cached_n / sizeof(float), dims);
+      lembed_result_embedding(context, cached, dims, format, sqlite3_free);
+      lembed_stats_record(&entry->stats, LEMBED_STAGE_CACHE_HIT, start, 0, 0);
+      return;
+    }
+    if (entry->cache_table &&
+        cache_table_get(sqlite3_context_db_handle(context), &entry->cache_get,
+                        entry->cache_table, entry->name, hash, &cached,
+                        &cached_n)) {
+      // Embeddings persisted with another output_dims are misses
+      if (cached_n == (int)sizeof(float) * dimensions) {
+        lembed_cache_count(entry->cache, &entry->cache->table_hits);
+        lembed_cache_put(entry->cache, hash, cached, cached_n);
+        embedding_truncate(cached, dimensions, dims);
+        lembed_result_embedding(context, cached, dims, format, sqlite3_free);
+        lembed_stats_record(&entry->stats, LEMBED_STAGE_CACHE_HIT, start, 0,
+                            0);
+        return;
+      }
+      sqlite3_free(cached);
+    }
+    lembed_cache_count(entry->cache, &entry->cache->misses);
+  }
+
+  // float32 embeddings are written straight into the result BLOB. Other
+  // formats are quantized from the context's output buffer, so the context is
+  // held until they're done with it. Coalesced calls don't hold a context.
+  float *result = NULL;
+  if (format == LEMBED_OUTPUT_FLOAT32 || entry->coalescer) {
+    result = sqlite3_malloc(sizeof(float) * dimensions);
+    if (!result) {
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+  }
+  ApiContext *ctx = NULL;
+  float *embedding = result;
+  int token_count;
+  if (entry->coalescer) {
+    rc = embed_coalesced(entry, prefix, input, input_len, embedding,
+                         &token_count);
+  } else {
+    ctx = api_model_context_acquire(entry);
+    if (!embedding) {
+      embedding = ctx->output;
+    }
+    rc = embed_single(model, ctx, prefix, input, input_len, embedding,
+                      &token_count);
+  }
+  if(rc != SQLITE_OK) {
+    if (ctx) {
+      api_model_context_release(entry, ctx);
+    }
+    sqlite3_free(result);
+    lembed_stats_record(&entry->stats, LEMBED_STAGE_EMBED, start, token_count,
+                        1);
+    if (rc == SQLITE_TOOBIG) {
+      char *zErr = sqlite3_mprintf(
+          "Input is longer than the batch size of %d tokens. Use the "
+          "long_inputs context option to truncate or split long inputs.",
+          entry->n_tokens_max);
+      sqlite3_result_error(context, zErr, -1);
+      sqlite3_free(zErr);
+      return;
+    }
+    sqlite3_result_error(context, "Error generating embedding", -1);
+    return;
+  }
+  if (entry->cache) {
+    lembed_cache_put(entry->cache, hash, embedding, sizeof(float) * dimensions);
+    if (entry->cache_table) {
+      cache_table_put(sqlite3_context_db_handle(context), &entry->cache_put,
+                      entry->cache_table, entry->name, hash, embedding,
+                      sizeof(float) * dimensions);
+    }
+  }
+  int64_t result_start = lembed_time_ns();
+  embedding_truncate(embedding, dimensions, dims);
+  lembed_result_embedding(context, embedding, dims, format,
+                          result ? sqlite3_free : SQLITE_STATIC);
+  if (ctx) {
+    api_model_context_release(entry, ctx);
+  }
+  lembed_stats_record(&entry->stats, LEMBED_STAGE_RESULT, result_start, 0, 0);
+  lembed_stats_record(&entry->stats, LEMBED_STAGE_EMBED, start, token_count,
+                      0);
+}
+
+static void lembed(sqlite3_context *context, int argc, sqlite3_value **argv) {
+  lembed_generic(context, argc, argv, LEMBED_OUTPUT_FLOAT32, 0);
+}
+
+static void lembed_int8(sqlite3_context *context, int argc,
+                        sqlite3_value **argv) {
+  lembed_generic(context, argc, argv, LEMBED_OUTPUT_INT8, 0);
+}
+
+static void lembed_bit(sqlite3_context *context, int argc,
+                       sqlite3_value **argv) {
+  lembed_generic(context, argc, argv, LEMBED_OUTPUT_BIT, 0);
+}
+
+/** Like lembed(), but with the query_prefix of the model instead. */
+static void lembed_query(sqlite3_context *context, int argc,
+                         sqlite3_value **argv) {
+  lembed_generic(context, argc, argv, LEMBED_OUTPUT_FLOAT32, 1);
+}
+
+static void lembed_cache_stats(sqlite3_context *context, int argc,
+                               sqlite3_value **argv) {
+  struct llama_model *model;
+  ApiModel *entry;
+  int rc = api_model_from_name((struct Api *)sqlite3_user_data(context),
+                               (const char *)sqlite3_value_text(argv[0]),
+                               sqlite3_value_bytes(argv[0]), &model, &entry);
+  if (rc != SQLITE_OK) {
+    char *zSql = sqlite3_mprintf("Unknown model name '%s'. Was it registered with lembed_models?", sqlite3_value_text(argv[0]));
+    sqlite3_result_error(context, zSql, -1);
+    sqlite3_free(zSql);
+    return;
+  }
+  if (!entry->cache) {
+    sqlite3_result_null(context);
+    return;
+  }
+  lembed_cache *c = entry->cache;
+  lembed_mutex_lock(&c->lock);
+  char *result = sqlite3_mprintf(
+      "{\"hits\":%lld,\"table_hits\":%lld,\"misses\":%lld,\"entries\":%d,"
+      "\"bytes\":%lld,\"budget\":%lld}",
+      c->hits, c->table_hits, c->misses, c->n_entries, c->bytes, c->budget);
+  lembed_mutex_unlock(&c->lock);
+  if (!result) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  sqlite3_result_text(context, result, -1, sqlite3_free);
+  sqlite3_result_subtype(context, JSON_SUBTYPE);
+}
+
+/** Like api_model_from_name(), but results an error for unknown models. */
+static ApiModel *queue_model_from_name(sqlite3_context *context,
+                                       sqlite3_value *name) {
+  struct llama_model *model;
+  ApiModel *entry;
+  int rc = api_model_from_name((struct Api *)sqlite3_user_data(context),
+                               (const char *)sqlite3_value_text(name),
+                               sqlite3_value_bytes(name), &model, &entry);
+  if (rc != SQLITE_OK) {
+    char *zErr = sqlite3_mprintf(
+        "Unknown model name '%s'. Was it registered with lembed_models?",
+        sqlite3_value_text(name));
+    sqlite3_result_error(context, zErr, -1);
+    sqlite3_free(zErr);
+    return NULL;
+  }
+  return entry;
+}
+
+/**
+ * lembed_enqueue(model, key, text): queue text to be embedded in the
+ * background, and return the id of the job. The embedding shows up in the
+ * model's queue_table under key, or in lembed_results.
+ */
+static void lembed_enqueue(sqlite3_context *context, int argc,
+                           sqlite3_value **argv) {
+  struct Api *api = (struct Api *)sqlite3_user_data(context);
+  ApiModel *entry = queue_model_from_name(context, argv[0]);
+  if (!entry) {
+    return;
+  }
+  char *zEmbedError = api_model_embed_error(entry);
+  if (zEmbedError) {
+    sqlite3_result_error(context, zEmbedError, -1);
+    sqlite3_free(zEmbedError);
+    return;
+  }
+  if (sqlite3_value_type(argv[2]) == SQLITE_NULL) {
+    return;
+  }
+  if (!entry->queue) {
+    entry->queue =
+        lembed_queue_new(entry, entry->queue_db_path, entry->queue_table);
+    if (!entry->queue) {
+      sqlite3_result_error(context, "Could not start embedding queue", -1);
+      return;
+    }
+  }
+  lembed_job *job = sqlite3_malloc(sizeof(*job));
+  if (!job) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  memset(job, 0, sizeof(*job));
+  job->key = sqlite3_value_dup(argv[1]);
+  job->text_length = sqlite3_value_bytes(argv[2]);
+  job->text = sqlite3_malloc(job->text_length + 1);
+  if (!job->key || !job->text) {
+    lembed_job_free(job);
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  memcpy(job->text, sqlite3_value_text(argv[2]), job->text_length);
+  job->text[job->text_length] = 0;
+  job->id = ++api->next_job_id;
+
+  lembed_queue *q = entry->queue;
+  lembed_mutex_lock(&q->lock);
+  if (!q->table &&
+      q->queued + q->running + q->n_results >= entry->queue_results_max) {
+    lembed_mutex_unlock(&q->lock);
+    lembed_job_free(job);
+    char *zErr = sqlite3_mprintf(
+        "lembed_results is full with %d results of '%s'. Delete the ones "
+        "you've read, or raise the queue_results_max context option",
+        entry->queue_results_max, entry->name);
+    sqlite3_result_error(context, zErr ? zErr : "out of memory", -1);
+    sqlite3_free(zErr);
+    return;
+  }
+  *q->tail = job;
+  q->tail = &job->next;
+  q->queued++;
+  lembed_cond_signal(&q->work_available);
+  lembed_mutex_unlock(&q->lock);
+  sqlite3_result_int64(context, job->id);
+}
+
+static void lembed_result_queue_stats(sqlite3_context *context,
+                                      lembed_queue *q) {
+  char *result = sqlite3_mprintf(
+      "{\"queued\":%lld,\"running\":%lld,\"completed\":%lld,"
+      "\"failed\":%lld,\"results\":%lld,\"dropped\":%lld,\"workers\":%d}",
+      q->queued, q->running, q->completed, q->failed, q->n_results, q->dropped,
+      q->n_workers);
+  if (!result) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  sqlite3_result_text(context, result, -1, sqlite3_free);
+  sqlite3_result_subtype(context, JSON_SUBTYPE);
+}
+
+/**
+ * lembed_queue_stats(model): JSON object with the number of jobs of the model
+ * that are queued, running, completed and failed, how many are waiting in
+ * lembed_results, and how many failed ones were dropped from it. NULL if
+ * nothing was enqueued yet.
+ */
+static void lembed_queue_stats(sqlite3_context *context, int argc,
+                               sqlite3_value **argv) {
+  ApiModel *entry = queue_model_from_name(context, argv[0]);
+  if (!entry || !entry->queue) {
+    return;
+  }
+  lembed_queue *q = entry->queue;
+  lembed_mutex_lock(&q->lock);
+  lembed_result_queue_stats(context, q);
+  lembed_mutex_unlock(&q->lock);
+}
+
+/**
+ * lembed_queue_wait(model): block until every job of the model is done, and
+ * return lembed_queue_stats(model). Workers can't write to a queue_table
+ * while this connection holds a write transaction, so don't wait inside one.
+ */
+static void lembed_queue_wait(sqlite3_context *context, int argc,
+                              sqlite3_value **argv) {
+  ApiModel *entry = queue_model_from_name(context, argv[0]);
+  if (!entry || !entry->queue) {
+    return;
+  }
+  lembed_queue *q = entry->queue;
+  lembed_mutex_lock(&q->lock);
+  while (q->queued > 0 || q->running > 0) {
+    lembed_cond_wait(&q->progress, &q->lock);
+  }
+  lembed_result_queue_stats(context, q);
+  lembed_mutex_unlock(&q->lock);
+}
+
+/**
+ * lembed_token_count(model, text): the number of tokens lembed() would embed
+ * text as, special tokens and the model's document_prefix included. Only runs
+ * the tokenizer: llama_tokenize() returns how many tokens it needs room for,
+ * so nothing is copied out.
+ */
+static void lembed_token_count(sqlite3_context *context, int argc,
+                               sqlite3_value **argv) {
+  struct llama_model *model;
+  ApiModel *entry;
+  int rc = api_model_from_name((struct Api *)sqlite3_user_data(context),
+                               (const char *)sqlite3_value_text(argv[0]),
+                               sqlite3_value_bytes(argv[0]), &model, &entry);
+  if (rc != SQLITE_OK) {
+    char *zErr = sqlite3_mprintf(
+        "Unknown model name '%s'. Was it registered with lembed_models?",
+        sqlite3_value_text(argv[0]));
+    sqlite3_result_error(context, zErr, -1);
+    sqlite3_free(zErr);
+    return;
+  }
+  if (sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+    return;
+  }
+  const char *input = (const char *)sqlite3_value_text(argv[1]);
+  int input_len = sqlite3_value_bytes(argv[1]);
+  int64_t start = lembed_time_ns();
+  int n = llama_tokenize(model, input, input_len, NULL, 0, true, true);
+  if (n < 0) {
+    n = -n;
+  }
+  lembed_stats_record(&entry->stats, LEMBED_STAGE_TOKENIZE, start, n, 0);
+  sqlite3_result_int(context, n + entry->document_prefix.n_tokens);
+}
+
+static void lembed_tokenize_json(sqlite3_context *context, int argc,
+                                 sqlite3_value **argv) {
+  struct llama_model *model;
+  int rc = api_model_from_name((struct Api *)sqlite3_user_data(context),
+                               (const char *)sqlite3_value_text(argv[0]),
+                               sqlite3_value_bytes(argv[0]), &model, NULL);
+  const char *input = (const char *)sqlite3_value_text(argv[1]);
+  sqlite3_int64 input_len = sqlite3_value_bytes(argv[1]);
+  int token_count;
+  llama_token *tokens;
+  rc = tokenize(model, input, input_len, NULL, &token_count, &tokens, NULL);
+  assert(rc == SQLITE_OK);
+
+  sqlite3_str *s = sqlite3_str_new(NULL);
+  sqlite3_str_appendchar(s, 1, '[');
+  for (int i = 0; i < token_count; i++) {
+    if (i != 0) {
+      sqlite3_str_appendchar(s, 1, ',');
+    }
+    sqlite3_str_appendf(s, "%d", tokens[i]);
+  }
+  sqlite3_str_appendchar(s, 1, ']');
+  char *result = sqlite3_str_finish(s);
+  assert(result);
+  sqlite3_result_text(context, result, -1, sqlite3_free);
+}
+
+static void lembed_token_score(sqlite3_context *context, int argc,
+                               sqlite3_value **argv) {
+  struct llama_model *model;
+  int rc = api_model_from_name((struct Api *)sqlite3_user_data(context),
+                               (const char *)sqlite3_value_text(argv[0]),
+                               sqlite3_value_bytes(argv[0]), &model, NULL);
+
+  int32_t token = sqlite3_value_int(argv[1]);
+
+  float score = llama_token_get_score(model, token);
+  sqlite3_result_double(context, score);
+}
+static void lembed_token_to_piece_(sqlite3_context *context, int argc,
+                                   sqlite3_value **argv) {
+  struct llama_model *model;
+  int rc = api_model_from_name((struct Api *)sqlite3_user_data(context),
+                               (const char *)sqlite3_value_text(argv[0]),
+                               sqlite3_value_bytes(argv[0]), &model, NULL);
+
+  int32_t token = sqlite3_value_int(argv[1]);
+#define BUFLEN 256
+  char buf[BUFLEN];
+  int n = llama_token_to_piece(model, token, buf, BUFLEN, false);
+  if (n) {
+    sqlite3_result_text(context, buf, n, SQLITE_TRANSIENT);
+  } else {
+    sqlite3_result_null(context);
+  }
+}
+
+#pragma region distance functions
+
+/**
+ * Reads a float32 vector BLOB from value in place, without copying. Returns
+ * SQLITE_ERROR and sets an error on context when value isn't one.
+ */
+static int vector_from_value(sqlite3_context *context, sqlite3_value *value,
+                             const char *argument, const float **vec,
+                             int *dimensions) {
+  if (sqlite3_value_type(value) != SQLITE_BLOB) {
+    char *zErr = sqlite3_mprintf("%s must be a float32 vector BLOB", argument);
+    sqlite3_result_error(context, zErr, -1);
+    sqlite3_free(zErr);
+    return SQLITE_ERROR;
+  }
+  int n = sqlite3_value_bytes(value);
+  if (n == 0 || n % sizeof(float) != 0) {
+    char *zErr = sqlite3_mprintf(
+        "%s has %d bytes, which is not a float32 vector", argument, n);
+    sqlite3_result_error(context, zErr, -1);
+    sqlite3_free(zErr);
+    return SQLITE_ERROR;
+  }
+  *vec = (const float *)sqlite3_value_blob(value);
+  *dimensions = n / sizeof(float);
+  return SQLITE_OK;
+}
+
+static int vectors_from_values(sqlite3_context *context, sqlite3_value **argv,
+                               const float **a, const float **b,
+                               int *dimensions) {
+  int a_dimensions;
+  int b_dimensions;
+  if (vector_from_value(context, argv[0], "a", a, &a_dimensions) !=
+          SQLITE_OK ||
+      vector_from_value(context, argv[1], "b", b, &b_dimensions) !=
+          SQLITE_OK) {
+    return SQLITE_ERROR;
+  }
+  if (a_dimensions != b_dimensions) {
+    char *zErr = sqlite3_mprintf(
+        "Vector dimension mismatch: a has %d dimensions, b has %d", a_dimensions,
+        b_dimensions);
+    sqlite3_result_error(context, zErr, -1);
+    sqlite3_free(zErr);
+    return SQLITE_ERROR;
+  }
+  *dimensions = a_dimensions;
+  return SQLITE_OK;
+}
+
+static float cosine_distance(const float *a, const float *b, int n) {
+  float norms = sqrtf(kernels.dot(a, a, n)) * sqrtf(kernels.dot(b, b, n));
+  if (norms == 0) {
+    return 1.0f;
+  }
+  return 1.0f - kernels.dot(a, b, n) / norms;
+}
+
+static void lembed_distance_cosine(sqlite3_context *context, int argc,
+                                   sqlite3_value **argv) {
+  const float *a;
+  const float *b;
+  int dimensions;
+  if (vectors_from_values(context, argv, &a, &b, &dimensions) != SQLITE_OK) {
+    return;
+  }
+  sqlite3_result_double(context, cosine_distance(a, b, dimensions));
+}
+
+static void lembed_distance_l2(sqlite3_context *context, int argc,
+                               sqlite3_value **argv) {
+  const float *a;
+  const float *b;
+  int dimensions;
+  if (vectors_from_values(context, argv, &a, &b, &dimensions) != SQLITE_OK) {
+    return;
+  }
+  sqlite3_result_double(context,
+                        sqrtf(kernels.l2_squared(a, b, dimensions)));
+}
+
+/*
+ * lembed_topk(query, embedding, id, k) aggregate: brute-force k nearest
+ * neighbors of query among the embedding column, by cosine distance. Returns
+ * a JSON array of {"id": ..., "distance": ...} objects, closest first.
+ *
+ * The query is normalized once, so every row only costs a dot product and the
+ * row's own norm, computed on the row's BLOB in place. The k best rows so far
+ * are kept in a max-heap on distance.
+ */
+typedef struct lembed_topk_item lembed_topk_item;
+struct lembed_topk_item {
+  float distance;
+  sqlite3_int64 seq;
+  sqlite3_value *id;
+};
+
+typedef struct lembed_topk_state lembed_topk_state;
+struct lembed_topk_state {
+  int k;
+  int dimensions;
+  float *query;
+  sqlite3_int64 seq;
+  int n_items;
+  lembed_topk_item *items;
+};
+
+static int topk_item_worse(const lembed_topk_item *a,
+                           const lembed_topk_item *b) {
+  return a->distance > b->distance ||
+         (a->distance == b->distance && a->seq > b->seq);
+}
+
+static void topk_sift_up(lembed_topk_item *items, int i) {
+  while (i > 0) {
+    int parent = (i - 1) / 2;
+    if (!topk_item_worse(&items[i], &items[parent])) {
+      break;
+    }
+    lembed_topk_item tmp = items[i];
+    items[i] = items[parent];
+    items[parent] = tmp;
+    i = parent;
+  }
+}
+
+static void topk_sift_down(lembed_topk_item *items, int n, int i) {
+  while (1) {
+    int worst = i;
+    int left = 2 * i + 1;
+    int right = 2 * i + 2;
+    if (left < n && topk_item_worse(&items[left], &items[worst])) {
+      worst = left;
+    }
+    if (right < n && topk_item_worse(&items[right], &items[worst])) {
+      worst = right;
+    }
+    if (worst == i) {
+      break;
+    }
+    lembed_topk_item tmp = items[i];
+    items[i] = items[worst];
+    items[worst] = tmp;
+    i = worst;
+  }
+}
+
+static void lembed_topkStep(sqlite3_context *context, int argc,
+                            sqlite3_value **argv) {
+  lembed_topk_state *state =
+      sqlite3_aggregate_context(context, sizeof(lembed_topk_state));
+  if (!state) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if (sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+    return;
+  }
+
+  if (!state->query) {
+    const float *query;
+    int dimensions;
+    if (vector_from_value(context, argv[0], "query", &query, &dimensions) !=
+        SQLITE_OK) {
+      return;
+    }
+    sqlite3_int64 k = sqlite3_value_int64(argv[3]);
+    if (k <= 0 || k > 100000) {
+      sqlite3_result_error(context, "k must be between 1 and 100000", -1);
+      return;
+    }
+    state->query = sqlite3_malloc(sizeof(float) * dimensions);
+    state->items = sqlite3_malloc(sizeof(lembed_topk_item) * k);
+    if (!state->query || !state->items) {
+      sqlite3_free(state->query);
+      sqlite3_free(state->items);
+      state->query = NULL;
+      state->items = NULL;
+      sqlite3_result_error_nomem(context);
+      return;
+    }
+    kernels.normalize(query, state->query, dimensions);
+    state->dimensions = dimensions;
+    state->k = k;
+  }
+
+  const float *embedding;
+  int dimensions;
+  if (vector_from_value(context, argv[1], "embedding", &embedding,
+                        &dimensions) != SQLITE_OK) {
+    return;
+  }
+  if (dimensions != state->dimensions) {
+    char *zErr = sqlite3_mprintf(
+        "Vector dimension mismatch: query has %d dimensions, embedding has %d",
+        state->dimensions, dimensions);
+    sqlite3_result_error(context, zErr, -1);
+    sqlite3_free(zErr);
+    return;
+  }
+
+  float norm = sqrtf(kernels.dot(embedding, embedding, dimensions));
+  float distance =
+      norm > 0
+          ? 1.0f - kernels.dot(state->query, embedding, dimensions) / norm
+          : 1.0f;
+  lembed_topk_item item = {distance, state->seq++, NULL};
+
+  if (state->n_items == state->k) {
+    if (!topk_item_worse(&state->items[0], &item)) {
+      return;
+    }
+    sqlite3_value_free(state->items[0].id);
+    item.id = sqlite3_value_dup(argv[2]);
+    state->items[0] = item;
+    topk_sift_down(state->items, state->n_items, 0);
+  } else {
+    item.id = sqlite3_value_dup(argv[2]);
+    state->items[state->n_items] = item;
+    topk_sift_up(state->items, state->n_items);
+    state->n_items++;
+  }
+}
+
+static void json_append_value(sqlite3_str *s, sqlite3_value *value) {
+  switch (sqlite3_value_type(value)) {
+  case SQLITE_INTEGER:
+    sqlite3_str_appendf(s, "%lld", sqlite3_value_int64(value));
+    break;
+  case SQLITE_FLOAT:
+    sqlite3_str_appendf(s, "%!.15g", sqlite3_value_double(value));
+    break;
+  case SQLITE_TEXT: {
+    const unsigned char *z = sqlite3_value_text(value);
+    int n = sqlite3_value_bytes(value);
+    sqlite3_str_appendchar(s, 1, '"');
+    for (int i = 0; i < n; i++) {
+      unsigned char c = z[i];
+      if (c == '"' || c == '\\') {
+        sqlite3_str_appendchar(s, 1, '\\');
+        sqlite3_str_appendchar(s, 1, c);
+      } else if (c < 0x20) {
+        sqlite3_str_appendf(s, "\\u%04x", c);
+      } else {
+        sqlite3_str_appendchar(s, 1, c);
+      }
+    }
+    sqlite3_str_appendchar(s, 1, '"');
+    break;
+  }
+  default:
+    sqlite3_str_appendall(s, "null");
+    break;
+  }
+}
+
+static void lembed_topkFinal(sqlite3_context *context) {
+  lembed_topk_state *state = sqlite3_aggregate_context(context, 0);
+  sqlite3_str *s = sqlite3_str_new(NULL);
+  sqlite3_str_appendchar(s, 1, '[');
+  if (state && state->items) {
+    // Pop the max-heap from the back, so the closest item ends up first.
+    int n = state->n_items;
+    for (int i = n - 1; i > 0; i--) {
+      lembed_topk_item tmp = state->items[0];
+      state->items[0] = state->items[i];
+      state->items[i] = tmp;
+      topk_sift_down(state->items, i, 0);
+    }
+    for (int i = 0; i < n; i++) {
+      if (i != 0) {
+        sqlite3_str_appendchar(s, 1, ',');
+      }
+      sqlite3_str_appendall(s, "{\"id\":");
+      json_append_value(s, state->items[i].id);
+      sqlite3_str_appendf(s, ",\"distance\":%!.9g}",
+                          (double)state->items[i].distance);
+      sqlite3_value_free(state->items[i].id);
+    }
+    sqlite3_free(state->items);
+    sqlite3_free(state->query);
+    state->items = NULL;
+    state->query = NULL;
+  }
+  sqlite3_str_appendchar(s, 1, ']');
+  char *result = sqlite3_str_finish(s);
+  if (!result) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  sqlite3_result_text(context, result, -1, sqlite3_free);
+  sqlite3_result_subtype(context, JSON_SUBTYPE);
+}
+
+#pragma endregion
+
+static void _noop(sqlite3_context *context, int argc, sqlite3_value **argv) {}
+static void ggml_test(sqlite3_context *context, int argc,
+                      sqlite3_value **argv) {
+  sqlite3_result_int64(context, ggml_cpu_has_avx());
+}
+
+#pragma region lembed_models() table function
+
+typedef struct lembed_models_vtab lembed_models_vtab;
+struct lembed_models_vtab {
+  sqlite3_vtab base;
+  sqlite3 *db;
+  struct Api *api;
+};
+
+typedef struct lembed_models_cursor lembed_models_cursor;
+struct lembed_models_cursor {
+  sqlite3_vtab_cursor base;
+  sqlite3_int64 iRowid;
+  // Whether the cursor stops after the row it's on, for rowid = or name =
+  int single;
+};
+
+static int lembed_modelsConnect(sqlite3 *db, void *pAux, int argc,
+                                const char *const *argv, sqlite3_vtab **ppVtab,
+                                char **pzErr) {
+  lembed_models_vtab *pNew;
+  int rc;
+  if (strcmp(argv[1], "temp") != 0) {
+    // return SQLITE_ERROR;
+  }
+#define LEMBED_MODELS_NAME            0
+#define LEMBED_MODELS_MODEL           1
+#define LEMBED_MODELS_MODEL_OPTIONS   2
+#define LEMBED_MODELS_CONTEXT_OPTIONS 3
+#define LEMBED_MODELS_MODEL_SIZE      4
+#define LEMBED_MODELS_LOAD_NS         5
+#define LEMBED_MODELS_RESIDENT_BYTES  6
+  rc = sqlite3_declare_vtab(db, "CREATE TABLE x(name, model, model_options "
+                                "hidden, context_options hidden, model_size, "
+                                "load_ns, resident_bytes)");
+  if (rc == SQLITE_OK) {
+    pNew = sqlite3_malloc(sizeof(*pNew));
+    *ppVtab = (sqlite3_vtab *)pNew;
+    if (pNew == 0)
+      return SQLITE_NOMEM;
+    memset(pNew, 0, sizeof(*pNew));
+    pNew->db = db;
+    pNew->api = pAux;
+  }
+  return rc;
+}
+
+static int lembed_modelsDisconnect(sqlite3_vtab *pVtab) {
+  lembed_models_vtab *p = (lembed_models_vtab *)pVtab;
+  // This runs before sqlite3_close() checks for unfinalized statements, and
+  // the models outlive it, until the registry is freed. Statements are
+  // prepared again if the models are still used.
+  for (int i = 0; i < p->api->n_models; i++) {
+    ApiModel *m = p->api->models[i];
+    if (m) {
+      sqlite3_finalize(m->cache_get);
+      sqlite3_finalize(m->cache_put);
+      m->cache_get = NULL;
+      m->cache_put = NULL;
+    }
+  }
+  sqlite3_free(p);
+  return SQLITE_OK;
+}
+
+#define POINTER_SUBTYPE 112
+
+// Sequences per llama_decode() call for batched embeddings (lembed_batch),
+// unless overridden with the n_seq_max context option.
+#define LEMBED_DEFAULT_N_SEQ_MAX 64
+
+/**
+ * Load a model from modelPath with the given options (either may be NULL),
+ * along with its contexts, cache and queue table, as a new ApiModel named
+ * name with one reference, for the caller.
+ */
+static int api_model_load(lembed_models_vtab *p, const char *key,
+                          const char *modelPath,
+                          lembed_model_options *modelOptions,
+                          lembed_context_options *contextOptions,
+                          ApiModel **out) {
+  sqlite3_vtab *pVTab = &p->base;
+  ApiModel *entry = sqlite3_malloc(sizeof(*entry));
+  if (!entry) {
+    return SQLITE_NOMEM;
+  }
+  memset(entry, 0, sizeof(*entry));
+  lembed_stats_reset(&entry->stats);
+  int64_t load_start = lembed_time_ns();
+  int64_t resident_start = lembed_resident_bytes();
+
+  struct llama_model *model;
+  struct llama_model_params mparams = llama_model_default_params();
+  if (modelOptions) {
+    if (modelOptions->defined[0]) {
+      mparams.n_gpu_layers = modelOptions->n_gpu_layers;
+    }
+    if (modelOptions->defined[1]) {
+      mparams.use_mmap = modelOptions->use_mmap;
+    }
+    if (modelOptions->defined[2]) {
+      mparams.use_mlock = modelOptions->use_mlock;
+    }
+    if (modelOptions->defined[3]) {
+      mparams.vocab_only = modelOptions->vocab_only;
+    }
+    if (modelOptions->defined[4] &&
+        numa_init(modelOptions->numa) != SQLITE_OK) {
+      pVTab->zErrMsg = sqlite3_mprintf(
+          "A different numa strategy is already in use, and it can only "
+          "be set once per process");
+      sqlite3_free(entry);
+      return SQLITE_ERROR;
+    }
+  }
+
+  model = shared_model_acquire(modelPath, mparams);
+  if (!model) {
+    sqlite3_free(entry);
+    return SQLITE_ERROR;
+  }
+
+  // Models loaded with vocab_only have no weights, so no contexts either,
+  // and can only be used for tokenizing
+  int n_parallel = mparams.vocab_only ? 0 : 1;
+  enum lembed_long_inputs long_inputs = LEMBED_LONG_INPUTS_ERROR;
+  int dimensions = llama_n_embd(model);
+  struct llama_context_params cparams = llama_context_default_params();
+  cparams.embeddings = 1;
+  cparams.n_seq_max = LEMBED_DEFAULT_N_SEQ_MAX;
+  if (contextOptions) {
+    if (contextOptions->defined[0]) {
+      cparams.seed = contextOptions->seed;
+    }
+    if (contextOptions->defined[1]) {
+      cparams.n_ctx = contextOptions->n_ctx;
+    }
+    if (contextOptions->defined[2]) {
+      cparams.rope_scaling_type = contextOptions->rope_scaling_type;
+    }
+    if (contextOptions->defined[3]) {
+      cparams.rope_freq_scale = contextOptions->rope_freq_scale;
+    }
+    if (contextOptions->defined[4]) {
+      cparams.n_batch = contextOptions->n_batch;
+    }
+    if (contextOptions->defined[5]) {
+      cparams.n_ubatch = contextOptions->n_ubatch;
+    }
+    if (contextOptions->defined[6]) {
+      cparams.n_seq_max = contextOptions->n_seq_max;
+    }
+    if (contextOptions->defined[7] && !mparams.vocab_only) {
+      n_parallel = contextOptions->n_parallel;
+    }
+    if (contextOptions->defined[10]) {
+      long_inputs = contextOptions->long_inputs;
+    }
+    if (contextOptions->defined[11]) {
+      if (contextOptions->output_dims > dimensions) {
+        pVTab->zErrMsg = sqlite3_mprintf(
+            "output_dims is %d, but the model only has %d dimensions",
+            contextOptions->output_dims, dimensions);
+        shared_model_release(model, 1);
+        sqlite3_free(entry);
+        return SQLITE_ERROR;
+      }
+      dimensions = contextOptions->output_dims;
+    }
+    if (contextOptions->defined[12]) {
+      cparams.pooling_type = contextOptions->pooling_type;
+    }
+    if (contextOptions->defined[16]) {
+      cparams.n_threads = contextOptions->n_threads;
+    }
+    if (contextOptions->defined[17]) {
+      cparams.n_threads_batch = contextOptions->n_threads_batch;
+    }
+  }
+
+  if (prefix_init(&entry->query_prefix, model,
+                  contextOptions ? contextOptions->query_prefix : NULL) !=
+          SQLITE_OK ||
+      prefix_init(&entry->document_prefix, model,
+                  contextOptions ? contextOptions->document_prefix : NULL) !=
+          SQLITE_OK) {
+    prefix_clear(&entry->query_prefix);
+    prefix_clear(&entry->document_prefix);
+    shared_model_release(model, 1);
+    sqlite3_free(entry);
+    return SQLITE_NOMEM;
+  }
+
+  ApiContext *contexts = NULL;
+  if (n_parallel > 0) {
+    contexts = sqlite3_malloc(sizeof(ApiContext) * n_parallel);
+    if (!contexts) {
+      prefix_clear(&entry->query_prefix);
+      prefix_clear(&entry->document_prefix);
+      shared_model_release(model, 1);
+      sqlite3_free(entry);
+      return SQLITE_NOMEM;
+    }
+    memset(contexts, 0, sizeof(ApiContext) * n_parallel);
+  }
+  for (int i = 0; i < n_parallel; i++) {
+    int rc = api_context_init(&contexts[i], model, cparams, long_inputs,
+                              dimensions, &entry->stats);
+    if (rc != SQLITE_OK) {
+      for (int j = 0; j <= i; j++) {
+        api_context_free(&contexts[j]);
+      }
+      sqlite3_free(contexts);
+      prefix_clear(&entry->query_prefix);
+      prefix_clear(&entry->document_prefix);
+      shared_model_release(model, 1);
+      sqlite3_free(entry);
+      return rc;
+    }
+    contexts[i].next_free = i + 1 < n_parallel ? &contexts[i + 1] : NULL;
+    if (contextOptions && contextOptions->defined[18]) {
+      contexts[i].cpu_mask = &entry->cpu_mask;
+    }
+  }
+
+  int rc = SQLITE_OK;
+  lembed_cache *cache = NULL;
+  char *cache_table = NULL;
+  if (contextOptions &&
+      (contextOptions->defined[8] || contextOptions->defined[9])) {
+    cache = lembed_cache_new(contextOptions->cache_size);
+    if (!cache) {
+      rc = SQLITE_NOMEM;
+    }
+    if (rc == SQLITE_OK && contextOptions->defined[9]) {
+      cache_table = cache_table_identifier(contextOptions->cache_table);
+      rc = cache_table ? cache_table_create(p->db, cache_table)
+                       : SQLITE_NOMEM;
+      if (rc != SQLITE_OK) {
+        pVTab->zErrMsg = sqlite3_mprintf(
+            "Could not create cache table %s: %s",
+            contextOptions->cache_table, sqlite3_errmsg(p->db));
+      }
+    }
+  }
+  char *queue_db_path = NULL;
+  char *queue_table = NULL;
+  if (rc == SQLITE_OK && contextOptions && contextOptions->defined[15]) {
+    rc = queue_table_init(p->db, contextOptions->queue_table, &queue_db_path,
+                          &queue_table, &pVTab->zErrMsg);
+  }
+  if (rc != SQLITE_OK) {
+    lembed_cache_free(cache);
+    sqlite3_free(cache_table);
+    for (int i = 0; i < n_parallel; i++) {
+      api_context_free(&contexts[i]);
+    }
+    sqlite3_free(contexts);
+    prefix_clear(&entry->query_prefix);
+    prefix_clear(&entry->document_prefix);
+    shared_model_release(model, 1);
+    sqlite3_free(entry);
+    return rc;
+  }
+
+  entry->refcount = 1;
+  entry->name = sqlite3_mprintf("%s", key);
+  entry->model_path = sqlite3_mprintf("%s", modelPath);
+  if (modelOptions) {
+    entry->model_options = sqlite3_malloc(sizeof(*modelOptions));
+    if (entry->model_options) {
+      *entry->model_options = *modelOptions;
+    }
+  }
+  if (contextOptions) {
+    entry->context_options = lembed_context_options_dup(contextOptions);
+  }
+  entry->cache = cache;
+  entry->cache_table = cache_table;
+  entry->queue = NULL;
+  entry->queue_db_path = queue_db_path;
+  entry->queue_table = queue_table;
+  entry->queue_results_max = contextOptions && contextOptions->defined[21]
+                                 ? contextOptions->queue_results_max
+                                 : LEMBED_QUEUE_RESULTS_MAX;
+  entry->model = model;
+  entry->long_inputs = long_inputs;
+  entry->reranker =
+      contexts && contexts[0].pooling == LLAMA_POOLING_TYPE_RANK;
+  entry->dimensions = entry->reranker ? 1 : dimensions;
+  if (contextOptions && contextOptions->defined[18]) {
+    entry->cpu_mask = contextOptions->cpu_mask;
+  }
+  entry->n_contexts = n_parallel;
+  entry->contexts = contexts;
+  entry->free_contexts = contexts;
+  lembed_mutex_init(&entry->lock);
+  lembed_cond_init(&entry->context_available);
+  if (contexts) {
+    batch_capacity(contexts[0].context, &entry->n_tokens_max,
+                   &entry->n_seq_max);
+  } else {
+    // What lembed_chunks() sizes chunks by
+    entry->n_tokens_max =
+        cparams.n_ctx ? (int)cparams.n_ctx : llama_n_ctx_train(model);
+    entry->n_seq_max = 1;
+  }
+  if (cache_table &&
+      cache_model_seed(modelPath, &cparams,
+                       contexts ? contexts[0].pooling : cparams.pooling_type,
+                       entry->dimensions, long_inputs, entry->n_tokens_max,
+                       entry->cache_seed) != SQLITE_OK) {
+    api_model_free(entry);
+    return SQLITE_NOMEM;
+  }
+  // A window of 0 doesn't wait for anyone, so there's nothing to coalesce.
+  // Rerankers can't be used with lembed() at all.
+  int coalesce = contextOptions && contextOptions->defined[19] &&
+                 contextOptions->coalesce_ms > 0 && contexts &&
+                 !entry->reranker;
+  if (coalesce) {
+    int max_sequences = entry->n_seq_max;
+    if (contextOptions->defined[20] &&
+        contextOptions->coalesce_max < max_sequences) {
+      max_sequences = contextOptions->coalesce_max;
+    }
+    entry->coalescer = coalescer_acquire(
+        model, cparams, entry->dimensions,
+        (int64_t)(contextOptions->coalesce_ms * 1e6), max_sequences);
+  }
+  lembed_stats_record(&entry->stats, LEMBED_STAGE_LOAD, load_start, 0, 0);
+  entry->load_ns = lembed_time_ns() - load_start;
+  int64_t resident_end = lembed_resident_bytes();
+  entry->resident_bytes = resident_start >= 0 && resident_end >= 0
+                              ? resident_end - resident_start
+                              : -1;
+  if (!entry->name || !entry->model_path ||
+      (modelOptions && !entry->model_options) ||
+      (contextOptions && !entry->context_options) ||
+      (coalesce && !entry->coalescer)) {
+    api_model_free(entry);
+    return SQLITE_NOMEM;
+  }
+  *out = entry;
+  return SQLITE_OK;
+}
+
+/**
+ * INSERT registers a model, DELETE unregisters one, and UPDATE swaps a model
+ * for a new one loaded with the updated columns, keeping the rest. Cursors
+ * that are still using a deleted or replaced model keep it until they're done,
+ * and its queued jobs are embedded in the background. Its weights are freed
+ * after that, unless another model or connection uses them.
+ */
+static int lembed_modelsUpdate(sqlite3_vtab *pVTab, int argc,
+                               sqlite3_value **argv, sqlite_int64 *pRowid) {
+  lembed_models_vtab *p = (lembed_models_vtab *)pVTab;
+  api_models_reap(p->api, 0);
+  // DELETE operation
+  if (argc == 1) {
+    ApiModel *m = api_model_at(p->api, sqlite3_value_int64(argv[0]));
+    if (m) {
+      m->evict = 1;
+    }
+    api_model_unregister(p->api, sqlite3_value_int64(argv[0]));
+    return SQLITE_OK;
+  }
+
+  ApiModel *old = NULL;
+  if (sqlite3_value_type(argv[0]) != SQLITE_NULL) {
+    old = api_model_at(p->api, sqlite3_value_int64(argv[0]));
+    if (!old) {
+      return SQLITE_OK;
+    }
+    if (sqlite3_value_int64(argv[0]) != sqlite3_value_int64(argv[1])) {
+      pVTab->zErrMsg =
+          sqlite3_mprintf("The rowid of a lembed_models row can't be changed");
+      return SQLITE_ERROR;
+    }
+  }
+
+  // Columns an UPDATE doesn't set are unchanged, and come from old
+  sqlite3_value **columnValues = &argv[2];
+  const char *key =
+      (const char *)sqlite3_value_text(columnValues[LEMBED_MODELS_NAME]);
+  if (old && sqlite3_value_nochange(columnValues[LEMBED_MODELS_NAME])) {
+    key = old->name;
+  }
+  if (!key) {
+    pVTab->zErrMsg = sqlite3_mprintf("lembed_models needs a name for the model");
+    return SQLITE_ERROR;
+  }
+  struct llama_model *existing;
+  ApiModel *other;
+  if (api_model_from_name(p->api, key, strlen(key), &existing, &other) ==
+          SQLITE_OK &&
+      other != old) {
+    pVTab->zErrMsg = sqlite3_mprintf(
+        "Model '%s' is already registered. UPDATE its row in lembed_models to "
+        "swap in a new model",
+        key);
+    return SQLITE_ERROR;
+  }
+
+  sqlite3_value *modelValue = columnValues[LEMBED_MODELS_MODEL];
+  const char *modelPath =
+      sqlite3_value_pointer(modelValue, POINTER_NAME_MODEL_PATH);
+  if (!modelPath && old &&
+      (sqlite3_value_nochange(modelValue) ||
+       sqlite3_value_pointer(modelValue, POINTER_NAME_MODEL) == old->model)) {
+    modelPath = old->model_path;
+  }
+  if (!modelPath) {
+    pVTab->zErrMsg = sqlite3_mprintf(
+        "The model of lembed_models must come from lembed_model_from_file()");
+    return SQLITE_ERROR;
+  }
+
+  lembed_model_options *modelOptions = NULL;
+  if (old && sqlite3_value_nochange(columnValues[LEMBED_MODELS_MODEL_OPTIONS])) {
+    modelOptions = old->model_options;
+  } else if (sqlite3_value_subtype(columnValues[LEMBED_MODELS_MODEL_OPTIONS]) ==
+             POINTER_SUBTYPE) {
+    modelOptions =
+        sqlite3_value_pointer(columnValues[LEMBED_MODELS_MODEL_OPTIONS],
+                              POINTER_NAME_MODEL_OPTIONS);
+  }
+
+  lembed_context_options *contextOptions = NULL;
+  if (old &&
+      sqlite3_value_nochange(columnValues[LEMBED_MODELS_CONTEXT_OPTIONS])) {
+    contextOptions = old->context_options;
+  } else if (sqlite3_value_subtype(
+                 columnValues[LEMBED_MODELS_CONTEXT_OPTIONS]) ==
+             POINTER_SUBTYPE) {
+    contextOptions =
+        sqlite3_value_pointer(columnValues[LEMBED_MODELS_CONTEXT_OPTIONS],
+                              POINTER_NAME_CONTEXT_OPTIONS);
+  }
+
+  ApiModel *entry;
+  int rc = api_model_load(p, key, modelPath, modelOptions, contextOptions,
+                          &entry);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  // UPDATE operation
+  if (old) {
+    api_model_replace(p->api, sqlite3_value_int64(argv[0]), entry);
+    return SQLITE_OK;
+  }
+  // INSERT operation
+  rc = api_model_register(p->api, entry, pRowid);
+  if (rc != SQLITE_OK) {
+    api_model_release(entry);
+  }
+  return rc;
+}
+
+static int lembed_modelsOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  lembed_models_cursor *pCur;
+  pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == 0)
+    return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
+
+static int lembed_modelsClose(sqlite3_vtab_cursor *cur) {
+  lembed_models_cursor *pCur = (lembed_models_cursor *)cur;
+  sqlite3_free(pCur);
+  return SQLITE_OK;
+}
+
+enum lembed_models_idx {
+  LEMBED_MODELS_IDX_SCAN = 1,
+  LEMBED_MODELS_IDX_ROWID = 2,
+  LEMBED_MODELS_IDX_NAME = 3,
+};
+
+/**
+ * rowid = and name = constraints find a single row, which is flagged with
+ * SQLITE_INDEX_SCAN_UNIQUE so UPDATEs are done in one pass. Otherwise SQLite
+ * runs UPDATEs through an ephemeral table, where the pointer values of
+ * lembed_model_from_file() and lembed_context_options() are lost.
+ */
+static int lembed_modelsBestIndex(sqlite3_vtab *pVTab,
+                                  sqlite3_index_info *pIdxInfo) {
+  UNUSED_PARAMETER(pVTab);
+  int iRowid = -1;
+  int iName = -1;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    const struct sqlite3_index_constraint *c = &pIdxInfo->aConstraint[i];
+    if (!c->usable || c->op != SQLITE_INDEX_CONSTRAINT_EQ) {
+      continue;
+    }
+    if (c->iColumn == -1) {
+      iRowid = i;
+    } else if (c->iColumn == LEMBED_MODELS_NAME) {
+      iName = i;
+    }
+  }
+  int i = iRowid >= 0 ? iRowid : iName;
+  if (i < 0) {
+    pIdxInfo->idxNum = LEMBED_MODELS_IDX_SCAN;
+    pIdxInfo->estimatedCost = (double)10;
+    pIdxInfo->estimatedRows = 10;
+    return SQLITE_OK;
+  }
+  pIdxInfo->idxNum =
+      iRowid >= 0 ? LEMBED_MODELS_IDX_ROWID : LEMBED_MODELS_IDX_NAME;
+  pIdxInfo->aConstraintUsage[i].argvIndex = 1;
+  pIdxInfo->aConstraintUsage[i].omit = 1;
+  pIdxInfo->estimatedCost = (double)1;
+  pIdxInfo->estimatedRows = 1;
+  pIdxInfo->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+  return SQLITE_OK;
+}
+
+static int lembed_modelsNext(sqlite3_vtab_cursor *cur);
+static int lembed_modelsFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                               const char *idxStr, int argc,
+                               sqlite3_value **argv) {
+  lembed_models_cursor *pCur = (lembed_models_cursor *)pVtabCursor;
+  struct Api *api = ((lembed_models_vtab *)pVtabCursor->pVtab)->api;
+  pCur->single = idxNum != LEMBED_MODELS_IDX_SCAN;
+  if (idxNum == LEMBED_MODELS_IDX_ROWID) {
+    pCur->iRowid = sqlite3_value_int64(argv[0]);
+    if (!api_model_at(api, pCur->iRowid)) {
+      pCur->iRowid = api->n_models;
+    }
+    return SQLITE_OK;
+  }
+  if (idxNum == LEMBED_MODELS_IDX_NAME) {
+    pCur->iRowid = api->n_models;
+    struct llama_model *model;
+    ApiModel *entry;
+    const char *name = (const char *)sqlite3_value_text(argv[0]);
+    if (name && api_model_from_name(api, name, sqlite3_value_bytes(argv[0]),
+                                    &model, &entry) == SQLITE_OK) {
+      for (int i = 0; i < api->n_models; i++) {
+        if (api->models[i] == entry) {
+          pCur->iRowid = i;
+          break;
+        }
+      }
+    }
+    return SQLITE_OK;
+  }
+  pCur->iRowid = -1;
+  lembed_modelsNext(pVtabCursor);
+  return SQLITE_OK;
+}
+
+static int lembed_modelsRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  lembed_models_cursor *pCur = (lembed_models_cursor *)cur;
+  *pRowid = pCur->iRowid;
+  return SQLITE_OK;
+}
+
+static int lembed_modelsNext(sqlite3_vtab_cursor *cur) {
+  lembed_models_cursor *pCur = (lembed_models_cursor *)cur;
+  lembed_models_vtab *p = (lembed_models_vtab *)pCur->base.pVtab;
+  if (pCur->single) {
+    pCur->iRowid = p->api->n_models;
+    return SQLITE_OK;
+  }
+  pCur->iRowid++;
+  while (pCur->iRowid < p->api->n_models) {
+    if (p->api->models[pCur->iRowid]) {
+      return SQLITE_OK;
+    }
+    pCur->iRowid++;
+  }
+  return SQLITE_OK;
+}
+
+static int lembed_modelsEof(sqlite3_vtab_cursor *cur) {
+  lembed_models_cursor *pCur = (lembed_models_cursor *)cur;
+  lembed_models_vtab *p = (lembed_models_vtab *)cur->pVtab;
+  return pCur->iRowid >= p->api->n_models;
+}
+
+static int lembed_modelsColumn(sqlite3_vtab_cursor *cur,
+                               sqlite3_context *context, int i) {
+  lembed_models_cursor *pCur = (lembed_models_cursor *)cur;
+  lembed_models_vtab *p = (lembed_models_vtab *)cur->pVtab;
+  ApiModel *m = api_model_at(p->api, pCur->iRowid);
+  // Columns an UPDATE doesn't set are left alone, see lembed_modelsUpdate()
+  if (!m || sqlite3_vtab_nochange(context)) {
+    return SQLITE_OK;
+  }
+  switch (i) {
+  case LEMBED_MODELS_NAME:
+    sqlite3_result_text(context, m->name, -1, SQLITE_TRANSIENT);
+    break;
+  case LEMBED_MODELS_MODEL:
+    sqlite3_result_pointer(context, m->model, POINTER_NAME_MODEL, NULL);
+    break;
+  case LEMBED_MODELS_MODEL_SIZE:
+    sqlite3_result_int64(context, llama_model_size(m->model));
+    break;
+  case LEMBED_MODELS_LOAD_NS:
+    sqlite3_result_int64(context, m->load_ns);
+    break;
+  case LEMBED_MODELS_RESIDENT_BYTES:
+    if (m->resident_bytes >= 0) {
+      sqlite3_result_int64(context, m->resident_bytes);
+    }
+    break;
+  }
+  return SQLITE_OK;
+}
+
+static sqlite3_module lembed_modelsModule = {
+    /* iVersion    */ 3,
+    /* xCreate     */ 0,
+    /* xConnect    */ lembed_modelsConnect,
+    /* xBestIndex  */ lembed_modelsBestIndex,
+    /* xDisconnect */ lembed_modelsDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ lembed_modelsOpen,
+    /* xClose      */ lembed_modelsClose,
+    /* xFilter     */ lembed_modelsFilter,
+    /* xNext       */ lembed_modelsNext,
+    /* xEof        */ lembed_modelsEof,
+    /* xColumn     */ lembed_modelsColumn,
+    /* xRowid      */ lembed_modelsRowid,
+    /* xUpdate     */ lembed_modelsUpdate,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+#pragma endregion
+
+#pragma region lembed_stats() table function
+
+/*
+ * One row per registered model and stage of embedding, with the counters and
+ * latency percentiles collected in the model's lembed_stats.
+ */
+typedef struct lembed_stats_vtab lembed_stats_vtab;
+struct lembed_stats_vtab {
+  sqlite3_vtab base;
+  struct Api *api;
+};
+
+typedef struct lembed_stats_cursor lembed_stats_cursor;
+struct lembed_stats_cursor {
+  sqlite3_vtab_cursor base;
+  // model index * LEMBED_STAGE_COUNT + stage
+  sqlite3_int64 iRowid;
+};
+
+static int lembed_statsConnect(sqlite3 *db, void *pAux, int argc,
+                               const char *const *argv, sqlite3_vtab **ppVtab,
+                               char **pzErr) {
+#define LEMBED_STATS_MODEL 0
+#define LEMBED_STATS_STAGE 1
+#define LEMBED_STATS_CALLS 2
+#define LEMBED_STATS_TOKENS 3
+#define LEMBED_STATS_ERRORS 4
+#define LEMBED_STATS_TOTAL_NS 5
+#define LEMBED_STATS_AVG_NS 6
+#define LEMBED_STATS_P50_NS 7
+#define LEMBED_STATS_P99_NS 8
+  int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(model, stage, calls, "
+                                    "tokens, errors, total_ns, avg_ns, "
+                                    "p50_ns, p99_ns)");
+  if (rc == SQLITE_OK) {
+    lembed_stats_vtab *pNew = sqlite3_malloc(sizeof(*pNew));
+    *ppVtab = (sqlite3_vtab *)pNew;
+    if (pNew == 0)
+      return SQLITE_NOMEM;
+    memset(pNew, 0, sizeof(*pNew));
+    pNew->api = pAux;
+  }
+  return rc;
+}
+
+static int lembed_statsDisconnect(sqlite3_vtab *pVtab) {
+  sqlite3_free(pVtab);
+  return SQLITE_OK;
+}
+
+static int lembed_statsOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  lembed_stats_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == 0)
+    return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
+
+static int lembed_statsClose(sqlite3_vtab_cursor *cur) {
+  sqlite3_free(cur);
+  return SQLITE_OK;
+}
+
+static int lembed_statsBestIndex(sqlite3_vtab *pVTab,
+                                 sqlite3_index_info *pIdxInfo) {
+  struct Api *api = ((lembed_stats_vtab *)pVTab)->api;
+  pIdxInfo->estimatedCost = (double)LEMBED_STAGE_COUNT * api->n_registered;
+  pIdxInfo->estimatedRows = LEMBED_STAGE_COUNT * api->n_registered;
+  return SQLITE_OK;
+}
+
+static int lembed_statsNext(sqlite3_vtab_cursor *cur) {
+  lembed_stats_cursor *pCur = (lembed_stats_cursor *)cur;
+  lembed_stats_vtab *p = (lembed_stats_vtab *)cur->pVtab;
+  pCur->iRowid++;
+  while (pCur->iRowid < (sqlite3_int64)p->api->n_models * LEMBED_STAGE_COUNT &&
+         !p->api->models[pCur->iRowid / LEMBED_STAGE_COUNT]) {
+    pCur->iRowid += LEMBED_STAGE_COUNT;
+    pCur->iRowid -= pCur->iRowid % LEMBED_STAGE_COUNT;
+  }
+  return SQLITE_OK;
+}
+
+static int lembed_statsFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                              const char *idxStr, int argc,
+                              sqlite3_value **argv) {
+  lembed_stats_cursor *pCur = (lembed_stats_cursor *)pVtabCursor;
+  pCur->iRowid = -1;
+  return lembed_statsNext(pVtabCursor);
+}
+
+static int lembed_statsEof(sqlite3_vtab_cursor *cur) {
+  lembed_stats_cursor *pCur = (lembed_stats_cursor *)cur;
+  lembed_stats_vtab *p = (lembed_stats_vtab *)cur->pVtab;
+  return pCur->iRowid >= (sqlite3_int64)p->api->n_models * LEMBED_STAGE_COUNT;
+}
+
+static int lembed_statsRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  lembed_stats_cursor *pCur = (lembed_stats_cursor *)cur;
+  *pRowid = pCur->iRowid;
+  return SQLITE_OK;
+}
+
+static int lembed_statsColumn(sqlite3_vtab_cursor *cur,
+                              sqlite3_context *context, int i) {
+  lembed_stats_cursor *pCur = (lembed_stats_cursor *)cur;
+  lembed_stats_vtab *p = (lembed_stats_vtab *)cur->pVtab;
+  ApiModel *entry = api_model_at(p->api, pCur->iRowid / LEMBED_STAGE_COUNT);
+  if (!entry) {
+    return SQLITE_OK;
+  }
+  int stage = pCur->iRowid % LEMBED_STAGE_COUNT;
+  lembed_stage_stats *s = &entry->stats.stages[stage];
+  switch (i) {
+  case LEMBED_STATS_MODEL:
+    sqlite3_result_text(context, entry->name, -1, SQLITE_TRANSIENT);
+    break;
+  case LEMBED_STATS_STAGE:
+    sqlite3_result_text(context, LEMBED_STAGE_NAMES[stage], -1,
+                        SQLITE_STATIC);
+    break;
+  case LEMBED_STATS_CALLS:
+    sqlite3_result_int64(context, lembed_atomic_load(&s->calls));
+    break;
+  case LEMBED_STATS_TOKENS:
+    sqlite3_result_int64(context, lembed_atomic_load(&s->tokens));
+    break;
+  case LEMBED_STATS_ERRORS:
+    sqlite3_result_int64(context, lembed_atomic_load(&s->errors));
+    break;
+  case LEMBED_STATS_TOTAL_NS:
+    sqlite3_result_int64(context, lembed_atomic_load(&s->total_ns));
+    break;
+  case LEMBED_STATS_AVG_NS: {
+    int64_t calls = lembed_atomic_load(&s->calls);
+    if (calls) {
+      sqlite3_result_int64(context, lembed_atomic_load(&s->total_ns) / calls);
+    } else {
+      sqlite3_result_null(context);
+    }
+    break;
+  }
+  case LEMBED_STATS_P50_NS:
+  case LEMBED_STATS_P99_NS: {
+    if (lembed_atomic_load(&s->calls)) {
+      sqlite3_result_int64(
+          context,
+          lembed_stats_percentile(s, i == LEMBED_STATS_P50_NS ? 0.5 : 0.99));
+    } else {
+      sqlite3_result_null(context);
+    }
+    break;
+  }
+  }
+  return SQLITE_OK;
+}
+
+static sqlite3_module lembed_statsModule = {
+    /* iVersion    */ 3,
+    /* xCreate     */ 0,
+    /* xConnect    */ lembed_statsConnect,
+    /* xBestIndex  */ lembed_statsBestIndex,
+    /* xDisconnect */ lembed_statsDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ lembed_statsOpen,
+    /* xClose      */ lembed_statsClose,
+    /* xFilter     */ lembed_statsFilter,
+    /* xNext       */ lembed_statsNext,
+    /* xEof        */ lembed_statsEof,
+    /* xColumn     */ lembed_statsColumn,
+    /* xRowid      */ lembed_statsRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+
+/** lembed_stats_reset([name]): zero the stats of one or every model. */
+static void lembed_stats_reset_(sqlite3_context *context, int argc,
+                                sqlite3_value **argv) {
+  struct Api *api = (struct Api *)sqlite3_user_data(context);
+  if (argc == 0) {
+    for (int i = 0; i < api->n_models; i++) {
+      if (api->models[i]) {
+        lembed_stats_reset(&api->models[i]->stats);
+      }
+    }
+    return;
+  }
+  struct llama_model *model;
+  ApiModel *entry;
+  int rc = api_model_from_name(api, (const char *)sqlite3_value_text(argv[0]),
+                               sqlite3_value_bytes(argv[0]), &model, &entry);
+  if (rc != SQLITE_OK) {
+    char *zErr = sqlite3_mprintf(
+        "Unknown model name '%s'. Was it registered with lembed_models?",
+        sqlite3_value_text(argv[0]));
+    sqlite3_result_error(context, zErr, -1);
+    sqlite3_free(zErr);
+    return;
+  }
+  lembed_stats_reset(&entry->stats);
+}
+
+#pragma endregion
+
+#pragma region lembed_results() table function
+
+/*
+ * Finished lembed_enqueue() jobs that weren't written to a queue_table, along
+ * with jobs that failed, on every model. Rows stay until they're deleted:
+ *
+ *   INSERT INTO doc_embeddings(id, embedding)
+ *     SELECT key, embedding FROM lembed_results WHERE error IS NULL;
+ *   DELETE FROM lembed_results;
+ *
+ * Workers keep adding rows in the background, so every scan reads a snapshot
+ * of the results, taken when it starts. Results don't change once they're
+ * finished, so the snapshot only references them, and keeps their model.
+ */
+typedef struct lembed_results_vtab lembed_results_vtab;
+struct lembed_results_vtab {
+  sqlite3_vtab base;
+  struct Api *api;
+};
+
+typedef struct lembed_results_row lembed_results_row;
+struct lembed_results_row {
+  ApiModel *model;
+  lembed_job *job;
+};
+
+typedef struct lembed_results_cursor lembed_results_cursor;
+struct lembed_results_cursor {
+  sqlite3_vtab_cursor base;
+  lembed_results_row *rows;
+  int n_rows;
+  int iRow;
+};
+
+static int lembed_resultsConnect(sqlite3 *db, void *pAux, int argc,
+                                 const char *const *argv,
+                                 sqlite3_vtab **ppVtab, char **pzErr) {
+#define LEMBED_RESULTS_MODEL 0
+#define LEMBED_RESULTS_KEY 1
+#define LEMBED_RESULTS_EMBEDDING 2
+#define LEMBED_RESULTS_ERROR 3
+  int rc = sqlite3_declare_vtab(db,
+                                "CREATE TABLE x(model, key, embedding, error)");
+  if (rc == SQLITE_OK) {
+    lembed_results_vtab *pNew = sqlite3_malloc(sizeof(*pNew));
+    *ppVtab = (sqlite3_vtab *)pNew;
+    if (pNew == 0)
+      return SQLITE_NOMEM;
+    memset(pNew, 0, sizeof(*pNew));
+    pNew->api = pAux;
+  }
+  return rc;
+}
+
+static int lembed_resultsDisconnect(sqlite3_vtab *pVtab) {
+  sqlite3_free(pVtab);
+  return SQLITE_OK;
+}
+
+static int lembed_resultsOpen(sqlite3_vtab *p,
+                              sqlite3_vtab_cursor **ppCursor) {
+  lembed_results_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == 0)
+    return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
+
+static void lembed_resultsClear(lembed_results_cursor *pCur) {
+  for (int i = 0; i < pCur->n_rows; i++) {
+    lembed_results_row *row = &pCur->rows[i];
+    lembed_queue *q = row->model->queue;
+    lembed_mutex_lock(&q->lock);
+    lembed_result_unref(row->job);
+    lembed_mutex_unlock(&q->lock);
+    api_model_release(row->model);
+  }
+  sqlite3_free(pCur->rows);
+  pCur->rows = NULL;
+  pCur->n_rows = 0;
+  pCur->iRow = 0;
+}
+
+static int lembed_resultsClose(sqlite3_vtab_cursor *cur) {
+  lembed_results_cursor *pCur = (lembed_results_cursor *)cur;
+  lembed_resultsClear(pCur);
+  sqlite3_free(pCur);
+  return SQLITE_OK;
+}
+
+static int lembed_resultsBestIndex(sqlite3_vtab *pVTab,
+                                   sqlite3_index_info *pIdxInfo) {
+  pIdxInfo->estimatedCost = (double)1000;
+  pIdxInfo->estimatedRows = 1000;
+  return SQLITE_OK;
+}
+
+/** Append the results of the queue of m to the rows of pCur. */
+static int lembed_resultsSnapshot(lembed_results_cursor *pCur, ApiModel *m) {
+  lembed_queue *q = m->queue;
+  lembed_mutex_lock(&q->lock);
+  if (q->n_results == 0) {
+    lembed_mutex_unlock(&q->lock);
+    return SQLITE_OK;
+  }
+  lembed_results_row *rows = sqlite3_realloc64(
+      pCur->rows, sizeof(lembed_results_row) * (pCur->n_rows + q->n_results));
+  if (!rows) {
+    lembed_mutex_unlock(&q->lock);
+    return SQLITE_NOMEM;
+  }
+  pCur->rows = rows;
+  for (lembed_job *job = q->results; job; job = job->next) {
+    lembed_results_row *row = &pCur->rows[pCur->n_rows++];
+    row->model = api_model_retain(m);
+    row->job = job;
+    job->refcount++;
+  }
+  lembed_mutex_unlock(&q->lock);
+  return SQLITE_OK;
+}
+
+static int lembed_resultsFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                                const char *idxStr, int argc,
+                                sqlite3_value **argv) {
+  lembed_results_cursor *pCur = (lembed_results_cursor *)pVtabCursor;
+  lembed_results_vtab *p = (lembed_results_vtab *)pVtabCursor->pVtab;
+  lembed_resultsClear(pCur);
+  for (int i = 0; i < p->api->n_models; i++) {
+    ApiModel *m = p->api->models[i];
+    if (!m || !m->queue) {
+      continue;
+    }
+    int rc = lembed_resultsSnapshot(pCur, m);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+  return SQLITE_OK;
+}
+
+static int lembed_resultsNext(sqlite3_vtab_cursor *cur) {
+  lembed_results_cursor *pCur = (lembed_results_cursor *)cur;
+  pCur->iRow++;
+  return SQLITE_OK;
+}
+
+static int lembed_resultsEof(sqlite3_vtab_cursor *cur) {
+  lembed_results_cursor *pCur = (lembed_results_cursor *)cur;
+  return pCur->iRow >= pCur->n_rows;
+}
+
+static int lembed_resultsRowid(sqlite3_vtab_cursor *cur,
+                               sqlite_int64 *pRowid) {
+  lembed_results_cursor *pCur = (lembed_results_cursor *)cur;
+  *pRowid = pCur->rows[pCur->iRow].job->id;
+  return SQLITE_OK;
+}
+
+static int lembed_resultsColumn(sqlite3_vtab_cursor *cur,
+                                sqlite3_context *context, int i) {
+  lembed_results_cursor *pCur = (lembed_results_cursor *)cur;
+  lembed_results_row *row = &pCur->rows[pCur->iRow];
+  lembed_job *job = row->job;
+  switch (i) {
+  case LEMBED_RESULTS_MODEL:
+    sqlite3_result_text(context, row->model->name, -1, SQLITE_TRANSIENT);
+    break;
+  case LEMBED_RESULTS_KEY:
+    sqlite3_result_value(context, job->key);
+    break;
+  case LEMBED_RESULTS_EMBEDDING:
+    if (job->embedding) {
+      sqlite3_result_blob(context, job->embedding,
+                          sizeof(float) * row->model->dimensions,
+                          SQLITE_TRANSIENT);
+      sqlite3_result_subtype(context, LEMBED_FLOAT32_SUBTYPE);
+    }
+    break;
+  case LEMBED_RESULTS_ERROR:
+    if (job->error) {
+      sqlite3_result_text(context, job->error, -1, SQLITE_TRANSIENT);
+    }
+    break;
+  }
+  return SQLITE_OK;
+}
+
+/** Only DELETE is supported, to drop results once they've been read. */
+static int lembed_resultsUpdate(sqlite3_vtab *pVTab, int argc,
+                                sqlite3_value **argv, sqlite_int64 *pRowid) {
+  lembed_results_vtab *p = (lembed_results_vtab *)pVTab;
+  if (argc != 1) {
+    pVTab->zErrMsg = sqlite3_mprintf("lembed_results only supports DELETE");
+    return SQLITE_ERROR;
+  }
+  sqlite3_int64 id = sqlite3_value_int64(argv[0]);
+  for (int i = 0; i < p->api->n_models; i++) {
+    ApiModel *m = p->api->models[i];
+    lembed_queue *q = m ? m->queue : NULL;
+    if (!q) {
+      continue;
+    }
+    lembed_mutex_lock(&q->lock);
+    for (lembed_job **pp = &q->results; *pp; pp = &(*pp)->next) {
+      if ((*pp)->id != id) {
+        continue;
+      }
+      // Freed once open scans are done with it
+      lembed_queue_remove_result(q, pp);
+      lembed_mutex_unlock(&q->lock);
+      return SQLITE_OK;
+    }
+    lembed_mutex_unlock(&q->lock);
+  }
+  return SQLITE_OK;
+}
+
+static sqlite3_module lembed_resultsModule = {
+    /* iVersion    */ 3,
+    /* xCreate     */ 0,
+    /* xConnect    */ lembed_resultsConnect,
+    /* xBestIndex  */ lembed_resultsBestIndex,
+    /* xDisconnect */ lembed_resultsDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ lembed_resultsOpen,
+    /* xClose      */ lembed_resultsClose,
+    /* xFilter     */ lembed_resultsFilter,
+    /* xNext       */ lembed_resultsNext,
+    /* xEof        */ lembed_resultsEof,
+    /* xColumn     */ lembed_resultsColumn,
+    /* xRowid      */ lembed_resultsRowid,
+    /* xUpdate     */ lembed_resultsUpdate,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+#pragma endregion
+
+#pragma region lembed_sync virtual table
+
+/*
+ * An embeddings table that's kept in step with a text column of a source
+ * table, on demand:
+ *
+ *   CREATE VIRTUAL TABLE doc_embeddings USING lembed_sync(
+ *     source=docs, column=body, model=all-MiniLM-L6-v2
+ *   );
+ *   INSERT INTO doc_embeddings(doc_embeddings) VALUES ('sync');
+ *   SELECT rowid, embedding FROM doc_embeddings;
+ *
+ * Embeddings are kept in the <name>_embeddings shadow table, keyed by source
+ * rowid, along with a hash of the text they were made from. Triggers on the
+ * source record the rowids of inserted, updated and deleted rows in
+ * <name>_dirty, which is all a writer pays. A 'sync' only visits those rows,
+ * embeds the ones whose text is new or different and drops the embeddings of
+ * deleted ones, so it costs the churn rather than a scan of the source.
+ * 'rebuild' scans and embeds every row again, say after the model's weights
+ * changed.
+ */
+#define LEMBED_SYNC_EMBEDDING 0
+#define LEMBED_SYNC_COMMAND 1
+
+typedef struct lembed_sync_vtab lembed_sync_vtab;
+struct lembed_sync_vtab {
+  sqlite3_vtab base;
+  sqlite3 *db;
+  struct Api *api;
+  char *schema;
+  char *name;
+  // Options from CREATE VIRTUAL TABLE
+  char *source;
+  char *column;
+  char *model;
+};
+
+typedef struct lembed_sync_cursor lembed_sync_cursor;
+struct lembed_sync_cursor {
+  sqlite3_vtab_cursor base;
+  sqlite3_stmt *stmt;
+  int eof;
+};
+
+static void lembed_sync_vtab_free(lembed_sync_vtab *p) {
+  sqlite3_free(p->schema);
+  sqlite3_free(p->name);
+  sqlite3_free(p->source);
+  sqlite3_free(p->column);
+  sqlite3_free(p->model);
+  sqlite3_free(p);
+}
+
+/**
+ * Split a "key=value" module argument into its key and value, without
+ * surrounding whitespace or quotes. Both are to be freed with sqlite3_free().
+ */
+static int module_argument(const char *arg, char **key, char **value) {
+  const char *eq = strchr(arg, '=');
+  if (!eq) {
+    return SQLITE_ERROR;
+  }
+  const char *k = arg;
+  const char *k_end = eq;
+  const char *v = eq + 1;
+  const char *v_end = arg + strlen(arg);
+  while (k < k_end && isspace((unsigned char)*k)) {
+    k++;
+  }
+  while (k_end > k && isspace((unsigned char)k_end[-1])) {
+    k_end--;
+  }
+  while (v < v_end && isspace((unsigned char)*v)) {
+    v++;
+  }
+  while (v_end > v && isspace((unsigned char)v_end[-1])) {
+    v_end--;
+  }
+  if (v_end - v >= 2 && (*v == '\'' || *v == '"' || *v == '`') &&
+      v_end[-1] == *v) {
+    v++;
+    v_end--;
+  }
+  *key = sqlite3_mprintf("%.*s", (int)(k_end - k), k);
+  *value = sqlite3_mprintf("%.*s", (int)(v_end - v), v);
+  if (!*key || !*value) {
+    sqlite3_free(*key);
+    sqlite3_free(*value);
+    return SQLITE_NOMEM;
+  }
+  return SQLITE_OK;
+}
+
+/**
+ * Create (or drop) the triggers that record the rowids of changed source rows
+ * in the <name>_dirty table. Updates that leave the rowid and the text alone
+ * don't count.
+ *
+ * Rows that REPLACE or an upsert deletes over a conflict on another UNIQUE
+ * column only fire the delete trigger with PRAGMA recursive_triggers on.
+ * Without it, their embeddings stay until a 'rebuild'.
+ */
+static int lembed_sync_triggers(lembed_sync_vtab *p, const char *name,
+                                int create) {
+  char *zSql;
+  if (create) {
+    zSql = sqlite3_mprintf(
+        "CREATE TRIGGER \"%w\".\"%w_dirty_insert\" AFTER INSERT ON \"%w\" "
+        "BEGIN INSERT OR IGNORE INTO \"%w_dirty\"(id) VALUES (new.rowid); "
+        "END;"
+        "CREATE TRIGGER \"%w\".\"%w_dirty_update\" AFTER UPDATE ON \"%w\" "
+        "WHEN old.rowid IS NOT new.rowid OR "
+        "old.\"%w\" IS NOT new.\"%w\" COLLATE BINARY "
+        "BEGIN INSERT OR IGNORE INTO \"%w_dirty\"(id) "
+        "VALUES (old.rowid), (new.rowid); END;"
+        "CREATE TRIGGER \"%w\".\"%w_dirty_delete\" AFTER DELETE ON \"%w\" "
+        "BEGIN INSERT OR IGNORE INTO \"%w_dirty\"(id) VALUES (old.rowid); "
+        "END;",
+        p->schema, name, p->source, name, p->schema, name, p->source,
+        p->column, p->column, name, p->schema, name, p->source, name);
+  } else {
+    zSql = sqlite3_mprintf(
+        "DROP TRIGGER IF EXISTS \"%w\".\"%w_dirty_insert\";"
+        "DROP TRIGGER IF EXISTS \"%w\".\"%w_dirty_update\";"
+        "DROP TRIGGER IF EXISTS \"%w\".\"%w_dirty_delete\";",
+        p->schema, name, p->schema, name, p->schema, name);
+  }
+  int rc = zSql ? sqlite3_exec(p->db, zSql, NULL, NULL, NULL) : SQLITE_NOMEM;
+  sqlite3_free(zSql);
+  return rc;
+}
+
+static int lembed_syncInit(sqlite3 *db, void *pAux, int argc,
+                           const char *const *argv, sqlite3_vtab **ppVtab,
+                           char **pzErr, int isCreate) {
+  lembed_sync_vtab *p = sqlite3_malloc(sizeof(*p));
+  if (!p) {
+    return SQLITE_NOMEM;
+  }
+  memset(p, 0, sizeof(*p));
+  p->db = db;
+  p->api = pAux;
+  p->schema = sqlite3_mprintf("%s", argv[1]);
+  p->name = sqlite3_mprintf("%s", argv[2]);
+  if (!p->schema || !p->name) {
+    lembed_sync_vtab_free(p);
+    return SQLITE_NOMEM;
+  }
+  for (int i = 3; i < argc; i++) {
+    char *key;
+    char *value;
+    int rc = module_argument(argv[i], &key, &value);
+    if (rc == SQLITE_NOMEM) {
+      lembed_sync_vtab_free(p);
+      return rc;
+    }
+    char **option = NULL;
+    if (rc == SQLITE_OK && sqlite3_stricmp(key, "source") == 0) {
+      option = &p->source;
+    } else if (rc == SQLITE_OK && sqlite3_stricmp(key, "column") == 0) {
+      option = &p->column;
+    } else if (rc == SQLITE_OK && sqlite3_stricmp(key, "model") == 0) {
+      option = &p->model;
+    }
+    if (!option) {
+      *pzErr = sqlite3_mprintf(
+          "Unknown lembed_sync option '%s', expected source=, column= or "
+          "model=",
+          argv[i]);
+      if (rc == SQLITE_OK) {
+        sqlite3_free(key);
+        sqlite3_free(value);
+      }
+      lembed_sync_vtab_free(p);
+      return SQLITE_ERROR;
+    }
+    sqlite3_free(key);
+    sqlite3_free(*option);
+    *option = value;
+  }
+  if (!p->source || !p->column || !p->model) {
+    *pzErr = sqlite3_mprintf(
+        "lembed_sync needs source=, column= and model= options");
+    lembed_sync_vtab_free(p);
+    return SQLITE_ERROR;
+  }
+
+  char *zSql = sqlite3_mprintf("CREATE TABLE x(embedding, \"%w\" hidden)",
+                               p->name);
+  int rc = zSql ? sqlite3_declare_vtab(db, zSql) : SQLITE_NOMEM;
+  sqlite3_free(zSql);
+  if (rc == SQLITE_OK && isCreate) {
+    // Fail early on a missing source or column, before anything is created.
+    // The column is looked up by name, since a quoted identifier that matches
+    // no column would pass for a string.
+    sqlite3_stmt *stmt;
+    rc = sqlite3_prepare_v2(db,
+                            "SELECT count(*) FROM pragma_table_xinfo(?1, ?2) "
+                            "WHERE name = ?3 COLLATE NOCASE",
+                            -1, &stmt, NULL);
+    if (rc == SQLITE_OK) {
+      sqlite3_bind_text(stmt, 1, p->source, -1, SQLITE_STATIC);
+      sqlite3_bind_text(stmt, 2, p->schema, -1, SQLITE_STATIC);
+      sqlite3_bind_text(stmt, 3, p->column, -1, SQLITE_STATIC);
+      rc = sqlite3_step(stmt) == SQLITE_ROW ? SQLITE_OK : SQLITE_ERROR;
+      if (rc == SQLITE_OK && sqlite3_column_int(stmt, 0) == 0) {
+        *pzErr = sqlite3_mprintf("no such column: %s.%s", p->source,
+                                 p->column);
+        rc = SQLITE_ERROR;
+      }
+    }
+    if (rc != SQLITE_OK && !*pzErr) {
+      *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    }
+    sqlite3_finalize(stmt);
+  }
+  if (rc == SQLITE_OK && isCreate) {
+    // Every row that's already in the source starts out dirty
+    zSql = sqlite3_mprintf(
+        "CREATE TABLE \"%w\".\"%w_embeddings\"(id INTEGER PRIMARY KEY, "
+        "hash BLOB, embedding BLOB);"
+        "CREATE TABLE \"%w\".\"%w_dirty\"(id INTEGER PRIMARY KEY);"
+        "INSERT INTO \"%w\".\"%w_dirty\"(id) SELECT rowid FROM \"%w\".\"%w\";",
+        p->schema, p->name, p->schema, p->name, p->schema, p->name, p->schema,
+        p->source);
+    rc = zSql ? sqlite3_exec(db, zSql, NULL, NULL, pzErr) : SQLITE_NOMEM;
+    sqlite3_free(zSql);
+  }
+  if (rc == SQLITE_OK && isCreate) {
+    rc = lembed_sync_triggers(p, p->name, 1);
+  }
+  if (rc != SQLITE_OK) {
+    lembed_sync_vtab_free(p);
+    return rc;
+  }
+  *ppVtab = &p->base;
+  return SQLITE_OK;
+}
+
+static int lembed_syncCreate(sqlite3 *db, void *pAux, int argc,
+                             const char *const *argv, sqlite3_vtab **ppVtab,
+                             char **pzErr) {
+  return lembed_syncInit(db, pAux, argc, argv, ppVtab, pzErr, 1);
+}
+
+static int lembed_syncConnect(sqlite3 *db, void *pAux, int argc,
+                              const char *const *argv, sqlite3_vtab **ppVtab,
+                              char **pzErr) {
+  return lembed_syncInit(db, pAux, argc, argv, ppVtab, pzErr, 0);
+}
+
+static int lembed_syncDisconnect(sqlite3_vtab *pVtab) {
+  lembed_sync_vtab_free((lembed_sync_vtab *)pVtab);
+  return SQLITE_OK;
+}
+
+static int lembed_syncDestroy(sqlite3_vtab *pVtab) {
+  lembed_sync_vtab *p = (lembed_sync_vtab *)pVtab;
+  int rc = lembed_sync_triggers(p, p->name, 0);
+  if (rc == SQLITE_OK) {
+    char *zSql = sqlite3_mprintf(
+        "DROP TABLE IF EXISTS \"%w\".\"%w_embeddings\";"
+        "DROP TABLE IF EXISTS \"%w\".\"%w_dirty\";",
+        p->schema, p->name, p->schema, p->name);
+    rc = zSql ? sqlite3_exec(p->db, zSql, NULL, NULL, NULL) : SQLITE_NOMEM;
+    sqlite3_free(zSql);
+  }
+  if (rc == SQLITE_OK) {
+    lembed_sync_vtab_free(p);
+  }
+  return rc;
+}
+
+static int lembed_syncRename(sqlite3_vtab *pVtab, const char *zNew) {
+  lembed_sync_vtab *p = (lembed_sync_vtab *)pVtab;
+  // The triggers are named after the table too, so they're made again
+  int rc = lembed_sync_triggers(p, p->name, 0);
+  if (rc == SQLITE_OK) {
+    char *zSql = sqlite3_mprintf(
+        "ALTER TABLE \"%w\".\"%w_embeddings\" RENAME TO \"%w_embeddings\";"
+        "ALTER TABLE \"%w\".\"%w_dirty\" RENAME TO \"%w_dirty\";",
+        p->schema, p->name, zNew, p->schema, p->name, zNew);
+    rc = zSql ? sqlite3_exec(p->db, zSql, NULL, NULL, NULL) : SQLITE_NOMEM;
+    sqlite3_free(zSql);
+  }
+  if (rc == SQLITE_OK) {
+    rc = lembed_sync_triggers(p, zNew, 1);
+  }
+  if (rc == SQLITE_OK) {
+    char *name = sqlite3_mprintf("%s", zNew);
+    if (!name) {
+      return SQLITE_NOMEM;
+    }
+    sqlite3_free(p->name);
+    p->name = name;
+  }
+  return rc;
+}
+
+/*
+ * <name>_dirty isn't a shadow table: with SQLITE_DBCONFIG_DEFENSIVE on, shadow
+ * tables are read-only to ordinary SQL, and that includes the triggers that
+ * write to it.
+ */
+static int lembed_syncShadowName(const char *zName) {
+  return sqlite3_stricmp(zName, "embeddings") == 0;
+}
+
+static int lembed_syncOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  lembed_sync_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == 0)
+    return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
+
+static int lembed_syncClose(sqlite3_vtab_cursor *cur) {
+  lembed_sync_cursor *pCur = (lembed_sync_cursor *)cur;
+  sqlite3_finalize(pCur->stmt);
+  sqlite3_free(pCur);
+  return SQLITE_OK;
+}
+
+static int lembed_syncBestIndex(sqlite3_vtab *pVTab,
+                                sqlite3_index_info *pIdxInfo) {
+  for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    if (pCons->usable && pCons->iColumn == -1 &&
+        pCons->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+      pIdxInfo->aConstraintUsage[i].argvIndex = 1;
+      pIdxInfo->aConstraintUsage[i].omit = 1;
+      pIdxInfo->idxNum = 1;
+      pIdxInfo->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+      pIdxInfo->estimatedCost = 1;
+      pIdxInfo->estimatedRows = 1;
+      return SQLITE_OK;
+    }
+  }
+  pIdxInfo->idxNum = 0;
+  pIdxInfo->estimatedCost = 1000000;
+  pIdxInfo->estimatedRows = 1000000;
+  return SQLITE_OK;
+}
+
+static int lembed_syncNext(sqlite3_vtab_cursor *cur) {
+  lembed_sync_cursor *pCur = (lembed_sync_cursor *)cur;
+  int rc = sqlite3_step(pCur->stmt);
+  if (rc == SQLITE_ROW) {
+    return SQLITE_OK;
+  }
+  pCur->eof = 1;
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int lembed_syncFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                             const char *idxStr, int argc,
+                             sqlite3_value **argv) {
+  lembed_sync_cursor *pCur = (lembed_sync_cursor *)pVtabCursor;
+  lembed_sync_vtab *p = (lembed_sync_vtab *)pVtabCursor->pVtab;
+  sqlite3_finalize(pCur->stmt);
+  pCur->stmt = NULL;
+  pCur->eof = 0;
+  char *zSql =
+      sqlite3_mprintf("SELECT id, embedding FROM \"%w\".\"%w_embeddings\"%s",
+                      p->schema, p->name, idxNum == 1 ? " WHERE id = ?" : "");
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  int rc = sqlite3_prepare_v2(p->db, zSql, -1, &pCur->stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    p->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(p->db));
+    return rc;
+  }
+  if (idxNum == 1) {
+    sqlite3_bind_value(pCur->stmt, 1, argv[0]);
+  }
+  return lembed_syncNext(pVtabCursor);
+}
+
+static int lembed_syncEof(sqlite3_vtab_cursor *cur) {
+  return ((lembed_sync_cursor *)cur)->eof;
+}
+
+static int lembed_syncRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  lembed_sync_cursor *pCur = (lembed_sync_cursor *)cur;
+  *pRowid = sqlite3_column_int64(pCur->stmt, 0);
+  return SQLITE_OK;
+}
+
+static int lembed_syncColumn(sqlite3_vtab_cursor *cur,
+                             sqlite3_context *context, int i) {
+  lembed_sync_cursor *pCur = (lembed_sync_cursor *)cur;
+  if (i == LEMBED_SYNC_EMBEDDING &&
+      sqlite3_column_type(pCur->stmt, 1) != SQLITE_NULL) {
+    sqlite3_result_value(context, sqlite3_column_value(pCur->stmt, 1));
+    sqlite3_result_subtype(context, LEMBED_FLOAT32_SUBTYPE);
+  }
+  return SQLITE_OK;
+}
+
+/** Rows of a sync waiting to be embedded together, up to n_seq_max. */
+typedef struct lembed_sync_batch lembed_sync_batch;
+struct lembed_sync_batch {
+  int n;
+  sqlite3_int64 *rowids;
+  uint64_t *hashes;
+  llama_token **tokens;
+  int *token_counts;
+  float *embeddings;
+};
+
+/** Embed the rows of batch, and write them to the shadow table with upsert. */
+static int lembed_sync_flush(lembed_sync_vtab *p, ApiModel *entry,
+                             lembed_sync_batch *batch, sqlite3_stmt *upsert) {
+  if (batch->n == 0) {
+    return SQLITE_OK;
+  }
+  ApiContext *ctx = api_model_context_acquire(entry);
+  int rc = embed_many(entry->model, ctx, batch->tokens, batch->token_counts,
+                      batch->n, entry->document_prefix.n_tokens,
+                      batch->embeddings);
+  api_model_context_release(entry, ctx);
+  if (rc != SQLITE_OK) {
+    p->base.zErrMsg = sqlite3_mprintf("Error generating embeddings");
+  }
+  for (int i = 0; i < batch->n && rc == SQLITE_OK; i++) {
+    sqlite3_bind_int64(upsert, 1, batch->rowids[i]);
+    sqlite3_bind_blob(upsert, 2, &batch->hashes[i * 2], sizeof(uint64_t) * 2,
+                      SQLITE_STATIC);
+    sqlite3_bind_blob(upsert, 3, batch->embeddings + (i * entry->dimensions),
+                      sizeof(float) * entry->dimensions, SQLITE_STATIC);
+    rc = sqlite3_step(upsert);
+    rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+    sqlite3_reset(upsert);
+  }
+  for (int i = 0; i < batch->n; i++) {
+    sqlite3_free(batch->tokens[i]);
+    batch->tokens[i] = NULL;
+  }
+  batch->n = 0;
+  return rc;
+}
+
+/**
+ * Embed the rows of the source that are new or changed since the last sync
+ * (or every row, with rebuild), drop the embeddings of deleted rows, and
+ * clear <name>_dirty.
+ */
+static int lembed_sync_run(lembed_sync_vtab *p, int rebuild) {
+  struct llama_model *model;
+  ApiModel *entry;
+  if (api_model_from_name(p->api, p->model, strlen(p->model), &model,
+                          &entry) != SQLITE_OK) {
+    p->base.zErrMsg = sqlite3_mprintf(
+        "Unknown model name '%s'. Was it registered with lembed_models?",
+        p->model);
+    return SQLITE_ERROR;
+  }
+  p->base.zErrMsg = api_model_embed_error(entry);
+  if (p->base.zErrMsg) {
+    return SQLITE_ERROR;
+  }
+
+  int n_max = entry->n_seq_max;
+  lembed_sync_batch batch;
+  memset(&batch, 0, sizeof(batch));
+  batch.rowids = sqlite3_malloc64(sizeof(sqlite3_int64) * n_max);
+  batch.hashes = sqlite3_malloc64(sizeof(uint64_t) * 2 * n_max);
+  batch.tokens = sqlite3_malloc64(sizeof(llama_token *) * n_max);
+  batch.token_counts = sqlite3_malloc64(sizeof(int) * n_max);
+  batch.embeddings =
+      sqlite3_malloc64(sizeof(float) * entry->dimensions * n_max);
+
+  sqlite3_stmt *select = NULL;
+  sqlite3_stmt *upsert = NULL;
+  sqlite3_stmt *remove = NULL;
+  int rc = SQLITE_NOMEM;
+  if (batch.rowids && batch.hashes && batch.tokens && batch.token_counts &&
+      batch.embeddings) {
+    memset(batch.tokens, 0, sizeof(llama_token *) * n_max);
+    char *zSelect =
+        rebuild
+            ? sqlite3_mprintf(
+                  "SELECT s.rowid, s.\"%w\", e.hash, length(e.embedding) "
+                  "FROM \"%w\".\"%w\" AS s "
+                  "LEFT JOIN \"%w\".\"%w_embeddings\" AS e ON e.id = s.rowid",
+                  p->column, p->schema, p->source, p->schema, p->name)
+            : sqlite3_mprintf(
+                  "SELECT d.id, s.\"%w\", e.hash, length(e.embedding) "
+                  "FROM \"%w\".\"%w_dirty\" AS d "
+                  "LEFT JOIN \"%w\".\"%w\" AS s ON s.rowid = d.id "
+                  "LEFT JOIN \"%w\".\"%w_embeddings\" AS e ON e.id = d.id",
+                  p->column, p->schema, p->name, p->schema, p->source,
+                  p->schema, p->name);
+    char *zUpsert = sqlite3_mprintf("INSERT OR REPLACE INTO "
+                                    "\"%w\".\"%w_embeddings\"(id, hash, "
+                                    "embedding) VALUES (?, ?, ?)",
+                                    p->schema, p->name);
+    char *zRemove =
+        sqlite3_mprintf("DELETE FROM \"%w\".\"%w_embeddings\" WHERE id = ?",
+                        p->schema, p->name);
+    if (zSelect && zUpsert && zRemove) {
+      rc = sqlite3_prepare_v2(p->db, zSelect, -1, &select, NULL);
+      if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(p->db, zUpsert, -1, &upsert, NULL);
+      }
+      if (rc == SQLITE_OK) {
+        rc = sqlite3_prepare_v2(p->db, zRemove, -1, &remove, NULL);
+      }
+      if (rc != SQLITE_OK) {
+        p->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(p->db));
+      }
+    }
+    sqlite3_free(zSelect);
+    sqlite3_free(zUpsert);
+    sqlite3_free(zRemove);
+  }
+
+  while (rc == SQLITE_OK) {
+    int step = sqlite3_step(select);
+    if (step == SQLITE_DONE) {
+      rc = lembed_sync_flush(p, entry, &batch, upsert);
+      break;
+    }
+    if (step != SQLITE_ROW) {
+      rc = step;
+      p->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(p->db));
+      break;
+    }
+    sqlite3_int64 rowid = sqlite3_column_int64(select, 0);
+    const char *text = (const char *)sqlite3_column_text(select, 1);
+    int text_length = sqlite3_column_bytes(select, 1);
+    int synced = sqlite3_column_type(select, 2) != SQLITE_NULL;
+    if (!text) {
+      if (synced) {
+        sqlite3_bind_int64(remove, 1, rowid);
+        rc = sqlite3_step(remove);
+        rc = rc == SQLITE_DONE ? SQLITE_OK : rc;
+        sqlite3_reset(remove);
+      }
+      continue;
+    }
+
+    // The document prefix is part of what's embedded, so part of the hash
+    uint64_t *hash = &batch.hashes[batch.n * 2];
+    murmur3_128(text, text_length, hash);
+    hash[0] ^= entry->document_prefix.hash[0];
+    hash[1] ^= entry->document_prefix.hash[1];
+    if (!rebuild && synced &&
+        sqlite3_column_bytes(select, 2) == sizeof(uint64_t) * 2 &&
+        memcmp(sqlite3_column_blob(select, 2), hash, sizeof(uint64_t) * 2) ==
+            0 &&
+        sqlite3_column_int64(select, 3) ==
+            (sqlite3_int64)(sizeof(float) * entry->dimensions)) {
+      continue;
+    }
+
+    int i = batch.n;
+    batch.rowids[i] = rowid;
+    rc = tokenize(model, text, text_length, &entry->document_prefix,
+                  &batch.token_counts[i], &batch.tokens[i], &entry->stats);
+    if (rc != SQLITE_OK) {
+      p->base.zErrMsg = sqlite3_mprintf("Error tokenizing row %lld", rowid);
+      break;
+    }
+    batch.n++;
+    if (batch.token_counts[i] > entry->n_tokens_max &&
+        entry->long_inputs == LEMBED_LONG_INPUTS_ERROR) {
+      p->base.zErrMsg = sqlite3_mprintf(
+          "Row %lld has %d tokens, more than the batch size of %d. Use the "
+          "long_inputs context option to truncate or split long inputs.",
+          rowid, batch.token_counts[i], entry->n_tokens_max);
+      rc = SQLITE_ERROR;
+      break;
+    }
+    if (batch.n == n_max) {
+      rc = lembed_sync_flush(p, entry, &batch, upsert);
+    }
+  }
+
+  // A sync saw the deleted rows through <name>_dirty, a rebuild didn't
+  if (rc == SQLITE_OK && rebuild) {
+    char *zSql = sqlite3_mprintf(
+        "DELETE FROM \"%w\".\"%w_embeddings\" "
+        "WHERE id NOT IN (SELECT rowid FROM \"%w\".\"%w\")",
+        p->schema, p->name, p->schema, p->source);
+    rc = zSql ? sqlite3_exec(p->db, zSql, NULL, NULL, NULL) : SQLITE_NOMEM;
+    sqlite3_free(zSql);
+  }
+  if (rc == SQLITE_OK) {
+    char *zSql = sqlite3_mprintf("DELETE FROM \"%w\".\"%w_dirty\"",
+                                 p->schema, p->name);
+    rc = zSql ? sqlite3_exec(p->db, zSql, NULL, NULL, NULL) : SQLITE_NOMEM;
+    sqlite3_free(zSql);
+  }
+
+  if (batch.tokens) {
+    for (int i = 0; i < batch.n; i++) {
+      sqlite3_free(batch.tokens[i]);
+    }
+  }
+  sqlite3_finalize(select);
+  sqlite3_finalize(upsert);
+  sqlite3_finalize(remove);
+  sqlite3_free(batch.rowids);
+  sqlite3_free(batch.hashes);
+  sqlite3_free(batch.tokens);
+  sqlite3_free(batch.token_counts);
+  sqlite3_free(batch.embeddings);
+  return rc;
+}
+
+/**
+ * The only writes are commands, FTS5 style, inserted into the hidden column
+ * named after the table: 'sync' or 'rebuild'.
+ */
+static int lembed_syncUpdate(sqlite3_vtab *pVTab, int argc,
+                             sqlite3_value **argv, sqlite_int64 *pRowid) {
+  lembed_sync_vtab *p = (lembed_sync_vtab *)pVTab;
+  if (argc > 1 && sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    const char *command =
+        (const char *)sqlite3_value_text(argv[2 + LEMBED_SYNC_COMMAND]);
+    if (command && sqlite3_stricmp(command, "sync") == 0) {
+      return lembed_sync_run(p, 0);
+    }
+    if (command && sqlite3_stricmp(command, "rebuild") == 0) {
+      return lembed_sync_run(p, 1);
+    }
+  }
+  pVTab->zErrMsg = sqlite3_mprintf(
+      "%s is kept in sync with %s by lembed_sync. Run INSERT INTO %s(%s) "
+      "VALUES ('sync') to update it",
+      p->name, p->source, p->name, p->name);
+  return SQLITE_ERROR;
+}
+
+static sqlite3_module lembed_syncModule = {
+    /* iVersion    */ 3,
+    /* xCreate     */ lembed_syncCreate,
+    /* xConnect    */ lembed_syncConnect,
+    /* xBestIndex  */ lembed_syncBestIndex,
+    /* xDisconnect */ lembed_syncDisconnect,
+    /* xDestroy    */ lembed_syncDestroy,
+    /* xOpen       */ lembed_syncOpen,
+    /* xClose      */ lembed_syncClose,
+    /* xFilter     */ lembed_syncFilter,
+    /* xNext       */ lembed_syncNext,
+    /* xEof        */ lembed_syncEof,
+    /* xColumn     */ lembed_syncColumn,
+    /* xRowid      */ lembed_syncRowid,
+    /* xUpdate     */ lembed_syncUpdate,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ lembed_syncRename,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ lembed_syncShadowName};
+#pragma endregion
+
+#pragma region lembed_index virtual table
+
+/*
+ * An approximate nearest neighbors index over float32 embeddings, as an IVF
+ * (inverted file) index: vectors are clustered around centroids with k-means,
+ * and a query only scans the clusters ("lists") closest to it.
+ *
+ *   CREATE VIRTUAL TABLE article_index USING lembed_index(dimensions=384);
+ *   INSERT INTO article_index(rowid, embedding) SELECT ...;
+ *   INSERT INTO article_index(article_index) VALUES ('build');
+ *   SELECT rowid, distance FROM article_index
+ *   WHERE embedding MATCH lembed('all-MiniLM-L6-v2', :query) AND k = 10;
+ *
+ * Everything lives in shadow tables. Vectors are stored L2 normalized, and
+ * distances are cosine distances. The key of each vector in <name>_vectors is
+ * its list in the high 32 bits and a slot in the low 32, so a list is one
+ * contiguous range of the table's b-tree, and scanning it touches as few
+ * pages as possible. <name>_rowids maps rowids to keys.
+ *
+ * Until the first 'build' every vector is in list 0, and queries are exact.
+ * A 'build' trains lists centroids on a sample of the vectors, and moves every
+ * vector to its closest one. Inserts after that go to their closest centroid,
+ * so build again once the data has drifted a lot.
+ */
+#define LEMBED_INDEX_EMBEDDING 0
+#define LEMBED_INDEX_DISTANCE 1
+#define LEMBED_INDEX_K 2
+#define LEMBED_INDEX_NPROBE 3
+#define LEMBED_INDEX_COMMAND 4
+
+// idxNum flags of lembed_indexBestIndex()
+#define LEMBED_INDEX_PLAN_ROWID 1
+#define LEMBED_INDEX_PLAN_KNN 2
+#define LEMBED_INDEX_PLAN_K 4
+#define LEMBED_INDEX_PLAN_NPROBE 8
+#define LEMBED_INDEX_PLAN_LIMIT 16
+
+#define LEMBED_INDEX_LISTS_MAX 65536
+#define LEMBED_INDEX_K_MAX 100000
+// k of queries with no k = constraint, and no LIMIT that SQLite passed down
+#define LEMBED_INDEX_K_DEFAULT 10
+// k-means trains on at most this many floats worth of sampled vectors
+#define LEMBED_INDEX_TRAIN_FLOATS (16 * 1024 * 1024)
+#define LEMBED_INDEX_ITERATIONS 10
+// Vectors are moved to their new lists this many at a time during a build
+#define LEMBED_INDEX_CHUNK 4096
+
+enum lembed_index_stmt {
+  LEMBED_INDEX_STMT_CENTROIDS_VERSION,
+  LEMBED_INDEX_STMT_CENTROIDS,
+  LEMBED_INDEX_STMT_NEXT_KEY,
+  LEMBED_INDEX_STMT_INSERT_ROWID,
+  LEMBED_INDEX_STMT_INSERT_VECTOR,
+  LEMBED_INDEX_STMT_KEY,
+  LEMBED_INDEX_STMT_SET_KEY,
+  LEMBED_INDEX_STMT_DELETE_ROWID,
+  LEMBED_INDEX_STMT_DELETE_VECTOR,
+  LEMBED_INDEX_STMT_EMBEDDING,
+  LEMBED_INDEX_STMT_VECTOR,
+  LEMBED_INDEX_STMT_SCAN_LIST,
+  LEMBED_INDEX_STMT_COUNT,
+};
+
+// Every statement is formatted with schema, name, schema, name
+static const char *lembed_index_stmt_sql[LEMBED_INDEX_STMT_COUNT] = {
+    "SELECT min(id), count(*) FROM \"%w\".\"%w_centroids\"",
+    "SELECT centroid FROM \"%w\".\"%w_centroids\" ORDER BY id",
+    "SELECT max(key) FROM \"%w\".\"%w_vectors\" WHERE key BETWEEN ? AND ?",
+    "INSERT INTO \"%w\".\"%w_rowids\"(id, key) VALUES (?, ?)",
+    "INSERT INTO \"%w\".\"%w_vectors\"(key, id, embedding) VALUES (?, ?, ?)",
+    "SELECT key FROM \"%w\".\"%w_rowids\" WHERE id = ?",
+    "UPDATE \"%w\".\"%w_rowids\" SET key = ? WHERE id = ?",
+    "DELETE FROM \"%w\".\"%w_rowids\" WHERE id = ?",
+    "DELETE FROM \"%w\".\"%w_vectors\" WHERE key = ?",
+    "SELECT v.embedding FROM \"%w\".\"%w_rowids\" AS r "
+    "JOIN \"%w\".\"%w_vectors\" AS v ON v.key = r.key WHERE r.id = ?",
+    "SELECT embedding FROM \"%w\".\"%w_vectors\" WHERE key = ?",
+    "SELECT id, embedding FROM \"%w\".\"%w_vectors\" WHERE key BETWEEN ? AND ?",
+};
+
+typedef struct lembed_index_vtab lembed_index_vtab;
+struct lembed_index_vtab {
+  sqlite3_vtab base;
+  sqlite3 *db;
+  char *schema;
+  char *name;
+  // Options from CREATE VIRTUAL TABLE
+  int dimensions;
+  // Number of lists to build, 0 for the square root of the number of vectors
+  int lists;
+  int nprobe;
+  int threads;
+  // Centroids of the last build, while the first centroid id is centroids_base
+  sqlite3_int64 centroids_base;
+  int n_centroids;
+  float *centroids;
+  // Scratch space for one normalized vector
+  float *vector;
+  sqlite3_stmt *stmts[LEMBED_INDEX_STMT_COUNT];
+};
+
+typedef struct lembed_index_cursor lembed_index_cursor;
+struct lembed_index_cursor {
+  sqlite3_vtab_cursor base;
+  // Full scans and rowid lookups step stmt
+  sqlite3_stmt *stmt;
+  // KNN queries return rowids and distances, closest first
+  int knn;
+  int n_results;
+  int i;
+  sqlite3_int64 *rowids;
+  float *distances;
+  int eof;
+};
+
+static void lembed_index_finalize(lembed_index_vtab *p) {
+  for (int i = 0; i < LEMBED_INDEX_STMT_COUNT; i++) {
+    sqlite3_finalize(p->stmts[i]);
+    p->stmts[i] = NULL;
+  }
+}
+
+static void lembed_index_vtab_free(lembed_index_vtab *p) {
+  lembed_index_finalize(p);
+  sqlite3_free(p->schema);
+  sqlite3_free(p->name);
+  sqlite3_free(p->centroids);
+  sqlite3_free(p->vector);
+  sqlite3_free(p);
+}
+
+/** The cached statement i of p, reset and ready to bind. NULL on error. */
+static sqlite3_stmt *index_stmt(lembed_index_vtab *p, enum lembed_index_stmt i) {
+  if (!p->stmts[i]) {
+    char *zSql = sqlite3_mprintf(lembed_index_stmt_sql[i], p->schema, p->name,
+                                 p->schema, p->name);
+    if (!zSql) {
+      return NULL;
+    }
+    int rc = sqlite3_prepare_v3(p->db, zSql, -1, SQLITE_PREPARE_PERSISTENT,
+                                &p->stmts[i], NULL);
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+      return NULL;
+    }
+  }
+  sqlite3_reset(p->stmts[i]);
+  sqlite3_clear_bindings(p->stmts[i]);
+  return p->stmts[i];
+}
+
+/** Run the one-off SQL format zFormat on p's shadow tables. */
+static int index_exec(lembed_index_vtab *p, const char *zFormat) {
+  char *zSql =
+      sqlite3_mprintf(zFormat, p->schema, p->name, p->schema, p->name);
+  int rc = zSql ? sqlite3_exec(p->db, zSql, NULL, NULL, NULL) : SQLITE_NOMEM;
+  sqlite3_free(zSql);
+  return rc;
+}
+
+/** Run a step of the statement stmt, that doesn't return rows. */
+static int index_step_done(sqlite3_stmt *stmt) {
+  int rc = sqlite3_step(stmt);
+  sqlite3_reset(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/** Parse an integer option between min and max, or return SQLITE_ERROR. */
+static int index_int_option(const char *value, int min, int max, int *out) {
+  char *end;
+  long v = strtol(value, &end, 10);
+  if (end == value || *end != '\0' || v < min || v > max) {
+    return SQLITE_ERROR;
+  }
+  *out = (int)v;
+  return SQLITE_OK;
+}
+
+static int lembed_indexInit(sqlite3 *db, void *pAux, int argc,
+                            const char *const *argv, sqlite3_vtab **ppVtab,
+                            char **pzErr, int isCreate) {
+  lembed_index_vtab *p = sqlite3_malloc(sizeof(*p));
+  if (!p) {
+    return SQLITE_NOMEM;
+  }
+  memset(p, 0, sizeof(*p));
+  p->db = db;
+  p->nprobe = 8;
+  p->threads = 4;
+  p->schema = sqlite3_mprintf("%s", argv[1]);
+  p->name = sqlite3_mprintf("%s", argv[2]);
+  if (!p->schema || !p->name) {
+    lembed_index_vtab_free(p);
+    return SQLITE_NOMEM;
+  }
+  for (int i = 3; i < argc; i++) {
+    char *key;
+    char *value;
+    int rc = module_argument(argv[i], &key, &value);
+    if (rc == SQLITE_NOMEM) {
+      lembed_index_vtab_free(p);
+      return rc;
+    }
+    if (rc != SQLITE_OK) {
+      *pzErr = sqlite3_mprintf(
+          "Unknown lembed_index option '%s', expected dimensions=, lists=, "
+          "nprobe= or threads=",
+          argv[i]);
+      lembed_index_vtab_free(p);
+      return SQLITE_ERROR;
+    }
+    if (sqlite3_stricmp(key, "dimensions") == 0) {
+      rc = index_int_option(value, 1, 65536, &p->dimensions);
+    } else if (sqlite3_stricmp(key, "lists") == 0) {
+      rc = index_int_option(value, 1, LEMBED_INDEX_LISTS_MAX, &p->lists);
+    } else if (sqlite3_stricmp(key, "nprobe") == 0) {
+      rc = index_int_option(value, 1, LEMBED_INDEX_LISTS_MAX, &p->nprobe);
+    } else if (sqlite3_stricmp(key, "threads") == 0) {
+      rc = index_int_option(value, 1, 1024, &p->threads);
+    } else {
+      *pzErr = sqlite3_mprintf(
+          "Unknown lembed_index option '%s', expected dimensions=, lists=, "
+          "nprobe= or threads=",
+          argv[i]);
+      rc = SQLITE_MISUSE;
+    }
+    if (rc == SQLITE_ERROR) {
+      *pzErr = sqlite3_mprintf("Invalid lembed_index option '%s'", argv[i]);
+    }
+    sqlite3_free(key);
+    sqlite3_free(value);
+    if (rc != SQLITE_OK) {
+      lembed_index_vtab_free(p);
+      return SQLITE_ERROR;
+    }
+  }
+  if (!p->dimensions) {
+    *pzErr = sqlite3_mprintf("lembed_index needs a dimensions= option");
+    lembed_index_vtab_free(p);
+    return SQLITE_ERROR;
+  }
+  p->vector = sqlite3_malloc64(sizeof(float) * p->dimensions);
+  if (!p->vector) {
+    lembed_index_vtab_free(p);
+    return SQLITE_NOMEM;
+  }
+
+  char *zSql = sqlite3_mprintf("CREATE TABLE x(embedding, distance hidden, k "
+                               "hidden, nprobe hidden, \"%w\" hidden)",
+                               p->name);
+  int rc = zSql ? sqlite3_declare_vtab(db, zSql) : SQLITE_NOMEM;
+  sqlite3_free(zSql);
+  if (rc == SQLITE_OK && isCreate) {
+    rc = index_exec(p,
+                    "CREATE TABLE \"%w\".\"%w_centroids\"(id INTEGER PRIMARY "
+                    "KEY, centroid BLOB)");
+    if (rc == SQLITE_OK) {
+      rc = index_exec(p, "CREATE TABLE \"%w\".\"%w_vectors\"(key INTEGER "
+                         "PRIMARY KEY, id INTEGER, embedding BLOB)");
+    }
+    if (rc == SQLITE_OK) {
+      rc = index_exec(p, "CREATE TABLE \"%w\".\"%w_rowids\"(id INTEGER "
+                         "PRIMARY KEY, key INTEGER)");
+    }
+    if (rc != SQLITE_OK) {
+      *pzErr = sqlite3_mprintf("%s", sqlite3_errmsg(db));
+    }
+  }
+  if (rc != SQLITE_OK) {
+    lembed_index_vtab_free(p);
+    return rc;
+  }
+  *ppVtab = &p->base;
+  return SQLITE_OK;
+}
+
+static int lembed_indexCreate(sqlite3 *db, void *pAux, int argc,
+                              const char *const *argv, sqlite3_vtab **ppVtab,
+                              char **pzErr) {
+  return lembed_indexInit(db, pAux, argc, argv, ppVtab, pzErr, 1);
+}
+
+static int lembed_indexConnect(sqlite3 *db, void *pAux, int argc,
+                               const char *const *argv, sqlite3_vtab **ppVtab,
+                               char **pzErr) {
+  return lembed_indexInit(db, pAux, argc, argv, ppVtab, pzErr, 0);
+}
+
+static int lembed_indexDisconnect(sqlite3_vtab *pVtab) {
+  lembed_index_vtab_free((lembed_index_vtab *)pVtab);
+  return SQLITE_OK;
+}
+
+static int lembed_indexDestroy(sqlite3_vtab *pVtab) {
+  lembed_index_vtab *p = (lembed_index_vtab *)pVtab;
+  lembed_index_finalize(p);
+  int rc = index_exec(p, "DROP TABLE IF EXISTS \"%w\".\"%w_centroids\"");
+  if (rc == SQLITE_OK) {
+    rc = index_exec(p, "DROP TABLE IF EXISTS \"%w\".\"%w_vectors\"");
+  }
+  if (rc == SQLITE_OK) {
+    rc = index_exec(p, "DROP TABLE IF EXISTS \"%w\".\"%w_rowids\"");
+  }
+  if (rc == SQLITE_OK) {
+    lembed_index_vtab_free(p);
+  }
+  return rc;
+}
+
+static int lembed_indexRename(sqlite3_vtab *pVtab, const char *zNew) {
+  lembed_index_vtab *p = (lembed_index_vtab *)pVtab;
+  static const char *suffixes[] = {"centroids", "vectors", "rowids"};
+  lembed_index_finalize(p);
+  for (int i = 0; i < 3; i++) {
+    char *zSql = sqlite3_mprintf(
+        "ALTER TABLE \"%w\".\"%w_%s\" RENAME TO \"%w_%s\"", p->schema,
+        p->name, suffixes[i], zNew, suffixes[i]);
+    int rc = zSql ? sqlite3_exec(p->db, zSql, NULL, NULL, NULL) : SQLITE_NOMEM;
+    sqlite3_free(zSql);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+  char *name = sqlite3_mprintf("%s", zNew);
+  if (!name) {
+    return SQLITE_NOMEM;
+  }
+  sqlite3_free(p->name);
+  p->name = name;
+  return SQLITE_OK;
+}
+
+static int lembed_indexShadowName(const char *zName) {
+  return sqlite3_stricmp(zName, "centroids") == 0 ||
+         sqlite3_stricmp(zName, "vectors") == 0 ||
+         sqlite3_stricmp(zName, "rowids") == 0;
+}
+
+/**
+ * Make sure p->centroids holds the centroids of the last build, reloading
+ * them if another build (maybe on another connection) has replaced them.
+ */
+static int index_centroids_load(lembed_index_vtab *p) {
+  sqlite3_stmt *stmt = index_stmt(p, LEMBED_INDEX_STMT_CENTROIDS_VERSION);
+  if (!stmt || sqlite3_step(stmt) != SQLITE_ROW) {
+    return SQLITE_ERROR;
+  }
+  sqlite3_int64 base = sqlite3_column_int64(stmt, 0);
+  int n = sqlite3_column_int(stmt, 1);
+  sqlite3_reset(stmt);
+  if (n == p->n_centroids && (n == 0 || base == p->centroids_base)) {
+    return SQLITE_OK;
+  }
+  sqlite3_free(p->centroids);
+  p->centroids = NULL;
+  p->n_centroids = 0;
+  if (n == 0) {
+    return SQLITE_OK;
+  }
+  float *centroids = sqlite3_malloc64(sizeof(float) * p->dimensions * n);
+  if (!centroids) {
+    return SQLITE_NOMEM;
+  }
+  stmt = index_stmt(p, LEMBED_INDEX_STMT_CENTROIDS);
+  int i = 0;
+  while (stmt && i < n && sqlite3_step(stmt) == SQLITE_ROW) {
+    if (sqlite3_column_bytes(stmt, 0) != (int)sizeof(float) * p->dimensions) {
+      break;
+    }
+    memcpy(centroids + (size_t)i * p->dimensions, sqlite3_column_blob(stmt, 0),
+           sizeof(float) * p->dimensions);
+    i++;
+  }
+  if (stmt) {
+    sqlite3_reset(stmt);
+  }
+  if (i != n) {
+    sqlite3_free(centroids);
+    return SQLITE_CORRUPT_VTAB;
+  }
+  p->centroids = centroids;
+  p->centroids_base = base;
+  p->n_centroids = n;
+  return SQLITE_OK;
+}
+
+/** Index of the centroid closest to the normalized vector. */
+static int index_nearest(const float *centroids, int n_centroids,
+                         const float *vector, int dimensions) {
+  int best = 0;
+  float best_dot = -INFINITY;
+  for (int c = 0; c < n_centroids; c++) {
+    float dot = kernels.dot(centroids + (size_t)c * dimensions, vector,
+                            dimensions);
+    if (dot > best_dot) {
+      best_dot = dot;
+      best = c;
+    }
+  }
+  return best;
+}
+
+/** A slice of vectors for a thread of index_assign(). */
+typedef struct lembed_index_slice lembed_index_slice;
+struct lembed_index_slice {
+  const float *centroids;
+  int n_centroids;
+  int dimensions;
+  const float *vectors;
+  int n_vectors;
+  int *assignments;
+};
+
+static void index_assign_slice(void *arg) {
+  lembed_index_slice *s = arg;
+  for (int i = 0; i < s->n_vectors; i++) {
+    s->assignments[i] =
+        index_nearest(s->centroids, s->n_centroids,
+                      s->vectors + (size_t)i * s->dimensions, s->dimensions);
+  }
+}
+
+/**
+ * Set assignments[i] to the closest centroid of each of the n vectors, split
+ * across up to p->threads threads from the thread budget.
+ */
+static void index_assign(lembed_index_vtab *p, const float *centroids,
+                         int n_centroids, const float *vectors, int n,
+                         int *assignments) {
+  int want = p->threads;
+  if (want > n) {
+    want = n > 0 ? n : 1;
+  }
+  int n_threads = lembed_threads_acquire(want);
+  lembed_index_slice slices[64];
+  lembed_thread threads[64];
+  int started[64];
+  if (n_threads > 64) {
+    n_threads = 64;
+  }
+  int per_thread = (n + n_threads - 1) / n_threads;
+  for (int t = 0; t < n_threads; t++) {
+    int first = t * per_thread;
+    int count = n - first < per_thread ? n - first : per_thread;
+    slices[t] = (lembed_index_slice){centroids,
+                                     n_centroids,
+                                     p->dimensions,
+                                     vectors + (size_t)first * p->dimensions,
+                                     count > 0 ? count : 0,
+                                     assignments + first};
+    // The calling thread takes the first slice, and any a thread couldn't
+    // be started for
+    started[t] = t > 0 && lembed_thread_create(&threads[t], index_assign_slice,
+                                               &slices[t]) == SQLITE_OK;
+  }
+  for (int t = 0; t < n_threads; t++) {
+    if (!started[t]) {
+      index_assign_slice(&slices[t]);
+    }
+  }
+  for (int t = 1; t < n_threads; t++) {
+    if (started[t]) {
+      lembed_thread_join(threads[t]);
+    }
+  }
+  lembed_threads_release(n_threads);
+}
+
+/** splitmix64, seeded from sqlite3_randomness(), for sampling. */
+static uint64_t index_random(uint64_t *state) {
+  uint64_t z = (*state += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+/**
+ * Train centroids with k-means on a sample of the vectors, and move every
+ * vector to the list of its closest centroid. New lists get ids above every
+ * old one, so the old vectors can be read while the new ones are written,
+ * and dropped with a single range delete at the end.
+ */
+static int index_build(lembed_index_vtab *p) {
+  int dims = p->dimensions;
+  sqlite3_int64 n = 0;
+  sqlite3_int64 base = 0;
+  sqlite3_stmt *stmt;
+  char *zSql = sqlite3_mprintf(
+      "SELECT (SELECT count(*) FROM \"%w\".\"%w_rowids\"), "
+      "max(coalesce((SELECT max(key) >> 32 FROM \"%w\".\"%w_vectors\"), 0), "
+      "coalesce((SELECT max(id) FROM \"%w\".\"%w_centroids\"), 0))",
+      p->schema, p->name, p->schema, p->name, p->schema, p->name);
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  int rc = sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  if (sqlite3_step(stmt) == SQLITE_ROW) {
+    n = sqlite3_column_int64(stmt, 0);
+    base = sqlite3_column_int64(stmt, 1) + 1;
+  }
+  sqlite3_finalize(stmt);
+
+  rc = index_exec(p, "DELETE FROM \"%w\".\"%w_centroids\"");
+  if (rc != SQLITE_OK || n == 0) {
+    return rc;
+  }
+
+  sqlite3_int64 n_sample = LEMBED_INDEX_TRAIN_FLOATS / dims;
+  if (n_sample > n) {
+    n_sample = n;
+  }
+  sqlite3_int64 lists = p->lists;
+  if (lists == 0) {
+    lists = (sqlite3_int64)sqrt((double)n);
+  }
+  if (lists < 1) {
+    lists = 1;
+  }
+  if (lists > n_sample) {
+    lists = n_sample;
+  }
+  if (base + lists >= INT32_MAX) {
+    p->base.zErrMsg = sqlite3_mprintf("%s has run out of list ids", p->name);
+    return SQLITE_FULL;
+  }
+
+  uint64_t random_state;
+  sqlite3_randomness(sizeof(random_state), &random_state);
+  sqlite3_int64 *keys = sqlite3_malloc64(sizeof(sqlite3_int64) * n_sample);
+  float *sample = sqlite3_malloc64(sizeof(float) * dims * n_sample);
+  int *assignments = sqlite3_malloc64(
+      sizeof(int) * (n_sample > LEMBED_INDEX_CHUNK ? n_sample
+                                                   : LEMBED_INDEX_CHUNK));
+  float *centroids = sqlite3_malloc64(sizeof(float) * dims * lists);
+  float *sums = sqlite3_malloc64(sizeof(float) * dims * lists);
+  int *counts = sqlite3_malloc64(sizeof(int) * lists);
+  sqlite3_int64 *ids = sqlite3_malloc64(sizeof(sqlite3_int64) *
+                                        LEMBED_INDEX_CHUNK);
+  float *chunk = sqlite3_malloc64(sizeof(float) * dims * LEMBED_INDEX_CHUNK);
+  uint32_t *slots = sqlite3_malloc64(sizeof(uint32_t) * lists);
+  rc = SQLITE_NOMEM;
+  if (!keys || !sample || !assignments || !centroids || !sums || !counts ||
+      !ids || !chunk || !slots) {
+    goto done;
+  }
+
+  // Reservoir sample of the keys, shuffled, so the first lists vectors of the
+  // sample are a random pick for the initial centroids
+  zSql = sqlite3_mprintf("SELECT key FROM \"%w\".\"%w_rowids\"", p->schema,
+                         p->name);
+  rc = zSql ? sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL) : SQLITE_NOMEM;
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  sqlite3_int64 seen = 0;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    sqlite3_int64 key = sqlite3_column_int64(stmt, 0);
+    if (seen < n_sample) {
+      keys[seen] = key;
+    } else {
+      uint64_t j = index_random(&random_state) % (uint64_t)(seen + 1);
+      if (j < (uint64_t)n_sample) {
+        keys[j] = key;
+      }
+    }
+    seen++;
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_DONE || seen < n_sample) {
+    rc = rc == SQLITE_DONE ? SQLITE_CORRUPT_VTAB : rc;
+    goto done;
+  }
+  for (sqlite3_int64 i = n_sample - 1; i > 0; i--) {
+    sqlite3_int64 j = index_random(&random_state) % (uint64_t)(i + 1);
+    sqlite3_int64 tmp = keys[i];
+    keys[i] = keys[j];
+    keys[j] = tmp;
+  }
+  for (sqlite3_int64 i = 0; i < n_sample; i++) {
+    stmt = index_stmt(p, LEMBED_INDEX_STMT_VECTOR);
+    if (!stmt) {
+      rc = SQLITE_ERROR;
+      goto done;
+    }
+    sqlite3_bind_int64(stmt, 1, keys[i]);
+    if (sqlite3_step(stmt) != SQLITE_ROW ||
+        sqlite3_column_bytes(stmt, 0) != (int)sizeof(float) * dims) {
+      sqlite3_reset(stmt);
+      rc = SQLITE_CORRUPT_VTAB;
+      goto done;
+    }
+    memcpy(sample + i * dims, sqlite3_column_blob(stmt, 0),
+           sizeof(float) * dims);
+    sqlite3_reset(stmt);
+  }
+
+  // Spherical k-means: vectors are normalized, so are the centroids
+  memcpy(centroids, sample, sizeof(float) * dims * lists);
+  for (int iteration = 0; iteration < LEMBED_INDEX_ITERATIONS; iteration++) {
+    index_assign(p, centroids, lists, sample, n_sample, assignments);
+    memset(sums, 0, sizeof(float) * dims * lists);
+    memset(counts, 0, sizeof(int) * lists);
+    for (sqlite3_int64 i = 0; i < n_sample; i++) {
+      float *sum = sums + (size_t)assignments[i] * dims;
+      const float *vector = sample + i * dims;
+      for (int d = 0; d < dims; d++) {
+        sum[d] += vector[d];
+      }
+      counts[assignments[i]]++;
+    }
+    for (sqlite3_int64 c = 0; c < lists; c++) {
+      if (counts[c] == 0) {
+        // An empty list restarts from a random vector of the sample
+        sqlite3_int64 i = index_random(&random_state) % (uint64_t)n_sample;
+        memcpy(centroids + c * dims, sample + i * dims, sizeof(float) * dims);
+      } else {
+        kernels.normalize(sums + c * dims, centroids + c * dims, dims);
+      }
+    }
+  }
+
+  zSql = sqlite3_mprintf(
+      "INSERT INTO \"%w\".\"%w_centroids\"(id, centroid) VALUES (?, ?)",
+      p->schema, p->name);
+  rc = zSql ? sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL) : SQLITE_NOMEM;
+  sqlite3_free(zSql);
+  for (sqlite3_int64 c = 0; c < lists && rc == SQLITE_OK; c++) {
+    sqlite3_bind_int64(stmt, 1, base + c);
+    sqlite3_bind_blob(stmt, 2, centroids + c * dims, sizeof(float) * dims,
+                      SQLITE_STATIC);
+    rc = index_step_done(stmt);
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+
+  // Move every vector to its new list, a chunk of rowids at a time
+  zSql = sqlite3_mprintf(
+      "SELECT r.id, v.embedding FROM \"%w\".\"%w_rowids\" AS r "
+      "JOIN \"%w\".\"%w_vectors\" AS v ON v.key = r.key "
+      "WHERE r.id > ? ORDER BY r.id LIMIT %d",
+      p->schema, p->name, p->schema, p->name, LEMBED_INDEX_CHUNK);
+  rc = zSql ? sqlite3_prepare_v2(p->db, zSql, -1, &stmt, NULL) : SQLITE_NOMEM;
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  memset(slots, 0, sizeof(uint32_t) * lists);
+  sqlite3_int64 last_id = INT64_MIN;
+  while (rc == SQLITE_OK) {
+    int n_chunk = 0;
+    sqlite3_bind_int64(stmt, 1, last_id);
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+      if (sqlite3_column_bytes(stmt, 1) != (int)sizeof(float) * dims) {
+        rc = SQLITE_CORRUPT_VTAB;
+        break;
+      }
+      ids[n_chunk] = sqlite3_column_int64(stmt, 0);
+      memcpy(chunk + (size_t)n_chunk * dims, sqlite3_column_blob(stmt, 1),
+             sizeof(float) * dims);
+      n_chunk++;
+    }
+    sqlite3_reset(stmt);
+    if (rc != SQLITE_OK || n_chunk == 0) {
+      break;
+    }
+    last_id = ids[n_chunk - 1];
+    index_assign(p, centroids, lists, chunk, n_chunk, assignments);
+    for (int i = 0; i < n_chunk && rc == SQLITE_OK; i++) {
+      int c = assignments[i];
+      sqlite3_int64 key = ((base + c) << 32) | slots[c]++;
+      sqlite3_stmt *insert = index_stmt(p, LEMBED_INDEX_STMT_INSERT_VECTOR);
+      sqlite3_stmt *set_key = index_stmt(p, LEMBED_INDEX_STMT_SET_KEY);
+      if (!insert || !set_key) {
+        rc = SQLITE_ERROR;
+        break;
+      }
+      sqlite3_bind_int64(insert, 1, key);
+      sqlite3_bind_int64(insert, 2, ids[i]);
+      sqlite3_bind_blob(insert, 3, chunk + (size_t)i * dims,
+                        sizeof(float) * dims, SQLITE_STATIC);
+      rc = index_step_done(insert);
+      if (rc == SQLITE_OK) {
+        sqlite3_bind_int64(set_key, 1, key);
+        sqlite3_bind_int64(set_key, 2, ids[i]);
+        rc = index_step_done(set_key);
+      }
+    }
+  }
+  sqlite3_finalize(stmt);
+  if (rc != SQLITE_OK) {
+    goto done;
+  }
+  zSql = sqlite3_mprintf("DELETE FROM \"%w\".\"%w_vectors\" WHERE key < %lld",
+                         p->schema, p->name, base << 32);
+  rc = zSql ? sqlite3_exec(p->db, zSql, NULL, NULL, NULL) : SQLITE_NOMEM;
+  sqlite3_free(zSql);
+  if (rc == SQLITE_OK) {
+    sqlite3_free(p->centroids);
+    p->centroids = centroids;
+    p->centroids_base = base;
+    p->n_centroids = lists;
+    centroids = NULL;
+  }
+
+done:
+  sqlite3_free(keys);
+  sqlite3_free(sample);
+  sqlite3_free(assignments);
+  sqlite3_free(centroids);
+  sqlite3_free(sums);
+  sqlite3_free(counts);
+  sqlite3_free(ids);
+  sqlite3_free(chunk);
+  sqlite3_free(slots);
+  return rc;
+}
+
+/**
+ * Read a float32 vector of p's dimensions from value into p->vector,
+ * normalized. Sets an error on p when value isn't one.
+ */
+static int index_vector_from_value(lembed_index_vtab *p, sqlite3_value *value,
+                                   const char *argument) {
+  if (sqlite3_value_type(value) != SQLITE_BLOB ||
+      sqlite3_value_bytes(value) != (int)sizeof(float) * p->dimensions) {
+    sqlite3_free(p->base.zErrMsg);
+    p->base.zErrMsg = sqlite3_mprintf(
+        "%s must be a float32 vector BLOB with %d dimensions", argument,
+        p->dimensions);
+    return SQLITE_ERROR;
+  }
+  kernels.normalize((const float *)sqlite3_value_blob(value), p->vector,
+                    p->dimensions);
+  return SQLITE_OK;
+}
+
+static int index_insert(lembed_index_vtab *p, sqlite3_value *rowid,
+                        sqlite3_value *embedding, sqlite_int64 *pRowid) {
+  int rc = index_vector_from_value(p, embedding, "embedding");
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  rc = index_centroids_load(p);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_int64 list = 0;
+  if (p->n_centroids > 0) {
+    list = p->centroids_base + index_nearest(p->centroids, p->n_centroids,
+                                             p->vector, p->dimensions);
+  }
+  sqlite3_stmt *stmt = index_stmt(p, LEMBED_INDEX_STMT_NEXT_KEY);
+  if (!stmt) {
+    return SQLITE_ERROR;
+  }
+  sqlite3_bind_int64(stmt, 1, list << 32);
+  sqlite3_bind_int64(stmt, 2, (list << 32) | UINT32_MAX);
+  if (sqlite3_step(stmt) != SQLITE_ROW) {
+    sqlite3_reset(stmt);
+    return SQLITE_ERROR;
+  }
+  sqlite3_int64 key = sqlite3_column_type(stmt, 0) == SQLITE_NULL
+                          ? list << 32
+                          : sqlite3_column_int64(stmt, 0) + 1;
+  sqlite3_reset(stmt);
+  if ((key >> 32) != list) {
+    p->base.zErrMsg = sqlite3_mprintf(
+        "List %lld of %s is full, build the index again", list, p->name);
+    return SQLITE_FULL;
+  }
+
+  stmt = index_stmt(p, LEMBED_INDEX_STMT_INSERT_ROWID);
+  if (!stmt) {
+    return SQLITE_ERROR;
+  }
+  sqlite3_bind_value(stmt, 1, rowid);
+  sqlite3_bind_int64(stmt, 2, key);
+  rc = index_step_done(stmt);
+  if (rc == SQLITE_CONSTRAINT) {
+    p->base.zErrMsg = sqlite3_mprintf("A row with rowid %lld is already in %s",
+                                      sqlite3_value_int64(rowid), p->name);
+    return rc;
+  }
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  sqlite3_int64 id = sqlite3_value_type(rowid) == SQLITE_NULL
+                         ? sqlite3_last_insert_rowid(p->db)
+                         : sqlite3_value_int64(rowid);
+  stmt = index_stmt(p, LEMBED_INDEX_STMT_INSERT_VECTOR);
+  if (!stmt) {
+    return SQLITE_ERROR;
+  }
+  sqlite3_bind_int64(stmt, 1, key);
+  sqlite3_bind_int64(stmt, 2, id);
+  sqlite3_bind_blob(stmt, 3, p->vector, sizeof(float) * p->dimensions,
+                    SQLITE_STATIC);
+  rc = index_step_done(stmt);
+  *pRowid = id;
+  return rc;
+}
+
+static int index_delete(lembed_index_vtab *p, sqlite3_value *rowid) {
+  sqlite3_stmt *stmt = index_stmt(p, LEMBED_INDEX_STMT_KEY);
+  if (!stmt) {
+    return SQLITE_ERROR;
+  }
+  sqlite3_bind_value(stmt, 1, rowid);
+  if (sqlite3_step(stmt) != SQLITE_ROW) {
+    sqlite3_reset(stmt);
+    return SQLITE_OK;
+  }
+  sqlite3_int64 key = sqlite3_column_int64(stmt, 0);
+  sqlite3_reset(stmt);
+  stmt = index_stmt(p, LEMBED_INDEX_STMT_DELETE_VECTOR);
+  if (!stmt) {
+    return SQLITE_ERROR;
+  }
+  sqlite3_bind_int64(stmt, 1, key);
+  int rc = index_step_done(stmt);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  stmt = index_stmt(p, LEMBED_INDEX_STMT_DELETE_ROWID);
+  if (!stmt) {
+    return SQLITE_ERROR;
+  }
+  sqlite3_bind_value(stmt, 1, rowid);
+  return index_step_done(stmt);
+}
+
+/**
+ * INSERT, UPDATE and DELETE of vectors, and the 'build' command, inserted
+ * FTS5 style into the hidden column named after the table.
+ */
+static int lembed_indexUpdate(sqlite3_vtab *pVTab, int argc,
+                              sqlite3_value **argv, sqlite_int64 *pRowid) {
+  lembed_index_vtab *p = (lembed_index_vtab *)pVTab;
+  int rc;
+  if (argc == 1) {
+    rc = index_delete(p, argv[0]);
+  } else if (sqlite3_value_type(argv[0]) == SQLITE_NULL &&
+             sqlite3_value_type(argv[2 + LEMBED_INDEX_COMMAND]) !=
+                 SQLITE_NULL) {
+    const char *command =
+        (const char *)sqlite3_value_text(argv[2 + LEMBED_INDEX_COMMAND]);
+    if (sqlite3_stricmp(command, "build") != 0) {
+      pVTab->zErrMsg = sqlite3_mprintf(
+          "Unknown %s command '%s', expected 'build'", p->name, command);
+      return SQLITE_ERROR;
+    }
+    rc = index_build(p);
+  } else if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+    rc = index_insert(p, argv[1], argv[2 + LEMBED_INDEX_EMBEDDING], pRowid);
+  } else {
+    rc = index_delete(p, argv[0]);
+    if (rc == SQLITE_OK) {
+      rc = index_insert(p, argv[1], argv[2 + LEMBED_INDEX_EMBEDDING], pRowid);
+    }
+  }
+  if (rc != SQLITE_OK && !pVTab->zErrMsg) {
+    pVTab->zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(p->db));
+  }
+  return rc;
+}
+
+static int lembed_indexOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  lembed_index_cursor *pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == 0)
+    return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
+
+static void lembed_index_cursor_clear(lembed_index_cursor *pCur) {
+  sqlite3_finalize(pCur->stmt);
+  sqlite3_free(pCur->rowids);
+  sqlite3_free(pCur->distances);
+  pCur->stmt = NULL;
+  pCur->rowids = NULL;
+  pCur->distances = NULL;
+  pCur->n_results = 0;
+  pCur->i = 0;
+  pCur->knn = 0;
+  pCur->eof = 0;
+}
+
+static int lembed_indexClose(sqlite3_vtab_cursor *cur) {
+  lembed_index_cursor *pCur = (lembed_index_cursor *)cur;
+  lembed_index_cursor_clear(pCur);
+  sqlite3_free(pCur);
+  return SQLITE_OK;
+}
+
+static int lembed_indexBestIndex(sqlite3_vtab *pVTab,
+                                 sqlite3_index_info *pIdxInfo) {
+  int match = -1;
+  int k = -1;
+  int nprobe = -1;
+  int limit = -1;
+  int rowid = -1;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    if (!pCons->usable) {
+      continue;
+    }
+    if (pCons->op == SQLITE_INDEX_CONSTRAINT_MATCH &&
+        pCons->iColumn == LEMBED_INDEX_EMBEDDING) {
+      match = i;
+    } else if (pCons->op == SQLITE_INDEX_CONSTRAINT_EQ &&
+               pCons->iColumn == LEMBED_INDEX_K) {
+      k = i;
+    } else if (pCons->op == SQLITE_INDEX_CONSTRAINT_EQ &&
+               pCons->iColumn == LEMBED_INDEX_NPROBE) {
+      nprobe = i;
+    } else if (pCons->op == SQLITE_INDEX_CONSTRAINT_EQ &&
+               pCons->iColumn == -1) {
+      rowid = i;
+    }
+#ifdef SQLITE_INDEX_CONSTRAINT_LIMIT
+    else if (pCons->op == SQLITE_INDEX_CONSTRAINT_LIMIT) {
+      limit = i;
+    }
+#endif
+  }
+
+  if (match >= 0) {
+    int argvIndex = 1;
+    pIdxInfo->idxNum = LEMBED_INDEX_PLAN_KNN;
+    pIdxInfo->aConstraintUsage[match].argvIndex = argvIndex++;
+    pIdxInfo->aConstraintUsage[match].omit = 1;
+    if (k >= 0) {
+      pIdxInfo->idxNum |= LEMBED_INDEX_PLAN_K;
+      pIdxInfo->aConstraintUsage[k].argvIndex = argvIndex++;
+      pIdxInfo->aConstraintUsage[k].omit = 1;
+    } else if (limit >= 0) {
+      pIdxInfo->idxNum |= LEMBED_INDEX_PLAN_LIMIT;
+      pIdxInfo->aConstraintUsage[limit].argvIndex = argvIndex++;
+    }
+    if (nprobe >= 0) {
+      pIdxInfo->idxNum |= LEMBED_INDEX_PLAN_NPROBE;
+      pIdxInfo->aConstraintUsage[nprobe].argvIndex = argvIndex++;
+      pIdxInfo->aConstraintUsage[nprobe].omit = 1;
+    }
+    if (pIdxInfo->nOrderBy == 1 &&
+        pIdxInfo->aOrderBy[0].iColumn == LEMBED_INDEX_DISTANCE &&
+        !pIdxInfo->aOrderBy[0].desc) {
+      pIdxInfo->orderByConsumed = 1;
+    }
+    pIdxInfo->estimatedCost = 10;
+    pIdxInfo->estimatedRows = 10;
+    return SQLITE_OK;
+  }
+  if (rowid >= 0) {
+    pIdxInfo->idxNum = LEMBED_INDEX_PLAN_ROWID;
+    pIdxInfo->aConstraintUsage[rowid].argvIndex = 1;
+    pIdxInfo->aConstraintUsage[rowid].omit = 1;
+    pIdxInfo->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+    pIdxInfo->estimatedCost = 1;
+    pIdxInfo->estimatedRows = 1;
+    return SQLITE_OK;
+  }
+  pIdxInfo->idxNum = 0;
+  pIdxInfo->estimatedCost = 1000000;
+  pIdxInfo->estimatedRows = 1000000;
+  return SQLITE_OK;
+}
+
+/** Scan the vectors of list into the k-sized max-heap of items. */
+static int index_scan_list(lembed_index_vtab *p, sqlite3_int64 list,
+                           const float *query, lembed_topk_item *items,
+                           int k, int *n_items) {
+  sqlite3_stmt *stmt = index_stmt(p, LEMBED_INDEX_STMT_SCAN_LIST);
+  if (!stmt) {
+    return SQLITE_ERROR;
+  }
+  sqlite3_bind_int64(stmt, 1, list << 32);
+  sqlite3_bind_int64(stmt, 2, (list << 32) | UINT32_MAX);
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    if (sqlite3_column_bytes(stmt, 1) != (int)sizeof(float) * p->dimensions) {
+      rc = SQLITE_CORRUPT_VTAB;
+      break;
+    }
+    const float *vector = sqlite3_column_blob(stmt, 1);
+    lembed_topk_item item = {
+        1.0f - kernels.dot(query, vector, p->dimensions),
+        sqlite3_column_int64(stmt, 0), NULL};
+    if (*n_items == k) {
+      if (topk_item_worse(&items[0], &item)) {
+        items[0] = item;
+        topk_sift_down(items, k, 0);
+      }
+    } else {
+      items[*n_items] = item;
+      topk_sift_up(items, *n_items);
+      (*n_items)++;
+    }
+  }
+  sqlite3_reset(stmt);
+  return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+/** Find the k vectors closest to query, probing the nprobe closest lists. */
+static int index_knn(lembed_index_vtab *p, lembed_index_cursor *pCur,
+                     sqlite3_value *query, sqlite3_int64 k,
+                     sqlite3_int64 nprobe) {
+  if (index_vector_from_value(p, query, "lembed_index query") != SQLITE_OK) {
+    return SQLITE_ERROR;
+  }
+  if (k < 1 || k > LEMBED_INDEX_K_MAX) {
+    p->base.zErrMsg = sqlite3_mprintf("k must be between 1 and %d",
+                                      LEMBED_INDEX_K_MAX);
+    return SQLITE_ERROR;
+  }
+  if (nprobe < 1) {
+    p->base.zErrMsg = sqlite3_mprintf("nprobe must be at least 1");
+    return SQLITE_ERROR;
+  }
+  int rc = index_centroids_load(p);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  if (nprobe > p->n_centroids) {
+    nprobe = p->n_centroids;
+  }
+
+  lembed_topk_item *items = sqlite3_malloc64(sizeof(lembed_topk_item) * k);
+  lembed_topk_item *probes =
+      sqlite3_malloc64(sizeof(lembed_topk_item) * (nprobe > 0 ? nprobe : 1));
+  if (!items || !probes) {
+    sqlite3_free(items);
+    sqlite3_free(probes);
+    return SQLITE_NOMEM;
+  }
+  int n_probes = 0;
+  for (int c = 0; c < p->n_centroids && nprobe > 0; c++) {
+    lembed_topk_item item = {
+        1.0f - kernels.dot(p->vector,
+                           p->centroids + (size_t)c * p->dimensions,
+                           p->dimensions),
+        c, NULL};
+    if (n_probes == nprobe) {
+      if (topk_item_worse(&probes[0], &item)) {
+        probes[0] = item;
+        topk_sift_down(probes, n_probes, 0);
+      }
+    } else {
+      probes[n_probes] = item;
+      topk_sift_up(probes, n_probes);
+      n_probes++;
+    }
+  }
+
+  // List 0 holds the vectors inserted before the first build
+  int n_items = 0;
+  rc = index_scan_list(p, 0, p->vector, items, k, &n_items);
+  for (int i = 0; i < n_probes && rc == SQLITE_OK; i++) {
+    rc = index_scan_list(p, p->centroids_base + probes[i].seq, p->vector,
+                         items, k, &n_items);
+  }
+  sqlite3_free(probes);
+  if (rc == SQLITE_OK) {
+    pCur->rowids = sqlite3_malloc64(sizeof(sqlite3_int64) * (n_items + 1));
+    pCur->distances = sqlite3_malloc64(sizeof(float) * (n_items + 1));
+    rc = pCur->rowids && pCur->distances ? SQLITE_OK : SQLITE_NOMEM;
+  }
+  if (rc == SQLITE_OK) {
+    // Pop the max-heap from the back, so the closest item ends up first.
+    for (int i = n_items - 1; i >= 0; i--) {
+      pCur->rowids[i] = items[0].seq;
+      pCur->distances[i] = items[0].distance;
+      items[0] = items[i];
+      topk_sift_down(items, i, 0);
+    }
+    pCur->n_results = n_items;
+  }
+  sqlite3_free(items);
+  return rc;
+}
+
+static int lembed_indexFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                              const char *idxStr, int argc,
+                              sqlite3_value **argv) {
+  lembed_index_cursor *pCur = (lembed_index_cursor *)pVtabCursor;
+  lembed_index_vtab *p = (lembed_index_vtab *)pVtabCursor->pVtab;
+  lembed_index_cursor_clear(pCur);
+
+  if (idxNum & LEMBED_INDEX_PLAN_KNN) {
+    pCur->knn = 1;
+    int i = 1;
+    sqlite3_int64 k = -1;
+    sqlite3_int64 nprobe = p->nprobe;
+    if (idxNum & LEMBED_INDEX_PLAN_K) {
+      k = sqlite3_value_int64(argv[i++]);
+    } else if (idxNum & LEMBED_INDEX_PLAN_LIMIT) {
+      // Any LIMIT is valid SQL, so it's clamped rather than checked. A
+      // negative one means no limit.
+      k = sqlite3_value_int64(argv[i++]);
+      if (k == 0) {
+        pCur->eof = 1;
+        return SQLITE_OK;
+      }
+      if (k < 0 || k > LEMBED_INDEX_K_MAX) {
+        k = LEMBED_INDEX_K_MAX;
+      }
+    } else {
+      // SQLite only passes a LIMIT down since 3.38, and not for every query
+      // even then
+      k = LEMBED_INDEX_K_DEFAULT;
+    }
+    if (idxNum & LEMBED_INDEX_PLAN_NPROBE) {
+      nprobe = sqlite3_value_int64(argv[i++]);
+    }
+    int rc = index_knn(p, pCur, argv[0], k, nprobe);
+    if (rc != SQLITE_OK && !p->base.zErrMsg) {
+      p->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(p->db));
+    }
+    pCur->eof = pCur->n_results == 0;
+    return rc;
+  }
+
+  char *zSql = sqlite3_mprintf(
+      "SELECT r.id, v.embedding FROM \"%w\".\"%w_rowids\" AS r "
+      "JOIN \"%w\".\"%w_vectors\" AS v ON v.key = r.key%s",
+      p->schema, p->name, p->schema, p->name,
+      idxNum == LEMBED_INDEX_PLAN_ROWID ? " WHERE r.id = ?" : "");
+  if (!zSql) {
+    return SQLITE_NOMEM;
+  }
+  int rc = sqlite3_prepare_v2(p->db, zSql, -1, &pCur->stmt, NULL);
+  sqlite3_free(zSql);
+  if (rc != SQLITE_OK) {
+    p->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(p->db));
+    return rc;
+  }
+  if (idxNum == LEMBED_INDEX_PLAN_ROWID) {
+    sqlite3_bind_value(pCur->stmt, 1, argv[0]);
+  }
+  rc = sqlite3_step(pCur->stmt);
+  pCur->eof = rc != SQLITE_ROW;
+  return rc == SQLITE_ROW || rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int lembed_indexNext(sqlite3_vtab_cursor *cur) {
+  lembed_index_cursor *pCur = (lembed_index_cursor *)cur;
+  if (pCur->knn) {
+    pCur->i++;
+    pCur->eof = pCur->i >= pCur->n_results;
+    return SQLITE_OK;
+  }
+  int rc = sqlite3_step(pCur->stmt);
+  pCur->eof = rc != SQLITE_ROW;
+  return rc == SQLITE_ROW || rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int lembed_indexEof(sqlite3_vtab_cursor *cur) {
+  return ((lembed_index_cursor *)cur)->eof;
+}
+
+static int lembed_indexRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  lembed_index_cursor *pCur = (lembed_index_cursor *)cur;
+  *pRowid = pCur->knn ? pCur->rowids[pCur->i]
+                      : sqlite3_column_int64(pCur->stmt, 0);
+  return SQLITE_OK;
+}
+
+static int lembed_indexColumn(sqlite3_vtab_cursor *cur,
+                              sqlite3_context *context, int i) {
+  lembed_index_cursor *pCur = (lembed_index_cursor *)cur;
+  lembed_index_vtab *p = (lembed_index_vtab *)cur->pVtab;
+  switch (i) {
+  case LEMBED_INDEX_EMBEDDING: {
+    if (!pCur->knn) {
+      sqlite3_result_value(context, sqlite3_column_value(pCur->stmt, 1));
+      sqlite3_result_subtype(context, LEMBED_FLOAT32_SUBTYPE);
+      break;
+    }
+    sqlite3_stmt *stmt = index_stmt(p, LEMBED_INDEX_STMT_EMBEDDING);
+    if (!stmt) {
+      sqlite3_result_error(context, sqlite3_errmsg(p->db), -1);
+      return SQLITE_ERROR;
+    }
+    sqlite3_bind_int64(stmt, 1, pCur->rowids[pCur->i]);
+    if (sqlite3_step(stmt) == SQLITE_ROW) {
+      sqlite3_result_value(context, sqlite3_column_value(stmt, 0));
+      sqlite3_result_subtype(context, LEMBED_FLOAT32_SUBTYPE);
+    }
+    sqlite3_reset(stmt);
+    break;
+  }
+  case LEMBED_INDEX_DISTANCE:
+    if (pCur->knn) {
+      sqlite3_result_double(context, pCur->distances[pCur->i]);
+    }
+    break;
+  }
+  return SQLITE_OK;
+}
+
+static sqlite3_module lembed_indexModule = {
+    /* iVersion    */ 3,
+    /* xCreate     */ lembed_indexCreate,
+    /* xConnect    */ lembed_indexConnect,
+    /* xBestIndex  */ lembed_indexBestIndex,
+    /* xDisconnect */ lembed_indexDisconnect,
+    /* xDestroy    */ lembed_indexDestroy,
+    /* xOpen       */ lembed_indexOpen,
+    /* xClose      */ lembed_indexClose,
+    /* xFilter     */ lembed_indexFilter,
+    /* xNext       */ lembed_indexNext,
+    /* xEof        */ lembed_indexEof,
+    /* xColumn     */ lembed_indexColumn,
+    /* xRowid      */ lembed_indexRowid,
+    /* xUpdate     */ lembed_indexUpdate,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ lembed_indexRename,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ lembed_indexShadowName};
+#pragma endregion
+
+#pragma region lembed_chunks() table function
+
+/*
+ * lembed_chunks(model, source, chunk_size, overlap) splits source into windows
+ * of chunk_size tokens, where consecutive windows share overlap tokens. Each
+ * row is a slice of source, from the first byte of its first token to the last
+ * byte of its last token.
+ *
+ * llama.cpp doesn't report where in the input each token came from, so tokens
+ * are aligned back to source by matching their pieces, case-insensitively and
+ * ignoring word-boundary whitespace. Pieces that don't match (like [UNK])
+ * cover the rest of the word they start in.
+ *
+ * Source is tokenized LEMBED_CHUNKS_SEGMENT_BYTES at a time, split at
+ * whitespace, and only the tokens from the current row onwards are kept, so
+ * large documents are chunked with bounded memory on top of the source itself.
+ */
+#define LEMBED_CHUNKS_SEGMENT_BYTES (16 * 1024)
+
+/**
+ * Tokens of a source text, tokenized incrementally, along with the byte
+ * offsets in source they were aligned to. Tokens that are no longer needed are
+ * dropped from the front with token_stream_drop().
+ */
+typedef struct lembed_token_stream lembed_token_stream;
+struct lembed_token_stream {
+  struct llama_model *model;
+  lembed_stats *stats;
+  char *source;
+  sqlite3_int64 source_length;
+  // Bytes of source handed to llama_tokenize() so far
+  sqlite3_int64 tokenized;
+
+  int n_tokens;
+  int tokens_capacity;
+  llama_token *tokens;
+  sqlite3_int64 *token_starts;
+  sqlite3_int64 *token_ends;
+
+  // Scratch buffers for llama_tokenize() and llama_token_to_piece()
+  llama_token *segment;
+  int segment_capacity;
+  char *piece;
+  int piece_capacity;
+};
+
+static void token_stream_clear(lembed_token_stream *stream) {
+  sqlite3_free(stream->source);
+  sqlite3_free(stream->tokens);
+  sqlite3_free(stream->token_starts);
+  sqlite3_free(stream->token_ends);
+  sqlite3_free(stream->segment);
+  sqlite3_free(stream->piece);
+  memset(stream, 0, sizeof(*stream));
+}
+
+static int chunks_is_space(unsigned char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r' || c == '\f' ||
+         c == '\v';
+}
+
+static unsigned char chunks_ascii_lower(unsigned char c) {
+  return c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c;
+}
+
+/** Length of the UTF-8 character that starts with byte c. */
+static int chunks_utf8_length(unsigned char c) {
+  if ((c & 0xE0) == 0xC0)
+    return 2;
+  if ((c & 0xF0) == 0xE0)
+    return 3;
+  if ((c & 0xF8) == 0xF0)
+    return 4;
+  return 1;
+}
+
+/**
+ * Number of bytes at the start of src that piece was tokenized from. Tokenizers
+ * like WordPiece lowercase and strip accents, so ASCII is compared
+ * case-insensitively and a non-ASCII character in src matches any single
+ * character in piece. Returns 0 when nothing matches.
+ */
+static sqlite3_int64 chunks_match_piece(const char *src, sqlite3_int64 src_len,
+                                        const char *piece, int piece_len) {
+  sqlite3_int64 i = 0;
+  int j = 0;
+  while (i < src_len && j < piece_len) {
+    unsigned char s = src[i];
+    unsigned char c = piece[j];
+    if (chunks_ascii_lower(s) == chunks_ascii_lower(c)) {
+      i++;
+      j++;
+    } else if (s >= 0x80) {
+      i += chunks_utf8_length(s);
+      j += chunks_utf8_length(c);
+    } else {
+      break;
+    }
+  }
+  return i < src_len ? i : src_len;
+}
+
+static int token_stream_grow(lembed_token_stream *stream, int needed) {
+  if (needed <= stream->tokens_capacity) {
+    return SQLITE_OK;
+  }
+  int capacity = stream->tokens_capacity ? stream->tokens_capacity : 256;
+  while (capacity < needed) {
+    capacity *= 2;
+  }
+  llama_token *tokens =
+      sqlite3_realloc64(stream->tokens, sizeof(llama_token) * capacity);
+  if (!tokens) {
+    return SQLITE_NOMEM;
+  }
+  stream->tokens = tokens;
+  sqlite3_int64 *starts =
+      sqlite3_realloc64(stream->token_starts, sizeof(sqlite3_int64) * capacity);
+  if (!starts) {
+    return SQLITE_NOMEM;
+  }
+  stream->token_starts = starts;
+  sqlite3_int64 *ends =
+      sqlite3_realloc64(stream->token_ends, sizeof(sqlite3_int64) * capacity);
+  if (!ends) {
+    return SQLITE_NOMEM;
+  }
+  stream->token_ends = ends;
+  stream->tokens_capacity = capacity;
+  return SQLITE_OK;
+}
+
+/**
+ * Tokenize the next segment of source, and append its tokens and their byte
+ * offsets to the stream.
+ */
+static int token_stream_tokenize_segment(lembed_token_stream *stream) {
+  const char *source = stream->source;
+  sqlite3_int64 begin = stream->tokenized;
+  sqlite3_int64 end = begin + LEMBED_CHUNKS_SEGMENT_BYTES;
+  if (end >= stream->source_length) {
+    end = stream->source_length;
+  } else {
+    // End the segment at whitespace, so no word is split across two
+    // llama_tokenize() calls.
+    sqlite3_int64 e = end;
+    while (e > begin && !chunks_is_space(source[e])) {
+      e--;
+    }
+    if (e > begin) {
+      end = e;
+    } else {
+      while (end < stream->source_length && !chunks_is_space(source[end])) {
+        end++;
+      }
+    }
+  }
+
+  int n;
+  while (1) {
+    n = llama_tokenize(stream->model, source + begin, end - begin, stream->segment,
+                       stream->segment_capacity, false, false);
+    if (n >= 0) {
+      break;
+    }
+    llama_token *segment =
+        sqlite3_realloc64(stream->segment, sizeof(llama_token) * -n);
+    if (!segment) {
+      return SQLITE_NOMEM;
+    }
+    stream->segment = segment;
+    stream->segment_capacity = -n;
+  }
+  int rc = token_stream_grow(stream, stream->n_tokens + n);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  sqlite3_int64 pos = begin;
+  for (int i = 0; i < n; i++) {
+    int piece_len;
+    while (1) {
+      piece_len = llama_token_to_piece(stream->model, stream->segment[i],
+                                       stream->piece, stream->piece_capacity,
+                                       false);
+      if (piece_len >= 0) {
+        break;
+      }
+      char *piece = sqlite3_realloc64(stream->piece, -piece_len);
+      if (!piece) {
+        return SQLITE_NOMEM;
+      }
+      stream->piece = piece;
+      stream->piece_capacity = -piece_len;
+    }
+
+    // Leading whitespace in a piece marks a word boundary, and the whitespace
+    // it stands for isn't made part of the token.
+    const char *piece = stream->piece;
+    while (piece_len > 0 && chunks_is_space(*piece)) {
+      piece++;
+      piece_len--;
+    }
+    sqlite3_int64 start = pos;
+    while (start < end && chunks_is_space(source[start])) {
+      start++;
+    }
+    sqlite3_int64 length = 0;
+    if (piece_len == 0) {
+      // Whitespace-only tokens cover the whitespace they were made from.
+      length = start - pos;
+      start = pos;
+    } else {
+      length = chunks_match_piece(source + start, end - start, piece,
+                                  piece_len);
+      if (length == 0) {
+        while (start + length < end &&
+               !chunks_is_space(source[start + length])) {
+          length++;
+        }
+      }
+    }
+    stream->tokens[stream->n_tokens] = stream->segment[i];
+    stream->token_starts[stream->n_tokens] = start;
+    stream->token_ends[stream->n_tokens] = start + length;
+    stream->n_tokens++;
+    pos = start + length;
+  }
+
+  stream->tokenized = end;
+  return SQLITE_OK;
+}
+
+/** Tokenize source until at least n tokens are buffered, or it runs out. */
+static int token_stream_fill(lembed_token_stream *stream, int n) {
+  while (stream->n_tokens < n && stream->tokenized < stream->source_length) {
+    int64_t start = lembed_time_ns();
+    int n_before = stream->n_tokens;
+    int rc = token_stream_tokenize_segment(stream);
+    lembed_stats_record(stream->stats, LEMBED_STAGE_TOKENIZE, start,
+                        stream->n_tokens - n_before, rc != SQLITE_OK);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+  return SQLITE_OK;
+}
+
+/** Drop the first n tokens of the stream. */
+static void token_stream_drop(lembed_token_stream *stream, int n) {
+  stream->n_tokens -= n;
+  memmove(stream->tokens, stream->tokens + n,
+          sizeof(llama_token) * stream->n_tokens);
+  memmove(stream->token_starts, stream->token_starts + n,
+          sizeof(sqlite3_int64) * stream->n_tokens);
+  memmove(stream->token_ends, stream->token_ends + n,
+          sizeof(sqlite3_int64) * stream->n_tokens);
+}
+
+/**
+ * Byte offsets in source of the count tokens starting at token first. Tokens
+ * from byte-level tokenizers can split a UTF-8 character, but spans never do.
+ */
+static void token_stream_span(lembed_token_stream *stream, int first, int count,
+                              sqlite3_int64 *out_start,
+                              sqlite3_int64 *out_end) {
+  sqlite3_int64 start = stream->token_starts[first];
+  sqlite3_int64 end = stream->token_ends[first + count - 1];
+  while (start > 0 && (stream->source[start] & 0xC0) == 0x80) {
+    start--;
+  }
+  while (end < stream->source_length &&
+         (stream->source[end] & 0xC0) == 0x80) {
+    end++;
+  }
+  *out_start = start;
+  *out_end = end;
+}
+
+/** Start a stream over a copy of source. */
+static int token_stream_init(lembed_token_stream *stream,
+                             struct llama_model *model, lembed_stats *stats,
+                             sqlite3_value *source) {
+  token_stream_clear(stream);
+  stream->model = model;
+  stream->stats = stats;
+  stream->source_length = sqlite3_value_bytes(source);
+  stream->source = sqlite3_malloc64(stream->source_length + 1);
+  if (!stream->source) {
+    return SQLITE_NOMEM;
+  }
+  const char *text = (const char *)sqlite3_value_text(source);
+  if (text) {
+    memcpy(stream->source, text, stream->source_length);
+  }
+  stream->source[stream->source_length] = 0;
+  return SQLITE_OK;
+}
+
+typedef struct lembed_chunks_vtab lembed_chunks_vtab;
+struct lembed_chunks_vtab {
+  sqlite3_vtab base;
+  struct Api *api;
+};
+
+typedef struct lembed_chunks_cursor lembed_chunks_cursor;
+struct lembed_chunks_cursor {
+  sqlite3_vtab_cursor base;
+  sqlite3_int64 iRowid;
+  char *model_name;
+  ApiModel *entry;
+  int chunk_size;
+  int overlap;
+  // Tokens of the current row onwards
+  lembed_token_stream stream;
+  int eof;
+  int chunk_token_count;
+};
+
+static int lembed_chunksConnect(sqlite3 *db, void *pAux, int argc,
+                                const char *const *argv, sqlite3_vtab **ppVtab,
+                                char **pzErr) {
+  lembed_chunks_vtab *pNew;
+  int rc;
+#define lembed_chunks_CONTENTS 0
+#define lembed_chunks_TOKEN_COUNT 1
+#define lembed_chunks_START_OFFSET 2
+#define lembed_chunks_END_OFFSET 3
+#define lembed_chunks_MODEL 4
+#define lembed_chunks_SOURCE 5
+#define lembed_chunks_CHUNK_SIZE 6
+#define lembed_chunks_OVERLAP 7
+  rc = sqlite3_declare_vtab(
+      db, "CREATE TABLE x(contents, token_count, start_offset, end_offset, "
+          "model hidden, source hidden, chunk_size hidden, overlap hidden)");
+  if (rc == SQLITE_OK) {
+    pNew = sqlite3_malloc(sizeof(*pNew));
+    *ppVtab = (sqlite3_vtab *)pNew;
+    if (pNew == 0)
+      return SQLITE_NOMEM;
+    memset(pNew, 0, sizeof(*pNew));
+    pNew->api = pAux;
+  }
+  return rc;
+}
+
+static int lembed_chunksDisconnect(sqlite3_vtab *pVtab) {
+  lembed_chunks_vtab *p = (lembed_chunks_vtab *)pVtab;
+  sqlite3_free(p);
+  return SQLITE_OK;
+}
+
+static int lembed_chunksOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  lembed_chunks_cursor *pCur;
+  pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == 0)
+    return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
+
+static void lembed_chunksClear(lembed_chunks_cursor *pCur) {
+  sqlite3_free(pCur->model_name);
+  api_model_release(pCur->entry);
+  token_stream_clear(&pCur->stream);
+  sqlite3_vtab_cursor base = pCur->base;
+  memset(pCur, 0, sizeof(*pCur));
+  pCur->base = base;
+}
+
+static int lembed_chunksClose(sqlite3_vtab_cursor *cur) {
+  lembed_chunks_cursor *pCur = (lembed_chunks_cursor *)cur;
+  lembed_chunksClear(pCur);
+  sqlite3_free(pCur);
+  return SQLITE_OK;
+}
+
+static int lembed_chunksBestIndex(sqlite3_vtab *pVTab,
+                                  sqlite3_index_info *pIdxInfo) {
+  int idxModel = -1;
+  int idxSource = -1;
+  int idxChunkSize = -1;
+  int idxOverlap = -1;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    if (!pCons->usable || pCons->op != SQLITE_INDEX_CONSTRAINT_EQ)
+      continue;
+    switch (pCons->iColumn) {
+    case lembed_chunks_MODEL:
+      idxModel = i;
+      break;
+    case lembed_chunks_SOURCE:
+      idxSource = i;
+      break;
+    case lembed_chunks_CHUNK_SIZE:
+      idxChunkSize = i;
+      break;
+    case lembed_chunks_OVERLAP:
+      idxOverlap = i;
+      break;
+    }
+  }
+  if (idxModel < 0 || idxSource < 0) {
+    pVTab->zErrMsg = sqlite3_mprintf("model and source arguments are required");
+    return SQLITE_ERROR;
+  }
+  int argvIndex = 1;
+  pIdxInfo->aConstraintUsage[idxModel].argvIndex = argvIndex++;
+  pIdxInfo->aConstraintUsage[idxModel].omit = 1;
+  pIdxInfo->aConstraintUsage[idxSource].argvIndex = argvIndex++;
+  pIdxInfo->aConstraintUsage[idxSource].omit = 1;
+  pIdxInfo->idxNum = 0;
+  if (idxChunkSize >= 0) {
+    pIdxInfo->aConstraintUsage[idxChunkSize].argvIndex = argvIndex++;
+    pIdxInfo->aConstraintUsage[idxChunkSize].omit = 1;
+    pIdxInfo->idxNum |= 1;
+  }
+  if (idxOverlap >= 0) {
+    pIdxInfo->aConstraintUsage[idxOverlap].argvIndex = argvIndex++;
+    pIdxInfo->aConstraintUsage[idxOverlap].omit = 1;
+    pIdxInfo->idxNum |= 2;
+  }
+
+  pIdxInfo->estimatedCost = (double)10;
+  pIdxInfo->estimatedRows = 10;
+  return SQLITE_OK;
+}
+
+static int lembed_chunksFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                               const char *idxStr, int argc,
+                               sqlite3_value **argv) {
+  lembed_chunks_cursor *pCur = (lembed_chunks_cursor *)pVtabCursor;
+  lembed_chunks_vtab *p = (lembed_chunks_vtab *)pVtabCursor->pVtab;
+  lembed_chunksClear(pCur);
+
+  struct llama_model *model;
+  ApiModel *entry;
+  int rc = api_model_from_name(p->api, (const char *)sqlite3_value_text(argv[0]),
+                               sqlite3_value_bytes(argv[0]), &model, &entry);
+  if (rc != SQLITE_OK) {
+    p->base.zErrMsg = sqlite3_mprintf(
+        "Unknown model name '%s'. Was it registered with lembed_models?",
+        sqlite3_value_text(argv[0]));
+    return SQLITE_ERROR;
+  }
+  // Released by the next xFilter or xClose, so the model outlives a DELETE
+  pCur->entry = api_model_retain(entry);
+
+  // By default, chunks fit in a single batch along with the special tokens
+  // lembed() adds around them.
+  pCur->chunk_size = entry->n_tokens_max > 2 ? entry->n_tokens_max - 2 : 1;
+  pCur->overlap = 0;
+  int iArg = 2;
+  if (idxNum & 1) {
+    pCur->chunk_size = sqlite3_value_int(argv[iArg++]);
+  }
+  if (idxNum & 2) {
+    pCur->overlap = sqlite3_value_int(argv[iArg++]);
+  }
+  if (pCur->chunk_size < 1) {
+    p->base.zErrMsg = sqlite3_mprintf("chunk_size must be greater than 0");
+    return SQLITE_ERROR;
+  }
+  if (pCur->overlap < 0 || pCur->overlap >= pCur->chunk_size) {
+    p->base.zErrMsg = sqlite3_mprintf(
+        "overlap must be between 0 and chunk_size - 1, got %d", pCur->overlap);
+    return SQLITE_ERROR;
+  }
+
+  pCur->model_name = sqlite3_mprintf("%s", sqlite3_value_text(argv[0]));
+  if (!pCur->model_name) {
+    return SQLITE_NOMEM;
+  }
+  rc = token_stream_init(&pCur->stream, model, &entry->stats, argv[1]);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  pCur->iRowid = 0;
+  rc = token_stream_fill(&pCur->stream, pCur->chunk_size);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  pCur->eof = pCur->stream.n_tokens == 0;
+  pCur->chunk_token_count = pCur->stream.n_tokens < pCur->chunk_size
+                                ? pCur->stream.n_tokens
+                                : pCur->chunk_size;
+  return SQLITE_OK;
+}
+
+static int lembed_chunksRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  lembed_chunks_cursor *pCur = (lembed_chunks_cursor *)cur;
+  *pRowid = pCur->iRowid;
+  return SQLITE_OK;
+}
+
+static int lembed_chunksNext(sqlite3_vtab_cursor *cur) {
+  lembed_chunks_cursor *pCur = (lembed_chunks_cursor *)cur;
+  // One more token than a chunk, to know if the current chunk is the last one
+  int rc = token_stream_fill(&pCur->stream, pCur->chunk_size + 1);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  if (pCur->stream.n_tokens <= pCur->chunk_size) {
+    pCur->eof = 1;
+    return SQLITE_OK;
+  }
+
+  token_stream_drop(&pCur->stream, pCur->chunk_size - pCur->overlap);
+  rc = token_stream_fill(&pCur->stream, pCur->chunk_size);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  pCur->chunk_token_count = pCur->stream.n_tokens < pCur->chunk_size
+                                ? pCur->stream.n_tokens
+                                : pCur->chunk_size;
+  pCur->iRowid++;
+  return SQLITE_OK;
+}
+
+static int lembed_chunksEof(sqlite3_vtab_cursor *cur) {
+  lembed_chunks_cursor *pCur = (lembed_chunks_cursor *)cur;
+  return pCur->eof;
+}
+
+static int lembed_chunksColumn(sqlite3_vtab_cursor *cur,
+                               sqlite3_context *context, int i) {
+  lembed_chunks_cursor *pCur = (lembed_chunks_cursor *)cur;
+  sqlite3_int64 start;
+  sqlite3_int64 end;
+  token_stream_span(&pCur->stream, 0, pCur->chunk_token_count, &start, &end);
+  switch (i) {
+  case lembed_chunks_CONTENTS:
+    sqlite3_result_text64(context, pCur->stream.source + start, end - start,
+                          SQLITE_TRANSIENT, SQLITE_UTF8);
+    break;
+  case lembed_chunks_TOKEN_COUNT:
+    sqlite3_result_int(context, pCur->chunk_token_count);
+    break;
+  case lembed_chunks_START_OFFSET:
+    sqlite3_result_int64(context, start);
+    break;
+  case lembed_chunks_END_OFFSET:
+    sqlite3_result_int64(context, end);
+    break;
+  case lembed_chunks_MODEL:
+    sqlite3_result_text(context, pCur->model_name, -1, SQLITE_TRANSIENT);
+    break;
+  case lembed_chunks_SOURCE:
+    sqlite3_result_text64(context, pCur->stream.source,
+                          pCur->stream.source_length,
+                          SQLITE_TRANSIENT, SQLITE_UTF8);
+    break;
+  case lembed_chunks_CHUNK_SIZE:
+    sqlite3_result_int(context, pCur->chunk_size);
+    break;
+  case lembed_chunks_OVERLAP:
+    sqlite3_result_int(context, pCur->overlap);
+    break;
+  }
+  return SQLITE_OK;
+}
+
+static sqlite3_module lembed_chunksModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ lembed_chunksConnect,
+    /* xBestIndex  */ lembed_chunksBestIndex,
+    /* xDisconnect */ lembed_chunksDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ lembed_chunksOpen,
+    /* xClose      */ lembed_chunksClose,
+    /* xFilter     */ lembed_chunksFilter,
+    /* xNext       */ lembed_chunksNext,
+    /* xEof        */ lembed_chunksEof,
+    /* xColumn     */ lembed_chunksColumn,
+    /* xRowid      */ lembed_chunksRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+#pragma endregion
+
+#pragma region lembed_tokens() table function
+
+/*
+ * The tokens lembed() would embed source as, one row per token, with the byte
+ * offsets in source each token was aligned to. The model's special tokens
+ * (like [CLS] and [SEP]) come first and last, and its document_prefix tokens
+ * right after the first ones, all with NULL offsets, so count(*) matches
+ * lembed_token_count(). Tokens are read from a lembed_token_stream, so long
+ * sources are tokenized in bounded memory.
+ */
+typedef struct lembed_tokens_vtab lembed_tokens_vtab;
+struct lembed_tokens_vtab {
+  sqlite3_vtab base;
+  struct Api *api;
+};
+
+// Content tokens are dropped from the stream in batches of this many
+#define LEMBED_TOKENS_DROP 4096
+
+typedef struct lembed_tokens_cursor lembed_tokens_cursor;
+struct lembed_tokens_cursor {
+  sqlite3_vtab_cursor base;
+  // Position of the current token, special ones included
+  sqlite3_int64 iRowid;
+  char *model_name;
+  ApiModel *entry;
+  lembed_special_tokens special;
+  lembed_token_stream stream;
+  // Content tokens dropped from the front of stream so far
+  sqlite3_int64 dropped;
+  int eof;
+
+  llama_token token;
+  // -1 for special tokens
+  sqlite3_int64 byte_start;
+  sqlite3_int64 byte_end;
+};
+
+static int lembed_tokensConnect(sqlite3 *db, void *pAux, int argc,
+                                const char *const *argv, sqlite3_vtab **ppVtab,
+                                char **pzErr) {
+  lembed_tokens_vtab *pNew;
+  int rc;
+#define lembed_tokens_POSITION 0
+#define lembed_tokens_TOKEN_ID 1
+#define lembed_tokens_BYTE_START 2
+#define lembed_tokens_BYTE_END 3
+#define lembed_tokens_MODEL 4
+#define lembed_tokens_SOURCE 5
+  rc = sqlite3_declare_vtab(db, "CREATE TABLE x(position, token_id, "
+                                "byte_start, byte_end, model hidden, "
+                                "source hidden)");
+  if (rc == SQLITE_OK) {
+    pNew = sqlite3_malloc(sizeof(*pNew));
+    *ppVtab = (sqlite3_vtab *)pNew;
+    if (pNew == 0)
+      return SQLITE_NOMEM;
+    memset(pNew, 0, sizeof(*pNew));
+    pNew->api = pAux;
+  }
+  return rc;
+}
+
+static int lembed_tokensDisconnect(sqlite3_vtab *pVtab) {
+  lembed_tokens_vtab *p = (lembed_tokens_vtab *)pVtab;
+  sqlite3_free(p);
+  return SQLITE_OK;
+}
+
+static int lembed_tokensOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  lembed_tokens_cursor *pCur;
+  pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == 0)
+    return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
+
+static void lembed_tokensClear(lembed_tokens_cursor *pCur) {
+  sqlite3_free(pCur->model_name);
+  api_model_release(pCur->entry);
+  token_stream_clear(&pCur->stream);
+  sqlite3_vtab_cursor base = pCur->base;
+  memset(pCur, 0, sizeof(*pCur));
+  pCur->base = base;
+}
+
+static int lembed_tokensClose(sqlite3_vtab_cursor *cur) {
+  lembed_tokens_cursor *pCur = (lembed_tokens_cursor *)cur;
+  lembed_tokensClear(pCur);
+  sqlite3_free(pCur);
+  return SQLITE_OK;
+}
+
+static int lembed_tokensBestIndex(sqlite3_vtab *pVTab,
+                                  sqlite3_index_info *pIdxInfo) {
+  int idxModel = -1;
+  int idxSource = -1;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    if (!pCons->usable || pCons->op != SQLITE_INDEX_CONSTRAINT_EQ)
+      continue;
+    switch (pCons->iColumn) {
+    case lembed_tokens_MODEL:
+      idxModel = i;
+      break;
+    case lembed_tokens_SOURCE:
+      idxSource = i;
+      break;
+    }
+  }
+  if (idxModel < 0 || idxSource < 0) {
+    pVTab->zErrMsg = sqlite3_mprintf("model and source arguments are required");
+    return SQLITE_ERROR;
+  }
+  pIdxInfo->aConstraintUsage[idxModel].argvIndex = 1;
+  pIdxInfo->aConstraintUsage[idxModel].omit = 1;
+  pIdxInfo->aConstraintUsage[idxSource].argvIndex = 2;
+  pIdxInfo->aConstraintUsage[idxSource].omit = 1;
+  pIdxInfo->estimatedCost = (double)100;
+  pIdxInfo->estimatedRows = 100;
+  return SQLITE_OK;
+}
+
+/** Point the cursor at the token at position iRowid, or set eof. */
+static int lembed_tokensLocate(lembed_tokens_cursor *pCur) {
+  sqlite3_int64 i = pCur->iRowid;
+  if (i < pCur->special.n_prefix) {
+    pCur->token = pCur->special.prefix[i];
+    pCur->byte_start = pCur->byte_end = -1;
+    return SQLITE_OK;
+  }
+  i -= pCur->special.n_prefix;
+  const lembed_prefix *instruction = &pCur->entry->document_prefix;
+  if (i < instruction->n_tokens) {
+    pCur->token = instruction->tokens[i];
+    pCur->byte_start = pCur->byte_end = -1;
+    return SQLITE_OK;
+  }
+  i -= instruction->n_tokens + pCur->dropped;
+  if (i >= LEMBED_TOKENS_DROP) {
+    token_stream_drop(&pCur->stream, (int)i);
+    pCur->dropped += i;
+    i = 0;
+  }
+  int rc = token_stream_fill(&pCur->stream, (int)i + 1);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  if (i < pCur->stream.n_tokens) {
+    pCur->token = pCur->stream.tokens[i];
+    pCur->byte_start = pCur->stream.token_starts[i];
+    pCur->byte_end = pCur->stream.token_ends[i];
+    return SQLITE_OK;
+  }
+  i -= pCur->stream.n_tokens;
+  if (i < pCur->special.n_suffix) {
+    pCur->token = pCur->special.suffix[i];
+    pCur->byte_start = pCur->byte_end = -1;
+    return SQLITE_OK;
+  }
+  pCur->eof = 1;
+  return SQLITE_OK;
+}
+
+static int lembed_tokensFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                               const char *idxStr, int argc,
+                               sqlite3_value **argv) {
+  lembed_tokens_cursor *pCur = (lembed_tokens_cursor *)pVtabCursor;
+  lembed_tokens_vtab *p = (lembed_tokens_vtab *)pVtabCursor->pVtab;
+  lembed_tokensClear(pCur);
+
+  struct llama_model *model;
+  ApiModel *entry;
+  int rc = api_model_from_name(p->api, (const char *)sqlite3_value_text(argv[0]),
+                               sqlite3_value_bytes(argv[0]), &model, &entry);
+  if (rc != SQLITE_OK) {
+    p->base.zErrMsg = sqlite3_mprintf(
+        "Unknown model name '%s'. Was it registered with lembed_models?",
+        sqlite3_value_text(argv[0]));
+    return SQLITE_ERROR;
+  }
+  // Released by the next xFilter or xClose, so the model outlives a DELETE
+  pCur->entry = api_model_retain(entry);
+  if (sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+    pCur->eof = 1;
+    return SQLITE_OK;
+  }
+  if (special_tokens(model, &pCur->special) != SQLITE_OK) {
+    memset(&pCur->special, 0, sizeof(pCur->special));
+  }
+
+  pCur->model_name = sqlite3_mprintf("%s", sqlite3_value_text(argv[0]));
+  if (!pCur->model_name) {
+    return SQLITE_NOMEM;
+  }
+  rc = token_stream_init(&pCur->stream, model, &entry->stats, argv[1]);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  return lembed_tokensLocate(pCur);
+}
+
+static int lembed_tokensRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  lembed_tokens_cursor *pCur = (lembed_tokens_cursor *)cur;
+  *pRowid = pCur->iRowid;
+  return SQLITE_OK;
+}
+
+static int lembed_tokensNext(sqlite3_vtab_cursor *cur) {
+  lembed_tokens_cursor *pCur = (lembed_tokens_cursor *)cur;
+  pCur->iRowid++;
+  return lembed_tokensLocate(pCur);
+}
+
+static int lembed_tokensEof(sqlite3_vtab_cursor *cur) {
+  lembed_tokens_cursor *pCur = (lembed_tokens_cursor *)cur;
+  return pCur->eof;
+}
+
+static int lembed_tokensColumn(sqlite3_vtab_cursor *cur,
+                               sqlite3_context *context, int i) {
+  lembed_tokens_cursor *pCur = (lembed_tokens_cursor *)cur;
+  switch (i) {
+  case lembed_tokens_POSITION:
+    sqlite3_result_int64(context, pCur->iRowid);
+    break;
+  case lembed_tokens_TOKEN_ID:
+    sqlite3_result_int(context, pCur->token);
+    break;
+  case lembed_tokens_BYTE_START:
+    if (pCur->byte_start >= 0) {
+      sqlite3_result_int64(context, pCur->byte_start);
+    }
+    break;
+  case lembed_tokens_BYTE_END:
+    if (pCur->byte_end >= 0) {
+      sqlite3_result_int64(context, pCur->byte_end);
+    }
+    break;
+  case lembed_tokens_MODEL:
+    sqlite3_result_text(context, pCur->model_name, -1, SQLITE_TRANSIENT);
+    break;
+  case lembed_tokens_SOURCE:
+    sqlite3_result_text64(context, pCur->stream.source,
+                          pCur->stream.source_length, SQLITE_TRANSIENT,
+                          SQLITE_UTF8);
+    break;
+  }
+  return SQLITE_OK;
+}
+
+static sqlite3_module lembed_tokensModule = {
+    /* iVersion    */ 3,
+    /* xCreate     */ 0,
+    /* xConnect    */ lembed_tokensConnect,
+    /* xBestIndex  */ lembed_tokensBestIndex,
+    /* xDisconnect */ lembed_tokensDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ lembed_tokensOpen,
+    /* xClose      */ lembed_tokensClose,
+    /* xFilter     */ lembed_tokensFilter,
+    /* xNext       */ lembed_tokensNext,
+    /* xEof        */ lembed_tokensEof,
+    /* xColumn     */ lembed_tokensColumn,
+    /* xRowid      */ lembed_tokensRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+#pragma endregion
+
+#pragma region lembed_chunk_embeddings() table function
+
+/*
+ * lembed_chunk_embeddings(model, source, chunk_size, overlap) is the same as
+ * embedding every row of lembed_chunks() with lembed(), without the round trip
+ * through text. Source is tokenized once, and the token windows of each chunk
+ * (wrapped in the model's special tokens) are embedded directly, as many
+ * chunks per llama_decode() call as fit in the batch.
+ */
+typedef struct lembed_chunk_embeddings_vtab lembed_chunk_embeddings_vtab;
+struct lembed_chunk_embeddings_vtab {
+  sqlite3_vtab base;
+  struct Api *api;
+};
+
+typedef struct lembed_chunk_embeddings_cursor lembed_chunk_embeddings_cursor;
+struct lembed_chunk_embeddings_cursor {
+  sqlite3_vtab_cursor base;
+  sqlite3_int64 iRowid;
+  struct llama_model *model;
+  ApiModel *entry;
+  char *model_name;
+  int chunk_size;
+  int overlap;
+  // Tokens of the next chunk that isn't embedded yet onwards
+  lembed_token_stream stream;
+  int done;
+
+  lembed_special_tokens special;
+
+  int n_tokens_max;
+  int n_seq_max;
+  int dimensions;
+
+  // Chunks of the current batch, each sized n_seq_max. windows point into
+  // window_tokens, sized n_tokens_max.
+  int n_chunks;
+  int iChunk;
+  llama_token *window_tokens;
+  llama_token **windows;
+  int *window_counts;
+  int *token_counts;
+  sqlite3_int64 *starts;
+  sqlite3_int64 *ends;
+  float *embeddings;
+};
+
+static int lembed_chunk_embeddingsConnect(sqlite3 *db, void *pAux, int argc,
+                                          const char *const *argv,
+                                          sqlite3_vtab **ppVtab,
+                                          char **pzErr) {
+  lembed_chunk_embeddings_vtab *pNew;
+  int rc;
+#define LEMBED_CHUNK_EMBEDDINGS_CHUNK_INDEX 0
+#define LEMBED_CHUNK_EMBEDDINGS_START_OFFSET 1
+#define LEMBED_CHUNK_EMBEDDINGS_END_OFFSET 2
+#define LEMBED_CHUNK_EMBEDDINGS_TOKEN_COUNT 3
+#define LEMBED_CHUNK_EMBEDDINGS_EMBEDDING 4
+#define LEMBED_CHUNK_EMBEDDINGS_MODEL 5
+#define LEMBED_CHUNK_EMBEDDINGS_SOURCE 6
+#define LEMBED_CHUNK_EMBEDDINGS_CHUNK_SIZE 7
+#define LEMBED_CHUNK_EMBEDDINGS_OVERLAP 8
+  rc = sqlite3_declare_vtab(
+      db, "CREATE TABLE x(chunk_index, start_offset, end_offset, token_count, "
+          "embedding, model hidden, source hidden, chunk_size hidden, overlap "
+          "hidden)");
+  if (rc == SQLITE_OK) {
+    pNew = sqlite3_malloc(sizeof(*pNew));
+    *ppVtab = (sqlite3_vtab *)pNew;
+    if (pNew == 0)
+      return SQLITE_NOMEM;
+    memset(pNew, 0, sizeof(*pNew));
+    pNew->api = pAux;
+  }
+  return rc;
+}
+
+static int lembed_chunk_embeddingsDisconnect(sqlite3_vtab *pVtab) {
+  lembed_chunk_embeddings_vtab *p = (lembed_chunk_embeddings_vtab *)pVtab;
+  sqlite3_free(p);
+  return SQLITE_OK;
+}
+
+static int lembed_chunk_embeddingsOpen(sqlite3_vtab *p,
+                                       sqlite3_vtab_cursor **ppCursor) {
+  lembed_chunk_embeddings_cursor *pCur;
+  pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == 0)
+    return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
+
+static void lembed_chunk_embeddingsClear(lembed_chunk_embeddings_cursor *pCur) {
+  sqlite3_free(pCur->model_name);
+  token_stream_clear(&pCur->stream);
+  sqlite3_free(pCur->window_tokens);
+  sqlite3_free(pCur->windows);
+  sqlite3_free(pCur->window_counts);
+  sqlite3_free(pCur->token_counts);
+  sqlite3_free(pCur->starts);
+  sqlite3_free(pCur->ends);
+  sqlite3_free(pCur->embeddings);
+  api_model_release(pCur->entry);
+  sqlite3_vtab_cursor base = pCur->base;
+  memset(pCur, 0, sizeof(*pCur));
+  pCur->base = base;
+}
+
+static int lembed_chunk_embeddingsClose(sqlite3_vtab_cursor *cur) {
+  lembed_chunk_embeddings_cursor *pCur = (lembed_chunk_embeddings_cursor *)cur;
+  lembed_chunk_embeddingsClear(pCur);
+  sqlite3_free(pCur);
+  return SQLITE_OK;
+}
+
+static int lembed_chunk_embeddingsBestIndex(sqlite3_vtab *pVTab,
+                                            sqlite3_index_info *pIdxInfo) {
+  int idxModel = -1;
+  int idxSource = -1;
+  int idxChunkSize = -1;
+  int idxOverlap = -1;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    if (!pCons->usable || pCons->op != SQLITE_INDEX_CONSTRAINT_EQ)
+      continue;
+    switch (pCons->iColumn) {
+    case LEMBED_CHUNK_EMBEDDINGS_MODEL:
+      idxModel = i;
+      break;
+    case LEMBED_CHUNK_EMBEDDINGS_SOURCE:
+      idxSource = i;
+      break;
+    case LEMBED_CHUNK_EMBEDDINGS_CHUNK_SIZE:
+      idxChunkSize = i;
+      break;
+    case LEMBED_CHUNK_EMBEDDINGS_OVERLAP:
+      idxOverlap = i;
+      break;
+    }
+  }
+  if (idxModel < 0 || idxSource < 0) {
+    pVTab->zErrMsg = sqlite3_mprintf("model and source arguments are required");
+    return SQLITE_ERROR;
+  }
+  int argvIndex = 1;
+  pIdxInfo->aConstraintUsage[idxModel].argvIndex = argvIndex++;
+  pIdxInfo->aConstraintUsage[idxModel].omit = 1;
+  pIdxInfo->aConstraintUsage[idxSource].argvIndex = argvIndex++;
+  pIdxInfo->aConstraintUsage[idxSource].omit = 1;
+  pIdxInfo->idxNum = 0;
+  if (idxChunkSize >= 0) {
+    pIdxInfo->aConstraintUsage[idxChunkSize].argvIndex = argvIndex++;
+    pIdxInfo->aConstraintUsage[idxChunkSize].omit = 1;
+    pIdxInfo->idxNum |= 1;
+  }
+  if (idxOverlap >= 0) {
+    pIdxInfo->aConstraintUsage[idxOverlap].argvIndex = argvIndex++;
+    pIdxInfo->aConstraintUsage[idxOverlap].omit = 1;
+    pIdxInfo->idxNum |= 2;
+  }
+
+  pIdxInfo->estimatedCost = (double)100;
+  pIdxInfo->estimatedRows = 10;
+  return SQLITE_OK;
+}
+
+/**
+ * Slice the next chunks of the token stream into windows, and embed as many
+ * of them as fit in a single batch. Leaves n_chunks at 0 once every chunk has
+ * been embedded.
+ */
+static int lembed_chunk_embeddingsFill(lembed_chunk_embeddings_cursor *pCur) {
+  lembed_token_stream *stream = &pCur->stream;
+  // Every window gets the document_prefix of the model, after the special
+  // prefix tokens, like any other document.
+  const lembed_prefix *instruction = &pCur->entry->document_prefix;
+  int n_special = pCur->special.n_prefix + pCur->special.n_suffix +
+                  instruction->n_tokens;
+  int step = pCur->chunk_size - pCur->overlap;
+  int n = 0;
+  int total_tokens = 0;
+  // Index in stream of the first token of the next chunk
+  int first = 0;
+  pCur->n_chunks = 0;
+  pCur->iChunk = 0;
+
+  while (!pCur->done && n < pCur->n_seq_max) {
+    // One more token than a chunk, to know if this chunk is the last one
+    int rc = token_stream_fill(stream, first + pCur->chunk_size + 1);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    if (first >= stream->n_tokens) {
+      pCur->done = 1;
+      break;
+    }
+    int count = stream->n_tokens - first < pCur->chunk_size
+                    ? stream->n_tokens - first
+                    : pCur->chunk_size;
+    if (total_tokens + count + n_special > pCur->n_tokens_max) {
+      break;
+    }
+
+    llama_token *window = pCur->window_tokens + total_tokens;
+    const lembed_special_tokens *special = &pCur->special;
+    int n_before = special->n_prefix + instruction->n_tokens;
+    memcpy(window, special->prefix, sizeof(llama_token) * special->n_prefix);
+    if (instruction->n_tokens) {
+      memcpy(window + special->n_prefix, instruction->tokens,
+             sizeof(llama_token) * instruction->n_tokens);
+    }
+    memcpy(window + n_before, stream->tokens + first,
+           sizeof(llama_token) * count);
+    memcpy(window + n_before + count, special->suffix,
+           sizeof(llama_token) * special->n_suffix);
+    pCur->windows[n] = window;
+    pCur->window_counts[n] = count + n_special;
+    pCur->token_counts[n] = count;
+    token_stream_span(stream, first, count, &pCur->starts[n], &pCur->ends[n]);
+    total_tokens += count + n_special;
+    n++;
+
+    if (first + pCur->chunk_size >= stream->n_tokens) {
+      pCur->done = 1;
+      break;
+    }
+    first += step;
+  }
+  token_stream_drop(stream, pCur->done ? stream->n_tokens : first);
+
+  pCur->n_chunks = n;
+  if (n == 0) {
+    return SQLITE_OK;
+  }
+  ApiContext *ctx = api_model_context_acquire(pCur->entry);
+  int rc = embed_many(pCur->model, ctx, pCur->windows, pCur->window_counts, n,
+                      instruction->n_tokens, pCur->embeddings);
+  api_model_context_release(pCur->entry, ctx);
+  if (rc != SQLITE_OK) {
+    pCur->base.pVtab->zErrMsg =
+        sqlite3_mprintf("Error generating embeddings");
+  }
+  return rc;
+}
+
+static int lembed_chunk_embeddingsFilter(sqlite3_vtab_cursor *pVtabCursor,
+                                         int idxNum, const char *idxStr,
+                                         int argc, sqlite3_value **argv) {
+  lembed_chunk_embeddings_cursor *pCur =
+      (lembed_chunk_embeddings_cursor *)pVtabCursor;
+  lembed_chunk_embeddings_vtab *p =
+      (lembed_chunk_embeddings_vtab *)pVtabCursor->pVtab;
+  lembed_chunk_embeddingsClear(pCur);
+
+  int rc = api_model_from_name(p->api, (const char *)sqlite3_value_text(argv[0]),
+                               sqlite3_value_bytes(argv[0]), &pCur->model,
+                               &pCur->entry);
+  if (rc != SQLITE_OK) {
+    p->base.zErrMsg = sqlite3_mprintf(
+        "Unknown model name '%s'. Was it registered with lembed_models?",
+        sqlite3_value_text(argv[0]));
+    return SQLITE_ERROR;
+  }
+  // Released by the next xFilter or xClose, so the model outlives a DELETE
+  api_model_retain(pCur->entry);
+  p->base.zErrMsg = api_model_embed_error(pCur->entry);
+  if (p->base.zErrMsg) {
+    return SQLITE_ERROR;
+  }
+  rc = special_tokens(pCur->model, &pCur->special);
+  if (rc != SQLITE_OK) {
+    p->base.zErrMsg =
+        sqlite3_mprintf("Could not determine the special tokens of model '%s'",
+                        sqlite3_value_text(argv[0]));
+    return SQLITE_ERROR;
+  }
+
+  pCur->n_tokens_max = pCur->entry->n_tokens_max;
+  pCur->n_seq_max = pCur->entry->n_seq_max;
+  pCur->dimensions = pCur->entry->dimensions;
+  int n_special = pCur->special.n_prefix + pCur->special.n_suffix +
+                  pCur->entry->document_prefix.n_tokens;
+  pCur->chunk_size = pCur->n_tokens_max > n_special
+                         ? pCur->n_tokens_max - n_special
+                         : 1;
+  pCur->overlap = 0;
+  int iArg = 2;
+  if (idxNum & 1) {
+    pCur->chunk_size = sqlite3_value_int(argv[iArg++]);
+  }
+  if (idxNum & 2) {
+    pCur->overlap = sqlite3_value_int(argv[iArg++]);
+  }
+  if (pCur->chunk_size < 1) {
+    p->base.zErrMsg = sqlite3_mprintf("chunk_size must be greater than 0");
+    return SQLITE_ERROR;
+  }
+  if (pCur->chunk_size + n_special > pCur->n_tokens_max) {
+    p->base.zErrMsg = sqlite3_mprintf(
+        "chunk_size of %d plus %d special tokens is more than the batch size "
+        "of %d",
+        pCur->chunk_size, n_special, pCur->n_tokens_max);
+    return SQLITE_ERROR;
+  }
+  if (pCur->overlap < 0 || pCur->overlap >= pCur->chunk_size) {
+    p->base.zErrMsg = sqlite3_mprintf(
+        "overlap must be between 0 and chunk_size - 1, got %d", pCur->overlap);
+    return SQLITE_ERROR;
+  }
+
+  pCur->model_name = sqlite3_mprintf("%s", sqlite3_value_text(argv[0]));
+  pCur->window_tokens = sqlite3_malloc(sizeof(llama_token) * pCur->n_tokens_max);
+  pCur->windows = sqlite3_malloc(sizeof(llama_token *) * pCur->n_seq_max);
+  pCur->window_counts = sqlite3_malloc(sizeof(int) * pCur->n_seq_max);
+  pCur->token_counts = sqlite3_malloc(sizeof(int) * pCur->n_seq_max);
+  pCur->starts = sqlite3_malloc(sizeof(sqlite3_int64) * pCur->n_seq_max);
+  pCur->ends = sqlite3_malloc(sizeof(sqlite3_int64) * pCur->n_seq_max);
+  pCur->embeddings =
+      sqlite3_malloc(sizeof(float) * pCur->n_seq_max * pCur->dimensions);
+  if (!pCur->model_name || !pCur->window_tokens || !pCur->windows ||
+      !pCur->window_counts || !pCur->token_counts || !pCur->starts ||
+      !pCur->ends || !pCur->embeddings) {
+    return SQLITE_NOMEM;
+  }
+  rc = token_stream_init(&pCur->stream, pCur->model, &pCur->entry->stats,
+                         argv[1]);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+
+  pCur->iRowid = 0;
+  return lembed_chunk_embeddingsFill(pCur);
+}
+
+static int lembed_chunk_embeddingsRowid(sqlite3_vtab_cursor *cur,
+                                        sqlite_int64 *pRowid) {
+  lembed_chunk_embeddings_cursor *pCur = (lembed_chunk_embeddings_cursor *)cur;
+  *pRowid = pCur->iRowid;
+  return SQLITE_OK;
+}
+
+static int lembed_chunk_embeddingsNext(sqlite3_vtab_cursor *cur) {
+  lembed_chunk_embeddings_cursor *pCur = (lembed_chunk_embeddings_cursor *)cur;
+  pCur->iRowid++;
+  pCur->iChunk++;
+  if (pCur->iChunk >= pCur->n_chunks) {
+    return lembed_chunk_embeddingsFill(pCur);
+  }
+  return SQLITE_OK;
+}
+
+static int lembed_chunk_embeddingsEof(sqlite3_vtab_cursor *cur) {
+  lembed_chunk_embeddings_cursor *pCur = (lembed_chunk_embeddings_cursor *)cur;
+  return pCur->n_chunks == 0;
+}
+
+static int lembed_chunk_embeddingsColumn(sqlite3_vtab_cursor *cur,
+                                         sqlite3_context *context, int i) {
+  lembed_chunk_embeddings_cursor *pCur = (lembed_chunk_embeddings_cursor *)cur;
+  int c = pCur->iChunk;
+  switch (i) {
+  case LEMBED_CHUNK_EMBEDDINGS_CHUNK_INDEX:
+    sqlite3_result_int64(context, pCur->iRowid);
+    break;
+  case LEMBED_CHUNK_EMBEDDINGS_START_OFFSET:
+    sqlite3_result_int64(context, pCur->starts[c]);
+    break;
+  case LEMBED_CHUNK_EMBEDDINGS_END_OFFSET:
+    sqlite3_result_int64(context, pCur->ends[c]);
+    break;
+  case LEMBED_CHUNK_EMBEDDINGS_TOKEN_COUNT:
+    sqlite3_result_int(context, pCur->token_counts[c]);
+    break;
+  case LEMBED_CHUNK_EMBEDDINGS_EMBEDDING:
+    sqlite3_result_blob(context, pCur->embeddings + (c * pCur->dimensions),
+                        sizeof(float) * pCur->dimensions, SQLITE_TRANSIENT);
+    sqlite3_result_subtype(context, LEMBED_FLOAT32_SUBTYPE);
+    break;
+  case LEMBED_CHUNK_EMBEDDINGS_MODEL:
+    sqlite3_result_text(context, pCur->model_name, -1, SQLITE_TRANSIENT);
+    break;
+  case LEMBED_CHUNK_EMBEDDINGS_SOURCE:
+    sqlite3_result_text64(context, pCur->stream.source,
+                          pCur->stream.source_length, SQLITE_TRANSIENT,
+                          SQLITE_UTF8);
+    break;
+  case LEMBED_CHUNK_EMBEDDINGS_CHUNK_SIZE:
+    sqlite3_result_int(context, pCur->chunk_size);
+    break;
+  case LEMBED_CHUNK_EMBEDDINGS_OVERLAP:
+    sqlite3_result_int(context, pCur->overlap);
+    break;
+  }
+  return SQLITE_OK;
+}
+
+static sqlite3_module lembed_chunk_embeddingsModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ lembed_chunk_embeddingsConnect,
+    /* xBestIndex  */ lembed_chunk_embeddingsBestIndex,
+    /* xDisconnect */ lembed_chunk_embeddingsDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ lembed_chunk_embeddingsOpen,
+    /* xClose      */ lembed_chunk_embeddingsClose,
+    /* xFilter     */ lembed_chunk_embeddingsFilter,
+    /* xNext       */ lembed_chunk_embeddingsNext,
+    /* xEof        */ lembed_chunk_embeddingsEof,
+    /* xColumn     */ lembed_chunk_embeddingsColumn,
+    /* xRowid      */ lembed_chunk_embeddingsRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+#pragma endregion
+
+#pragma region lembed_batch() table function
+
+typedef struct lembed_batch_vtab lembed_batch_vtab;
+struct lembed_batch_vtab {
+  sqlite3_vtab base;
+  sqlite3 *db;
+  struct Api *api;
+};
+
+typedef struct lembed_batch_cursor lembed_batch_cursor;
+struct lembed_batch_cursor {
+  sqlite3_vtab_cursor base;
+  sqlite3_int64 iRowid;
+  struct llama_model *model;
+  ApiModel *entry;
+  // SELECT value FROM json_each(?) over the inputs argument
+  sqlite3_stmt *stmt;
+  int stmtDone;
+
+  int n_tokens_max;
+  int n_seq_max;
+  int dimensions;
+
+  // Inputs of the current batch, each sized n_seq_max. When an input read
+  // from stmt doesn't fit in the current batch, it's left at index n_inputs
+  // and becomes the first input of the next batch.
+  int n_inputs;
+  int hasPending;
+  int iInput;
+  char **contents;
+  int *contents_lengths;
+  llama_token **tokens;
+  int *token_counts;
+  float *embeddings;
+};
+
+static int lembed_batchConnect(sqlite3 *db, void *pAux, int argc,
+                               const char *const *argv, sqlite3_vtab **ppVtab,
+                               char **pzErr) {
+  lembed_batch_vtab *pNew;
+  int rc;
+#define LEMBED_BATCH_CONTENTS 0
+#define LEMBED_BATCH_EMBEDDING 1
+#define LEMBED_BATCH_MODEL 2
+#define LEMBED_BATCH_INPUTS 3
+  rc = sqlite3_declare_vtab(db, "CREATE TABLE x(contents, embedding, model "
+                                "hidden, inputs hidden)");
+  if (rc == SQLITE_OK) {
+    pNew = sqlite3_malloc(sizeof(*pNew));
+    *ppVtab = (sqlite3_vtab *)pNew;
+    if (pNew == 0)
+      return SQLITE_NOMEM;
+    memset(pNew, 0, sizeof(*pNew));
+    pNew->db = db;
+    pNew->api = pAux;
+  }
+  return rc;
+}
+
+static int lembed_batchDisconnect(sqlite3_vtab *pVtab) {
+  lembed_batch_vtab *p = (lembed_batch_vtab *)pVtab;
+  sqlite3_free(p);
+  return SQLITE_OK;
+}
+
+static int lembed_batchOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  lembed_batch_cursor *pCur;
+  pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == 0)
+    return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
+
+static void lembed_batchClear(lembed_batch_cursor *pCur) {
+  int n = pCur->n_inputs + (pCur->hasPending ? 1 : 0);
+  for (int i = 0; i < n; i++) {
+    sqlite3_free(pCur->contents[i]);
+    sqlite3_free(pCur->tokens[i]);
+  }
+  sqlite3_free(pCur->contents);
+  sqlite3_free(pCur->contents_lengths);
+  sqlite3_free(pCur->tokens);
+  sqlite3_free(pCur->token_counts);
+  sqlite3_free(pCur->embeddings);
+  sqlite3_finalize(pCur->stmt);
+
+  api_model_release(pCur->entry);
+  sqlite3_vtab_cursor base = pCur->base;
+  memset(pCur, 0, sizeof(*pCur));
+  pCur->base = base;
 }
 
-static void lembed_tokenize_json(sqlite3_context *context, int argc,
-                                 sqlite3_value **argv) {
-  struct llama_model *model;
-  int rc = api_model_from_name((struct Api *)sqlite3_user_data(context),
-                               (const char *)sqlite3_value_text(argv[0]),
-                               sqlite3_value_bytes(argv[0]), &model, NULL);
-  const char *input = (const char *)sqlite3_value_text(argv[1]);
-  sqlite3_int64 input_len = sqlite3_value_bytes(argv[1]);
-  int token_count;
-  llama_token *tokens;
-  rc = tokenize(model, input, input_len, &token_count, &tokens);
-  assert(rc == SQLITE_OK);
+static int lembed_batchClose(sqlite3_vtab_cursor *cur) {
+  lembed_batch_cursor *pCur = (lembed_batch_cursor *)cur;
+  lembed_batchClear(pCur);
+  sqlite3_free(pCur);
+  return SQLITE_OK;
+}
 
-  sqlite3_str *s = sqlite3_str_new(NULL);
-  sqlite3_str_appendchar(s, 1, '[');
-  for (int i = 0; i < token_count; i++) {
-    if (i != 0) {
-      sqlite3_str_appendchar(s, 1, ',');
+static int lembed_batchBestIndex(sqlite3_vtab *pVTab,
+                                 sqlite3_index_info *pIdxInfo) {
+  int idxModel = -1;
+  int idxInputs = -1;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    if (!pCons->usable || pCons->op != SQLITE_INDEX_CONSTRAINT_EQ)
+      continue;
+    switch (pCons->iColumn) {
+    case LEMBED_BATCH_MODEL:
+      idxModel = i;
+      break;
+    case LEMBED_BATCH_INPUTS:
+      idxInputs = i;
+      break;
     }
-    sqlite3_str_appendf(s, "%d", tokens[i]);
   }
-  sqlite3_str_appendchar(s, 1, ']');
-  char *result = sqlite3_str_finish(s);
-  assert(result);
-  sqlite3_result_text(context, result, -1, sqlite3_free);
+  if (idxModel < 0 || idxInputs < 0) {
+    pVTab->zErrMsg =
+        sqlite3_mprintf("model and inputs arguments are required");
+    return SQLITE_ERROR;
+  }
+  pIdxInfo->aConstraintUsage[idxModel].argvIndex = 1;
+  pIdxInfo->aConstraintUsage[idxModel].omit = 1;
+  pIdxInfo->aConstraintUsage[idxInputs].argvIndex = 2;
+  pIdxInfo->aConstraintUsage[idxInputs].omit = 1;
+
+  pIdxInfo->idxNum = 1;
+  pIdxInfo->estimatedCost = (double)10;
+  pIdxInfo->estimatedRows = 10;
+  return SQLITE_OK;
 }
 
-static void lembed_token_score(sqlite3_context *context, int argc,
-                               sqlite3_value **argv) {
-  struct llama_model *model;
-  int rc = api_model_from_name((struct Api *)sqlite3_user_data(context),
-                               (const char *)sqlite3_value_text(argv[0]),
-                               sqlite3_value_bytes(argv[0]), &model, NULL);
+/**
+ * Read the next batch of inputs from the json_each() statement, tokenize them,
+ * and embed them all with a single llama_decode() call. Reads as many inputs
+ * as fit in the context's batch capacity. Leaves n_inputs at 0 once every
+ * input has been embedded.
+ */
+static int lembed_batchFill(lembed_batch_cursor *pCur) {
+  sqlite3_vtab *pVtab = pCur->base.pVtab;
 
-  int32_t token = sqlite3_value_int(argv[1]);
+  for (int i = 0; i < pCur->n_inputs; i++) {
+    sqlite3_free(pCur->contents[i]);
+    sqlite3_free(pCur->tokens[i]);
+  }
+  int n = 0;
+  int total_tokens = 0;
+  if (pCur->hasPending) {
+    pCur->contents[0] = pCur->contents[pCur->n_inputs];
+    pCur->contents_lengths[0] = pCur->contents_lengths[pCur->n_inputs];
+    pCur->tokens[0] = pCur->tokens[pCur->n_inputs];
+    pCur->token_counts[0] = pCur->token_counts[pCur->n_inputs];
+    pCur->hasPending = 0;
+    total_tokens = pCur->token_counts[0] < pCur->n_tokens_max
+                       ? pCur->token_counts[0]
+                       : pCur->n_tokens_max;
+    n = 1;
+  }
+  pCur->n_inputs = 0;
+  pCur->iInput = 0;
 
-  float score = llama_token_get_score(model, token);
-  sqlite3_result_double(context, score);
+  while (!pCur->stmtDone && n < pCur->n_seq_max) {
+    int rc = sqlite3_step(pCur->stmt);
+    if (rc == SQLITE_DONE) {
+      pCur->stmtDone = 1;
+      break;
+    }
+    if (rc != SQLITE_ROW) {
+      pCur->n_inputs = n;
+      return rc;
+    }
+    const char *input = (const char *)sqlite3_column_text(pCur->stmt, 0);
+    int input_len = sqlite3_column_bytes(pCur->stmt, 0);
+    pCur->contents[n] = sqlite3_mprintf("%.*s", input_len, input ? input : "");
+    if (!pCur->contents[n]) {
+      pCur->n_inputs = n;
+      return SQLITE_NOMEM;
+    }
+    pCur->contents_lengths[n] = input_len;
+    rc = tokenize(pCur->model, pCur->contents[n], input_len,
+                  &pCur->entry->document_prefix, &pCur->token_counts[n],
+                  &pCur->tokens[n], &pCur->entry->stats);
+    if (rc != SQLITE_OK) {
+      sqlite3_free(pCur->contents[n]);
+      pCur->n_inputs = n;
+      pVtab->zErrMsg = sqlite3_mprintf("Error tokenizing input %lld",
+                                       pCur->iRowid + n);
+      return SQLITE_ERROR;
+    }
+    if (pCur->token_counts[n] > pCur->n_tokens_max &&
+        pCur->entry->long_inputs == LEMBED_LONG_INPUTS_ERROR) {
+      sqlite3_free(pCur->contents[n]);
+      sqlite3_free(pCur->tokens[n]);
+      pCur->n_inputs = n;
+      pVtab->zErrMsg = sqlite3_mprintf(
+          "Input %lld has %d tokens, more than the batch size of %d. Use the "
+          "long_inputs context option to truncate or split long inputs.",
+          pCur->iRowid + n, pCur->token_counts[n], pCur->n_tokens_max);
+      return SQLITE_ERROR;
+    }
+    // Long inputs are embedded on their own, so they take a whole batch
+    int budget = pCur->token_counts[n] < pCur->n_tokens_max
+                     ? pCur->token_counts[n]
+                     : pCur->n_tokens_max;
+    if (total_tokens + budget > pCur->n_tokens_max) {
+      pCur->hasPending = 1;
+      break;
+    }
+    total_tokens += budget;
+    n++;
+  }
+
+  pCur->n_inputs = n;
+  if (n == 0) {
+    return SQLITE_OK;
+  }
+  // Only hold a context for the duration of the decode, so other lembed()
+  // calls on the same model in this statement can still get one.
+  ApiContext *ctx = api_model_context_acquire(pCur->entry);
+  int rc = embed_many(pCur->model, ctx, pCur->tokens, pCur->token_counts, n,
+                      pCur->entry->document_prefix.n_tokens, pCur->embeddings);
+  api_model_context_release(pCur->entry, ctx);
+  if (rc != SQLITE_OK) {
+    pVtab->zErrMsg = sqlite3_mprintf("Error generating embeddings");
+  }
+  return rc;
 }
-static void lembed_token_to_piece_(sqlite3_context *context, int argc,
-                                   sqlite3_value **argv) {
-  struct llama_model *model;
-  int rc = api_model_from_name((struct Api *)sqlite3_user_data(context),
-                               (const char *)sqlite3_value_text(argv[0]),
-                               sqlite3_value_bytes(argv[0]), &model, NULL);
 
-  int32_t token = sqlite3_value_int(argv[1]);
-#define BUFLEN 256
-  char buf[BUFLEN];
-  int n = llama_token_to_piece(model, token, buf, BUFLEN, false);
-  if (n) {
-    sqlite3_result_text(context, buf, n, SQLITE_TRANSIENT);
-  } else {
-    sqlite3_result_null(context);
+static int lembed_batchFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                              const char *idxStr, int argc,
+                              sqlite3_value **argv) {
+  lembed_batch_cursor *pCur = (lembed_batch_cursor *)pVtabCursor;
+  lembed_batch_vtab *p = (lembed_batch_vtab *)pVtabCursor->pVtab;
+  lembed_batchClear(pCur);
+
+  int rc = api_model_from_name(p->api, (const char *)sqlite3_value_text(argv[0]),
+                               sqlite3_value_bytes(argv[0]), &pCur->model,
+                               &pCur->entry);
+  if (rc != SQLITE_OK) {
+    p->base.zErrMsg = sqlite3_mprintf(
+        "Unknown model name '%s'. Was it registered with lembed_models?",
+        sqlite3_value_text(argv[0]));
+    return SQLITE_ERROR;
+  }
+  // Released by the next xFilter or xClose, so the model outlives a DELETE
+  api_model_retain(pCur->entry);
+  p->base.zErrMsg = api_model_embed_error(pCur->entry);
+  if (p->base.zErrMsg) {
+    return SQLITE_ERROR;
+  }
+
+  rc = sqlite3_prepare_v2(p->db, "SELECT value FROM json_each(?)", -1,
+                          &pCur->stmt, NULL);
+  if (rc != SQLITE_OK) {
+    p->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(p->db));
+    return rc;
+  }
+  sqlite3_bind_value(pCur->stmt, 1, argv[1]);
+
+  pCur->n_tokens_max = pCur->entry->n_tokens_max;
+  pCur->n_seq_max = pCur->entry->n_seq_max;
+  pCur->dimensions = pCur->entry->dimensions;
+  pCur->contents = sqlite3_malloc(sizeof(char *) * pCur->n_seq_max);
+  pCur->contents_lengths = sqlite3_malloc(sizeof(int) * pCur->n_seq_max);
+  pCur->tokens = sqlite3_malloc(sizeof(llama_token *) * pCur->n_seq_max);
+  pCur->token_counts = sqlite3_malloc(sizeof(int) * pCur->n_seq_max);
+  pCur->embeddings =
+      sqlite3_malloc(sizeof(float) * pCur->n_seq_max * pCur->dimensions);
+  if (!pCur->contents || !pCur->contents_lengths || !pCur->tokens ||
+      !pCur->token_counts || !pCur->embeddings) {
+    return SQLITE_NOMEM;
   }
+
+  pCur->iRowid = 0;
+  return lembed_batchFill(pCur);
 }
 
-static void _noop(sqlite3_context *context, int argc, sqlite3_value **argv) {}
-static void ggml_test(sqlite3_context *context, int argc,
-                      sqlite3_value **argv) {
-  sqlite3_result_int64(context, ggml_cpu_has_avx());
+static int lembed_batchRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  lembed_batch_cursor *pCur = (lembed_batch_cursor *)cur;
+  *pRowid = pCur->iRowid;
+  return SQLITE_OK;
 }
 
-#pragma region lembed_models() table function
+static int lembed_batchNext(sqlite3_vtab_cursor *cur) {
+  lembed_batch_cursor *pCur = (lembed_batch_cursor *)cur;
+  pCur->iRowid++;
+  pCur->iInput++;
+  if (pCur->iInput >= pCur->n_inputs) {
+    return lembed_batchFill(pCur);
+  }
+  return SQLITE_OK;
+}
 
-typedef struct lembed_models_vtab lembed_models_vtab;
-struct lembed_models_vtab {
+static int lembed_batchEof(sqlite3_vtab_cursor *cur) {
+  lembed_batch_cursor *pCur = (lembed_batch_cursor *)cur;
+  return pCur->n_inputs == 0;
+}
+
+static int lembed_batchColumn(sqlite3_vtab_cursor *cur,
+                              sqlite3_context *context, int i) {
+  lembed_batch_cursor *pCur = (lembed_batch_cursor *)cur;
+  switch (i) {
+  case LEMBED_BATCH_CONTENTS:
+    sqlite3_result_text(context, pCur->contents[pCur->iInput],
+                        pCur->contents_lengths[pCur->iInput], SQLITE_TRANSIENT);
+    break;
+  case LEMBED_BATCH_EMBEDDING:
+    sqlite3_result_blob(context,
+                        pCur->embeddings + (pCur->iInput * pCur->dimensions),
+                        sizeof(float) * pCur->dimensions, SQLITE_TRANSIENT);
+    sqlite3_result_subtype(context, LEMBED_FLOAT32_SUBTYPE);
+    break;
+  default:
+    sqlite3_result_null(context);
+    break;
+  }
+  return SQLITE_OK;
+}
+
+static sqlite3_module lembed_batchModule = {
+    /* iVersion    */ 0,
+    /* xCreate     */ 0,
+    /* xConnect    */ lembed_batchConnect,
+    /* xBestIndex  */ lembed_batchBestIndex,
+    /* xDisconnect */ lembed_batchDisconnect,
+    /* xDestroy    */ 0,
+    /* xOpen       */ lembed_batchOpen,
+    /* xClose      */ lembed_batchClose,
+    /* xFilter     */ lembed_batchFilter,
+    /* xNext       */ lembed_batchNext,
+    /* xEof        */ lembed_batchEof,
+    /* xColumn     */ lembed_batchColumn,
+    /* xRowid      */ lembed_batchRowid,
+    /* xUpdate     */ 0,
+    /* xBegin      */ 0,
+    /* xSync       */ 0,
+    /* xCommit     */ 0,
+    /* xRollback   */ 0,
+    /* xFindMethod */ 0,
+    /* xRename     */ 0,
+    /* xSavepoint  */ 0,
+    /* xRelease    */ 0,
+    /* xRollbackTo */ 0,
+    /* xShadowName */ 0};
+#pragma endregion
+
+#pragma region lembed_stream() table function
+
+/*
+ * lembed_stream(model, sql) embeds the rows of an inner SELECT statement,
+ * returning the first column as id and the embedding of the second column.
+ *
+ *   INSERT INTO doc_embeddings(id, embedding)
+ *     SELECT id, embedding FROM lembed_stream('m', 'SELECT id, body FROM docs');
+ *
+ * Rows are read in slots of n_seq_max rows. While one slot is decoded (in as
+ * few token-budgeted batches as possible), the next slot is tokenized on
+ * another thread. Only the main thread touches SQLite: the inner statement
+ * runs on the same connection, which is busy with the outer statement.
+ */
+typedef struct lembed_stream_slot lembed_stream_slot;
+struct lembed_stream_slot {
+  struct llama_model *model;
+  const lembed_prefix *prefix;
+  lembed_stats *stats;
+  int n_rows;
+  sqlite3_value **ids;
+  // NULL for rows where the text is NULL, which get a NULL embedding
+  char **contents;
+  int *contents_lengths;
+  llama_token **tokens;
+  int *token_counts;
+  float *embeddings;
+  // Result of tokenizing, and the row that failed
+  int rc;
+  int iFailed;
+};
+
+typedef struct lembed_stream_vtab lembed_stream_vtab;
+struct lembed_stream_vtab {
   sqlite3_vtab base;
+  sqlite3 *db;
   struct Api *api;
 };
 
-typedef struct lembed_models_cursor lembed_models_cursor;
-struct lembed_models_cursor {
+typedef struct lembed_stream_cursor lembed_stream_cursor;
+struct lembed_stream_cursor {
   sqlite3_vtab_cursor base;
   sqlite3_int64 iRowid;
+  struct llama_model *model;
+  ApiModel *entry;
+  sqlite3_stmt *stmt;
+  int stmtDone;
+
+  int n_tokens_max;
+  int n_seq_max;
+  int dimensions;
+  // slots[current] is being returned, slots[!current] is read ahead
+  lembed_stream_slot slots[2];
+  int current;
+  int iRow;
 };
 
-static int lembed_modelsConnect(sqlite3 *db, void *pAux, int argc,
+static int lembed_streamConnect(sqlite3 *db, void *pAux, int argc,
                                 const char *const *argv, sqlite3_vtab **ppVtab,
                                 char **pzErr) {
-  lembed_models_vtab *pNew;
+  lembed_stream_vtab *pNew;
   int rc;
-  if (strcmp(argv[1], "temp") != 0) {
-    // return SQLITE_ERROR;
+#define LEMBED_STREAM_ID 0
+#define LEMBED_STREAM_EMBEDDING 1
+#define LEMBED_STREAM_MODEL 2
+#define LEMBED_STREAM_SQL 3
+  rc = sqlite3_declare_vtab(
+      db, "CREATE TABLE x(id, embedding, model hidden, sql hidden)");
+  if (rc == SQLITE_OK) {
+    // It runs the SQL it's given, so not from views or triggers of a
+    // database file someone else may have written
+    rc = sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
   }
-#define LEMBED_MODELS_NAME            0
-#define LEMBED_MODELS_MODEL           1
-#define LEMBED_MODELS_MODEL_OPTIONS   2
-#define LEMBED_MODELS_CONTEXT_OPTIONS 3
-  rc = sqlite3_declare_vtab(db, "CREATE TABLE x(name, model, model_options "
-                                "hidden, context_options hidden)");
   if (rc == SQLITE_OK) {
     pNew = sqlite3_malloc(sizeof(*pNew));
     *ppVtab = (sqlite3_vtab *)pNew;
     if (pNew == 0)
       return SQLITE_NOMEM;
     memset(pNew, 0, sizeof(*pNew));
+    pNew->db = db;
     pNew->api = pAux;
   }
   return rc;
 }
 
-static int lembed_modelsDisconnect(sqlite3_vtab *pVtab) {
-  lembed_models_vtab *p = (lembed_models_vtab *)pVtab;
+static int lembed_streamDisconnect(sqlite3_vtab *pVtab) {
+  lembed_stream_vtab *p = (lembed_stream_vtab *)pVtab;
   sqlite3_free(p);
   return SQLITE_OK;
 }
 
-#define POINTER_SUBTYPE 112
+static int lembed_streamOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  lembed_stream_cursor *pCur;
+  pCur = sqlite3_malloc(sizeof(*pCur));
+  if (pCur == 0)
+    return SQLITE_NOMEM;
+  memset(pCur, 0, sizeof(*pCur));
+  *ppCursor = &pCur->base;
+  return SQLITE_OK;
+}
 
-static int lembed_modelsUpdate(sqlite3_vtab *pVTab, int argc,
-                               sqlite3_value **argv, sqlite_int64 *pRowid) {
-  lembed_models_vtab *p = (lembed_models_vtab *)pVTab;
-  // DELETE operation
-  if (argc == 1 && sqlite3_value_type(argv[0]) != SQLITE_NULL) {
-    return SQLITE_ERROR;
+static int stream_slot_init(lembed_stream_slot *slot,
+                            struct llama_model *model,
+                            const lembed_prefix *prefix, lembed_stats *stats,
+                            int n_seq_max, int dimensions) {
+  slot->model = model;
+  slot->prefix = prefix;
+  slot->stats = stats;
+  slot->ids = sqlite3_malloc(sizeof(sqlite3_value *) * n_seq_max);
+  slot->contents = sqlite3_malloc(sizeof(char *) * n_seq_max);
+  slot->contents_lengths = sqlite3_malloc(sizeof(int) * n_seq_max);
+  slot->tokens = sqlite3_malloc(sizeof(llama_token *) * n_seq_max);
+  slot->token_counts = sqlite3_malloc(sizeof(int) * n_seq_max);
+  slot->embeddings = sqlite3_malloc(sizeof(float) * n_seq_max * dimensions);
+  if (!slot->ids || !slot->contents || !slot->contents_lengths ||
+      !slot->tokens || !slot->token_counts || !slot->embeddings) {
+    return SQLITE_NOMEM;
   }
-  // INSERT operation
-  else if (argc > 1 && sqlite3_value_type(argv[0]) == SQLITE_NULL) {
-    sqlite3_value **columnValues = &argv[2];
-    const char *key =
-        (const char *)sqlite3_value_text(columnValues[LEMBED_MODELS_NAME]);
-    int idx = -1;
-    for (int i = 0; i < MAX_MODELS; i++) {
-      if (!p->api->models[i].name) {
-        p->api->models[i].name = sqlite3_mprintf("%s", key);
-        idx = i;
-        break;
-      }
-    }
-    if (idx < 0)
-      abort();
+  return SQLITE_OK;
+}
 
-    const char *modelPath = sqlite3_value_pointer(
-        columnValues[LEMBED_MODELS_MODEL], POINTER_NAME_MODEL_PATH);
-    assert(modelPath);
+/** Free the rows of slot, keeping its arrays for the next rows. */
+static void stream_slot_reset(lembed_stream_slot *slot) {
+  for (int i = 0; i < slot->n_rows; i++) {
+    sqlite3_value_free(slot->ids[i]);
+    sqlite3_free(slot->contents[i]);
+    sqlite3_free(slot->tokens[i]);
+  }
+  slot->n_rows = 0;
+  slot->rc = SQLITE_OK;
+}
 
-    lembed_model_options *modelOptions = NULL;
-    if (sqlite3_value_subtype(columnValues[LEMBED_MODELS_MODEL_OPTIONS]) ==
-        POINTER_SUBTYPE) {
-      modelOptions =
-          sqlite3_value_pointer(columnValues[LEMBED_MODELS_MODEL_OPTIONS],
-                                POINTER_NAME_MODEL_OPTIONS);
-    }
+static void stream_slot_free(lembed_stream_slot *slot) {
+  if (slot->ids) {
+    stream_slot_reset(slot);
+  }
+  sqlite3_free(slot->ids);
+  sqlite3_free(slot->contents);
+  sqlite3_free(slot->contents_lengths);
+  sqlite3_free(slot->tokens);
+  sqlite3_free(slot->token_counts);
+  sqlite3_free(slot->embeddings);
+  memset(slot, 0, sizeof(*slot));
+}
 
-    lembed_context_options *contextOptions = NULL;
-    if (sqlite3_value_subtype(columnValues[LEMBED_MODELS_CONTEXT_OPTIONS]) ==
-        POINTER_SUBTYPE) {
-      contextOptions =
-          sqlite3_value_pointer(columnValues[LEMBED_MODELS_CONTEXT_OPTIONS],
-                                POINTER_NAME_CONTEXT_OPTIONS);
+/** Tokenize every row of slot. Runs on the tokenizer thread. */
+static void stream_slot_tokenize(void *p) {
+  lembed_stream_slot *slot = p;
+  for (int i = 0; i < slot->n_rows; i++) {
+    slot->tokens[i] = NULL;
+    // Rows without text are skipped by embed_many()
+    slot->token_counts[i] = -1;
+  }
+  for (int i = 0; i < slot->n_rows; i++) {
+    if (!slot->contents[i]) {
+      continue;
     }
-
-    struct llama_model *model;
-    struct llama_model_params mparams = llama_model_default_params();
-    if (modelOptions && modelOptions->defined[0]) {
-      mparams.n_gpu_layers = modelOptions->n_gpu_layers;
+    int rc = tokenize(slot->model, slot->contents[i], slot->contents_lengths[i],
+                      slot->prefix, &slot->token_counts[i], &slot->tokens[i],
+                      slot->stats);
+    if (rc != SQLITE_OK) {
+      slot->tokens[i] = NULL;
+      slot->rc = rc;
+      slot->iFailed = i;
+      return;
     }
+  }
+}
 
-    model = llama_load_model_from_file(modelPath, mparams);
-    if (!model) {
-      return SQLITE_ERROR;
-    }
+static void lembed_streamClear(lembed_stream_cursor *pCur) {
+  stream_slot_free(&pCur->slots[0]);
+  stream_slot_free(&pCur->slots[1]);
+  sqlite3_finalize(pCur->stmt);
 
-    struct llama_context *ctx;
-    struct llama_context_params cparams = llama_context_default_params();
-    cparams.embeddings = 1;
-    if (contextOptions) {
-      if (contextOptions->defined[0]) {
-        cparams.seed = contextOptions->seed;
-      }
-      if (contextOptions->defined[1]) {
-        cparams.n_ctx = contextOptions->n_ctx;
-      }
-      if (contextOptions->defined[2]) {
-        cparams.rope_scaling_type = contextOptions->rope_scaling_type;
-      }
-      if (contextOptions->defined[3]) {
-        cparams.rope_freq_scale = contextOptions->rope_freq_scale;
-      }
-    }
+  api_model_release(pCur->entry);
+  sqlite3_vtab_cursor base = pCur->base;
+  memset(pCur, 0, sizeof(*pCur));
+  pCur->base = base;
+}
 
-    ctx = llama_new_context_with_model(model, cparams);
-    if (!ctx) {
-      llama_free_model(model);
-      return SQLITE_ERROR;
+static int lembed_streamClose(sqlite3_vtab_cursor *cur) {
+  lembed_stream_cursor *pCur = (lembed_stream_cursor *)cur;
+  lembed_streamClear(pCur);
+  sqlite3_free(pCur);
+  return SQLITE_OK;
+}
+
+static int lembed_streamBestIndex(sqlite3_vtab *pVTab,
+                                  sqlite3_index_info *pIdxInfo) {
+  int idxModel = -1;
+  int idxSql = -1;
+  for (int i = 0; i < pIdxInfo->nConstraint; i++) {
+    const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    if (!pCons->usable || pCons->op != SQLITE_INDEX_CONSTRAINT_EQ)
+      continue;
+    switch (pCons->iColumn) {
+    case LEMBED_STREAM_MODEL:
+      idxModel = i;
+      break;
+    case LEMBED_STREAM_SQL:
+      idxSql = i;
+      break;
     }
-    p->api->models[idx].model = model;
-    p->api->models[idx].context = ctx;
-    return SQLITE_OK;
   }
-  // UPDATE operation
-  else if (argc > 1 && sqlite3_value_type(argv[0]) != SQLITE_NULL) {
-    if ((sqlite3_value_type(argv[0]) == SQLITE_INTEGER) &&
-        (sqlite3_value_type(argv[1]) == SQLITE_INTEGER) &&
-        (sqlite3_value_int64(argv[0]) == sqlite3_value_int64(argv[1]))) {
-      return SQLITE_ERROR;
-    }
-
+  if (idxModel < 0 || idxSql < 0) {
+    pVTab->zErrMsg = sqlite3_mprintf("model and sql arguments are required");
     return SQLITE_ERROR;
   }
-  return SQLITE_ERROR;
-}
+  pIdxInfo->aConstraintUsage[idxModel].argvIndex = 1;
+  pIdxInfo->aConstraintUsage[idxModel].omit = 1;
+  pIdxInfo->aConstraintUsage[idxSql].argvIndex = 2;
+  pIdxInfo->aConstraintUsage[idxSql].omit = 1;
 
-static int lembed_modelsOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
-  lembed_models_cursor *pCur;
-  pCur = sqlite3_malloc(sizeof(*pCur));
-  if (pCur == 0)
-    return SQLITE_NOMEM;
-  memset(pCur, 0, sizeof(*pCur));
-  *ppCursor = &pCur->base;
+  pIdxInfo->idxNum = 1;
+  pIdxInfo->estimatedCost = (double)1000;
+  pIdxInfo->estimatedRows = 1000;
   return SQLITE_OK;
 }
 
-static int lembed_modelsClose(sqlite3_vtab_cursor *cur) {
-  lembed_models_cursor *pCur = (lembed_models_cursor *)cur;
-  sqlite3_free(pCur);
+/** Read up to n_seq_max rows of the inner statement into slot. */
+static int lembed_streamRead(lembed_stream_cursor *pCur,
+                             lembed_stream_slot *slot) {
+  stream_slot_reset(slot);
+  while (!pCur->stmtDone && slot->n_rows < pCur->n_seq_max) {
+    int rc = sqlite3_step(pCur->stmt);
+    if (rc == SQLITE_DONE) {
+      pCur->stmtDone = 1;
+      break;
+    }
+    if (rc != SQLITE_ROW) {
+      pCur->base.pVtab->zErrMsg =
+          sqlite3_mprintf("%s", sqlite3_errmsg(sqlite3_db_handle(pCur->stmt)));
+      return rc;
+    }
+    int n = slot->n_rows;
+    slot->ids[n] = sqlite3_value_dup(sqlite3_column_value(pCur->stmt, 0));
+    slot->contents[n] = NULL;
+    slot->tokens[n] = NULL;
+    slot->n_rows++;
+    if (!slot->ids[n]) {
+      return SQLITE_NOMEM;
+    }
+    if (sqlite3_column_type(pCur->stmt, 1) == SQLITE_NULL) {
+      continue;
+    }
+    const char *text = (const char *)sqlite3_column_text(pCur->stmt, 1);
+    int text_len = sqlite3_column_bytes(pCur->stmt, 1);
+    slot->contents[n] = sqlite3_mprintf("%.*s", text_len, text ? text : "");
+    if (!slot->contents[n]) {
+      return SQLITE_NOMEM;
+    }
+    slot->contents_lengths[n] = text_len;
+  }
   return SQLITE_OK;
 }
 
-static int lembed_modelsBestIndex(sqlite3_vtab *pVTab,
-                                  sqlite3_index_info *pIdxInfo) {
-  pIdxInfo->idxNum = 1;
-  pIdxInfo->estimatedCost = (double)10;
-  pIdxInfo->estimatedRows = 10;
-  return SQLITE_OK;
+/** Embed every row of an already tokenized slot, with embed_many(). */
+static int lembed_streamDecode(lembed_stream_cursor *pCur,
+                               lembed_stream_slot *slot) {
+  sqlite3_vtab *pVtab = pCur->base.pVtab;
+  if (slot->rc != SQLITE_OK) {
+    pVtab->zErrMsg = sqlite3_mprintf("Error tokenizing row %lld",
+                                     pCur->iRowid + slot->iFailed);
+    return slot->rc;
+  }
+  for (int i = 0; i < slot->n_rows; i++) {
+    if (slot->token_counts[i] > pCur->n_tokens_max &&
+        pCur->entry->long_inputs == LEMBED_LONG_INPUTS_ERROR) {
+      pVtab->zErrMsg = sqlite3_mprintf(
+          "Row %lld has %d tokens, more than the batch size of %d. Use the "
+          "long_inputs context option to truncate or split long inputs.",
+          pCur->iRowid + i, slot->token_counts[i], pCur->n_tokens_max);
+      return SQLITE_ERROR;
+    }
+  }
+
+  ApiContext *ctx = api_model_context_acquire(pCur->entry);
+  int rc = embed_many(pCur->model, ctx, slot->tokens, slot->token_counts,
+                      slot->n_rows, slot->prefix->n_tokens, slot->embeddings);
+  api_model_context_release(pCur->entry, ctx);
+  if (rc != SQLITE_OK) {
+    pVtab->zErrMsg = sqlite3_mprintf("Error generating embeddings");
+  }
+  return rc;
+}
+
+/**
+ * Make the read-ahead slot the current one: start tokenizing the rows after
+ * it on another thread, and decode it in the meantime.
+ */
+static int lembed_streamAdvance(lembed_stream_cursor *pCur) {
+  pCur->current = !pCur->current;
+  pCur->iRow = 0;
+  lembed_stream_slot *current = &pCur->slots[pCur->current];
+  lembed_stream_slot *next = &pCur->slots[!pCur->current];
+  if (current->n_rows == 0) {
+    return SQLITE_OK;
+  }
+
+  int rc = lembed_streamRead(pCur, next);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  lembed_thread thread;
+  int threaded = 0;
+  if (next->n_rows > 0) {
+    threaded =
+        lembed_thread_create(&thread, stream_slot_tokenize, next) == SQLITE_OK;
+    if (!threaded) {
+      stream_slot_tokenize(next);
+    }
+  }
+  rc = lembed_streamDecode(pCur, current);
+  if (threaded) {
+    lembed_thread_join(thread);
+  }
+  return rc;
 }
 
-static int lembed_modelsNext(sqlite3_vtab_cursor *cur);
-static int lembed_modelsFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+static int lembed_streamFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
                                const char *idxStr, int argc,
                                sqlite3_value **argv) {
-  lembed_models_cursor *pCur = (lembed_models_cursor *)pVtabCursor;
-  struct Api *api = ((lembed_models_vtab *)pVtabCursor->pVtab)->api;
-  pCur->iRowid = -1;
-  lembed_modelsNext(pVtabCursor);
-  return SQLITE_OK;
+  lembed_stream_cursor *pCur = (lembed_stream_cursor *)pVtabCursor;
+  lembed_stream_vtab *p = (lembed_stream_vtab *)pVtabCursor->pVtab;
+  lembed_streamClear(pCur);
+
+  int rc = api_model_from_name(p->api, (const char *)sqlite3_value_text(argv[0]),
+                               sqlite3_value_bytes(argv[0]), &pCur->model,
+                               &pCur->entry);
+  if (rc != SQLITE_OK) {
+    p->base.zErrMsg = sqlite3_mprintf(
+        "Unknown model name '%s'. Was it registered with lembed_models?",
+        sqlite3_value_text(argv[0]));
+    return SQLITE_ERROR;
+  }
+  // Released by the next xFilter or xClose, so the model outlives a DELETE
+  api_model_retain(pCur->entry);
+  p->base.zErrMsg = api_model_embed_error(pCur->entry);
+  if (p->base.zErrMsg) {
+    return SQLITE_ERROR;
+  }
+
+  rc = sqlite3_prepare_v2(p->db, (const char *)sqlite3_value_text(argv[1]), -1,
+                          &pCur->stmt, NULL);
+  if (rc != SQLITE_OK) {
+    p->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(p->db));
+    return rc;
+  }
+  if (!pCur->stmt || sqlite3_column_count(pCur->stmt) != 2) {
+    p->base.zErrMsg = sqlite3_mprintf(
+        "sql must be a single statement that returns 2 columns: id and text");
+    return SQLITE_ERROR;
+  }
+  if (!sqlite3_stmt_readonly(pCur->stmt)) {
+    p->base.zErrMsg =
+        sqlite3_mprintf("sql must be a read-only statement, like a SELECT");
+    return SQLITE_ERROR;
+  }
+
+  pCur->n_tokens_max = pCur->entry->n_tokens_max;
+  pCur->n_seq_max = pCur->entry->n_seq_max;
+  pCur->dimensions = pCur->entry->dimensions;
+  for (int i = 0; i < 2; i++) {
+    rc = stream_slot_init(&pCur->slots[i], pCur->model,
+                          &pCur->entry->document_prefix, &pCur->entry->stats,
+                          pCur->n_seq_max, pCur->dimensions);
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+  }
+
+  // The first slot is read ahead and tokenized here, with nothing to overlap
+  pCur->current = 1;
+  rc = lembed_streamRead(pCur, &pCur->slots[0]);
+  if (rc != SQLITE_OK) {
+    return rc;
+  }
+  stream_slot_tokenize(&pCur->slots[0]);
+  pCur->iRowid = 0;
+  return lembed_streamAdvance(pCur);
 }
 
-static int lembed_modelsRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
-  lembed_models_cursor *pCur = (lembed_models_cursor *)cur;
+static int lembed_streamRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  lembed_stream_cursor *pCur = (lembed_stream_cursor *)cur;
   *pRowid = pCur->iRowid;
   return SQLITE_OK;
 }
 
-static int lembed_modelsNext(sqlite3_vtab_cursor *cur) {
-  lembed_models_cursor *pCur = (lembed_models_cursor *)cur;
-  lembed_models_vtab *p = (lembed_models_vtab *)pCur->base.pVtab;
+static int lembed_streamNext(sqlite3_vtab_cursor *cur) {
+  lembed_stream_cursor *pCur = (lembed_stream_cursor *)cur;
   pCur->iRowid++;
-  while (pCur->iRowid < MAX_MODELS) {
-    if (p->api->models[pCur->iRowid].name) {
-      return SQLITE_OK;
-    }
-    pCur->iRowid++;
+  pCur->iRow++;
+  if (pCur->iRow >= pCur->slots[pCur->current].n_rows) {
+    return lembed_streamAdvance(pCur);
   }
   return SQLITE_OK;
 }
 
-static int lembed_modelsEof(sqlite3_vtab_cursor *cur) {
-  lembed_models_cursor *pCur = (lembed_models_cursor *)cur;
-  return pCur->iRowid >= MAX_MODELS;
+static int lembed_streamEof(sqlite3_vtab_cursor *cur) {
+  lembed_stream_cursor *pCur = (lembed_stream_cursor *)cur;
+  return pCur->iRow >= pCur->slots[pCur->current].n_rows;
 }
 
-static int lembed_modelsColumn(sqlite3_vtab_cursor *cur,
+static int lembed_streamColumn(sqlite3_vtab_cursor *cur,
                                sqlite3_context *context, int i) {
-  lembed_models_cursor *pCur = (lembed_models_cursor *)cur;
-  lembed_models_vtab *p = (lembed_models_vtab *)cur->pVtab;
+  lembed_stream_cursor *pCur = (lembed_stream_cursor *)cur;
+  lembed_stream_slot *slot = &pCur->slots[pCur->current];
   switch (i) {
-  case LEMBED_MODELS_NAME:
-    sqlite3_result_text(context, p->api->models[pCur->iRowid].name, -1,
-                        SQLITE_TRANSIENT);
+  case LEMBED_STREAM_ID:
+    sqlite3_result_value(context, slot->ids[pCur->iRow]);
     break;
-  case LEMBED_MODELS_MODEL:
-    sqlite3_result_pointer(context, p->api->models[pCur->iRowid].model,
-                           POINTER_NAME_MODEL, NULL);
+  case LEMBED_STREAM_EMBEDDING:
+    if (!slot->contents[pCur->iRow]) {
+      sqlite3_result_null(context);
+      break;
+    }
+    sqlite3_result_blob(context,
+                        slot->embeddings + (pCur->iRow * pCur->dimensions),
+                        sizeof(float) * pCur->dimensions, SQLITE_TRANSIENT);
+    sqlite3_result_subtype(context, LEMBED_FLOAT32_SUBTYPE);
+    break;
+  default:
+    sqlite3_result_null(context);
     break;
   }
   return SQLITE_OK;
 }
 
-static sqlite3_module lembed_modelsModule = {
-    /* iVersion    */ 3,
+static sqlite3_module lembed_streamModule = {
+    /* iVersion    */ 0,
     /* xCreate     */ 0,
-    /* xConnect    */ lembed_modelsConnect,
-    /* xBestIndex  */ lembed_modelsBestIndex,
-    /* xDisconnect */ lembed_modelsDisconnect,
+    /* xConnect    */ lembed_streamConnect,
+    /* xBestIndex  */ lembed_streamBestIndex,
+    /* xDisconnect */ lembed_streamDisconnect,
     /* xDestroy    */ 0,
-    /* xOpen       */ lembed_modelsOpen,
-    /* xClose      */ lembed_modelsClose,
-    /* xFilter     */ lembed_modelsFilter,
-    /* xNext       */ lembed_modelsNext,
-    /* xEof        */ lembed_modelsEof,
-    /* xColumn     */ lembed_modelsColumn,
-    /* xRowid      */ lembed_modelsRowid,
-    /* xUpdate     */ lembed_modelsUpdate,
+    /* xOpen       */ lembed_streamOpen,
+    /* xClose      */ lembed_streamClose,
+    /* xFilter     */ lembed_streamFilter,
+    /* xNext       */ lembed_streamNext,
+    /* xEof        */ lembed_streamEof,
+    /* xColumn     */ lembed_streamColumn,
+    /* xRowid      */ lembed_streamRowid,
+    /* xUpdate     */ 0,
     /* xBegin      */ 0,
     /* xSync       */ 0,
     /* xCommit     */ 0,
@@ -618,52 +9549,227 @@ static sqlite3_module lembed_modelsModule = {
     /* xShadowName */ 0};
 #pragma endregion
 
-#pragma region lembed_chunks() table function
+#pragma region lembed_rerank()
 
-typedef struct lembed_chunks_vtab lembed_chunks_vtab;
-struct lembed_chunks_vtab {
+/*
+ * Rerankers (cross-encoders) score how relevant a document is to a query by
+ * reading both at once, so they run on (query, document) pairs instead of on
+ * single texts. A model is a reranker when its contexts pool with
+ * LLAMA_POOLING_TYPE_RANK, from its GGUF metadata or from the 'rank' value of
+ * the pooling context option.
+ *
+ *   SELECT lembed_rerank('reranker', :query, body) FROM docs;
+ *   SELECT id, score FROM lembed_rerank('reranker', :query,
+ *     'SELECT id, body FROM candidates') ORDER BY score DESC;
+ *
+ * The query and the document are tokenized on their own and joined the way
+ * BERT joins sentence pairs: the query inside the model's special tokens,
+ * then the document with only the closing ones ([CLS] q [SEP] d [SEP]). Pairs
+ * go through embed_many(), so every pair that fits in the batch is scored in
+ * the same llama_decode().
+ */
+
+/**
+ * Returns the error message (to be freed with sqlite3_free()) when entry
+ * can't rerank, or NULL if it can.
+ */
+static char *api_model_rerank_error(ApiModel *entry) {
+  if (entry->reranker) {
+    return NULL;
+  }
+  return sqlite3_mprintf("Model '%s' is not a reranker. Register it with "
+                         "the pooling context option set to 'rank'",
+                         entry->name);
+}
+
+/**
+ * Join the n_query tokens of a query with the n_document tokens of a
+ * document into *pair, a new array. Documents that make the pair too long
+ * for a batch are cut to fit, unless the long_inputs context option is
+ * 'error'. Both are tokenized with their special tokens.
+ */
+static int rerank_pair(ApiModel *entry, const llama_token *query, int n_query,
+                       const llama_token *document, int n_document,
+                       llama_token **pair, int *n_pair) {
+  const lembed_special_tokens *special = &entry->contexts[0].special;
+  const llama_token *content = document + special->n_prefix;
+  int n_content = n_document - special->n_prefix - special->n_suffix;
+  if (n_content < 0) {
+    n_content = 0;
+  }
+  int n = n_query + n_content + special->n_suffix;
+  if (n > entry->n_tokens_max) {
+    int room = entry->n_tokens_max - n_query - special->n_suffix;
+    if (entry->long_inputs == LEMBED_LONG_INPUTS_ERROR || room < 1) {
+      *n_pair = n;
+      return SQLITE_TOOBIG;
+    }
+    n_content = room;
+    n = entry->n_tokens_max;
+  }
+  *pair = sqlite3_malloc64(sizeof(llama_token) * (n > 0 ? n : 1));
+  if (!*pair) {
+    return SQLITE_NOMEM;
+  }
+  memcpy(*pair, query, sizeof(llama_token) * n_query);
+  memcpy(*pair + n_query, content, sizeof(llama_token) * n_content);
+  memcpy(*pair + n_query + n_content, special->suffix,
+         sizeof(llama_token) * special->n_suffix);
+  *n_pair = n;
+  return SQLITE_OK;
+}
+
+static char *rerank_too_long_error(ApiModel *entry, int n_pair) {
+  return sqlite3_mprintf(
+      "Query and document have %d tokens, more than the batch size of %d. "
+      "Use the long_inputs context option to truncate long documents.",
+      n_pair, entry->n_tokens_max);
+}
+
+/**
+ * lembed_rerank(model, query, document): relevance score of document for
+ * query, by a reranker model. Higher is more relevant.
+ */
+static void lembed_rerank(sqlite3_context *context, int argc,
+                          sqlite3_value **argv) {
+  struct llama_model *model;
+  ApiModel *entry;
+  int rc = api_model_from_name((struct Api *)sqlite3_user_data(context),
+                               (const char *)sqlite3_value_text(argv[0]),
+                               sqlite3_value_bytes(argv[0]), &model, &entry);
+  if (rc != SQLITE_OK) {
+    char *zErr = sqlite3_mprintf(
+        "Unknown model name '%s'. Was it registered with lembed_models?",
+        sqlite3_value_text(argv[0]));
+    sqlite3_result_error(context, zErr, -1);
+    sqlite3_free(zErr);
+    return;
+  }
+  char *zErr = api_model_rerank_error(entry);
+  if (zErr) {
+    sqlite3_result_error(context, zErr, -1);
+    sqlite3_free(zErr);
+    return;
+  }
+  if (sqlite3_value_type(argv[1]) == SQLITE_NULL ||
+      sqlite3_value_type(argv[2]) == SQLITE_NULL) {
+    return;
+  }
+
+  llama_token *query = NULL;
+  llama_token *document = NULL;
+  llama_token *pair = NULL;
+  int n_query;
+  int n_document;
+  int n_pair;
+  rc = tokenize(model, (const char *)sqlite3_value_text(argv[1]),
+                sqlite3_value_bytes(argv[1]), NULL, &n_query, &query,
+                &entry->stats);
+  if (rc == SQLITE_OK) {
+    rc = tokenize(model, (const char *)sqlite3_value_text(argv[2]),
+                  sqlite3_value_bytes(argv[2]), NULL, &n_document, &document,
+                  &entry->stats);
+  }
+  if (rc == SQLITE_OK) {
+    rc = rerank_pair(entry, query, n_query, document, n_document, &pair,
+                     &n_pair);
+  }
+  float score;
+  if (rc == SQLITE_OK) {
+    ApiContext *ctx = api_model_context_acquire(entry);
+    rc = embed_many(model, ctx, &pair, &n_pair, 1, 0, &score);
+    api_model_context_release(entry, ctx);
+  }
+  sqlite3_free(query);
+  sqlite3_free(document);
+  sqlite3_free(pair);
+  if (rc == SQLITE_TOOBIG) {
+    zErr = rerank_too_long_error(entry, n_pair);
+    sqlite3_result_error(context, zErr, -1);
+    sqlite3_free(zErr);
+    return;
+  }
+  if (rc == SQLITE_NOMEM) {
+    sqlite3_result_error_nomem(context);
+    return;
+  }
+  if (rc != SQLITE_OK) {
+    sqlite3_result_error(context, "Error reranking document", -1);
+    return;
+  }
+  sqlite3_result_double(context, score);
+}
+
+/*
+ * lembed_rerank(model, query, documents) table function: scores every
+ * document for query, best first. documents is a JSON array of texts, or a
+ * SELECT statement that returns an id and a text column like lembed_stream().
+ * Every document is read before the first row is returned, so all of the
+ * pairs are scored in as few decodes as fit.
+ */
+typedef struct lembed_rerank_row lembed_rerank_row;
+struct lembed_rerank_row {
+  sqlite3_value *id;
+  // NULL documents get a NULL score, and sort last
+  char *document;
+  int document_length;
+  float score;
+  sqlite3_int64 seq;
+};
+
+typedef struct lembed_rerank_vtab lembed_rerank_vtab;
+struct lembed_rerank_vtab {
   sqlite3_vtab base;
+  sqlite3 *db;
   struct Api *api;
 };
 
-typedef struct lembed_chunks_cursor lembed_chunks_cursor;
-struct lembed_chunks_cursor {
+typedef struct lembed_rerank_cursor lembed_rerank_cursor;
+struct lembed_rerank_cursor {
   sqlite3_vtab_cursor base;
-  sqlite3_int64 iRowid;
-  int32_t chunks_count;
-  char **chunks;
+  ApiModel *entry;
+  int n_rows;
+  int iRow;
+  lembed_rerank_row *rows;
 };
 
-static int lembed_chunksConnect(sqlite3 *db, void *pAux, int argc,
+static int lembed_rerankConnect(sqlite3 *db, void *pAux, int argc,
                                 const char *const *argv, sqlite3_vtab **ppVtab,
                                 char **pzErr) {
-  lembed_chunks_vtab *pNew;
+  lembed_rerank_vtab *pNew;
   int rc;
-#define lembed_chunks_CONTENTS 0
-#define lembed_chunks_TOKEN_COUNT 1
-#define lembed_chunks_SOURCE 2
-#define lembed_chunks_CHUNK_SIZE 3
-  rc = sqlite3_declare_vtab(db, "CREATE TABLE x(contents, token_count, source "
-                                "hidden, chunk_size hidden)");
+#define LEMBED_RERANK_ID 0
+#define LEMBED_RERANK_DOCUMENT 1
+#define LEMBED_RERANK_SCORE 2
+#define LEMBED_RERANK_MODEL 3
+#define LEMBED_RERANK_QUERY 4
+#define LEMBED_RERANK_DOCUMENTS 5
+  rc = sqlite3_declare_vtab(db, "CREATE TABLE x(id, document, score, model "
+                                "hidden, query hidden, documents hidden)");
+  if (rc == SQLITE_OK) {
+    // documents can be SQL to run, see lembed_streamConnect()
+    rc = sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+  }
   if (rc == SQLITE_OK) {
     pNew = sqlite3_malloc(sizeof(*pNew));
     *ppVtab = (sqlite3_vtab *)pNew;
     if (pNew == 0)
       return SQLITE_NOMEM;
     memset(pNew, 0, sizeof(*pNew));
+    pNew->db = db;
     pNew->api = pAux;
   }
   return rc;
 }
 
-static int lembed_chunksDisconnect(sqlite3_vtab *pVtab) {
-  lembed_chunks_vtab *p = (lembed_chunks_vtab *)pVtab;
+static int lembed_rerankDisconnect(sqlite3_vtab *pVtab) {
+  lembed_rerank_vtab *p = (lembed_rerank_vtab *)pVtab;
   sqlite3_free(p);
   return SQLITE_OK;
 }
 
-static int lembed_chunksOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
-  lembed_chunks_cursor *pCur;
+static int lembed_rerankOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
+  lembed_rerank_cursor *pCur;
   pCur = sqlite3_malloc(sizeof(*pCur));
   if (pCur == 0)
     return SQLITE_NOMEM;
@@ -672,154 +9778,327 @@ static int lembed_chunksOpen(sqlite3_vtab *p, sqlite3_vtab_cursor **ppCursor) {
   return SQLITE_OK;
 }
 
-static int lembed_chunksClose(sqlite3_vtab_cursor *cur) {
-  lembed_chunks_cursor *pCur = (lembed_chunks_cursor *)cur;
+static void lembed_rerankClear(lembed_rerank_cursor *pCur) {
+  for (int i = 0; i < pCur->n_rows; i++) {
+    sqlite3_value_free(pCur->rows[i].id);
+    sqlite3_free(pCur->rows[i].document);
+  }
+  sqlite3_free(pCur->rows);
+
+  api_model_release(pCur->entry);
+  sqlite3_vtab_cursor base = pCur->base;
+  memset(pCur, 0, sizeof(*pCur));
+  pCur->base = base;
+}
+
+static int lembed_rerankClose(sqlite3_vtab_cursor *cur) {
+  lembed_rerank_cursor *pCur = (lembed_rerank_cursor *)cur;
+  lembed_rerankClear(pCur);
   sqlite3_free(pCur);
   return SQLITE_OK;
 }
 
-static int lembed_chunksBestIndex(sqlite3_vtab *pVTab,
+static int lembed_rerankBestIndex(sqlite3_vtab *pVTab,
                                   sqlite3_index_info *pIdxInfo) {
-  int hasSource = 0;
-  int idxChunkSize = -1;
+  int idxModel = -1;
+  int idxQuery = -1;
+  int idxDocuments = -1;
   for (int i = 0; i < pIdxInfo->nConstraint; i++) {
     const struct sqlite3_index_constraint *pCons = &pIdxInfo->aConstraint[i];
+    if (!pCons->usable || pCons->op != SQLITE_INDEX_CONSTRAINT_EQ)
+      continue;
     switch (pCons->iColumn) {
-    case lembed_chunks_SOURCE: {
-      if (!hasSource && !pCons->usable ||
-          pCons->op != SQLITE_INDEX_CONSTRAINT_EQ)
-        return SQLITE_CONSTRAINT;
-      hasSource = 1;
-      pIdxInfo->aConstraintUsage[i].argvIndex = 1;
-      pIdxInfo->aConstraintUsage[i].omit = 1;
+    case LEMBED_RERANK_MODEL:
+      idxModel = i;
+      break;
+    case LEMBED_RERANK_QUERY:
+      idxQuery = i;
+      break;
+    case LEMBED_RERANK_DOCUMENTS:
+      idxDocuments = i;
       break;
-    }
-    case lembed_chunks_CHUNK_SIZE: {
-    }
     }
   }
-  if (!hasSource) {
-    pVTab->zErrMsg = sqlite3_mprintf("source argument is required");
+  if (idxModel < 0 || idxQuery < 0 || idxDocuments < 0) {
+    pVTab->zErrMsg = sqlite3_mprintf(
+        "model, query and documents arguments are required");
     return SQLITE_ERROR;
   }
+  pIdxInfo->aConstraintUsage[idxModel].argvIndex = 1;
+  pIdxInfo->aConstraintUsage[idxModel].omit = 1;
+  pIdxInfo->aConstraintUsage[idxQuery].argvIndex = 2;
+  pIdxInfo->aConstraintUsage[idxQuery].omit = 1;
+  pIdxInfo->aConstraintUsage[idxDocuments].argvIndex = 3;
+  pIdxInfo->aConstraintUsage[idxDocuments].omit = 1;
+  // Rows already come best first
+  if (pIdxInfo->nOrderBy == 1 &&
+      pIdxInfo->aOrderBy[0].iColumn == LEMBED_RERANK_SCORE &&
+      pIdxInfo->aOrderBy[0].desc) {
+    pIdxInfo->orderByConsumed = 1;
+  }
 
   pIdxInfo->idxNum = 1;
-  pIdxInfo->estimatedCost = (double)10;
-  pIdxInfo->estimatedRows = 10;
+  pIdxInfo->estimatedCost = (double)100;
+  pIdxInfo->estimatedRows = 100;
   return SQLITE_OK;
 }
 
-static int lembed_chunksFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
-                               const char *idxStr, int argc,
-                               sqlite3_value **argv) {
-  lembed_chunks_cursor *pCur = (lembed_chunks_cursor *)pVtabCursor;
-  struct Api *api = ((lembed_chunks_vtab *)pVtabCursor->pVtab)->api;
-  struct llama_model *model;
-  int rc = api_model_from_name(api, (const char *)sqlite3_value_text(argv[0]),
-                               sqlite3_value_bytes(argv[0]), &model, NULL);
-  pCur->iRowid = 0;
-
-  char *input = (char *)sqlite3_value_text(argv[1]);
-  sqlite3_int64 input_len = sqlite3_value_bytes(argv[1]);
-  int32_t chunk_size = 5; // sqlite3_value_int(argv[1]);
-  int32_t overlap = 0;    // argc > 2 ? sqlite3_value_int(argv[2]) : 0;
-
-  int token_count;
-  llama_token *tokens;
-  rc = tokenize(model, input, input_len, &token_count, &tokens);
-  assert(rc == SQLITE_OK);
+/** Best score first, then NULL scores, and input order between ties. */
+static int rerank_row_compare(const void *a, const void *b) {
+  const lembed_rerank_row *x = a;
+  const lembed_rerank_row *y = b;
+  if (!x->document != !y->document) {
+    return x->document ? -1 : 1;
+  }
+  if (x->document && x->score != y->score) {
+    return x->score > y->score ? -1 : 1;
+  }
+  return x->seq < y->seq ? -1 : x->seq > y->seq;
+}
 
-  char *ptr = input;
-  int nchunks = ceil(1.0 * token_count / chunk_size);
-  pCur->chunks_count = nchunks;
-  pCur->chunks = sqlite3_malloc(sizeof(char *) * nchunks);
-  assert(pCur->chunks);
-
-  for (int i = 0; i < nchunks; i++) {
-    sqlite3_str *str_chunk = sqlite3_str_new(NULL);
-    assert(str_chunk);
-
-    for (int j = 0; j < chunk_size; j++) {
-      int32_t token = tokens[i * chunk_size + j];
-      int32_t piece_len_neg =
-          llama_token_to_piece(model, token, NULL, 0, false);
-      // printf("%d\n", piece_len_neg);
-      // assert(piece_len_neg < 0);
-      int32_t piece_len = abs(piece_len_neg);
-      // include prefix space?
-      // assert(piece_len > 1);
-      if (!piece_len)
-        continue;
+/**
+ * Read every document of the documents statement into pCur->rows, and
+ * tokenize its pair with the n_query tokens of query.
+ */
+static int lembed_rerankRead(lembed_rerank_cursor *pCur, sqlite3_stmt *stmt,
+                             const llama_token *query, int n_query,
+                             llama_token ***pairs, int **pair_counts) {
+  sqlite3_vtab *pVtab = pCur->base.pVtab;
+  ApiModel *entry = pCur->entry;
+  int capacity = 0;
+  int rc;
+  while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+    int n = pCur->n_rows;
+    if (n == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      lembed_rerank_row *rows =
+          sqlite3_realloc64(pCur->rows, sizeof(lembed_rerank_row) * capacity);
+      if (!rows) {
+        return SQLITE_NOMEM;
+      }
+      pCur->rows = rows;
+      llama_token **grown =
+          sqlite3_realloc64(*pairs, sizeof(llama_token *) * capacity);
+      if (!grown) {
+        return SQLITE_NOMEM;
+      }
+      *pairs = grown;
+      int *counts = sqlite3_realloc64(*pair_counts, sizeof(int) * capacity);
+      if (!counts) {
+        return SQLITE_NOMEM;
+      }
+      *pair_counts = counts;
+    }
+    lembed_rerank_row *row = &pCur->rows[n];
+    memset(row, 0, sizeof(*row));
+    (*pairs)[n] = NULL;
+    (*pair_counts)[n] = -1;
+    row->seq = n;
+    row->id = sqlite3_value_dup(sqlite3_column_value(stmt, 0));
+    pCur->n_rows++;
+    if (!row->id) {
+      return SQLITE_NOMEM;
+    }
+    if (sqlite3_column_type(stmt, 1) == SQLITE_NULL) {
+      continue;
+    }
+    const char *text = (const char *)sqlite3_column_text(stmt, 1);
+    row->document_length = sqlite3_column_bytes(stmt, 1);
+    row->document = sqlite3_mprintf("%.*s", row->document_length,
+                                    text ? text : "");
+    if (!row->document) {
+      return SQLITE_NOMEM;
+    }
+    llama_token *tokens;
+    int n_tokens;
+    rc = tokenize(entry->model, row->document, row->document_length, NULL,
+                  &n_tokens, &tokens, &entry->stats);
+    if (rc != SQLITE_OK) {
+      pVtab->zErrMsg = sqlite3_mprintf("Error tokenizing document %d", n);
+      return SQLITE_ERROR;
+    }
+    int n_pair;
+    rc = rerank_pair(entry, query, n_query, tokens, n_tokens, &(*pairs)[n],
+                     &n_pair);
+    sqlite3_free(tokens);
+    if (rc == SQLITE_TOOBIG) {
+      pVtab->zErrMsg = rerank_too_long_error(entry, n_pair);
+      return SQLITE_ERROR;
+    }
+    if (rc != SQLITE_OK) {
+      return rc;
+    }
+    (*pair_counts)[n] = n_pair;
+  }
+  if (rc != SQLITE_DONE) {
+    pVtab->zErrMsg =
+        sqlite3_mprintf("%s", sqlite3_errmsg(sqlite3_db_handle(stmt)));
+    return rc;
+  }
+  return SQLITE_OK;
+}
 
-      char *piece = sqlite3_malloc(piece_len);
-      assert(piece);
-      llama_token_to_piece(model, token, piece, piece_len, false);
-      // printf("'%.*s' %d ", piece_len, piece, tokens[i*chunk_size + j]);
+static int lembed_rerankFilter(sqlite3_vtab_cursor *pVtabCursor, int idxNum,
+                               const char *idxStr, int argc,
+                               sqlite3_value **argv) {
+  lembed_rerank_cursor *pCur = (lembed_rerank_cursor *)pVtabCursor;
+  lembed_rerank_vtab *p = (lembed_rerank_vtab *)pVtabCursor->pVtab;
+  lembed_rerankClear(pCur);
 
-      char *begin = ptr;
-      while (*ptr != piece[piece_len > 1 ? 1 : 0]) {
-        ptr++;
-      }
-      sqlite3_str_append(str_chunk, begin, ptr - begin + piece_len);
-      ptr += piece_len;
+  struct llama_model *model;
+  int rc = api_model_from_name(p->api, (const char *)sqlite3_value_text(argv[0]),
+                               sqlite3_value_bytes(argv[0]), &model,
+                               &pCur->entry);
+  if (rc != SQLITE_OK) {
+    p->base.zErrMsg = sqlite3_mprintf(
+        "Unknown model name '%s'. Was it registered with lembed_models?",
+        sqlite3_value_text(argv[0]));
+    return SQLITE_ERROR;
+  }
+  // Released by the next xFilter or xClose, so the model outlives a DELETE
+  api_model_retain(pCur->entry);
+  p->base.zErrMsg = api_model_rerank_error(pCur->entry);
+  if (p->base.zErrMsg) {
+    return SQLITE_ERROR;
+  }
+  if (sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+    return SQLITE_OK;
+  }
 
-      sqlite3_free(piece);
+  // A JSON array of documents, or a statement that returns them
+  const char *documents = (const char *)sqlite3_value_text(argv[2]);
+  const char *z = documents ? documents : "";
+  while (isspace((unsigned char)*z)) {
+    z++;
+  }
+  sqlite3_stmt *stmt = NULL;
+  if (*z == '[') {
+    rc = sqlite3_prepare_v2(p->db, "SELECT key, value FROM json_each(?)", -1,
+                            &stmt, NULL);
+    if (rc == SQLITE_OK) {
+      sqlite3_bind_value(stmt, 1, argv[2]);
     }
-
-    char *chunk = sqlite3_str_finish(str_chunk);
-    assert(chunk);
-    pCur->chunks[i] = chunk;
+  } else {
+    rc = sqlite3_prepare_v2(p->db, z, -1, &stmt, NULL);
+  }
+  if (rc != SQLITE_OK) {
+    p->base.zErrMsg = sqlite3_mprintf("%s", sqlite3_errmsg(p->db));
+    return rc;
+  }
+  if (!stmt || sqlite3_column_count(stmt) != 2) {
+    sqlite3_finalize(stmt);
+    p->base.zErrMsg = sqlite3_mprintf(
+        "documents must be a JSON array, or a single statement that returns "
+        "2 columns: id and text");
+    return SQLITE_ERROR;
+  }
+  if (!sqlite3_stmt_readonly(stmt)) {
+    sqlite3_finalize(stmt);
+    p->base.zErrMsg = sqlite3_mprintf(
+        "documents must be a read-only statement, like a SELECT");
+    return SQLITE_ERROR;
   }
 
-  return SQLITE_OK;
+  llama_token *query = NULL;
+  int n_query;
+  llama_token **pairs = NULL;
+  int *pair_counts = NULL;
+  float *scores = NULL;
+  rc = tokenize(model, (const char *)sqlite3_value_text(argv[1]),
+                sqlite3_value_bytes(argv[1]), NULL, &n_query, &query,
+                &pCur->entry->stats);
+  if (rc == SQLITE_OK) {
+    rc = lembed_rerankRead(pCur, stmt, query, n_query, &pairs, &pair_counts);
+  }
+  sqlite3_finalize(stmt);
+  if (rc == SQLITE_OK && pCur->n_rows > 0) {
+    scores = sqlite3_malloc64(sizeof(float) * pCur->n_rows);
+    rc = scores ? SQLITE_OK : SQLITE_NOMEM;
+  }
+  if (rc == SQLITE_OK && pCur->n_rows > 0) {
+    // Only hold a context for the duration of the decodes, so other calls on
+    // the same model in this statement can still get one.
+    ApiContext *ctx = api_model_context_acquire(pCur->entry);
+    rc = embed_many(model, ctx, pairs, pair_counts, pCur->n_rows, 0, scores);
+    api_model_context_release(pCur->entry, ctx);
+    if (rc != SQLITE_OK) {
+      p->base.zErrMsg = sqlite3_mprintf("Error reranking documents");
+    }
+  }
+  if (rc == SQLITE_OK) {
+    for (int i = 0; i < pCur->n_rows; i++) {
+      pCur->rows[i].score = scores[i];
+    }
+    qsort(pCur->rows, pCur->n_rows, sizeof(lembed_rerank_row),
+          rerank_row_compare);
+  }
+  for (int i = 0; pairs && i < pCur->n_rows; i++) {
+    sqlite3_free(pairs[i]);
+  }
+  sqlite3_free(pairs);
+  sqlite3_free(pair_counts);
+  sqlite3_free(scores);
+  sqlite3_free(query);
+  return rc;
 }
 
-static int lembed_chunksRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
-  lembed_chunks_cursor *pCur = (lembed_chunks_cursor *)cur;
-  *pRowid = pCur->iRowid;
+static int lembed_rerankRowid(sqlite3_vtab_cursor *cur, sqlite_int64 *pRowid) {
+  lembed_rerank_cursor *pCur = (lembed_rerank_cursor *)cur;
+  *pRowid = pCur->rows[pCur->iRow].seq;
   return SQLITE_OK;
 }
 
-static int lembed_chunksNext(sqlite3_vtab_cursor *cur) {
-  lembed_chunks_cursor *pCur = (lembed_chunks_cursor *)cur;
-  pCur->iRowid++;
+static int lembed_rerankNext(sqlite3_vtab_cursor *cur) {
+  lembed_rerank_cursor *pCur = (lembed_rerank_cursor *)cur;
+  pCur->iRow++;
   return SQLITE_OK;
 }
 
-static int lembed_chunksEof(sqlite3_vtab_cursor *cur) {
-  lembed_chunks_cursor *pCur = (lembed_chunks_cursor *)cur;
-  return pCur->iRowid >= pCur->chunks_count;
+static int lembed_rerankEof(sqlite3_vtab_cursor *cur) {
+  lembed_rerank_cursor *pCur = (lembed_rerank_cursor *)cur;
+  return pCur->iRow >= pCur->n_rows;
 }
 
-static int lembed_chunksColumn(sqlite3_vtab_cursor *cur,
+static int lembed_rerankColumn(sqlite3_vtab_cursor *cur,
                                sqlite3_context *context, int i) {
-  lembed_chunks_cursor *pCur = (lembed_chunks_cursor *)cur;
+  lembed_rerank_cursor *pCur = (lembed_rerank_cursor *)cur;
+  lembed_rerank_row *row = &pCur->rows[pCur->iRow];
   switch (i) {
-  case lembed_chunks_CONTENTS:
-    sqlite3_result_text(context, pCur->chunks[pCur->iRowid], -1, SQLITE_STATIC);
+  case LEMBED_RERANK_ID:
+    sqlite3_result_value(context, row->id);
     break;
-  case lembed_chunks_SOURCE:
-    // TODO
+  case LEMBED_RERANK_DOCUMENT:
+    if (row->document) {
+      sqlite3_result_text(context, row->document, row->document_length,
+                          SQLITE_TRANSIENT);
+    }
+    break;
+  case LEMBED_RERANK_SCORE:
+    if (row->document) {
+      sqlite3_result_double(context, row->score);
+    }
+    break;
+  default:
     sqlite3_result_null(context);
     break;
   }
   return SQLITE_OK;
 }
 
-static sqlite3_module lembed_chunksModule = {
+static sqlite3_module lembed_rerankModule = {
     /* iVersion    */ 0,
     /* xCreate     */ 0,
-    /* xConnect    */ lembed_chunksConnect,
-    /* xBestIndex  */ lembed_chunksBestIndex,
-    /* xDisconnect */ lembed_chunksDisconnect,
+    /* xConnect    */ lembed_rerankConnect,
+    /* xBestIndex  */ lembed_rerankBestIndex,
+    /* xDisconnect */ lembed_rerankDisconnect,
     /* xDestroy    */ 0,
-    /* xOpen       */ lembed_chunksOpen,
-    /* xClose      */ lembed_chunksClose,
-    /* xFilter     */ lembed_chunksFilter,
-    /* xNext       */ lembed_chunksNext,
-    /* xEof        */ lembed_chunksEof,
-    /* xColumn     */ lembed_chunksColumn,
-    /* xRowid      */ lembed_chunksRowid,
+    /* xOpen       */ lembed_rerankOpen,
+    /* xClose      */ lembed_rerankClose,
+    /* xFilter     */ lembed_rerankFilter,
+    /* xNext       */ lembed_rerankNext,
+    /* xEof        */ lembed_rerankEof,
+    /* xColumn     */ lembed_rerankColumn,
+    /* xRowid      */ lembed_rerankRowid,
     /* xUpdate     */ 0,
     /* xBegin      */ 0,
     /* xSync       */ 0,
@@ -833,6 +10112,7 @@ static sqlite3_module lembed_chunksModule = {
     /* xShadowName */ 0};
 #pragma endregion
 
+
 #ifndef SQLITE_SUBTYPE
 #define SQLITE_SUBTYPE 0x000100000
 #endif
@@ -848,6 +10128,9 @@ static sqlite3_module lembed_chunksModule = {
 
 
 #define DEFAULT_FLAGS (SQLITE_UTF8 | SQLITE_INNOCUOUS | SQLITE_DETERMINISTIC)
+// lembed() and friends write to the cache_table of models that have one, on
+// the caller's connection, so they aren't innocuous
+#define EMBED_FLAGS (SQLITE_UTF8 | SQLITE_DETERMINISTIC)
 
 #ifdef _WIN32
 __declspec(dllexport)
@@ -858,6 +10141,7 @@ __declspec(dllexport)
 
   llama_backend_init();
   llama_log_set(dummy_log, NULL);
+  lembed_kernels_init();
 
   struct Api *a = sqlite3_malloc(sizeof(struct Api));
   assert(a);
@@ -874,7 +10158,9 @@ __declspec(dllexport)
   } aFunc[] = {
       // clang-format off
     {"lembed_version", _static_text_func, 0, DEFAULT_FLAGS,  SQLITE_LEMBED_VERSION },
-    {"lembed_debug",   _static_text_func, 0, DEFAULT_FLAGS,  SQLITE_LEMBED_DEBUG_STRING }
+    {"lembed_debug",   _static_text_func, 0, DEFAULT_FLAGS,  SQLITE_LEMBED_DEBUG_STRING },
+    {"lembed_distance_cosine", lembed_distance_cosine, 2, DEFAULT_FLAGS, NULL },
+    {"lembed_distance_l2",     lembed_distance_l2,     2, DEFAULT_FLAGS, NULL }
     // clang-format on
   };
 
@@ -891,21 +10177,42 @@ __declspec(dllexport)
     char *zFName;
     void (*xFunc)(sqlite3_context *, int, sqlite3_value **);
     int nArg;
+    int flags;
   } aFuncApi[] = {
       // clang-format off
-    {"lembed",                 lembed,                    1},
-    {"lembed",                 lembed,                    2},
-    {"lembed_tokenize_json",   lembed_tokenize_json,      2},
-    {"lembed_token_score",     lembed_token_score,        2},
-    {"lembed_token_to_piece",  lembed_token_to_piece_,    2},
-    {"lembed_model_size",      lembed_model_size,         1},
-    {"lembed_model_from_file", lembed_model_from_file,    1},
-    {"lembed_model_options",   lembed_model_options_,     -1},
-    {"lembed_context_options", lembed_context_options_,   -1},
+    {"lembed",                 lembed,                    1,  EMBED_FLAGS},
+    {"lembed",                 lembed,                    2,  EMBED_FLAGS},
+    {"lembed",                 lembed,                    3,  EMBED_FLAGS},
+    {"lembed_int8",            lembed_int8,               1,  EMBED_FLAGS},
+    {"lembed_int8",            lembed_int8,               2,  EMBED_FLAGS},
+    {"lembed_int8",            lembed_int8,               3,  EMBED_FLAGS},
+    {"lembed_bit",             lembed_bit,                1,  EMBED_FLAGS},
+    {"lembed_bit",             lembed_bit,                2,  EMBED_FLAGS},
+    {"lembed_bit",             lembed_bit,                3,  EMBED_FLAGS},
+    {"lembed_query",           lembed_query,              1,  EMBED_FLAGS},
+    {"lembed_query",           lembed_query,              2,  EMBED_FLAGS},
+    {"lembed_query",           lembed_query,              3,  EMBED_FLAGS},
+    {"lembed_tokenize_json",   lembed_tokenize_json,      2,  DEFAULT_FLAGS},
+    {"lembed_token_count",     lembed_token_count,        2,  DEFAULT_FLAGS},
+    {"lembed_token_score",     lembed_token_score,        2,  DEFAULT_FLAGS},
+    {"lembed_token_to_piece",  lembed_token_to_piece_,    2,  DEFAULT_FLAGS},
+    {"lembed_model_size",      lembed_model_size,         1,  DEFAULT_FLAGS},
+    {"lembed_model_from_file", lembed_model_from_file,    1,  DEFAULT_FLAGS},
+    {"lembed_model_options",   lembed_model_options_,     -1, DEFAULT_FLAGS},
+    {"lembed_context_options", lembed_context_options_,   -1, DEFAULT_FLAGS},
+    {"lembed_cache_stats",     lembed_cache_stats,        1,  SQLITE_UTF8},
+    {"lembed_enqueue",         lembed_enqueue,            3,  SQLITE_UTF8},
+    {"lembed_queue_stats",     lembed_queue_stats,        1,  SQLITE_UTF8},
+    {"lembed_queue_wait",      lembed_queue_wait,         1,  SQLITE_UTF8},
+    {"lembed_rerank",          lembed_rerank,             3,  DEFAULT_FLAGS},
+    {"lembed_stats_reset",     lembed_stats_reset_,       0,  SQLITE_UTF8},
+    {"lembed_stats_reset",     lembed_stats_reset_,       1,  SQLITE_UTF8},
+    {"lembed_thread_budget",   lembed_thread_budget,      0,  SQLITE_UTF8},
+    {"lembed_thread_budget",   lembed_thread_budget,      1,  SQLITE_UTF8},
     // clang-format on
   };
   for (unsigned long i = 0;i < sizeof(aFuncApi) / sizeof(aFuncApi[0]) && rc == SQLITE_OK; i++) {
-    rc = sqlite3_create_function_v2(db, aFuncApi[i].zFName, aFuncApi[i].nArg, DEFAULT_FLAGS, a, aFuncApi[i].xFunc, NULL, NULL, NULL);
+    rc = sqlite3_create_function_v2(db, aFuncApi[i].zFName, aFuncApi[i].nArg, aFuncApi[i].flags, a, aFuncApi[i].xFunc, NULL, NULL, NULL);
     if (rc != SQLITE_OK) {
       *pzErrMsg = sqlite3_mprintf("Error creating function %s: %s",
                                   aFuncApi[i].zFName, sqlite3_errmsg(db));
@@ -913,9 +10220,30 @@ __declspec(dllexport)
     }
   }
 
+  rc = sqlite3_create_function_v2(db, "lembed_topk", 4, DEFAULT_FLAGS, NULL,
+                                  NULL, lembed_topkStep, lembed_topkFinal,
+                                  NULL);
+  if (rc != SQLITE_OK) {
+    *pzErrMsg = sqlite3_mprintf("Error creating function lembed_topk: %s",
+                                sqlite3_errmsg(db));
+    return rc;
+  }
+
   sqlite3_create_function_v2(db, "_lembed_api", 0, 0, a, _noop, NULL, NULL, api_free);
 
+  sqlite3_create_module_v2(db, "lembed_batch", &lembed_batchModule, a, NULL);
+  sqlite3_create_module_v2(db, "lembed_chunk_embeddings",
+                           &lembed_chunk_embeddingsModule, a, NULL);
   sqlite3_create_module_v2(db, "lembed_chunks", &lembed_chunksModule, a, NULL);
   sqlite3_create_module_v2(db, "lembed_models", &lembed_modelsModule, a, NULL);
+  sqlite3_create_module_v2(db, "lembed_rerank", &lembed_rerankModule, a, NULL);
+  sqlite3_create_module_v2(db, "lembed_results", &lembed_resultsModule, a,
+                           NULL);
+  sqlite3_create_module_v2(db, "lembed_stats", &lembed_statsModule, a, NULL);
+  sqlite3_create_module_v2(db, "lembed_stream", &lembed_streamModule, a, NULL);
+  sqlite3_create_module_v2(db, "lembed_index", &lembed_indexModule, NULL,
+                           NULL);
+  sqlite3_create_module_v2(db, "lembed_sync", &lembed_syncModule, a, NULL);
+  sqlite3_create_module_v2(db, "lembed_tokens", &lembed_tokensModule, a, NULL);
   return SQLITE_OK;
 }
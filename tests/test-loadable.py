@@ -1,9 +1,11 @@
 # ruff: noqa: E731
 import struct
+import json
 import re
 import pytest
 import sqlite3
 import inspect
+import threading
 from contextlib import contextmanager
 
 EXT_PATH = "./dist/lembed0"
@@ -63,19 +65,51 @@ FUNCTIONS = [
     "_lembed_api",
     "lembed",
     "lembed",
+    "lembed",
+    "lembed_bit",
+    "lembed_bit",
+    "lembed_bit",
+    "lembed_cache_stats",
     "lembed_context_options",
     "lembed_debug",
+    "lembed_distance_cosine",
+    "lembed_distance_l2",
+    "lembed_enqueue",
+    "lembed_int8",
+    "lembed_int8",
+    "lembed_int8",
     "lembed_model_from_file",
     "lembed_model_options",
     "lembed_model_size",
+    "lembed_query",
+    "lembed_query",
+    "lembed_query",
+    "lembed_queue_stats",
+    "lembed_queue_wait",
+    "lembed_rerank",
+    "lembed_stats_reset",
+    "lembed_stats_reset",
+    "lembed_thread_budget",
+    "lembed_thread_budget",
+    "lembed_token_count",
     "lembed_token_score",
     "lembed_token_to_piece",
     "lembed_tokenize_json",
+    "lembed_topk",
     "lembed_version",
 ]
 MODULES = [
+    "lembed_batch",
+    "lembed_chunk_embeddings",
     "lembed_chunks",
+    "lembed_index",
     "lembed_models",
+    "lembed_rerank",
+    "lembed_results",
+    "lembed_stats",
+    "lembed_stream",
+    "lembed_sync",
+    "lembed_tokens",
 ]
 
 
@@ -131,6 +165,19 @@ def test_lembed():
     with _raises("No default model has been registered yet with lembed_models"):
         lembed("alex garcia")
 
+    # the first dims dimensions, normalized again
+    full = struct.unpack("384f", a)
+    norm = sum(x * x for x in full[:128]) ** 0.5
+    b = lembed("aaa", "alex garcia", 128)
+    assert struct.unpack("128f", b) == pytest.approx(
+        [x / norm for x in full[:128]], rel=1e-5
+    )
+    assert lembed("aaa", "alex garcia", 384) == a
+    with _raises("dims must be between 1 and 384, got 0"):
+        lembed("aaa", "alex garcia", 0)
+    with _raises("dims must be between 1 and 384, got 385"):
+        lembed("aaa", "alex garcia", 385)
+
     db.execute(
         "insert into temp.lembed_models(name, model) values (?, lembed_model_from_file(?))",
         ["default", MODEL1_PATH],
@@ -142,18 +189,555 @@ def test_lembed():
     )
 
 
+def test_lembed_int8():
+    a = struct.unpack(
+        "384f", db.execute("select lembed('aaa', 'alex garcia')").fetchone()[0]
+    )
+    q = db.execute("select lembed_int8('aaa', 'alex garcia')").fetchone()[0]
+    assert len(q) == 384
+    step = 2.0 / 255
+    expected = [int((x + 1.0) / step - 128) for x in a]
+    assert list(struct.unpack("384b", q)) == pytest.approx(expected, abs=1)
+
+
+def test_lembed_bit():
+    a = struct.unpack(
+        "384f", db.execute("select lembed('aaa', 'alex garcia')").fetchone()[0]
+    )
+    q = db.execute("select lembed_bit('aaa', 'alex garcia')").fetchone()[0]
+    assert len(q) == 384 // 8
+    assert [(q[i // 8] >> (i % 8)) & 1 for i in range(384)] == [
+        1 if x > 0 else 0 for x in a
+    ]
+
+
+def test_lembed_batch():
+    inputs = ["alex garcia", "hello world", "the quick brown fox jumps over the lazy dog"]
+    rows = execute_all(
+        db,
+        "select rowid, contents, embedding from lembed_batch('aaa', ?)",
+        [json.dumps(inputs)],
+    )
+    assert [row["rowid"] for row in rows] == [0, 1, 2]
+    assert [row["contents"] for row in rows] == inputs
+    for row in rows:
+        expected = db.execute("select lembed('aaa', ?)", [row["contents"]]).fetchone()[0]
+        assert struct.unpack("384f", row["embedding"]) == pytest.approx(
+            struct.unpack("384f", expected), abs=1e-5
+        )
+
+    # more inputs than sequences in a single batch
+    inputs = [f"document number {i}" for i in range(200)]
+    rows = execute_all(
+        db,
+        "select contents from lembed_batch('aaa', ?)",
+        [json.dumps(inputs)],
+    )
+    assert [row["contents"] for row in rows] == inputs
+
+    assert execute_all(db, "select * from lembed_batch('aaa', '[]')") == []
+
+    with _raises(
+        "Unknown model name 'aaaaaaaaa'. Was it registered with lembed_models?"
+    ):
+        db.execute("select * from lembed_batch('aaaaaaaaa', '[]')").fetchall()
+
+
+def test_lembed_cache_stats():
+    db.execute(
+        """
+          insert into temp.lembed_models(name, model, context_options)
+          select
+            'cached',
+            lembed_model_from_file(?),
+            lembed_context_options(
+              'cache_size', 1024 * 1024,
+              'cache_table', 'temp.lembed_cache'
+            )
+        """,
+        [MODEL1_PATH],
+    )
+    lembed_cache_stats = lambda name: json.loads(
+        db.execute("select lembed_cache_stats(?)", [name]).fetchone()[0]
+    )
+    assert db.execute("select lembed_cache_stats('aaa')").fetchone()[0] is None
+
+    a = db.execute("select lembed('cached', 'alex garcia')").fetchone()[0]
+    b = db.execute("select lembed('cached', 'alex garcia')").fetchone()[0]
+    assert a == b
+    assert a == db.execute("select lembed('aaa', 'alex garcia')").fetchone()[0]
+
+    stats = lembed_cache_stats("cached")
+    assert stats["hits"] == 1
+    assert stats["misses"] == 1
+    assert stats["entries"] == 1
+    assert execute_all(
+        db,
+        "select model, length(hash) as hash_length, embedding = ? as matches from temp.lembed_cache",
+        [a],
+    ) == [{"model": "cached", "hash_length": 16, "matches": 1}]
+
+    # Registering the name again with other options doesn't hit the
+    # embeddings of the old registration in the cache table
+    db.execute("delete from temp.lembed_models where name = 'cached'")
+    db.execute(
+        """
+          insert into temp.lembed_models(name, model, context_options)
+          select
+            'cached',
+            lembed_model_from_file(?),
+            lembed_context_options('pooling', 'cls', 'cache_table', 'temp.lembed_cache')
+        """,
+        [MODEL1_PATH],
+    )
+    assert db.execute("select lembed('cached', 'alex garcia')").fetchone()[0] != a
+    assert lembed_cache_stats("cached")["table_hits"] == 0
+    assert db.execute("select count(*) from temp.lembed_cache").fetchone()[0] == 2
+    db.execute("delete from temp.lembed_models where name = 'cached'")
+
+    # lembed() can write to a cache table, so it isn't innocuous
+    assert db.execute(
+        "select flags & 0x200000 from pragma_function_list where name = 'lembed'"
+    ).fetchone()[0] == 0
+
+
+def test_lembed_distance_cosine():
+    vec = lambda *v: struct.pack(f"{len(v)}f", *v)
+    lembed_distance_cosine = lambda a, b: db.execute(
+        "select lembed_distance_cosine(?, ?)", [a, b]
+    ).fetchone()[0]
+    assert lembed_distance_cosine(vec(1, 0), vec(1, 0)) == pytest.approx(0)
+    assert lembed_distance_cosine(vec(1, 0), vec(0, 1)) == pytest.approx(1)
+    assert lembed_distance_cosine(vec(1, 0), vec(-2, 0)) == pytest.approx(2)
+
+    a = db.execute("select lembed('aaa', 'alex garcia')").fetchone()[0]
+    b = db.execute("select lembed('aaa', 'hello world')").fetchone()[0]
+    fa = struct.unpack("384f", a)
+    fb = struct.unpack("384f", b)
+    assert lembed_distance_cosine(a, b) == pytest.approx(
+        1 - sum(x * y for x, y in zip(fa, fb)), abs=1e-5
+    )
+
+    with _raises("Vector dimension mismatch: a has 2 dimensions, b has 3"):
+        lembed_distance_cosine(vec(1, 0), vec(1, 0, 0))
+    with _raises("a has 3 bytes, which is not a float32 vector"):
+        lembed_distance_cosine(b"abc", vec(1, 0))
+    with _raises("b must be a float32 vector BLOB"):
+        lembed_distance_cosine(vec(1, 0), "not a vector")
+
+
+def test_lembed_distance_l2():
+    vec = lambda *v: struct.pack(f"{len(v)}f", *v)
+    lembed_distance_l2 = lambda a, b: db.execute(
+        "select lembed_distance_l2(?, ?)", [a, b]
+    ).fetchone()[0]
+    assert lembed_distance_l2(vec(1, 0), vec(1, 0)) == pytest.approx(0)
+    assert lembed_distance_l2(vec(3, 0), vec(0, 4)) == pytest.approx(5)
+
+    a = [float(i) for i in range(37)]
+    b = [float(i * i % 7) for i in range(37)]
+    assert lembed_distance_l2(vec(*a), vec(*b)) == pytest.approx(
+        sum((x - y) ** 2 for x, y in zip(a, b)) ** 0.5, rel=1e-5
+    )
+
+    with _raises("Vector dimension mismatch: a has 1 dimensions, b has 2"):
+        lembed_distance_l2(vec(1), vec(1, 0))
+
+
+def test_lembed_topk():
+    vec = lambda *v: struct.pack(f"{len(v)}f", *v)
+    db.execute("create temp table topk_items(id, embedding)")
+    db.executemany(
+        "insert into temp.topk_items values (?, ?)",
+        [
+            (1, vec(1, 0)),
+            ("two", vec(0, 1)),
+            (3, vec(1, 1)),
+            (4, None),
+            (5, vec(-1, 0)),
+        ],
+    )
+    lembed_topk = lambda query, k: json.loads(
+        db.execute(
+            "select lembed_topk(?, embedding, id, ?) from temp.topk_items",
+            [query, k],
+        ).fetchone()[0]
+    )
+    result = lembed_topk(vec(2, 0), 3)
+    assert [item["id"] for item in result] == [1, 3, "two"]
+    assert [item["distance"] for item in result] == pytest.approx(
+        [0, 1 - 0.5**0.5, 1], abs=1e-6
+    )
+    assert [item["id"] for item in lembed_topk(vec(0, 1), 10)] == [
+        "two",
+        3,
+        1,
+        5,
+    ]
+    assert lembed_topk(vec(1, 0), 1) == [{"id": 1, "distance": 0}]
+
+    assert (
+        db.execute(
+            "select lembed_topk(?, embedding, id, 2) from temp.topk_items where 0",
+            [vec(1, 0)],
+        ).fetchone()[0]
+        == "[]"
+    )
+
+    with _raises("k must be between 1 and 100000"):
+        lembed_topk(vec(1, 0), 0)
+    with _raises("Vector dimension mismatch: query has 3 dimensions, embedding has 2"):
+        lembed_topk(vec(1, 0, 0), 2)
+    db.execute("drop table temp.topk_items")
+
+
 @pytest.mark.skip(reason="TODO")
 def test__lembed_api():
     _lembed_api = lambda *args: db.execute("select _lembed_api()", args).fetchone()[0]
     pass
 
 
-@pytest.mark.skip(reason="TODO")
 def test_lembed_context_options():
-    lembed_context_options = lambda *args: db.execute(
-        "select lembed_context_options()", args
+    db.execute(
+        """
+          insert into temp.lembed_models(name, model, context_options)
+          select
+            'parallel',
+            lembed_model_from_file(?),
+            lembed_context_options('n_parallel', 4, 'n_seq_max', 8)
+        """,
+        [MODEL1_PATH],
+    )
+    a = db.execute("select lembed('parallel', 'alex garcia')").fetchone()[0]
+    b = db.execute("select lembed('aaa', 'alex garcia')").fetchone()[0]
+    assert a == b
+
+    # a connection runs one statement at a time, so the contexts are used at
+    # the same time by the queue's worker threads, here next to lembed() calls
+    texts = [f"parallel text {i}" for i in range(40)]
+    for i, text in enumerate(texts):
+        db.execute("select lembed_enqueue('parallel', ?, ?)", [i, text])
+    expected = [
+        db.execute("select lembed('parallel', ?)", [text]).fetchone()[0]
+        for text in texts
+    ]
+    stats = json.loads(
+        db.execute("select lembed_queue_wait('parallel')").fetchone()[0]
+    )
+    assert (stats["workers"], stats["completed"], stats["failed"]) == (4, 40, 0)
+    rows = execute_all(
+        db,
+        "select key, embedding from lembed_results where model = 'parallel' order by key",
+    )
+    assert [row["key"] for row in rows] == list(range(40))
+    for row, embedding in zip(rows, expected):
+        assert struct.unpack("384f", row["embedding"]) == pytest.approx(
+            struct.unpack("384f", embedding), rel=1e-5
+        )
+    db.execute("delete from lembed_results where model = 'parallel'")
+
+    # 16 token batches: 14 tokens of content, plus [CLS] and [SEP]
+    for name, long_inputs in [
+        ("short", None),
+        ("short-truncate", "truncate"),
+        ("short-mean", "mean"),
+    ]:
+        options = ["n_ctx", 16, "n_batch", 16, "n_ubatch", 16]
+        if long_inputs:
+            options += ["long_inputs", long_inputs]
+        db.execute(
+            f"""
+              insert into temp.lembed_models(name, model, context_options)
+              select ?, lembed_model_from_file(?), lembed_context_options({spread_args(options)})
+            """,
+            [name, MODEL1_PATH, *options],
+        )
+    words = [f"w{i}" for i in range(40)]
+    long_text = " ".join(words)
+    lembed = lambda name, text: db.execute(
+        "select lembed(?, ?)", [name, text]
     ).fetchone()[0]
-    pass
+
+    with _raises(
+        "Input is longer than the batch size of 16 tokens. Use the long_inputs context option to truncate or split long inputs."
+    ):
+        lembed("short", long_text)
+    truncated = struct.unpack("384f", lembed("short", " ".join(words[:14])))
+    assert struct.unpack("384f", lembed("short-truncate", long_text)) == (
+        pytest.approx(truncated, rel=1e-5)
+    )
+
+    mean = lembed("short-mean", long_text)
+    assert mean != lembed("short-truncate", long_text)
+    norm = sum(x * x for x in struct.unpack("384f", mean))
+    assert norm == pytest.approx(1.0, rel=1e-4)
+
+    rows = db.execute(
+        "select rowid, embedding from lembed_batch('short-mean', json_array(?, 'alex garcia'))",
+        [long_text],
+    ).fetchall()
+    assert [tuple(row) for row in rows] == [
+        (0, mean),
+        (1, lembed("short-mean", "alex garcia")),
+    ]
+    with _raises(
+        "Input 0 has 42 tokens, more than the batch size of 16. Use the long_inputs context option to truncate or split long inputs."
+    ):
+        db.execute(
+            "select * from lembed_batch('short', json_array(?))", [long_text]
+        ).fetchall()
+
+    with _raises(
+        "Unknown long_inputs value 'average', expected 'error', 'truncate' or 'mean'"
+    ):
+        db.execute("select lembed_context_options('long_inputs', 'average')")
+
+    db.execute(
+        """
+          insert into temp.lembed_models(name, model, context_options)
+          select 'dims', lembed_model_from_file(?), lembed_context_options('output_dims', 128)
+        """,
+        [MODEL1_PATH],
+    )
+    truncated = db.execute("select lembed('dims', 'alex garcia')").fetchone()[0]
+    assert struct.unpack("128f", truncated) == pytest.approx(
+        struct.unpack(
+            "128f",
+            db.execute("select lembed('aaa', 'alex garcia', 128)").fetchone()[0],
+        ),
+        rel=1e-5,
+    )
+    assert len(db.execute("select lembed_bit('dims', 'alex garcia')").fetchone()[0]) == 16
+    assert [tuple(row) for row in db.execute(
+        "select rowid, embedding from lembed_batch('dims', json_array('alex garcia'))"
+    ).fetchall()] == [(0, truncated)]
+    with _raises("dims must be between 1 and 128, got 384"):
+        db.execute("select lembed('dims', 'alex garcia', 384)").fetchone()
+    with _raises("output_dims is 1000, but the model only has 384 dimensions"):
+        db.execute(
+            """
+              insert into temp.lembed_models(name, model, context_options)
+              select 'too-wide', lembed_model_from_file(?), lembed_context_options('output_dims', 1000)
+            """,
+            [MODEL1_PATH],
+        )
+    with _raises("output_dims must be greater than 0"):
+        db.execute("select lembed_context_options('output_dims', 0)")
+
+    for pooling in ["mean", "cls", "none"]:
+        db.execute(
+            """
+              insert into temp.lembed_models(name, model, context_options)
+              select ?, lembed_model_from_file(?), lembed_context_options('pooling', ?)
+            """,
+            [f"pooling-{pooling}", MODEL1_PATH, pooling],
+        )
+    embedding = lambda name, text: struct.unpack(
+        "384f", lembed(name, text)
+    )
+    # 'none' mean pools the token embeddings itself
+    assert embedding("pooling-none", "alex garcia") == pytest.approx(
+        embedding("pooling-mean", "alex garcia"), rel=1e-4, abs=1e-6
+    )
+    assert embedding("pooling-cls", "alex garcia") != pytest.approx(
+        embedding("pooling-mean", "alex garcia"), rel=1e-4, abs=1e-6
+    )
+    rows = db.execute(
+        "select embedding from lembed_batch('pooling-none', json_array('alex garcia', 'hello world'))"
+    ).fetchall()
+    assert struct.unpack("384f", rows[1][0]) == pytest.approx(
+        embedding("pooling-mean", "hello world"), rel=1e-4, abs=1e-6
+    )
+    with _raises(
+        "Unknown pooling value 'max', expected 'mean', 'cls', 'last', 'rank' or 'none'"
+    ):
+        db.execute("select lembed_context_options('pooling', 'max')")
+
+    db.execute(
+        """
+          insert into temp.lembed_models(name, model, context_options)
+          select 'threads', lembed_model_from_file(?),
+            lembed_context_options('n_threads', 2, 'n_threads_batch', 4)
+        """,
+        [MODEL1_PATH],
+    )
+    assert db.execute("select lembed('threads', 'alex garcia')").fetchone()[
+        0
+    ] == db.execute("select lembed('aaa', 'alex garcia')").fetchone()[0]
+    with _raises("Unknown context option 'n_thread'"):
+        db.execute("select lembed_context_options('n_thread', 2)")
+
+    db.execute(
+        """
+          insert into temp.lembed_models(name, model, context_options)
+          select 'pinned', lembed_model_from_file(?),
+            lembed_context_options('cpu_mask', '0', 'n_threads', 1, 'n_threads_batch', 1)
+        """,
+        [MODEL1_PATH],
+    )
+    assert db.execute("select lembed('pinned', 'alex garcia')").fetchone()[
+        0
+    ] == db.execute("select lembed('aaa', 'alex garcia')").fetchone()[0]
+    for mask in ["", "3-1", "0,", "a", "0-2048"]:
+        with _raises(f"Invalid cpu_mask '{mask}', expected CPUs like '0-3,8'"):
+            db.execute("select lembed_context_options('cpu_mask', ?)", [mask])
+
+    # Concurrent lembed() calls on other connections share decodes
+    texts = [f"coalesced {i}" for i in range(32)]
+    expected = [struct.unpack("384f", lembed("aaa", text)) for text in texts]
+    n_threads = 8
+    results = {}
+    stats = []
+    ready = threading.Barrier(n_threads)
+
+    def embed(i):
+        conn = connect(EXT_PATH)
+        conn.execute(
+            """
+              insert into temp.lembed_models(name, model, context_options)
+              select 'coalesced', lembed_model_from_file(?),
+                lembed_context_options('coalesce_ms', 50, 'coalesce_max', 8)
+            """,
+            [MODEL1_PATH],
+        )
+        ready.wait()
+        for text in texts[i::n_threads]:
+            results[text] = conn.execute(
+                "select lembed('coalesced', ?)", [text]
+            ).fetchone()[0]
+        stats.append(
+            {
+                row["stage"]: row["calls"]
+                for row in conn.execute(
+                    "select stage, calls from lembed_stats where model = 'coalesced'"
+                )
+            }
+        )
+        conn.close()
+
+    threads = [threading.Thread(target=embed, args=[i]) for i in range(n_threads)]
+    for thread in threads:
+        thread.start()
+    for thread in threads:
+        thread.join()
+    for text, embedding in zip(texts, expected):
+        assert struct.unpack("384f", results[text]) == pytest.approx(
+            embedding, rel=1e-5, abs=1e-6
+        )
+    assert sum(s["coalesce"] for s in stats) == len(texts)
+    assert sum(s["decode"] for s in stats) < len(texts)
+
+    with _raises("coalesce_ms must be between 0 and 1000"):
+        db.execute("select lembed_context_options('coalesce_ms', -1)")
+    with _raises("coalesce_max must be greater than 0"):
+        db.execute("select lembed_context_options('coalesce_max', 0)")
+    for option in [
+        "seed",
+        "n_ctx",
+        "n_batch",
+        "n_ubatch",
+        "n_seq_max",
+        "n_parallel",
+        "n_threads",
+        "n_threads_batch",
+    ]:
+        with _raises(f"{option} must be greater than 0"):
+            db.execute("select lembed_context_options(?, 0)", [option])
+    with _raises("cache_size must not be negative"):
+        db.execute("select lembed_context_options('cache_size', -1)")
+    with _raises("queue_results_max must be greater than 0"):
+        db.execute("select lembed_context_options('queue_results_max', 0)")
+    for rope_scaling_type in ["none", "linear", "yarn", "YaRN"]:
+        db.execute(
+            "select lembed_context_options('rope_scaling_type', ?)", [rope_scaling_type]
+        )
+    with _raises(
+        "Unknown rope_scaling_type 'ntk', expected 'none', 'linear' or 'yarn'"
+    ):
+        db.execute("select lembed_context_options('rope_scaling_type', 'ntk')")
+    with _raises("lembed_context_options() takes pairs of keys and values"):
+        db.execute("select lembed_context_options('n_ctx')")
+
+
+def test_lembed_query():
+    db.execute(
+        """
+          insert into temp.lembed_models(name, model, context_options)
+          select 'e5', lembed_model_from_file(?), lembed_context_options(
+            'query_prefix', 'query: ',
+            'document_prefix', 'passage: ',
+            'cache_size', 1024 * 1024
+          )
+        """,
+        [MODEL1_PATH],
+    )
+    lembed = lambda *args: db.execute(
+        "select lembed({})".format(spread_args(args)), args
+    ).fetchone()[0]
+    lembed_query = lambda *args: db.execute(
+        "select lembed_query({})".format(spread_args(args)), args
+    ).fetchone()[0]
+
+    # without prefixes, lembed_query() is lembed()
+    assert lembed_query("aaa", "alex garcia") == lembed("aaa", "alex garcia")
+
+    query = lembed_query("e5", "alex garcia")
+    document = lembed("e5", "alex garcia")
+    assert query != document
+    # cached separately
+    assert lembed_query("e5", "alex garcia") == query
+    assert lembed("e5", "alex garcia") == document
+    assert struct.unpack("384f", query) == pytest.approx(
+        struct.unpack("384f", lembed("aaa", "query: alex garcia")), rel=1e-5
+    )
+    assert struct.unpack("384f", document) == pytest.approx(
+        struct.unpack("384f", lembed("aaa", "passage: alex garcia")), rel=1e-5
+    )
+    assert len(lembed_query("e5", "alex garcia", 128)) == 128 * 4
+
+    # the document_prefix is counted, and listed after [CLS] without offsets
+    assert (
+        db.execute("select lembed_token_count('e5', 'alex garcia')").fetchone()[0]
+        == db.execute(
+            "select lembed_token_count('aaa', 'passage: alex garcia')"
+        ).fetchone()[0]
+    )
+    tokens = execute_all(
+        db, "select token_id, byte_start from lembed_tokens('e5', 'alex garcia')"
+    )
+    assert [row["token_id"] for row in tokens] == json.loads(
+        db.execute(
+            "select lembed_tokenize_json('aaa', 'passage: alex garcia')"
+        ).fetchone()[0]
+    )
+    n_prefix = (
+        len(tokens)
+        - db.execute(
+            "select count(*) from lembed_tokens('aaa', 'alex garcia')"
+        ).fetchone()[0]
+    )
+    assert n_prefix > 0
+    for row in tokens[: 1 + n_prefix]:
+        assert row["byte_start"] is None
+    assert tokens[1 + n_prefix]["byte_start"] == 0
+
+    rows = db.execute(
+        "select embedding from lembed_batch('e5', json_array('alex garcia'))"
+    ).fetchall()
+    assert struct.unpack("384f", rows[0][0]) == pytest.approx(
+        struct.unpack("384f", document), rel=1e-5
+    )
+    rows = db.execute(
+        "select embedding from lembed_chunk_embeddings('e5', 'alex garcia')"
+    ).fetchall()
+    assert struct.unpack("384f", rows[0][0]) == pytest.approx(
+        struct.unpack("384f", document), rel=1e-5
+    )
+
+    with _raises(
+        "Unknown model name 'aaaaaaaaa'. Was it registered with lembed_models?"
+    ):
+        lembed_query("aaaaaaaaa", "alex garcia")
 
 
 @pytest.mark.skip(reason="TODO")
@@ -172,12 +756,57 @@ def test_lembed_model_from_file():
     pass
 
 
-@pytest.mark.skip(reason="TODO")
 def test_lembed_model_options():
-    lembed_model_options = lambda *args: db.execute(
-        "select lembed_model_options()", args
-    ).fetchone()[0]
-    pass
+    db.execute(
+        """
+          insert into temp.lembed_models(name, model, model_options)
+          select
+            'vocab',
+            lembed_model_from_file(?),
+            lembed_model_options('vocab_only', 1, 'use_mmap', 0)
+        """,
+        [MODEL1_PATH],
+    )
+    assert db.execute("select lembed_token_count('vocab', 'alex garcia')").fetchone()[
+        0
+    ] == db.execute("select lembed_token_count('aaa', 'alex garcia')").fetchone()[0]
+    assert (
+        db.execute("select count(*) from lembed_chunks('vocab', 'alex garcia')").fetchone()[0]
+        == 1
+    )
+    with _raises("Model 'vocab' was loaded with vocab_only, so it can only tokenize"):
+        db.execute("select lembed('vocab', 'alex garcia')").fetchone()
+    with _raises("Model 'vocab' was loaded with vocab_only, so it can only tokenize"):
+        db.execute(
+            "select * from lembed_batch('vocab', json_array('alex garcia'))"
+        ).fetchall()
+
+    with _raises("Unknown model option 'use_nmap'"):
+        db.execute("select lembed_model_options('use_nmap', 0)").fetchone()
+    with _raises("lembed_model_options() takes pairs of keys and values"):
+        db.execute("select lembed_model_options('use_mmap')").fetchone()
+
+    db.execute(
+        """
+          insert into temp.lembed_models(name, model, model_options)
+          select 'numa', lembed_model_from_file(?), lembed_model_options('numa', 'distribute')
+        """,
+        [MODEL1_PATH],
+    )
+    with _raises(
+        "A different numa strategy is already in use, and it can only be set once per process"
+    ):
+        db.execute(
+            """
+              insert into temp.lembed_models(name, model, model_options)
+              select 'numa-isolate', lembed_model_from_file(?), lembed_model_options('numa', 'isolate')
+            """,
+            [MODEL1_PATH],
+        )
+    with _raises(
+        "Unknown numa value 'spread', expected 'distribute', 'isolate', 'numactl' or 'mirror'"
+    ):
+        db.execute("select lembed_model_options('numa', 'spread')").fetchone()
 
 
 @pytest.mark.skip(reason="TODO")
@@ -188,6 +817,22 @@ def test_lembed_tokenize_json():
     pass
 
 
+def test_lembed_token_count():
+    lembed_token_count = lambda *args: db.execute(
+        "select lembed_token_count(?, ?)", args
+    ).fetchone()[0]
+    lembed_tokenize_json = lambda *args: db.execute(
+        "select json_array_length(lembed_tokenize_json(?, ?))", args
+    ).fetchone()[0]
+    for text in ["hello", "The quick brown fox jumps over the lazy dog.", ""]:
+        assert lembed_token_count("aaa", text) == lembed_tokenize_json("aaa", text)
+    assert lembed_token_count("aaa", None) is None
+    with _raises(
+        "Unknown model name 'aaaaaaaaa'. Was it registered with lembed_models?"
+    ):
+        lembed_token_count("aaaaaaaaa", "hello")
+
+
 @pytest.mark.skip(reason="TODO")
 def test_lembed_token_score():
     lembed_token_score = lambda *args: db.execute(
@@ -204,20 +849,1012 @@ def test_lembed_token_to_piece():
     pass
 
 
-@pytest.mark.skip(reason="TODO")
+def test_lembed_chunk_embeddings():
+    source = "the cat sat on the mat and the dog ate a bone. " * 100
+    lembed_chunk_embeddings = lambda *args: execute_all(
+        db,
+        f"select rowid, * from lembed_chunk_embeddings({spread_args(args)})",
+        args,
+    )
+    rows = lembed_chunk_embeddings("aaa", source, 8, 2)
+    chunks = execute_all(
+        db,
+        "select rowid, token_count, start_offset, end_offset from lembed_chunks('aaa', ?, 8, 2)",
+        [source],
+    )
+    assert len(rows) == len(chunks) > 1
+    for row, chunk in zip(rows, chunks):
+        assert row["rowid"] == row["chunk_index"] == chunk["rowid"]
+        assert row["token_count"] == chunk["token_count"]
+        assert row["start_offset"] == chunk["start_offset"]
+        assert row["end_offset"] == chunk["end_offset"]
+        expected = db.execute(
+            "select lembed('aaa', ?)",
+            [source.encode()[row["start_offset"] : row["end_offset"]].decode()],
+        ).fetchone()[0]
+        assert struct.unpack("384f", row["embedding"]) == pytest.approx(
+            struct.unpack("384f", expected), abs=1e-5
+        )
+
+    assert [row["chunk_index"] for row in lembed_chunk_embeddings("aaa", source[:200])] == [0]
+    assert lembed_chunk_embeddings("aaa", "") == []
+
+    with _raises("chunk_size of 100000 plus 2 special tokens is more than the batch size of"):
+        lembed_chunk_embeddings("aaa", source, 100000)
+    with _raises("overlap must be between 0 and chunk_size - 1, got 8"):
+        lembed_chunk_embeddings("aaa", source, 8, 8)
+    with _raises(
+        "Unknown model name 'aaaaaaaaa'. Was it registered with lembed_models?"
+    ):
+        lembed_chunk_embeddings("aaaaaaaaa", source)
+
+
 def test_lembed_chunks():
-    lembed_chunks = lambda *args: db.execute(
-        "select * from lembed_chunks()", args
-    ).fetchone()[0]
-    pass
+    source = "The quick brown fox jumps over the lazy dog. Hello, World!"
+    lembed_chunks = lambda *args: execute_all(
+        db,
+        f"select rowid, contents, token_count, start_offset, end_offset from lembed_chunks({spread_args(args)})",
+        args,
+    )
+    tokens = json.loads(
+        db.execute("select lembed_tokenize_json('aaa', ?)", [source]).fetchone()[0]
+    )
+    # without the [CLS] and [SEP] tokens
+    n_tokens = len(tokens) - 2
+
+    rows = lembed_chunks("aaa", source, 4)
+    assert [row["rowid"] for row in rows] == list(range(len(rows)))
+    assert sum(row["token_count"] for row in rows) == n_tokens
+    assert all(row["token_count"] == 4 for row in rows[:-1])
+    for row in rows:
+        assert row["contents"] == source[row["start_offset"] : row["end_offset"]]
+    assert rows[0]["contents"].startswith("The")
+    assert rows[0]["start_offset"] == 0
+    assert rows[-1]["end_offset"] == len(source)
+
+    overlapping = lembed_chunks("aaa", source, 4, 2)
+    assert [row["start_offset"] for row in overlapping[::2]] == [
+        row["start_offset"] for row in rows
+    ]
+    assert overlapping[-1]["end_offset"] == len(source)
+    assert all(row["token_count"] == 4 for row in overlapping[:-1])
+
+    # defaults to a single chunk for short inputs
+    assert lembed_chunks("aaa", source) == [
+        {
+            "rowid": 0,
+            "contents": source,
+            "token_count": n_tokens,
+            "start_offset": 0,
+            "end_offset": len(source),
+        }
+    ]
+    assert lembed_chunks("aaa", "") == []
+    assert lembed_chunks("aaa", "   ") == []
+
+    # multi-byte characters and sources larger than a single tokenizer segment
+    words = [f"Wörd{i}" for i in range(10000)]
+    large = " ".join(words)
+    rows = lembed_chunks("aaa", large, 100, 10)
+    assert rows[0]["start_offset"] == 0
+    assert rows[-1]["end_offset"] == len(large.encode())
+    encoded = large.encode()
+    for row in rows:
+        assert row["contents"].encode() == encoded[row["start_offset"] : row["end_offset"]]
+        assert not row["contents"].startswith(" ")
+
+    assert execute_all(
+        db,
+        "select model, source, chunk_size, overlap from lembed_chunks('aaa', 'hello', 3)",
+    ) == [{"model": "aaa", "source": "hello", "chunk_size": 3, "overlap": 0}]
+
+    with _raises("model and source arguments are required"):
+        db.execute("select * from lembed_chunks('aaa')").fetchall()
+    with _raises("chunk_size must be greater than 0"):
+        lembed_chunks("aaa", source, 0)
+    with _raises("overlap must be between 0 and chunk_size - 1, got 4"):
+        lembed_chunks("aaa", source, 4, 4)
+    with _raises(
+        "Unknown model name 'aaaaaaaaa'. Was it registered with lembed_models?"
+    ):
+        lembed_chunks("aaaaaaaaa", source)
+
+
+def test_lembed_tokens():
+    source = "The quick brown fox jumps over the lazy dog. Hello, Wörld!"
+    lembed_tokens = lambda *args: execute_all(
+        db,
+        f"select rowid, position, token_id, byte_start, byte_end from lembed_tokens({spread_args(args)})",
+        args,
+    )
+    tokens = json.loads(
+        db.execute("select lembed_tokenize_json('aaa', ?)", [source]).fetchone()[0]
+    )
+    rows = lembed_tokens("aaa", source)
+    assert [row["token_id"] for row in rows] == tokens
+    assert [row["position"] for row in rows] == list(range(len(tokens)))
+    assert [row["rowid"] for row in rows] == list(range(len(tokens)))
+
+    # [CLS] and [SEP] don't come from the source
+    for row in (rows[0], rows[-1]):
+        assert row["byte_start"] is None and row["byte_end"] is None
+    encoded = source.encode()
+    content = rows[1:-1]
+    assert content[0]["byte_start"] == 0
+    assert content[-1]["byte_end"] == len(encoded)
+    for a, b in zip(content, content[1:]):
+        assert a["byte_end"] <= b["byte_start"]
+    pieces = [encoded[row["byte_start"] : row["byte_end"]] for row in content]
+    assert "".join(b"".join(pieces).decode().split()) == "".join(source.split())
+
+    # sources larger than a single tokenizer segment
+    large = " ".join(f"word{i}" for i in range(10000))
+    assert (
+        db.execute(
+            "select count(*) from lembed_tokens('aaa', ?)", [large]
+        ).fetchone()[0]
+        == db.execute("select lembed_token_count('aaa', ?)", [large]).fetchone()[0]
+    )
+
+    assert execute_all(
+        db, "select model, source from lembed_tokens('aaa', 'hello') limit 1"
+    ) == [{"model": "aaa", "source": "hello"}]
+    assert lembed_tokens("aaa", None) == []
+
+    with _raises("model and source arguments are required"):
+        db.execute("select * from lembed_tokens('aaa')").fetchall()
+    with _raises(
+        "Unknown model name 'aaaaaaaaa'. Was it registered with lembed_models?"
+    ):
+        lembed_tokens("aaaaaaaaa", source)
 
 
-@pytest.mark.skip(reason="TODO")
 def test_lembed_models():
-    lembed_models = lambda *args: db.execute(
-        "select * from lembed_chunks()", args
+    row = execute_all(
+        db,
+        "select name, model_size, load_ns, resident_bytes from temp.lembed_models where name = 'aaa'",
+    )[0]
+    assert row["model_size"] > 0
+    assert row["load_ns"] > 0
+    assert row["resident_bytes"] is None or isinstance(row["resident_bytes"], int)
+    rowid = db.execute(
+        "select rowid from temp.lembed_models where name = 'aaa'"
     ).fetchone()[0]
-    pass
+    assert db.execute(
+        "select name from temp.lembed_models where rowid = ?", [rowid]
+    ).fetchone()[0] == "aaa"
+    assert db.execute(
+        "select name from temp.lembed_models where name = 'nope'"
+    ).fetchall() == []
+
+    lembed = lambda *args: db.execute(
+        f"select lembed({spread_args(args)})", args
+    ).fetchone()[0]
+    db.execute(
+        """
+          insert into temp.lembed_models(name, model, context_options)
+          select 'swap', lembed_model_from_file(?), lembed_context_options('output_dims', 128)
+        """,
+        [MODEL1_PATH],
+    )
+    with _raises(
+        "Model 'swap' is already registered. UPDATE its row in lembed_models to swap in a new model"
+    ):
+        db.execute(
+            "insert into temp.lembed_models(name, model) select 'swap', lembed_model_from_file(?)",
+            [MODEL1_PATH],
+        )
+
+    # new weights, same options
+    db.execute(
+        "update temp.lembed_models set model = lembed_model_from_file(?) where name = 'swap'",
+        [MODEL1_PATH],
+    )
+    assert len(lembed("swap", "alex garcia")) == 128 * 4
+    # new options, same weights
+    db.execute(
+        "update temp.lembed_models set context_options = lembed_context_options('output_dims', 64) where name = 'swap'"
+    )
+    assert len(lembed("swap", "alex garcia")) == 64 * 4
+    db.execute("update temp.lembed_models set name = 'swapped' where name = 'swap'")
+    assert len(lembed("swapped", "alex garcia")) == 64 * 4
+    with _raises("Unknown model name 'swap'. Was it registered with lembed_models?"):
+        lembed("swap", "alex garcia")
+    with _raises("The rowid of a lembed_models row can't be changed"):
+        db.execute("update temp.lembed_models set rowid = 1000 where name = 'swapped'")
+
+    # open cursors finish on the model they started with
+    cursor = db.execute(
+        "select embedding from lembed_batch('swapped', ?)",
+        [json.dumps([f"text {i}" for i in range(10)])],
+    )
+    assert len(cursor.fetchone()[0]) == 64 * 4
+    db.execute("delete from temp.lembed_models where name = 'swapped'")
+    assert [len(row[0]) for row in cursor.fetchall()] == [64 * 4] * 9
+    with _raises("Unknown model name 'swapped'. Was it registered with lembed_models?"):
+        lembed("swapped", "alex garcia")
+
+    # no limit on how many models are registered
+    count = db.execute("select count(*) from temp.lembed_models").fetchone()[0]
+    for i in range(40):
+        db.execute(
+            "insert into temp.lembed_models(name, model) select ?, lembed_model_from_file(?)",
+            [f"many-{i}", MODEL1_PATH],
+        )
+    assert lembed("many-39", "alex garcia") == lembed("aaa", "alex garcia")
+    db.execute("delete from temp.lembed_models where name like 'many-%'")
+    assert db.execute("select count(*) from temp.lembed_models").fetchone()[0] == count
+
+
+def test_lembed_thread_budget():
+    lembed_thread_budget = lambda *args: db.execute(
+        f"select lembed_thread_budget({spread_args(args)})", args
+    ).fetchone()[0]
+    assert lembed_thread_budget() == 0
+    expected = db.execute("select lembed('aaa', 'alex garcia')").fetchone()[0]
+    assert lembed_thread_budget(1) == 1
+    assert lembed_thread_budget() == 1
+    assert db.execute("select lembed('aaa', 'alex garcia')").fetchone()[0] == expected
+    rows = db.execute(
+        "select embedding from lembed_batch('aaa', json_array('a', 'b', 'c'))"
+    ).fetchall()
+    assert len(rows) == 3
+    assert lembed_thread_budget(0) == 0
+    with _raises(
+        "thread budget must be 0 (no budget) or a number of threads, got -1"
+    ):
+        lembed_thread_budget(-1)
+
+
+def test_lembed_stream():
+    db.execute("create temp table stream_docs(id integer primary key, body text)")
+    db.executemany(
+        "insert into temp.stream_docs(body) values (?)",
+        [(f"document number {i} is about {'cats' if i % 2 else 'dogs'}",) for i in range(300)],
+    )
+    db.execute("insert into temp.stream_docs(id, body) values (1000, null)")
+
+    rows = execute_all(
+        db,
+        "select rowid, id, embedding from lembed_stream('aaa', 'select id, body from temp.stream_docs order by id')",
+    )
+    assert [row["id"] for row in rows] == list(range(1, 301)) + [1000]
+    assert [row["rowid"] for row in rows] == list(range(301))
+    assert rows[-1]["embedding"] is None
+    for row in rows[:-1:37]:
+        expected = db.execute(
+            "select lembed('aaa', body) from temp.stream_docs where id = ?",
+            [row["id"]],
+        ).fetchone()[0]
+        assert struct.unpack("384f", row["embedding"]) == pytest.approx(
+            struct.unpack("384f", expected), abs=1e-5
+        )
+
+    db.execute("create temp table stream_embeddings(id integer primary key, embedding)")
+    db.execute(
+        """
+          insert into temp.stream_embeddings(id, embedding)
+          select id, embedding
+          from lembed_stream('aaa', 'select id, body from temp.stream_docs')
+        """
+    )
+    assert db.execute("select count(*) from temp.stream_embeddings").fetchone()[0] == 301
+
+    assert (
+        execute_all(
+            db, "select * from lembed_stream('aaa', 'select 1, 2 where 0')"
+        )
+        == []
+    )
+    with _raises(
+        "sql must be a single statement that returns 2 columns: id and text"
+    ):
+        db.execute("select * from lembed_stream('aaa', 'select 1')").fetchall()
+    with _raises("no such table: not_a_table"):
+        db.execute(
+            "select * from lembed_stream('aaa', 'select 1, 2 from not_a_table')"
+        ).fetchall()
+    with _raises(
+        "Unknown model name 'aaaaaaaaa'. Was it registered with lembed_models?"
+    ):
+        db.execute("select * from lembed_stream('aaaaaaaaa', 'select 1, 2')").fetchall()
+    with _raises("sql must be a read-only statement, like a SELECT"):
+        db.execute(
+            "select * from lembed_stream('aaa', 'delete from temp.stream_docs returning id, body')"
+        ).fetchall()
+    assert db.execute("select count(*) from temp.stream_docs").fetchone()[0] > 0
+    db.execute(
+        "create view main.stream_view as select * from lembed_stream('aaa', 'select 1, 2')"
+    )
+    with _raises('unsafe use of virtual table "lembed_stream"'):
+        db.execute("select * from main.stream_view").fetchall()
+    db.execute("drop view main.stream_view")
+    db.execute("drop table temp.stream_docs")
+    db.execute("drop table temp.stream_embeddings")
+
+
+def test_lembed_sync():
+    db.execute(
+        "insert into temp.lembed_models(name, model) values (?, lembed_model_from_file(?))",
+        ["sync", MODEL1_PATH],
+    )
+    tokenized = lambda: db.execute(
+        "select calls from lembed_stats where model = 'sync' and stage = 'tokenize'"
+    ).fetchone()[0]
+    sync = lambda command="sync": db.execute(
+        "insert into temp.sync_embeddings(sync_embeddings) values (?)", [command]
+    )
+    embeddings = lambda: {
+        row["rowid"]: row["embedding"]
+        for row in db.execute("select rowid, embedding from temp.sync_embeddings")
+    }
+    db.execute("create temp table sync_docs(id integer primary key, body text)")
+    db.executemany(
+        "insert into temp.sync_docs(id, body) values (?, ?)",
+        [(i, f"document number {i}") for i in range(1, 11)],
+    )
+    db.execute(
+        "create virtual table temp.sync_embeddings using lembed_sync(source=sync_docs, column=body, model='sync')"
+    )
+    assert embeddings() == {}
+    sync()
+    assert tokenized() == 10
+    assert sorted(embeddings()) == list(range(1, 11))
+    expected = db.execute("select lembed('sync', 'document number 3')").fetchone()[0]
+    assert struct.unpack("384f", embeddings()[3]) == pytest.approx(
+        struct.unpack("384f", expected), abs=1e-5
+    )
+    assert db.execute(
+        "select subtype(embedding) from temp.sync_embeddings where rowid = 3"
+    ).fetchone()[0] == 223
+    assert execute_all(
+        db, "select rowid from temp.sync_embeddings where rowid = 11"
+    ) == []
+
+    # nothing changed, so nothing is embedded
+    calls = tokenized()
+    sync()
+    assert tokenized() == calls
+
+    # only changed and new rows are embedded, deleted and NULL rows are dropped
+    before = embeddings()
+    db.execute("update temp.sync_docs set body = 'a new body' where id = 2")
+    db.execute("insert into temp.sync_docs(id, body) values (20, 'twenty')")
+    db.execute("delete from temp.sync_docs where id = 5")
+    db.execute("update temp.sync_docs set body = null where id = 7")
+    sync()
+    assert tokenized() == calls + 2
+    after = embeddings()
+    assert sorted(after) == [1, 2, 3, 4, 6, 8, 9, 10, 20]
+    assert after[2] != before[2]
+    assert after[1] == before[1]
+
+    # writers only record rowids, a sync clears them
+    dirty = lambda: [
+        row[0] for row in db.execute("select id from temp.sync_embeddings_dirty")
+    ]
+    assert dirty() == []
+    db.execute("update temp.sync_docs set body = body where id = 3")
+    assert dirty() == []
+    db.execute("update temp.sync_docs set id = 30 where id = 20")
+    assert dirty() == [20, 30]
+    sync()
+    assert tokenized() == calls + 3
+    assert sorted(embeddings()) == [1, 2, 3, 4, 6, 8, 9, 10, 30]
+    assert dirty() == []
+
+    sync("rebuild")
+    assert tokenized() == calls + 3 + 9
+    assert sorted(embeddings()) == [1, 2, 3, 4, 6, 8, 9, 10, 30]
+
+    # rows replaced over a conflict on another UNIQUE column are only seen
+    # with recursive_triggers on, or by a rebuild
+    db.execute("create temp table sync_slugs(id integer primary key, slug text unique, body text)")
+    db.execute("insert into temp.sync_slugs values (1, 'a', 'one'), (2, 'b', 'two')")
+    db.execute(
+        "create virtual table temp.sync_slug_embeddings using lembed_sync(source=sync_slugs, column=body, model=sync)"
+    )
+    slug_sync = lambda: db.execute(
+        "insert into temp.sync_slug_embeddings(sync_slug_embeddings) values ('sync')"
+    )
+    slug_ids = lambda: [
+        row[0]
+        for row in db.execute("select rowid from temp.sync_slug_embeddings order by rowid")
+    ]
+    slug_sync()
+    db.execute("insert or replace into temp.sync_slugs values (3, 'a', 'three')")
+    slug_sync()
+    assert slug_ids() == [1, 2, 3]
+    db.execute("insert into temp.sync_slug_embeddings(sync_slug_embeddings) values ('rebuild')")
+    assert slug_ids() == [2, 3]
+    db.execute("pragma recursive_triggers = on")
+    db.execute("insert or replace into temp.sync_slugs values (4, 'b', 'four')")
+    slug_sync()
+    assert slug_ids() == [3, 4]
+    db.execute("pragma recursive_triggers = off")
+    db.execute("drop table temp.sync_slug_embeddings")
+    db.execute("drop table temp.sync_slugs")
+
+    with _raises(
+        "sync_embeddings is kept in sync with sync_docs by lembed_sync. Run INSERT INTO sync_embeddings(sync_embeddings) VALUES ('sync') to update it"
+    ):
+        db.execute("delete from temp.sync_embeddings")
+    with _raises(
+        "sync_embeddings is kept in sync with sync_docs by lembed_sync. Run INSERT INTO sync_embeddings(sync_embeddings) VALUES ('sync') to update it"
+    ):
+        db.execute(
+            "insert into temp.sync_embeddings(sync_embeddings) values ('resync')"
+        )
+    with _raises("no such column: sync_docs.nope"):
+        db.execute(
+            "create virtual table temp.sync_bad using lembed_sync(source=sync_docs, column=nope, model=sync)"
+        )
+    with _raises("lembed_sync needs source=, column= and model= options"):
+        db.execute(
+            "create virtual table temp.sync_bad using lembed_sync(source=sync_docs, column=body)"
+        )
+    with _raises(
+        "Unknown lembed_sync option 'table=sync_docs', expected source=, column= or model="
+    ):
+        db.execute(
+            "create virtual table temp.sync_bad using lembed_sync(table=sync_docs, column=body, model=sync)"
+        )
+    db.execute(
+        "create virtual table temp.sync_bad using lembed_sync(source=sync_docs, column=body, model=nope)"
+    )
+    with _raises("Unknown model name 'nope'. Was it registered with lembed_models?"):
+        db.execute("insert into temp.sync_bad(sync_bad) values ('sync')")
+    db.execute("drop table temp.sync_bad")
+
+    db.execute("alter table temp.sync_embeddings rename to sync_renamed")
+    assert db.execute("select count(*) from temp.sync_renamed").fetchone()[0] == 9
+    db.execute("delete from temp.sync_docs where id = 30")
+    db.execute("insert into temp.sync_renamed(sync_renamed) values ('sync')")
+    assert db.execute("select count(*) from temp.sync_renamed").fetchone()[0] == 8
+    db.execute("drop table temp.sync_renamed")
+    assert (
+        db.execute(
+            "select count(*) from temp.sqlite_master where name like 'sync_%'"
+        ).fetchone()[0]
+        == 1
+    )
+    db.execute("drop table temp.sync_docs")
+    db.execute("delete from temp.lembed_models where name = 'sync'")
+
+
+def test_lembed_index():
+    import random
+
+    rng = random.Random(23)
+    centers = [[rng.gauss(0, 1) for _ in range(8)] for _ in range(6)]
+    vectors = {
+        i: [x + rng.gauss(0, 0.1) for x in centers[i % 6]] for i in range(1, 301)
+    }
+    pack = lambda v: struct.pack("8f", *v)
+    db.execute("create virtual table temp.idx using lembed_index(dimensions=8, lists=6, nprobe=2, threads=3)")
+    db.executemany(
+        "insert into temp.idx(rowid, embedding) values (?, ?)",
+        [(i, pack(v)) for i, v in vectors.items()],
+    )
+    assert db.execute("select count(*) from temp.idx").fetchone()[0] == 300
+
+    def exact(query, k):
+        rows = db.execute(
+            "select rowid, lembed_distance_cosine(embedding, ?) as d from temp.idx",
+            [pack(query)],
+        ).fetchall()
+        return [r[0] for r in sorted(rows, key=lambda r: (r[1], r[0]))][:k]
+
+    def knn(query, k, nprobe=None):
+        sql = "select rowid, distance from temp.idx where embedding match ? and k = ?"
+        args = [pack(query), k]
+        if nprobe is not None:
+            sql += " and nprobe = ?"
+            args.append(nprobe)
+        return db.execute(sql, args).fetchall()
+
+    query = [x + 0.05 for x in centers[2]]
+    # before a build, every vector is in one list and queries are exact
+    rows = knn(query, 10)
+    assert [r[0] for r in rows] == exact(query, 10)
+    assert [r[1] for r in rows] == sorted(r[1] for r in rows)
+    assert rows[0][1] == pytest.approx(
+        db.execute(
+            "select lembed_distance_cosine(?, ?)", [pack(query), pack(vectors[rows[0][0]])]
+        ).fetchone()[0],
+        abs=1e-5,
+    )
+
+    db.execute("insert into temp.idx(idx) values ('build')")
+    assert db.execute("select count(*) from temp.idx_centroids").fetchone()[0] == 6
+    assert db.execute("select count(*) from temp.idx_vectors").fetchone()[0] == 300
+    assert (
+        db.execute("select count(distinct key >> 32) from temp.idx_vectors").fetchone()[0]
+        > 1
+    )
+    # probing every list is exact, and clustered data has good recall with fewer
+    assert [r[0] for r in knn(query, 10, nprobe=6)] == exact(query, 10)
+    assert len(set(r[0] for r in knn(query, 10)) & set(exact(query, 10))) >= 8
+    assert [r[0] for r in knn(query, 10, nprobe=100)] == exact(query, 10)
+
+    # LIMIT works in place of k, and ORDER BY distance needs no sort
+    assert [
+        r[0]
+        for r in db.execute(
+            "select rowid from temp.idx where embedding match ? order by distance limit 5",
+            [pack(query)],
+        )
+    ] == [r[0] for r in knn(query, 5)]
+
+    # incremental inserts, updates and deletes after a build
+    db.execute("insert into temp.idx(rowid, embedding) values (1000, ?)", [pack(query)])
+    assert knn(query, 1)[0][0] == 1000
+    assert knn(query, 1)[0][1] == pytest.approx(0, abs=1e-5)
+    db.execute("update temp.idx set rowid = 1001 where rowid = 1000")
+    assert knn(query, 1)[0][0] == 1001
+    db.execute("delete from temp.idx where rowid = 1001")
+    assert knn(query, 1)[0][0] != 1001
+    db.execute("delete from temp.idx where rowid = 5000")
+    db.execute("insert into temp.idx(embedding) values (?)", [pack(query)])
+    assert knn(query, 1)[0][0] == 301
+
+    assert tuple(
+        db.execute(
+            "select subtype(embedding), length(embedding) from temp.idx where rowid = 3"
+        ).fetchone()
+    ) == (223, 32)
+    assert db.execute(
+        "select length(embedding) from temp.idx where embedding match ? and k = 1",
+        [pack(query)],
+    ).fetchone()[0] == 32
+
+    # build again, all vectors move to the new lists
+    db.execute("insert into temp.idx(idx) values ('build')")
+    assert db.execute("select count(*) from temp.idx_vectors").fetchone()[0] == 301
+    assert db.execute("select count(*) from temp.idx_rowids").fetchone()[0] == 301
+    assert [r[0] for r in knn(query, 10, nprobe=6)] == exact(query, 10)
+
+    # without k or a LIMIT, 10 neighbors are returned, and a LIMIT over the
+    # maximum k is clamped to it
+    count = lambda sql: db.execute(
+        f"select count(*) from (select rowid from temp.idx where embedding match ? {sql})",
+        [pack(query)],
+    ).fetchone()[0]
+    assert count("") == 10
+    assert count("limit 0") == 0
+    if sqlite3.sqlite_version_info >= (3, 38, 0):
+        assert count("and nprobe = 6 limit 200000") == 301
+        assert count("and nprobe = 6 limit -1") == 301
+
+    with _raises("embedding must be a float32 vector BLOB with 8 dimensions"):
+        db.execute("insert into temp.idx(rowid, embedding) values (2000, ?)", [b"\x00" * 12])
+    with _raises("A row with rowid 3 is already in idx", sqlite3.IntegrityError):
+        db.execute("insert into temp.idx(rowid, embedding) values (3, ?)", [pack(query)])
+    with _raises("lembed_index query must be a float32 vector BLOB with 8 dimensions"):
+        db.execute("select * from temp.idx where embedding match 'x' and k = 1").fetchall()
+    with _raises("k must be between 1 and 100000"):
+        knn(query, 0)
+    with _raises("nprobe must be at least 1"):
+        knn(query, 1, nprobe=0)
+    with _raises("Unknown idx command 'optimize', expected 'build'"):
+        db.execute("insert into temp.idx(idx) values ('optimize')")
+    with _raises("lembed_index needs a dimensions= option"):
+        db.execute("create virtual table temp.idx_bad using lembed_index(lists=4)")
+    with _raises("Invalid lembed_index option 'lists=0'"):
+        db.execute("create virtual table temp.idx_bad using lembed_index(dimensions=8, lists=0)")
+    with _raises(
+        "Unknown lembed_index option 'metric=l2', expected dimensions=, lists=, nprobe= or threads="
+    ):
+        db.execute("create virtual table temp.idx_bad using lembed_index(dimensions=8, metric=l2)")
+
+    db.execute("alter table temp.idx rename to idx_renamed")
+    assert (
+        len(
+            db.execute(
+                "select rowid from temp.idx_renamed where embedding match ? and k = 3",
+                [pack(query)],
+            ).fetchall()
+        )
+        == 3
+    )
+    assert db.execute("select count(*) from temp.idx_renamed_vectors").fetchone()[0] == 301
+    db.execute("drop table temp.idx_renamed")
+    assert (
+        db.execute(
+            "select count(*) from temp.sqlite_master where name like 'idx%'"
+        ).fetchone()[0]
+        == 0
+    )
+
+    # with real embeddings from lembed()
+    db.execute("create virtual table temp.idx_text using lembed_index(dimensions=384)")
+    texts = ["alex garcia", "sqlite extensions", "embedding models"]
+    for i, text in enumerate(texts):
+        db.execute(
+            "insert into temp.idx_text(rowid, embedding) values (?, lembed('aaa', ?))",
+            [i + 1, text],
+        )
+    db.execute("insert into temp.idx_text(idx_text) values ('build')")
+    row = db.execute(
+        "select rowid, distance from temp.idx_text where embedding match lembed('aaa', 'sqlite extensions') and k = 3"
+    ).fetchone()
+    assert row[0] == 2
+    assert row[1] == pytest.approx(0, abs=1e-5)
+    db.execute("drop table temp.idx_text")
+
+
+def test_lembed_stats():
+    db.execute(
+        "insert into temp.lembed_models(name, model) values (?, lembed_model_from_file(?))",
+        ["stats", MODEL1_PATH],
+    )
+    stats = lambda: {
+        row["stage"]: dict(row)
+        for row in db.execute("select * from lembed_stats where model = 'stats'")
+    }
+    assert list(stats().keys()) == [
+        "embed",
+        "tokenize",
+        "decode",
+        "normalize",
+        "result",
+        "cache_hit",
+        "context_wait",
+        "coalesce",
+        "load",
+    ]
+    assert stats()["load"]["calls"] == 1
+    assert stats()["embed"]["calls"] == 0
+    assert stats()["embed"]["avg_ns"] is None
+
+    tokens = len(
+        json.loads(
+            db.execute(
+                "select lembed_tokenize_json('stats', 'alex garcia')"
+            ).fetchone()[0]
+        )
+    )
+    db.execute("select lembed('stats', 'alex garcia')").fetchone()
+    db.execute("select lembed('stats', 'alex garcia')").fetchone()
+    s = stats()
+    for stage in ["embed", "tokenize", "decode", "normalize", "result"]:
+        assert s[stage]["calls"] == 2
+        assert s[stage]["errors"] == 0
+        assert s[stage]["total_ns"] > 0
+        assert 0 < s[stage]["p50_ns"] <= s[stage]["p99_ns"]
+    assert s["embed"]["tokens"] == 2 * tokens
+    assert s["tokenize"]["tokens"] == 2 * tokens
+    assert s["decode"]["tokens"] == 2 * tokens
+
+    db.execute(
+        "select * from lembed_batch('stats', json_array('a', 'b', 'c'))"
+    ).fetchall()
+    assert stats()["tokenize"]["calls"] == 5
+    assert stats()["decode"]["calls"] == 3
+
+
+def test_lembed_stats_reset():
+    db.execute("select lembed('stats', 'alex garcia')").fetchone()
+    db.execute("select lembed('aaa', 'alex garcia')").fetchone()
+    db.execute("select lembed_stats_reset('stats')")
+    calls = lambda model: db.execute(
+        "select sum(calls) from lembed_stats where model = ?", [model]
+    ).fetchone()[0]
+    assert calls("stats") == 0
+    assert calls("aaa") > 0
+    db.execute("select lembed_stats_reset()")
+    assert db.execute("select sum(calls) from lembed_stats").fetchone()[0] == 0
+
+    with _raises(
+        "Unknown model name 'aaaaaaaaa'. Was it registered with lembed_models?"
+    ):
+        db.execute("select lembed_stats_reset('aaaaaaaaa')")
+
+
+def test_lembed_enqueue():
+    db.execute(
+        """
+          insert into temp.lembed_models(name, model, context_options)
+          select 'queued', lembed_model_from_file(?), lembed_context_options(
+            'n_parallel', 2, 'n_ctx', 16, 'n_batch', 16, 'n_ubatch', 16
+          )
+        """,
+        [MODEL1_PATH],
+    )
+    db.commit()
+    texts = [f"text number {i}" for i in range(20)]
+    ids = [
+        db.execute("select lembed_enqueue('queued', ?, ?)", [i, text]).fetchone()[0]
+        for i, text in enumerate(texts)
+    ]
+    assert ids == sorted(ids) and len(set(ids)) == len(ids)
+    assert db.execute("select lembed_enqueue('queued', 'x', null)").fetchone()[0] is None
+    long_text = " ".join(f"w{i}" for i in range(40))
+    db.execute("select lembed_enqueue('queued', 'long', ?)", [long_text])
+
+    json.loads(db.execute("select lembed_queue_wait('queued')").fetchone()[0])
+    rows = execute_all(
+        db,
+        "select rowid, model, key, embedding, error from lembed_results where model = 'queued' order by rowid",
+    )
+    assert [row["key"] for row in rows] == list(range(20)) + ["long"]
+    assert [row["rowid"] for row in rows[:20]] == ids
+    for row, text in zip(rows, texts):
+        assert row["error"] is None
+        assert struct.unpack("384f", row["embedding"]) == pytest.approx(
+            struct.unpack(
+                "384f",
+                db.execute("select lembed('aaa', ?)", [text]).fetchone()[0],
+            ),
+            rel=1e-5,
+        )
+    assert rows[-1]["embedding"] is None
+    assert rows[-1]["error"] == (
+        "Input has 42 tokens, more than the batch size of 16. Use the long_inputs context option to truncate or split long inputs."
+    )
+
+    db.execute("delete from lembed_results where rowid = ?", [ids[0]])
+    assert (
+        db.execute(
+            "select count(*) from lembed_results where model = 'queued'"
+        ).fetchone()[0]
+        == 20
+    )
+    db.execute("delete from lembed_results where model = 'queued'")
+    assert (
+        db.execute(
+            "select count(*) from lembed_results where model = 'queued'"
+        ).fetchone()[0]
+        == 0
+    )
+    db.commit()
+
+    with _raises(
+        "Unknown model name 'aaaaaaaaa'. Was it registered with lembed_models?"
+    ):
+        db.execute("select lembed_enqueue('aaaaaaaaa', 1, 'hello')")
+
+
+def test_lembed_queue_stats():
+    assert db.execute("select lembed_queue_stats('aaa')").fetchone()[0] is None
+    assert json.loads(
+        db.execute("select lembed_queue_stats('queued')").fetchone()[0]
+    ) == {
+        "queued": 0,
+        "running": 0,
+        "completed": 20,
+        "failed": 1,
+        "results": 0,
+        "dropped": 0,
+        "workers": 2,
+    }
+
+
+def test_lembed_queue_wait():
+    assert db.execute("select lembed_queue_wait('aaa')").fetchone()[0] is None
+    db.execute("select lembed_enqueue('queued', 'again', 'alex garcia')")
+    stats = json.loads(db.execute("select lembed_queue_wait('queued')").fetchone()[0])
+    assert (stats["queued"], stats["running"], stats["results"]) == (0, 0, 1)
+    db.execute("delete from lembed_results")
+    db.commit()
+
+
+def test_lembed_rerank():
+    db.execute(
+        """
+          insert into temp.lembed_models(name, model, context_options)
+          select 'reranker', lembed_model_from_file(?),
+            lembed_context_options('pooling', 'rank', 'n_seq_max', 16)
+        """,
+        [MODEL1_PATH],
+    )
+    rerank = lambda *args: db.execute(
+        "select lembed_rerank(?, ?, ?)", args
+    ).fetchone()[0]
+    documents = [
+        "the cat sat on the mat",
+        "sqlite is a database",
+        "dogs chase cats",
+        "embedding models in gguf",
+        "a cat",
+    ]
+    scores = [rerank("reranker", "cats", d) for d in documents]
+    assert all(isinstance(s, float) for s in scores)
+    assert len(set(scores)) == len(documents)
+    assert rerank("reranker", "cats", None) is None
+    assert rerank("reranker", None, "cats") is None
+
+    # every pair is scored in one decode
+    decodes = lambda: db.execute(
+        "select calls from lembed_stats where model = 'reranker' and stage = 'decode'"
+    ).fetchone()[0]
+    before = decodes()
+    rows = execute_all(
+        db,
+        "select rowid, id, document, score from lembed_rerank('reranker', 'cats', ?)",
+        [json.dumps(documents)],
+    )
+    assert decodes() == before + 1
+    expected = sorted(range(len(documents)), key=lambda i: -scores[i])
+    assert [row["id"] for row in rows] == expected
+    assert [row["document"] for row in rows] == [documents[i] for i in expected]
+    assert [row["score"] for row in rows] == pytest.approx(
+        [scores[i] for i in expected], rel=1e-5
+    )
+    assert [row["rowid"] for row in rows] == expected
+    assert [
+        row["id"]
+        for row in execute_all(
+            db,
+            "select id from lembed_rerank('reranker', 'cats', ?) order by score",
+            [json.dumps(documents)],
+        )
+    ] == expected[::-1]
+
+    db.execute("create temp table rerank_docs(id integer primary key, body text)")
+    db.executemany(
+        "insert into temp.rerank_docs(id, body) values (?, ?)",
+        [(i * 10, d) for i, d in enumerate(documents)] + [(99, None)],
+    )
+    rows = execute_all(
+        db,
+        "select id, score from lembed_rerank('reranker', 'cats', 'select id, body from temp.rerank_docs') limit 3",
+    )
+    assert [row["id"] for row in rows] == [i * 10 for i in expected[:3]]
+    last = execute_all(
+        db,
+        "select id, score from lembed_rerank('reranker', 'cats', 'select id, body from temp.rerank_docs')",
+    )[-1]
+    assert (last["id"], last["score"]) == (99, None)
+    assert (
+        execute_all(db, "select * from lembed_rerank('reranker', 'cats', '[]')")
+        == []
+    )
+    db.execute("drop table temp.rerank_docs")
+
+    with _raises(
+        "Model 'aaa' is not a reranker. Register it with the pooling context option set to 'rank'"
+    ):
+        rerank("aaa", "cats", "dogs")
+    with _raises(
+        "Model 'aaa' is not a reranker. Register it with the pooling context option set to 'rank'"
+    ):
+        db.execute("select * from lembed_rerank('aaa', 'cats', '[\"dogs\"]')").fetchall()
+    with _raises(
+        "Model 'reranker' is a reranker, so it can only score with lembed_rerank()"
+    ):
+        db.execute("select lembed('reranker', 'cats')").fetchone()
+    with _raises("Unknown model name 'nope'. Was it registered with lembed_models?"):
+        rerank("nope", "cats", "dogs")
+    with _raises("model, query and documents arguments are required"):
+        db.execute("select * from lembed_rerank('reranker', 'cats')").fetchall()
+    with _raises(
+        "documents must be a JSON array, or a single statement that returns 2 columns: id and text"
+    ):
+        db.execute("select * from lembed_rerank('reranker', 'cats', 'select 1')").fetchall()
+    db.execute("create temp table rerank_docs(id, body)")
+    with _raises("documents must be a read-only statement, like a SELECT"):
+        db.execute(
+            "select * from lembed_rerank('reranker', 'cats', 'insert into temp.rerank_docs values (1, 2) returning id, body')"
+        ).fetchall()
+    assert db.execute("select count(*) from temp.rerank_docs").fetchone()[0] == 0
+    db.execute("drop table temp.rerank_docs")
+    db.execute(
+        "create view main.rerank_view as select * from lembed_rerank('reranker', 'cats', '[\"dogs\"]')"
+    )
+    with _raises('unsafe use of virtual table "lembed_rerank"'):
+        db.execute("select * from main.rerank_view").fetchall()
+    db.execute("drop view main.rerank_view")
+    with _raises("Query and document have"):
+        rerank("reranker", "cats", "cats " * 5000)
+    db.execute("delete from temp.lembed_models where name = 'reranker'")
+
+
+def test_lembed_results(tmp_path):
+    with _raises(
+        "queue_table queue_embeddings must be in a database file, not in memory"
+    ):
+        db.execute(
+            """
+              insert into temp.lembed_models(name, model, context_options)
+              select 'in-memory', lembed_model_from_file(?), lembed_context_options('queue_table', 'queue_embeddings')
+            """,
+            [MODEL1_PATH],
+        )
+    db.rollback()
+
+    file_db = connect(EXT_PATH, str(tmp_path / "queue.db"))
+    file_db.isolation_level = None
+    file_db.execute(
+        """
+          insert into temp.lembed_models(name, model, context_options)
+          select 'aaa', lembed_model_from_file(?), lembed_context_options('queue_table', 'main.queue_embeddings')
+        """,
+        [MODEL1_PATH],
+    )
+    for i in range(5):
+        file_db.execute("select lembed_enqueue('aaa', ?, ?)", [i, f"text {i}"])
+    stats = json.loads(
+        file_db.execute("select lembed_queue_wait('aaa')").fetchone()[0]
+    )
+    assert (stats["completed"], stats["failed"], stats["results"]) == (5, 0, 0)
+    rows = execute_all(
+        file_db, "select key, embedding from queue_embeddings order by key"
+    )
+    assert [row["key"] for row in rows] == list(range(5))
+    assert rows[3]["embedding"] == file_db.execute(
+        "select lembed('aaa', 'text 3')"
+    ).fetchone()[0]
+    assert execute_all(file_db, "select * from lembed_results") == []
+
+    with _raises("lembed_results only supports DELETE"):
+        file_db.execute("insert into lembed_results(key) values (1)")
+
+    # without a queue_table, lembed_enqueue() refuses jobs once the results
+    # would go over queue_results_max
+    db.execute(
+        """
+          insert into temp.lembed_models(name, model, context_options)
+          select 'capped', lembed_model_from_file(?),
+            lembed_context_options('queue_results_max', 3)
+        """,
+        [MODEL1_PATH],
+    )
+    for i in range(3):
+        db.execute("select lembed_enqueue('capped', ?, 'alex garcia')", [i])
+    with _raises(
+        "lembed_results is full with 3 results of 'capped'. Delete the ones you've read, or raise the queue_results_max context option"
+    ):
+        db.execute("select lembed_enqueue('capped', 3, 'alex garcia')")
+    db.execute("select lembed_queue_wait('capped')")
+    # rows deleted during a scan stay readable until it's done
+    rows = db.execute(
+        "select key, embedding from lembed_results where model = 'capped'"
+    )
+    assert rows.fetchone()["key"] == 0
+    db.execute("delete from lembed_results where model = 'capped'")
+    assert [row["key"] for row in rows.fetchall()] == [1, 2]
+    db.execute("select lembed_enqueue('capped', 3, 'alex garcia')")
+    db.execute("select lembed_queue_wait('capped')")
+    db.execute("delete from lembed_results")
+    db.execute("delete from temp.lembed_models where name = 'capped'")
+    db.commit()
+
+    # with one, the oldest failed jobs are dropped instead
+    file_db.execute(
+        """
+          insert into temp.lembed_models(name, model, context_options)
+          select 'short', lembed_model_from_file(?), lembed_context_options(
+            'queue_table', 'main.queue_embeddings', 'queue_results_max', 2,
+            'n_ctx', 16, 'n_batch', 16, 'n_ubatch', 16
+          )
+        """,
+        [MODEL1_PATH],
+    )
+    long_text = " ".join(f"w{i}" for i in range(40))
+    for key in ["long 1", "long 2", "long 3"]:
+        file_db.execute("select lembed_enqueue('short', ?, ?)", [key, long_text])
+    stats = json.loads(
+        file_db.execute("select lembed_queue_wait('short')").fetchone()[0]
+    )
+    assert (stats["failed"], stats["results"], stats["dropped"]) == (3, 2, 1)
+    assert [
+        row["key"] for row in execute_all(file_db, "select key from lembed_results")
+    ] == ["long 2", "long 3"]
+    file_db.execute("delete from temp.lembed_models where name = 'short'")
+
+    # Deleting a model doesn't wait for its queue, which is still embedded in
+    # the background, and finished before the connection closes
+    for i in range(5, 50):
+        file_db.execute("select lembed_enqueue('aaa', ?, ?)", [i, f"text {i}"])
+    file_db.execute("delete from temp.lembed_models where name = 'aaa'")
+    file_db.close()
+    file_db = connect(EXT_PATH, str(tmp_path / "queue.db"))
+    assert (
+        file_db.execute("select count(*) from queue_embeddings").fetchone()[0]
+        == 50
+    )
+    file_db.close()
 
 
 def test_coverage():